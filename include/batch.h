@@ -0,0 +1,37 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <sys/types.h>
+
+struct secure_key;
+
+/**
+ * batch frame:
+ *     header record (header_len bytes, see PROTOCOL_BATCH)
+ *     payload record (count * row_len bytes compressed by codec, then encrypted once)
+ *  an empty batch (count == 0) has no payload record
+*/
+
+/* return the number of bytes on the wire, or -1 on failure */
+ssize_t batch_send(int channel, struct secure_key * key,
+                   int header_len, const void * rows, int row_len, int count,
+                   int codec, int level);
+/** batch_recv note:
+ *     header is the PROTOCOL_BATCH record the caller has already received,
+ *     return the malloc'd rows (to be freed by the caller), NULL if empty or broken,
+ *     count is -1 if broken, the payload may be left unread, so the
+ *     connection is lost
+*/
+void * batch_recv(int channel, struct secure_key * key,
+                  const char * header, int * row_len, int * count);
+/** batch_recv_pages return value:
+ *     return the number of rows
+ *     return -1 if the connection is broken
+ *  batch_recv_pages note:
+ *     receives batches of header_len-byte headers up to the first one with
+ *     fewer than page_rows rows (the inbox), every row goes to put if any
+*/
+int batch_recv_pages(int channel, struct secure_key * key, int header_len, int page_rows,
+                     void (* put)(void * arg, const char * row), void * arg);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * capture file:
+ *     CAPTURE_MAGIC, then frames in the order they were taken, which is the
+ *     order of their times, each a struct capture_frame and stored bytes,
+ *     a record is len bytes of which stored are in the file, the rest are
+ *     zeros (chat records are mostly padding),
+ *     passwords of sign in / sign up and the text of chat messages are
+ *     blanked (a message keeps its length), usernames stay
+*/
+#define CAPTURE_MAGIC           "SMCAP001"
+
+#define CAPTURE_OPEN            0x01    /* keys built, SECURE_TICKET_STATE_LEN bytes of state if resumed */
+#define CAPTURE_RECORD          0x02    /* a record from the client, as the server dispatches it */
+#define CAPTURE_CLOSE           0x03    /* the server is done with the session */
+
+struct capture_frame
+{
+    uint64_t time;              /* ns since the capture started */
+    uint32_t session;
+    uint16_t len;
+    uint16_t stored;
+    uint8_t type;
+    uint8_t reserved[7];
+};
+
+/**
+ * capture_* do nothing unless SERVER_CAPTURE is defined, a thread captures
+ * for the session it opened until it closes it
+*/
+int capture_init(const char * filename);
+/* state is NULL unless the session is resumed */
+void capture_open(const void * state);
+void capture_record(const void * buf, size_t len);
+void capture_close(void);
+void capture_finish(void);
+
+#endif
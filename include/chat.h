@@ -0,0 +1,85 @@
+#ifndef _CHAT_H_
+#define _CHAT_H_
+
+#include "protocol.h"
+#include <stdint.h>
+
+struct secure_key;
+
+/**
+ * chat mode of one connection, without threads and without a terminal:
+ *     the caller polls the channel and calls chat_client_read once it is
+ *     readable, it reads one record (or one batch) and returns, secure_recv
+ *     does not read ahead so poll() sees whatever is left, what the user
+ *     types goes to chat_client_line or the caller makes the requests below
+ *     itself, everything there is to show goes to put, so one process may
+ *     run as many clients as it has channels
+*/
+#define CHAT_STREAM_FREE            0
+#define CHAT_STREAM_PENDING         1
+#define CHAT_STREAM_OPEN            2
+#define CHAT_STREAM_CLOSING         3
+
+struct chat_stream
+{
+    int state;
+    int history_mode;
+    char peername[65];
+};
+
+/* stream_id 0 is a reply to a request or a row of the friend list */
+struct chat_line
+{
+    int stream_id;
+    double time;            /* when a message was sent, 0 for the rest */
+    int history;            /* a message of the history sent when the chat was opened */
+    const char * text;      /* without a trailing newline */
+};
+
+typedef void (*chat_put_t)(void * arg, const struct chat_line * line);
+
+struct chat_client
+{
+    int channel;
+    struct secure_key * key;
+    char username[65];
+    int current;            /* the stream chat_client_line sends messages to, 0 for none */
+    uint32_t request_id;
+    struct chat_stream streams[SERVER_MAX_STREAM_NUM + 1];
+    char friend_requests[CLIENT_FRIEND_BATCH_NUM][80];
+    chat_put_t put;
+    void * arg;
+};
+
+void chat_client_init(struct chat_client * client, int channel, struct secure_key * key,
+                      const char * username, chat_put_t put, void * arg);
+/** chat_client_enter return value:
+ *     return  0 if in chat mode, the friend list has gone to put row by row
+ *     return -1 if the connection is broken
+*/
+int chat_client_enter(struct chat_client * client);
+/** chat_client_read return value:
+ *     return  0 if a record is handled
+ *     return  1 if the server has finished chat mode (after chat_client_quit)
+ *     return -1 if the connection is broken
+*/
+int chat_client_read(struct chat_client * client);
+/** chat_client_line return value:
+ *     return  0 if the line is handled, a message to the current chat or one of
+ *             "\open", "\to", "\close", "\list", "\add", "\accept", "\reject"
+ *     return -1 if the line is "\quit", chat_client_read returns 1 later on
+*/
+int chat_client_line(struct chat_client * client, char * line);
+
+/* return the stream id that chats with peername, 0 if all of them are taken */
+int chat_client_open(struct chat_client * client, const char * peername);
+void chat_client_send(struct chat_client * client, int stream_id, const char * message);
+void chat_client_close(struct chat_client * client, int stream_id);
+/* flag is PROTOCOL_FRIEND_ADD / _ACCEPT / _REJECT, the reply comes to put */
+void chat_client_friend(struct chat_client * client, int flag, const char * peername);
+void chat_client_quit(struct chat_client * client);
+
+/* "[being]", "[recv] ", "[send] " or "[?]    " for a PROTOCOL_FRIEND_LIST row seen by username */
+const char * chat_friend_state(const char * username, const char * row);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef _CHATLOG_H_
+#define _CHATLOG_H_
+
+#include "protocol.h"
+#include "sync.h"
+#include <pthread.h>
+#include <stddef.h>
+
+/**
+ * a chat transcript with a writer thread of its own:
+ *     chat_log_put only copies the line, the writer takes whatever has piled
+ *     up meanwhile, writes it with one write and syncs it as mode
+ *     (CLIENT_CHAT_SYNC_*) says, so neither a write nor a sync holds up the
+ *     thread that shows the chats, a history (rows put with history set) is
+ *     synced once per write in every mode but CLIENT_CHAT_SYNC_NONE
+*/
+struct chat_log
+{
+    int fd;
+    int mode;
+    pthread_t thread;
+    struct sync_mutex mutex;
+    struct sync_cond cond;
+    char * buf;                 /* lines put and not taken by the writer yet */
+    size_t len;
+    size_t capacity;
+    size_t * marks;             /* ends of the lines in buf to be synced on their own */
+    int mark_num;
+    int mark_capacity;
+    int line_num;               /* lines in buf after the last mark */
+    int stop;
+};
+
+/* return 0 if filename is truncated and the writer runs, -1 otherwise */
+int chat_log_open(struct chat_log * log, const char * filename, int mode);
+void chat_log_put(struct chat_log * log, const char * text, int history);
+/* returns once every line is written, and synced unless the mode is CLIENT_CHAT_SYNC_NONE */
+void chat_log_close(struct chat_log * log);
+
+#endif
@@ -17,10 +17,16 @@ MYSQL * database_connect(void);
 /* create table if not exists "table" ("definition") */
 int database_create_table(MYSQL * mysql, const char * table,
                                         const char * definition);
+/* user, friend and message, if they do not exist */
+int database_create_tables(MYSQL * mysql);
 /* insert into "table" ("column") values ("value") */
 int database_insert(MYSQL * mysql, const char * table,
                                     const char * column,
                                     const char * value);
+/* insert ignore into "table" ("column") values "values", values is "(...), (...), ..." */
+int database_insert_rows(MYSQL * mysql, const char * table,
+                                        const char * column,
+                                        const char * values);
 /* update "table" set "assignment" "constraint" */
 int database_update(MYSQL * mysql, const char * table,
                                     const char * assignment,
@@ -0,0 +1,106 @@
+#ifndef _LOCK_H_
+#define _LOCK_H_
+
+#include "protocol.h"
+#include "metrics.h"
+#include "sync.h"
+#include <stdint.h>
+
+/**
+ * lock_t, a mutex named by METRICS_LOCK_*:
+ *     with LOCK_PROFILE every acquisition is timed from asking for the lock
+ *     to taking it (METRICS_LOCK_WAIT, 0 without a clock read if it is free),
+ *     every hold from taking it to releasing it (METRICS_LOCK_HOLD), and the
+ *     acquisitions that found it held are counted (METRICS_LOCK_CONTENDED),
+ *     locks of one name add up, without LOCK_PROFILE a lock_t is a bare
+ *     sync_mutex (spins a little, then parks) and the calls below inline
+ *     to the sync_mutex calls
+*/
+typedef struct lock_t
+{
+    struct sync_mutex mutex;
+#ifdef LOCK_PROFILE
+    int name;
+    uint64_t held;          /* when it was taken, only the holder touches it */
+#endif /* LOCK_PROFILE */
+} lock_t;
+
+#ifdef LOCK_PROFILE
+#define LOCK_INITIALIZER(name)  {SYNC_MUTEX_INITIALIZER, (name), 0}
+#else
+#define LOCK_INITIALIZER(name)  {SYNC_MUTEX_INITIALIZER}
+#endif /* LOCK_PROFILE */
+
+static inline void lock_init(lock_t * lock, int name)
+{
+    sync_mutex_init(&(lock->mutex));
+#ifdef LOCK_PROFILE
+    lock->name = name;
+    lock->held = 0;
+#endif /* LOCK_PROFILE */
+}
+
+static inline void lock_acquire(lock_t * lock)
+{
+#ifdef LOCK_PROFILE
+    uint64_t start;
+
+    if (sync_mutex_trylock(&(lock->mutex)) == 0) {
+        metrics_observe(METRICS_LOCK_WAIT + lock->name, 0);
+    } else {
+        start = metrics_now();
+        sync_mutex_lock(&(lock->mutex));
+        metrics_time(METRICS_LOCK_WAIT + lock->name, start);
+        metrics_add(METRICS_LOCK_CONTENDED + lock->name, 1);
+    }
+    lock->held = metrics_now();
+#else
+    sync_mutex_lock(&(lock->mutex));
+#endif /* LOCK_PROFILE */
+}
+
+/** lock_try return value:
+ *     return  0 if the lock is taken
+ *     return  EBUSY otherwise, nothing is counted
+*/
+static inline int lock_try(lock_t * lock)
+{
+    int ret;
+
+    ret = sync_mutex_trylock(&(lock->mutex));
+#ifdef LOCK_PROFILE
+    if (ret == 0) {
+        metrics_observe(METRICS_LOCK_WAIT + lock->name, 0);
+        lock->held = metrics_now();
+    }
+#endif /* LOCK_PROFILE */
+
+    return ret;
+}
+
+static inline void lock_release(lock_t * lock)
+{
+#ifdef LOCK_PROFILE
+    metrics_time(METRICS_LOCK_HOLD + lock->name, lock->held);
+#endif /* LOCK_PROFILE */
+    sync_mutex_unlock(&(lock->mutex));
+}
+
+/* sync_cond_wait, the time asleep is neither a hold nor a wait for the lock */
+static inline void lock_wait(struct sync_cond * cond, lock_t * lock)
+{
+#ifdef LOCK_PROFILE
+    metrics_time(METRICS_LOCK_HOLD + lock->name, lock->held);
+#endif /* LOCK_PROFILE */
+    sync_cond_wait(cond, &(lock->mutex));
+#ifdef LOCK_PROFILE
+    lock->held = metrics_now();
+#endif /* LOCK_PROFILE */
+}
+
+/* nothing to free, it is there for the symmetry with lock_init */
+static inline void lock_destroy(lock_t * lock)
+{
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* counters */
+#define METRICS_CONNECTIONS             0
+#define METRICS_SEALED_BYTES            1       /* plaintext bytes sealed in user space */
+#define METRICS_OPENED_BYTES            2       /* plaintext bytes opened in user space */
+#define METRICS_LOCK_CONTENDED          3       /* + METRICS_LOCK_*, acquisitions that found it held */
+#define METRICS_COUNTER_NUM             (3 + METRICS_LOCK_NUM)
+
+/* latency histograms */
+#define METRICS_HANDSHAKE_FULL          0
+#define METRICS_HANDSHAKE_RESUMED       1
+#define METRICS_SIGN_IN                 2
+#define METRICS_SIGN_UP                 3
+#define METRICS_FRIEND_ADD              4
+#define METRICS_FRIEND_ACCEPT           5
+#define METRICS_FRIEND_REJECT           6
+#define METRICS_FRIEND_LIST             7
+#define METRICS_CHAT_SELECT             8
+#define METRICS_MESSAGE_INSERT          9
+#define METRICS_HISTORY_SYNC            10
+#define METRICS_INBOX_SYNC              11
+#define METRICS_DB_CREATE_TABLE         12
+#define METRICS_DB_INSERT               13
+#define METRICS_DB_UPDATE               14
+#define METRICS_DB_SELECT               15
+#define METRICS_DB_STORE_RESULT         16
+#define METRICS_LOCK_WAIT               17      /* + METRICS_LOCK_*, from asking for it to taking it */
+#define METRICS_LOCK_HOLD               (17 + METRICS_LOCK_NUM)
+#define METRICS_HISTOGRAM_NUM           (17 + 2 * METRICS_LOCK_NUM)
+
+/* the locks of lock.h, only exported with LOCK_PROFILE */
+#define METRICS_LOCK_QUEUE              0
+#define METRICS_LOCK_LOG                1
+#define METRICS_LOCK_POOL_DEQUE         2
+#define METRICS_LOCK_POOL_IDLE          3
+#define METRICS_LOCK_TICKET             4
+#define METRICS_LOCK_KEYPAIR            5
+#define METRICS_LOCK_TRACE              6
+#define METRICS_LOCK_CAPTURE            7
+#define METRICS_LOCK_NUM                8
+
+/**
+ * metrics registry:
+ *     every thread counts into a block of its own with plain stores, the
+ *     exporter sums the blocks when it is scraped, a block outlives its
+ *     thread and is taken over by the next new thread, so nothing is lost
+ *     and nothing is folded on the way out,
+ *     metrics_add / metrics_time work without metrics_init, which only
+ *     starts the exporter on METRICS_IP:METRICS_PORT
+*/
+int metrics_init(void);
+/* monotonic nanoseconds, the start of a metrics_time */
+uint64_t metrics_now(void);
+void metrics_add(int counter, uint64_t value);
+/* observes the time since start (metrics_now) in histogram */
+void metrics_time(int histogram, uint64_t start);
+/* observes ns nanoseconds in histogram */
+void metrics_observe(int histogram, uint64_t ns);
+/* writes every metric in prometheus text format into a malloc'ed buffer, *len excludes the '\0' */
+char * metrics_render(size_t * len);
+void metrics_finish(void);
+
+#endif
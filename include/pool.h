@@ -0,0 +1,85 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include "lock.h"
+#include "sync.h"
+#include <pthread.h>
+
+/**
+ * work-stealing pool:
+ *     every worker owns a deque, a task is pushed to the deque of worker
+ *     (hint % worker_num), the owner takes its oldest task, a worker with an
+ *     empty deque steals the oldest task of a random victim,
+ *     worker_init runs once on every worker, its return value is passed to
+ *     every task run by that worker (e.g. a database connection)
+ *
+ * continuations:
+ *     a task submitted with pool_submit_then does not set done, the worker
+ *     writes it into the pipe of its owner (a connection) instead, the owner
+ *     polls fd[0] along with whatever else it waits for and pool_complete
+ *     runs then(arg) on the owner's thread, so the owner does not block on
+ *     the pool and whatever then sends stays on the owner's thread
+*/
+
+struct pool_owner
+{
+    int fd[2];
+    int inflight;           /* submitted and not completed, touched by the owner only */
+};
+
+struct pool_task
+{
+    void (* func)(void * worker_data, void * arg);
+    void * arg;
+    struct sync_event done;
+    void (* then)(void * arg);
+    struct pool_owner * owner;      /* NULL for a task completed through done */
+};
+
+struct pool_deque
+{
+    lock_t lock;
+    struct pool_task ** tasks;
+    int capacity;
+    int head;           /* the oldest task, taken by the owner and by thieves */
+    int size;           /* tasks are pushed at head + size */
+};
+
+struct pool_worker
+{
+    pthread_t thread;
+    struct pool * pool;
+    struct pool_deque deque;
+    void * data;
+    unsigned int seed;
+};
+
+struct pool
+{
+    int worker_num;
+    struct pool_worker * workers;
+    void * (* worker_init)(void);
+    void (* worker_finish)(void * worker_data);
+    /* idle workers sleep until pending > 0 */
+    lock_t idle_lock;
+    struct sync_cond idle_cond;
+    int pending;
+    int exit_flag;
+};
+
+struct pool * pool_init(int worker_num,
+                        void * (* worker_init)(void),
+                        void (* worker_finish)(void * worker_data));
+void pool_task_init(struct pool_task * task,
+                    void (* func)(void * worker_data, void * arg),
+                    void * arg);
+int pool_submit(struct pool * pool, struct pool_task * task, unsigned int hint);
+void pool_wait(struct pool_task * task);
+int pool_owner_init(struct pool_owner * owner);
+void pool_owner_finish(struct pool_owner * owner);
+int pool_submit_then(struct pool * pool, struct pool_task * task, unsigned int hint,
+                     struct pool_owner * owner, void (* then)(void * arg));
+int pool_complete(struct pool_owner * owner);
+void pool_finish(struct pool * pool);
+
+#endif
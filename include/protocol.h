@@ -19,14 +19,83 @@
  *          state       tinyint not null
  */
 
-#undef  MULTICORE
+#undef  SERVER_ACCEPTOR_PIN
 
 #define SERVER_IP                   "xxx"
 #define SERVER_PORT                 25566
 #define SERVER_MAX_CLIENT_NUM       10
+#define SERVER_ACCEPTOR_NUM         4
+#define SERVER_LISTEN_BACKLOG       4096
 #define SERVER_CHAT_SYN_INTERVAL    0.5
+#define SERVER_MAX_STREAM_NUM       8
+#define SERVER_STREAM_SYNC_ROWS     64
+#define SERVER_INBOX_PAGE_ROWS      1024        /* the clients stop at the first inbox batch with fewer rows */
+#define SERVER_POOL_WORKER_NUM      4
+#define SERVER_CHAT_JOB_NUM         8           /* chat requests a connection reads ahead of the pool */
+#define SERVER_FRIEND_JOB_NUM       8           /* friend requests of a connection on the pool at once */
 
+#define SECURE_SESSION_BUF_SIZE     (16 << 10)
+
+/* the server runs handshake math on a pool of its own (0: one worker per online core) */
+#define SECURE_CRYPTO_WORKER_NUM    0
+#define SECURE_KEYPAIR_CACHE_NUM    32
+
+/* AEAD suites, the server offers a mask, the client picks one by its cpu */
+#define SECURE_SUITE_AES_256_GCM            0x01
+#define SECURE_SUITE_CHACHA20_POLY1305      0x02
+#define SECURE_SERVER_SUITES        (SECURE_SUITE_AES_256_GCM | SECURE_SUITE_CHACHA20_POLY1305)
+#define SECURE_TAG_LEN              16
+/* AES-256-GCM records up to SECURE_SEAL_MAX_LEN bytes are sealed up to SECURE_SEAL_BATCH at a time (./src/seal.c) */
+#define SECURE_SEAL_MAX_LEN         512
+#define SECURE_SEAL_BATCH           64
+
+/* kernel TLS record layer, used only when both ends define it and have the tls ulp */
+#undef  SECURE_KTLS
+#define SECURE_SUITE_KTLS           0x80    /* or'ed into the suite byte of the handshake */
+
+/**
+ * session tickets, sealed by the server with a ticket key that only lives in
+ * its memory, a new key takes over every SECURE_TICKET_ROTATE seconds and is
+ * kept until the last ticket it sealed expires
+*/
+#define SECURE_TICKET_STATE_LEN     66      /* 65B username + 1B codec */
+#define SECURE_TICKET_LEN           138     /* 4B key id + 12B nonce + 8B time + 32B secret + state + 16B tag */
+#define SECURE_TICKET_ROTATE        3600
+#define SECURE_TICKET_LIFETIME      (2 * SECURE_TICKET_ROTATE)
+
+/* io_uring backend, only built with make IO_URING=1 */
+#define SECURE_URING_DEPTH          16          /* send slots, writes queued or in flight per thread */
+#define SECURE_URING_SLOT_SIZE      (32 << 10)
+
+#define CLIENT_TICKET_FILENAME      "secure_messaging.ticket"
+/* the chats of the chat box are kept in CLIENT_CHAT_FILENAME, synced as CLIENT_CHAT_SYNC says */
 #define CLIENT_CHAT_FILENAME        "secure_messaging.chat"
+#define CLIENT_CHAT_SYNC_NONE       0       /* never, the kernel writes it back */
+#define CLIENT_CHAT_SYNC_EACH       1       /* every message on its own, a history once it is written */
+#define CLIENT_CHAT_SYNC_GROUP      2       /* CLIENT_CHAT_SYNC_MS after the oldest line not synced, or CLIENT_CHAT_SYNC_NUM lines */
+#define CLIENT_CHAT_SYNC            CLIENT_CHAT_SYNC_GROUP
+#define CLIENT_CHAT_SYNC_MS         100
+#define CLIENT_CHAT_SYNC_NUM        256
+#define CLIENT_FRIEND_BATCH_NUM     16
+
+/* prometheus text format over http, whatever the path, keep it off public interfaces */
+#define METRICS_IP                  "127.0.0.1"
+#define METRICS_PORT                9464
+
+/* sync.h waiters spin this many pauses before they park on the futex, 0 parks at once */
+#define SYNC_SPIN_NUM               100
+
+/* lock_t waits and holds by lock, exported with the metrics, lock_t is a bare mutex without it */
+#undef  LOCK_PROFILE
+
+/* spans of 1 in TRACE_SAMPLE_RATE connections, kill -USR2 the server to write them out */
+#define TRACE_SAMPLE_RATE           16
+#define TRACE_THREAD_SPANS          4096
+#define TRACE_FILENAME              "secure_messaging.trace.json"
+
+/* every record from the clients, for ./replay, blanks passwords and message text but not usernames */
+#undef  SERVER_CAPTURE
+#define SERVER_CAPTURE_FILENAME     "secure_messaging.capture"
 
 #define LOG_USE_STDOUT
 #define LOG_FILENAME                "xxx"
@@ -36,6 +105,16 @@
 #define DATABASE_PASSWORD           "xxx"
 #define DATABASE_DBNAME             "secure_messaging_db"
 
+/* codecs are ordered, both sides use the lesser of the two */
+#define BATCH_CODEC_NULL            0x00    /* no batch, one record per row */
+#define BATCH_CODEC_STORE           0x01    /* batch, uncompressed */
+#define BATCH_CODEC_ZLIB            0x02    /* batch, zlib compressed */
+#define BATCH_MAX_SIZE              (64 << 20)
+
+#define SERVER_BATCH_CODEC          BATCH_CODEC_ZLIB
+#define SERVER_BATCH_LEVEL          3
+#define CLIENT_BATCH_CODEC          BATCH_CODEC_ZLIB
+
 #define TABLE_F_STATE_BEING         0x01
 #define TABLE_F_STATE_RECV          0x02
 #define TABLE_F_STATE_RECV_REJ      0x04
@@ -46,31 +125,61 @@
 #define TABLE_M_STATE_READ          0x01
 #define TABLE_M_STATE_UNREAD        0x02
 
-#define PROTOCOL_BUILD_P            0x00    /* flag + 512B dh_p */
-#define PROTOCOL_BUILD_PUBK         0x01    /* flag + 512B dh_pubk */
+#define PROTOCOL_BUILD_P            0x00    /* flag + 512B dh_p + 1B offered suites (| SECURE_SUITE_KTLS) */
+#define PROTOCOL_BUILD_PUBK         0x01    /* flag + 512B dh_pubk + 1B picked suite (| SECURE_SUITE_KTLS, 0 from the server) */
+#define PROTOCOL_BUILD_HELLO        0x02    /* flag + 513B null, the first record of a client without a ticket */
+#define PROTOCOL_BUILD_RESUME       0x03    /* flag + 32B random + 138B ticket + 342B null + 1B suite (| SECURE_SUITE_KTLS) */
+                                            /* (flag + 32B random + 480B null + 1B SECURE_SUITE_KTLS or 0 from the server) */
 
-#define PROTOCOL_SIGN_IN            0x10    /* flag + 65B username + 65B password */
-#define PROTOCOL_SIGN_UP            0x11    /* flag + 65B username + 65B password */
+#define PROTOCOL_SIGN_IN            0x10    /* flag + 65B username + 65B password + 1B codec */
+#define PROTOCOL_SIGN_UP            0x11    /* flag + 65B username + 65B password + 1B codec */
+#define PROTOCOL_TICKET             0x12    /* flag + 138B ticket, after sign in / sign up / resumption */
 
+/**
+ * chat mode:
+ *     requests are 811B, replies are 813B, both start with flag + 1B stream id,
+ *     stream 1 ~ SERVER_MAX_STREAM_NUM are chats, stream 0 is the connection,
+ *     friend requests are sent on stream 0 as flag + 1B stream id + 4B request id + 65B username
+*/
 #define PROTOCOL_CHAT               0x20    /* flag */
-#define PROTOCOL_CHAT_SELECT        0x21    /* flag + 65B username */
-#define PROTOCOL_CHAT_MESSAGE       0x22    /* flag + 8B time + 801B message */
+#define PROTOCOL_CHAT_SELECT        0x21    /* flag + 1B stream id + 65B username */
+#define PROTOCOL_CHAT_MESSAGE       0x22    /* flag + 1B stream id + 8B time + 801B message */
+#define PROTOCOL_CHAT_CLOSE         0x23    /* flag + 1B stream id */
 #define PROTOCOL_CHAT_LIST_SEND     0x2C    /* flag */
 #define PROTOCOL_CHAT_LIST_RECV     0x2D    /* flag */
-#define PROTOCOL_CHAT_LIST          0x2E    /* flag + 1B sr_flag + 8B time + 801B message + 1B state */
-#define PROTOCOL_CHAT_LIST_END      0x2F    /* flag + 811B null */
+#define PROTOCOL_CHAT_LIST          0x2E    /* flag + 1B stream id + 1B sr_flag + 8B time + 801B message + 1B state */
+#define PROTOCOL_CHAT_LIST_END      0x2F    /* flag + 1B stream id + 811B null, once the history is sent */
 
 #define PROTOCOL_FRIEND             0x30    /* flag */
-#define PROTOCOL_FRIEND_ADD         0x31    /* flag + 65B username */
-#define PROTOCOL_FRIEND_ACCEPT      0x32    /* flag + 65B username */
-#define PROTOCOL_FRIEND_REJECT      0x33    /* flag + 65B username */
+#define PROTOCOL_FRIEND_ADD         0x31    /* flag + 4B request id + 65B username */
+#define PROTOCOL_FRIEND_ACCEPT      0x32    /* flag + 4B request id + 65B username */
+#define PROTOCOL_FRIEND_REJECT      0x33    /* flag + 4B request id + 65B username */
+#define PROTOCOL_FRIEND_REFRESH     0x34    /* flag + 4B request id */
 #define PROTOCOL_FRIEND_LIST        0x3E    /* flag + 65B username + 1B state */
-#define PROTOCOL_FRIEND_LIST_END    0x3F    /* flag + 66B null */
+#define PROTOCOL_FRIEND_LIST_END    0x3F    /* flag + 4B request id + 62B null */
+
+#define PROTOCOL_INBOX              0x40    /* flag + 65B username + 8B time + 801B message */
+                                            /* (batches of SERVER_INBOX_PAGE_ROWS rows, the last one has fewer, maybe none) */
 
-#define PROTOCOL_ERROR              0x7B    /* flag */
-#define PROTOCOL_FAIL               0x7C    /* flag */
-#define PROTOCOL_SUCCEED            0x7D    /* flag */
-#define PROTOCOL_FINISH             0x7E    /* flag */
+#define PROTOCOL_BATCH              0x50    /* flag + 1B codec + 4B count + 4B row size + 4B payload size */
+
+/**
+ * friend mode:
+ *     requests are 70B and carry a request id, so they can be pipelined,
+ *     replies are 67B and echo the request id, so they can come out of order,
+ *     requests on different usernames run at once and are replied to as
+ *     they finish, those on one username one after another, the friend
+ *     list (refresh) and the finish come after every reply before them
+*/
+#define PROTOCOL_ERROR              0x7B    /* flag (+ 4B request id in friend mode) */
+                                            /*      (+ 1B stream id + 4B request id in chat mode) */
+#define PROTOCOL_FAIL               0x7C    /* flag (+ 1B codec after sign in / sign up) */
+                                            /*      (+ 4B request id in friend mode) */
+                                            /*      (+ 1B stream id + 4B request id in chat mode) */
+#define PROTOCOL_SUCCEED            0x7D    /* flag (+ 1B codec after sign in / sign up) */
+                                            /*      (+ 4B request id in friend mode) */
+                                            /*      (+ 1B stream id + 4B request id in chat mode) */
+#define PROTOCOL_FINISH             0x7E    /* flag (+ 1B stream id in chat mode) */
 #define PROTOCOL_DISCONNECT         0x7F    /* flag */
 
 #endif
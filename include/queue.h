@@ -1,11 +1,11 @@
 #ifndef _UTILITY_H_
 #define _UTILITY_H_
 
-#include <pthread.h>
+#include "lock.h"
 
 struct queue
 {
-    pthread_mutex_t lock;
+    lock_t lock;
     int front;
     int rear;
     int cur_size;
@@ -0,0 +1,42 @@
+#ifndef _SEAL_H_
+#define _SEAL_H_
+
+#include <stddef.h>
+
+/**
+ * multi-buffer AES-256-GCM:
+ *     seal_batch seals any number of records, each under its own key and
+ *     nonce, SEAL_LANES records at a time, the AES rounds of the lanes are
+ *     interleaved so the AES unit has SEAL_LANES independent blocks in
+ *     flight, where a small record on its own leaves it mostly waiting,
+ *     every lane keeps its own GHASH, SEAL_GHASH_BLOCKS blocks at a time
+ *     with one reduction, the output is byte for byte what
+ *     EVP_aes_256_gcm seals (no AAD, 16-byte tag),
+ *     x86-64 with AES-NI and PCLMULQDQ only, seal_available says whether
+ *     the CPU has them, nothing else may be called if it does not
+*/
+#define SEAL_LANES          8
+#define SEAL_GHASH_BLOCKS   4
+
+struct seal_key
+{
+    unsigned char round_keys[15][16] __attribute__((aligned(16)));
+    unsigned char h[SEAL_GHASH_BLOCKS][16] __attribute__((aligned(16)));   /* H = E(K, 0) and its powers, byte reversed */
+};
+
+/* in and out may be the same, out gets len bytes of ciphertext then the tag */
+struct seal_record
+{
+    const struct seal_key * key;
+    unsigned char nonce[12];
+    const unsigned char * in;
+    size_t len;
+    unsigned char * out;
+};
+
+int seal_available(void);
+/* expands a 32-byte key */
+void seal_key_init(struct seal_key * key, const unsigned char * raw);
+void seal_batch(struct seal_record * records, int num);
+
+#endif
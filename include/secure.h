@@ -1,21 +1,124 @@
 #ifndef _SECURE_H_
 #define _SECURE_H_
 
+#include "protocol.h"
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
 
-/* due to block alignment, the return value is supposed to be len - len % 16 + 16 */
+/**
+ * connection keys, built by the handshake:
+ *     every record is sealed with the negotiated AEAD suite (SECURE_SUITE_*),
+ *     each direction has its own key and nonce salt, the nonce of a record is
+ *     the salt xor its sequence number, so records must be opened in the
+ *     order they were sealed and one thread at a time may send (or receive),
+ *     with ktls set the kernel seals and opens the records (TLS 1.3 with the
+ *     same keys and nonces), the channel carries plaintext for this layer and
+ *     a record is len bytes, without the tag
+*/
+struct secure_key
+{
+    int suite;
+    int ktls;
+    unsigned char send_key[32];
+    unsigned char send_iv[12];
+    uint64_t send_seq;
+    unsigned char recv_key[32];
+    unsigned char recv_iv[12];
+    uint64_t recv_seq;
+    unsigned char resume_secret[32];    /* what a ticket issued on this connection resumes */
+};
+
+/**
+ * what a client keeps to come back without the dh exchange: the ticket is
+ * opaque to it, the secret is never sent, a resumed connection derives its
+ * keys from the secret and a random number of each end
+*/
+struct secure_ticket
+{
+    int suite;
+    unsigned char ticket[SECURE_TICKET_LEN];
+    unsigned char secret[32];
+};
+
+/**
+ * the return value is supposed to be len + SECURE_TAG_LEN (len with ktls)
+ * note: flags may carry MSG_MORE when more records follow right away, the
+ *       last record of a run must be sent without it, with the io_uring
+ *       backend the run is held back until then, and the record is handed
+ *       to the kernel without waiting for the write, so an error shows up
+ *       in the next send or receive on the channel
+*/
 ssize_t secure_send(int channel, const void * buf, size_t len, int flags,
-                    const unsigned char * key, const unsigned char * iv);
-/* due to block alignment, the return value is supposed to be len - len % 16 + 16 */
+                    struct secure_key * key);
+/**
+ * sends count records, each sealed on its own exactly as secure_send does,
+ * with one send, the return value is the sum of the record lengths
+ * note: MSG_MORE in flags holds back the tail of the run for the next record
+*/
+ssize_t secure_sendv(int channel, const struct iovec * records, int count, int flags,
+                     struct secure_key * key);
+/**
+ * the return value is supposed to be len + SECURE_TAG_LEN (len with ktls),
+ * a record that fails authentication returns -1 with errno EBADMSG
+*/
 ssize_t secure_recv(int channel, void * buf, size_t len, int flags,
-                    const unsigned char * key, const unsigned char * iv);
+                    struct secure_key * key);
+
+/**
+ * with the io_uring backend, records the calling thread sends from now on
+ * are held back even without MSG_MORE, they go into the kernel in one
+ * submission with the next receive of the thread (on any channel) or at
+ * secure_flush, a thread that corks must call secure_flush before it waits
+ * on anything else (poll, another thread) and before it closes a channel,
+ * both do nothing in the default build, where every record is sent at once
+*/
+void secure_cork(void);
+/* returns once every record the calling thread has sent is written */
+void secure_flush(void);
+
+/**
+ * a session owns the inbound side of a channel once the key is built:
+ *     it reads as much as the channel has into one buffer and decrypts each
+ *     record in place, so every read on the channel must go through it,
+ *     records still buffered (secure_session_buffered) do not wake poll()
+*/
+struct secure_session
+{
+    int channel;
+    struct secure_key * key;
+    unsigned char * buf;
+    size_t capacity;
+    size_t head;            /* the next record starts here */
+    size_t tail;            /* bytes read from the channel end here */
+};
+
+int secure_session_init(struct secure_session * session, int channel,
+                        struct secure_key * key);
+ssize_t secure_recv_view(struct secure_session * session, size_t len, void ** view);
+size_t secure_session_buffered(const struct secure_session * session);
+void secure_session_finish(struct secure_session * session);
+
+/**
+ * hands the record layer of channel to the kernel with the keys as they are,
+ * both ends must switch at the same record, the handshake does it right after
+ * key agreement when both ends have SECURE_KTLS
+*/
+int secure_ktls_enable(int channel, struct secure_key * key);
 
 int secure_server_init(void);
-int secure_server_buildkey(int channel, unsigned char * key, unsigned char * iv);
+int secure_server_buildkey(int channel, struct secure_key * key, void * state);
+/* seals SECURE_TICKET_STATE_LEN bytes of state with the resume secret of key into ticket */
+void secure_server_ticket(const struct secure_key * key, const void * state,
+                          unsigned char * ticket);
 void secure_server_finish(void);
 
 int secure_client_init(void);
-int secure_client_buildkey(int channel, unsigned char * key, unsigned char * iv);
+int secure_client_buildkey(int channel, struct secure_key * key,
+                           const struct secure_ticket * ticket);
+/* keeps a ticket the server has sent on the connection of key */
+void secure_client_ticket(const struct secure_key * key, const unsigned char * ticket,
+                          struct secure_ticket * out);
 void secure_client_finish(void);
 
 #endif
@@ -0,0 +1,66 @@
+#ifndef _SYNC_H_
+#define _SYNC_H_
+
+#include <stdint.h>
+
+/**
+ * futex primitives, private to the process:
+ *     a waiter spins SYNC_SPIN_NUM times (./include/protocol.h) with a
+ *     pause in between when more than one core is online, then parks on
+ *     the futex, so a short hold costs no syscall and a long one no core,
+ *     the owner of a change only makes a syscall if someone is parked,
+ *     all of them start zeroed, the _init calls are for readability
+*/
+
+/* 0 free, 1 taken, 2 taken and someone may be parked */
+struct sync_mutex
+{
+    uint32_t state;
+};
+
+/* a waiter parks on the sequence it saw, every signal moves it on, and wakes it if it is counted */
+struct sync_cond
+{
+    uint32_t seq;
+    uint32_t waiters;
+};
+
+/* one-shot, 0 not set, 1 set, 2 not set and someone may be parked */
+struct sync_event
+{
+    uint32_t state;
+};
+
+struct sync_sem
+{
+    uint32_t value;
+    uint32_t waiters;
+};
+
+#define SYNC_MUTEX_INITIALIZER  {0}
+#define SYNC_COND_INITIALIZER   {0, 0}
+
+void sync_mutex_init(struct sync_mutex * mutex);
+void sync_mutex_lock(struct sync_mutex * mutex);
+/* returns 0 if the mutex is taken, EBUSY otherwise */
+int sync_mutex_trylock(struct sync_mutex * mutex);
+void sync_mutex_unlock(struct sync_mutex * mutex);
+
+void sync_cond_init(struct sync_cond * cond);
+/* mutex is held, it is released while parked and held again on return, wakeups may be spurious */
+void sync_cond_wait(struct sync_cond * cond, struct sync_mutex * mutex);
+/* sync_cond_wait for ms at most, the caller tells a timeout from a wakeup by the clock */
+void sync_cond_timedwait(struct sync_cond * cond, struct sync_mutex * mutex, int ms);
+void sync_cond_signal(struct sync_cond * cond);
+void sync_cond_broadcast(struct sync_cond * cond);
+
+void sync_event_init(struct sync_event * event);
+void sync_event_set(struct sync_event * event);
+/* returns once the event is set */
+void sync_event_wait(struct sync_event * event);
+
+void sync_sem_init(struct sync_sem * sem, uint32_t value);
+void sync_sem_post(struct sync_sem * sem);
+void sync_sem_wait(struct sync_sem * sem);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/**
+ * trace spans:
+ *     every accepted connection gets a trace id, 1 in TRACE_SAMPLE_RATE of
+ *     them is traced, a thread records spans for the trace id it is set to
+ *     into a ring of its own (the last TRACE_THREAD_SPANS), rings outlive
+ *     their threads, SIGUSR2 writes every ring to TRACE_FILENAME as chrome
+ *     trace event json (chrome://tracing, ui.perfetto.dev), one process per
+ *     trace id, one thread per ring
+*/
+/* blocks SIGUSR2 and starts the dump thread, call it before any other thread is created */
+int trace_init(void);
+/* the id of a new connection, 0 if it is not sampled */
+uint32_t trace_new_id(void);
+/* spans of the calling thread belong to id from now on, 0 stops recording */
+void trace_set_id(uint32_t id);
+uint32_t trace_get_id(void);
+/* the start of a span, 0 if the calling thread does not record */
+uint64_t trace_begin(void);
+/* records name from start (trace_begin or metrics_now) until now, name must be a literal */
+void trace_end(const char * name, uint64_t start);
+int trace_dump(const char * filename);
+void trace_finish(void);
+
+#endif
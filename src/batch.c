@@ -0,0 +1,140 @@
+#include "protocol.h"
+#include "batch.h"
+#include "secure.h"
+#include <zlib.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+ssize_t batch_send(int channel, struct secure_key * key,
+                   int header_len, const void * rows, int row_len, int count,
+                   int codec, int level)
+{
+    char header[1024];
+    unsigned char * payload;
+    const void * send_buf;
+    uLongf payload_len;
+    uLong raw_len;
+    struct iovec records[2];
+    ssize_t total_send_len;
+
+    raw_len = (uLong)row_len * count;
+    payload = NULL;
+    send_buf = rows;
+    payload_len = raw_len;
+
+    if (count > 0 && codec == BATCH_CODEC_ZLIB) {
+        payload_len = compressBound(raw_len);
+        payload = (unsigned char *)malloc(payload_len);
+        if (payload == NULL) {
+            return -1;
+        }
+        if (Z_OK != compress2(payload, &payload_len, rows, raw_len, level)) {
+            free(payload);
+            return -1;
+        }
+        send_buf = payload;
+    } else {
+        codec = BATCH_CODEC_STORE;
+    }
+
+    memset(header, 0, header_len);
+    header[0] = PROTOCOL_BATCH;
+    header[1] = (char)codec;
+    *((uint32_t *)(&(header[2]))) = (uint32_t)count;
+    *((uint32_t *)(&(header[6]))) = (uint32_t)row_len;
+    *((uint32_t *)(&(header[10]))) = (uint32_t)payload_len;
+
+    records[0].iov_base = header;
+    records[0].iov_len = header_len;
+    records[1].iov_base = (void *)send_buf;
+    records[1].iov_len = payload_len;
+    total_send_len = secure_sendv(channel, records, (count > 0) ? 2 : 1, 0, key);
+
+    free(payload);
+
+    return total_send_len;
+}
+
+void * batch_recv(int channel, struct secure_key * key,
+                  const char * header, int * row_len, int * count)
+{
+    unsigned char * payload;
+    unsigned char * rows;
+    uint32_t payload_len;
+    uLongf raw_len;
+
+    *count = (int)*((uint32_t *)(&(header[2])));
+    *row_len = (int)*((uint32_t *)(&(header[6])));
+    payload_len = *((uint32_t *)(&(header[10])));
+
+    /* an empty batch has no payload record */
+    if (*count == 0 && payload_len == 0) {
+        return NULL;
+    }
+    /* the payload record is left unread, the records after it can not be told apart */
+    if ((header[1] != BATCH_CODEC_STORE && header[1] != BATCH_CODEC_ZLIB) ||
+        *count <= 0 || *row_len <= 0 ||
+        (uint64_t)*count * *row_len > BATCH_MAX_SIZE || payload_len > BATCH_MAX_SIZE) {
+        *count = -1;
+        return NULL;
+    }
+
+    raw_len = (uLongf)*count * *row_len;
+    payload = (unsigned char *)malloc(payload_len);
+    if (payload == NULL || secure_recv(channel, payload, payload_len, 0, key) <= 0) {
+        free(payload);
+        *count = -1;
+        return NULL;
+    }
+
+    if (header[1] == BATCH_CODEC_STORE) {
+        if (payload_len == raw_len) {
+            return payload;
+        }
+        rows = NULL;
+    } else {
+        rows = (unsigned char *)malloc(raw_len);
+        if (rows != NULL && (Z_OK != uncompress(rows, &raw_len, payload, payload_len) ||
+                             raw_len != (uLongf)*count * *row_len)) {
+            free(rows);
+            rows = NULL;
+        }
+    }
+
+    if (rows == NULL) {
+        *count = -1;
+    }
+
+    free(payload);
+
+    return rows;
+}
+
+int batch_recv_pages(int channel, struct secure_key * key, int header_len, int page_rows,
+                     void (* put)(void * arg, const char * row), void * arg)
+{
+    char header[1024];
+    char * rows;
+    int row_len, count;
+    int total = 0;
+
+    do {
+        if (secure_recv(channel, header, header_len, 0, key) <= 0 || header[0] != PROTOCOL_BATCH) {
+            return -1;
+        }
+        rows = batch_recv(channel, key, header, &row_len, &count);
+        if (count < 0) {
+            return -1;
+        }
+        for (int i = 0; put != NULL && i < count; ++i) {
+            put(arg, &(rows[i * row_len]));
+        }
+        free(rows);
+        total += count;
+    } while (count == page_rows);
+
+    return total;
+}
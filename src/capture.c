@@ -0,0 +1,143 @@
+#include "protocol.h"
+#include "capture.h"
+#include "metrics.h"
+#include "lock.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+static pthread_once_t capture_once = PTHREAD_ONCE_INIT;
+static pthread_key_t capture_key;
+static lock_t capture_lock = LOCK_INITIALIZER(METRICS_LOCK_CAPTURE);
+static FILE * capture_file;
+static uint64_t capture_start;
+static uint32_t session_num;
+
+static void _capture_key_init(void)
+{
+    pthread_key_create(&capture_key, NULL);
+}
+
+/* the session of the calling thread, 0 if none */
+static uint32_t _session_get(void)
+{
+    pthread_once(&capture_once, _capture_key_init);
+    return (uint32_t)(uintptr_t)pthread_getspecific(capture_key);
+}
+
+static void _session_set(uint32_t session)
+{
+    pthread_once(&capture_once, _capture_key_init);
+    pthread_setspecific(capture_key, (void *)(uintptr_t)session);
+}
+
+/* the time is taken under the lock, so the file is in time order */
+static void _write(uint32_t session, int type, const void * buf, size_t len, size_t stored)
+{
+    struct capture_frame frame;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.session = session;
+    frame.len = (uint16_t)len;
+    frame.stored = (uint16_t)stored;
+    frame.type = (uint8_t)type;
+
+    lock_acquire(&capture_lock);
+    if (capture_file == NULL) {
+        lock_release(&capture_lock);
+        return;
+    }
+    frame.time = metrics_now() - capture_start;
+    fwrite(&frame, sizeof(frame), 1, capture_file);
+    if (stored > 0) {
+        fwrite(buf, 1, stored, capture_file);
+    }
+    /* a session is whole on disk once it is closed */
+    if (type == CAPTURE_CLOSE) {
+        fflush(capture_file);
+    }
+    lock_release(&capture_lock);
+}
+
+/** capture_init return value:
+ *     return  0 if frames go to filename, or SERVER_CAPTURE is not defined
+ *     return -1 if filename can not be written
+*/
+int capture_init(const char * filename)
+{
+#ifdef SERVER_CAPTURE
+    int fd;
+
+    /* it holds usernames and who talks to whom */
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || (capture_file = fdopen(fd, "w")) == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    capture_start = metrics_now();
+    fwrite(CAPTURE_MAGIC, 1, 8, capture_file);
+#endif /* SERVER_CAPTURE */
+
+    return 0;
+}
+
+void capture_open(const void * state)
+{
+    uint32_t session;
+
+    if (capture_file == NULL) {
+        return;
+    }
+    session = __atomic_add_fetch(&session_num, 1, __ATOMIC_RELAXED);
+    _session_set(session);
+    _write(session, CAPTURE_OPEN, state, (state != NULL) ? SECURE_TICKET_STATE_LEN : 0,
+           (state != NULL) ? SECURE_TICKET_STATE_LEN : 0);
+}
+
+void capture_record(const void * buf, size_t len)
+{
+    char record[1024];
+    uint32_t session;
+    size_t stored;
+
+    if (capture_file == NULL || (session = _session_get()) == 0 || len > sizeof(record)) {
+        return;
+    }
+
+    memcpy(record, buf, len);
+    if ((record[0] == PROTOCOL_SIGN_IN || record[0] == PROTOCOL_SIGN_UP) && len == 132) {
+        memset(&(record[66]), 0, 65);
+    } else if (record[0] == PROTOCOL_CHAT_MESSAGE && len == 811) {
+        for (int i = 10; i < 810 && record[i] != '\0'; ++i) {
+            record[i] = 'x';
+        }
+    }
+    for (stored = len; stored > 0 && record[stored - 1] == '\0'; --stored);
+
+    _write(session, CAPTURE_RECORD, record, len, stored);
+}
+
+void capture_close(void)
+{
+    uint32_t session;
+
+    if (capture_file == NULL || (session = _session_get()) == 0) {
+        return;
+    }
+    _write(session, CAPTURE_CLOSE, NULL, 0, 0);
+    _session_set(0);
+}
+
+void capture_finish(void)
+{
+    if (capture_file != NULL) {
+        lock_acquire(&capture_lock);
+        fclose(capture_file);
+        capture_file = NULL;
+        lock_release(&capture_lock);
+    }
+}
@@ -0,0 +1,389 @@
+#include "protocol.h"
+#include "secure.h"
+#include "batch.h"
+#include "chat.h"
+#include <sys/time.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void _put(struct chat_client * client, int stream_id, double time, const char * text)
+{
+    struct chat_line line;
+
+    line.stream_id = stream_id;
+    line.time = time;
+    line.history = 0;
+    line.text = text;
+    client->put(client->arg, &line);
+}
+
+void chat_client_init(struct chat_client * client, int channel, struct secure_key * key,
+                      const char * username, chat_put_t put, void * arg)
+{
+    memset(client, 0, sizeof(struct chat_client));
+    client->channel = channel;
+    client->key = key;
+    strcpy(client->username, username);
+    client->put = put;
+    client->arg = arg;
+}
+
+const char * chat_friend_state(const char * username, const char * row)
+{
+    switch (row[66])
+    {
+    case TABLE_F_STATE_BEING:
+        return "[being]";
+    case TABLE_F_STATE_RECV:
+        return (strcmp(username, &(row[1])) < 0) ? "[recv] " : "[send] ";
+    case TABLE_F_STATE_SEND:
+        return (strcmp(username, &(row[1])) < 0) ? "[send] " : "[recv] ";
+    default:
+        return "[?]    ";
+    }
+}
+
+static void _put_friend(struct chat_client * client, const char * row)
+{
+    char text[128];
+
+    snprintf(text, sizeof(text), "   %s %s", chat_friend_state(client->username, row), &(row[1]));
+    _put(client, 0, 0, text);
+}
+
+int chat_client_enter(struct chat_client * client)
+{
+    char buf[128];
+    char * rows;
+    int row_len, count;
+
+    buf[0] = PROTOCOL_CHAT;
+    if (secure_send(client->channel, buf, 1, 0, client->key) <= 0) {
+        return -1;
+    }
+
+    _put(client, 0, 0, "   state   username   ");
+    while (true) {
+        if (secure_recv(client->channel, buf, 67, 0, client->key) <= 0) {
+            return -1;
+        }
+        if (buf[0] == PROTOCOL_FRIEND_LIST_END) {
+            break;
+        } else if (buf[0] == PROTOCOL_BATCH) {
+            rows = batch_recv(client->channel, client->key, buf, &row_len, &count);
+            if (count < 0) {
+                return -1;
+            }
+            for (int i = 0; rows != NULL && i < count; ++i) {
+                _put_friend(client, &(rows[i * row_len]));
+            }
+            free(rows);
+        } else {
+            _put_friend(client, buf);
+        }
+    }
+
+    return 0;
+}
+
+static void _put_message(struct chat_client * client, const char * buf, struct chat_stream * stream)
+{
+    struct chat_line line;
+    char text[1024];
+    char time_string[26];
+    time_t time;
+
+    time = (time_t)*((double *)(&(buf[3])));
+    ctime_r(&time, time_string);
+    time_string[19] = '\0';
+    time_string[24] = '\0';
+
+    /** > 1993 Jun 30 21:49:08 [bob]
+     *      this is a sent message example
+     *  < 1993 Jun 30 21:49:08 [bob] [unread]
+     *      this is a received message example
+    */
+    snprintf(text, sizeof(text), "%c %s %s [%s] %s\n    %.800s",
+             (buf[2] == PROTOCOL_CHAT_LIST_SEND) ? '>' : '<',
+             &(time_string[20]), &(time_string[4]), stream->peername,
+             (stream->history_mode && (buf[812] == TABLE_M_STATE_UNREAD)) ? "[unread]" : "",
+             &(buf[11]));
+    line.stream_id = (int)(stream - client->streams);
+    line.time = *((double *)(&(buf[3])));
+    line.history = stream->history_mode;
+    line.text = text;
+    client->put(client->arg, &line);
+}
+
+/* handles one 813B record of chat mode */
+static void _dispatch(struct chat_client * client, const char * buf)
+{
+    struct chat_stream * stream;
+    char text[160];
+    int stream_id;
+
+    stream_id = (unsigned char)buf[1];
+    if (stream_id > SERVER_MAX_STREAM_NUM) {
+        return;
+    }
+    stream = &(client->streams[stream_id]);
+
+    if (stream_id == 0) {
+        /* reply to a friend request */
+        snprintf(text, sizeof(text), (buf[0] == PROTOCOL_SUCCEED) ? ">> %s successfully" : ">> fail: %s",
+                 client->friend_requests[*((uint32_t *)(&(buf[2]))) % CLIENT_FRIEND_BATCH_NUM]);
+        _put(client, 0, 0, text);
+    } else if (buf[0] == PROTOCOL_CHAT_LIST) {
+        _put_message(client, buf, stream);
+    } else if (buf[0] == PROTOCOL_CHAT_LIST_END) {
+        stream->history_mode = 0;
+        snprintf(text, sizeof(text), "---------------- history with %s ----------------",
+                 stream->peername);
+        _put(client, stream_id, 0, text);
+    } else if (buf[0] == PROTOCOL_SUCCEED) {
+        stream->state = CHAT_STREAM_OPEN;
+    } else if (buf[0] == PROTOCOL_FINISH) {
+        stream->state = CHAT_STREAM_FREE;
+        snprintf(text, sizeof(text), "---------------- end of chat with %s ----------------",
+                 stream->peername);
+        _put(client, stream_id, 0, text);
+    } else if (stream->state == CHAT_STREAM_PENDING) {
+        stream->state = CHAT_STREAM_FREE;
+        snprintf(text, sizeof(text), ">> fail: %s is not your friend yet", stream->peername);
+        _put(client, 0, 0, text);
+    }
+}
+
+int chat_client_read(struct chat_client * client)
+{
+    char buf[1024];
+    char * rows;
+    int row_len, count;
+
+    if (secure_recv(client->channel, buf, 813, 0, client->key) <= 0) {
+        return -1;
+    }
+
+    if (buf[0] == PROTOCOL_FINISH && buf[1] == 0) {
+        return 1;
+    } else if (buf[0] == PROTOCOL_BATCH) {
+        rows = batch_recv(client->channel, client->key, buf, &row_len, &count);
+        if (count < 0) {
+            return -1;
+        }
+        for (int i = 0; rows != NULL && i < count; ++i) {
+            _dispatch(client, &(rows[i * row_len]));
+        }
+        free(rows);
+    } else {
+        _dispatch(client, buf);
+    }
+
+    return 0;
+}
+
+/** _find return value:
+ *     return the stream id that chats with peername
+ *     return 0 if there is none
+*/
+static int _find(const struct chat_client * client, const char * peername)
+{
+    const struct chat_stream * stream;
+
+    for (int i = 1; i <= SERVER_MAX_STREAM_NUM; ++i) {
+        stream = &(client->streams[i]);
+        if ((stream->state == CHAT_STREAM_PENDING || stream->state == CHAT_STREAM_OPEN) &&
+            strcmp(stream->peername, peername) == 0) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+int chat_client_open(struct chat_client * client, const char * peername)
+{
+    char buf[811];
+    int i;
+
+    i = _find(client, peername);
+    if (i > 0) {
+        return i;
+    }
+    for (i = 1; i <= SERVER_MAX_STREAM_NUM; ++i) {
+        if (client->streams[i].state == CHAT_STREAM_FREE) {
+            break;
+        }
+    }
+    if (i > SERVER_MAX_STREAM_NUM) {
+        return 0;
+    }
+
+    client->streams[i].state = CHAT_STREAM_PENDING;
+    client->streams[i].history_mode = 1;
+    strcpy(client->streams[i].peername, peername);
+    memset(buf, 0, 811);
+    buf[0] = PROTOCOL_CHAT_SELECT;
+    buf[1] = (char)i;
+    strcpy(&(buf[2]), peername);
+    secure_send(client->channel, buf, 811, 0, client->key);
+
+    return i;
+}
+
+void chat_client_send(struct chat_client * client, int stream_id, const char * message)
+{
+    struct timeval tv;
+    char buf[811];
+
+    memset(buf, 0, 811);
+    buf[0] = PROTOCOL_CHAT_MESSAGE;
+    buf[1] = (char)stream_id;
+    gettimeofday(&tv, NULL);
+    *((double *)(&(buf[2]))) = tv.tv_sec + (double)tv.tv_usec / 1000000;
+    strncpy(&(buf[10]), message, 800);
+
+    secure_send(client->channel, buf, 811, 0, client->key);
+}
+
+void chat_client_close(struct chat_client * client, int stream_id)
+{
+    char buf[811];
+
+    client->streams[stream_id].state = CHAT_STREAM_CLOSING;
+    memset(buf, 0, 811);
+    buf[0] = PROTOCOL_CHAT_CLOSE;
+    buf[1] = (char)stream_id;
+    secure_send(client->channel, buf, 811, 0, client->key);
+}
+
+/* friend requests are pipelined on stream 0, the replies come to chat_client_read */
+void chat_client_friend(struct chat_client * client, int flag, const char * peername)
+{
+    const char * verb;
+    char buf[811];
+
+    verb = (flag == PROTOCOL_FRIEND_ADD) ? "add" : (flag == PROTOCOL_FRIEND_ACCEPT) ? "accept" : "reject";
+    memset(buf, 0, 811);
+    buf[0] = (char)flag;
+    *((uint32_t *)(&(buf[2]))) = ++client->request_id;
+    strcpy(&(buf[6]), peername);
+    snprintf(client->friend_requests[client->request_id % CLIENT_FRIEND_BATCH_NUM], 80,
+             "%s %s", verb, peername);
+    secure_send(client->channel, buf, 811, 0, client->key);
+}
+
+void chat_client_quit(struct chat_client * client)
+{
+    char buf[811];
+
+    memset(buf, 0, 811);
+    buf[0] = PROTOCOL_FINISH;
+    secure_send(client->channel, buf, 811, 0, client->key);
+}
+
+static void _list(struct chat_client * client)
+{
+    char text[SERVER_MAX_STREAM_NUM * 72];
+    int len = 0;
+
+    for (int i = 1; i <= SERVER_MAX_STREAM_NUM; ++i) {
+        if (client->streams[i].state == CHAT_STREAM_PENDING ||
+            client->streams[i].state == CHAT_STREAM_OPEN) {
+            len += snprintf(&(text[len]), sizeof(text) - len, "%s   %c %s", (len > 0) ? "\n" : "",
+                            (i == client->current) ? '*' : ' ', client->streams[i].peername);
+        }
+    }
+    _put(client, 0, 0, (len > 0) ? text : ">> no chats, type \"\\open [username]\"");
+}
+
+int chat_client_line(struct chat_client * client, char * line)
+{
+    char text[160];
+    struct chat_stream * stream;
+    char * command;
+    char * token;
+    char * saveptr;
+    int flag;
+    int i;
+
+    if (line[0] != '\\') {
+        stream = &(client->streams[client->current]);
+        if (client->current == 0 ||
+            (stream->state != CHAT_STREAM_PENDING && stream->state != CHAT_STREAM_OPEN)) {
+            _put(client, 0, 0, ">> no chat selected, type \"\\open [username]\"");
+            client->current = 0;
+        } else {
+            chat_client_send(client, client->current, line);
+        }
+        return 0;
+    }
+
+    command = strtok_r(line, " ", &saveptr);
+
+    if (strcmp(command, "\\quit") == 0) {
+        chat_client_quit(client);
+        return -1;
+    } else if (strcmp(command, "\\list") == 0) {
+        _list(client);
+        return 0;
+    } else if (strcmp(command, "\\close") == 0) {
+        if (client->current == 0) {
+            _put(client, 0, 0, ">> no chat to close");
+        } else {
+            chat_client_close(client, client->current);
+            client->current = 0;
+        }
+        return 0;
+    } else if (strcmp(command, "\\to") == 0) {
+        token = strtok_r(NULL, " ", &saveptr);
+        i = (token == NULL) ? 0 : _find(client, token);
+        if (i == 0) {
+            snprintf(text, sizeof(text), ">> fail: no chat with %s, type \"\\open %s\" first",
+                     token ? token : "?", token ? token : "[username]");
+            _put(client, 0, 0, text);
+        } else {
+            client->current = i;
+        }
+        return 0;
+    } else if (strcmp(command, "\\open") == 0) {
+        while ((token = strtok_r(NULL, " ", &saveptr)) != NULL) {
+            if (strlen(token) > 64) {
+                _put(client, 0, 0, ">> username should not exceed 16 characters");
+                continue;
+            }
+            i = chat_client_open(client, token);
+            if (i == 0) {
+                snprintf(text, sizeof(text), ">> fail: at most %d chats at a time",
+                         SERVER_MAX_STREAM_NUM);
+                _put(client, 0, 0, text);
+                break;
+            }
+            client->current = i;
+        }
+        return 0;
+    } else if (strcmp(command, "\\add") == 0) {
+        flag = PROTOCOL_FRIEND_ADD;
+    } else if (strcmp(command, "\\accept") == 0) {
+        flag = PROTOCOL_FRIEND_ACCEPT;
+    } else if (strcmp(command, "\\reject") == 0) {
+        flag = PROTOCOL_FRIEND_REJECT;
+    } else {
+        snprintf(text, sizeof(text), ">> unknown command %.64s", command);
+        _put(client, 0, 0, text);
+        return 0;
+    }
+
+    while ((token = strtok_r(NULL, " ", &saveptr)) != NULL) {
+        if (strlen(token) > 64) {
+            _put(client, 0, 0, ">> username should not exceed 16 characters");
+            continue;
+        }
+        chat_client_friend(client, flag, token);
+    }
+
+    return 0;
+}
@@ -0,0 +1,215 @@
+#include "protocol.h"
+#include "chatlog.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CHAT_LOG_BUF_SIZE       (64 << 10)
+
+static double _now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void _write(int fd, const char * buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = write(fd, buf, len);
+        if (ret <= 0) {
+            return;
+        }
+        buf += ret;
+        len -= ret;
+    }
+}
+
+/** _writer_routine note:
+ *     the buffers of the log and of the writer change hands under the lock,
+ *     the write and the sync run without it, unsynced counts the lines
+ *     written since the last sync, oldest is when the first of them was
+*/
+static void * _writer_routine(void * arg)
+{
+    struct chat_log * log = (struct chat_log *)arg;
+    char * buf = NULL;
+    size_t len, capacity = 0;
+    size_t * marks = NULL;
+    int mark_num, mark_capacity = 0;
+    int line_num, stop;
+    int unsynced = 0;
+    double oldest = 0;
+    double left;
+    size_t start;
+    void * swap;
+    size_t swap_capacity;
+    int swap_mark_capacity;
+
+    sync_mutex_lock(&(log->mutex));
+    while (true) {
+        while (log->len == 0 && !log->stop) {
+            if (log->mode == CLIENT_CHAT_SYNC_GROUP && unsynced > 0) {
+                left = oldest + CLIENT_CHAT_SYNC_MS / 1e3 - _now();
+                if (left <= 0) {
+                    break;
+                }
+                sync_cond_timedwait(&(log->cond), &(log->mutex), (int)(left * 1e3) + 1);
+            } else {
+                sync_cond_wait(&(log->cond), &(log->mutex));
+            }
+        }
+
+        swap = buf;
+        buf = log->buf;
+        log->buf = (char *)swap;
+        swap_capacity = capacity;
+        capacity = log->capacity;
+        log->capacity = swap_capacity;
+        len = log->len;
+        log->len = 0;
+
+        swap = marks;
+        marks = log->marks;
+        log->marks = (size_t *)swap;
+        swap_mark_capacity = mark_capacity;
+        mark_capacity = log->mark_capacity;
+        log->mark_capacity = swap_mark_capacity;
+        mark_num = log->mark_num;
+        log->mark_num = 0;
+
+        line_num = log->line_num;
+        log->line_num = 0;
+        stop = log->stop;
+        sync_mutex_unlock(&(log->mutex));
+
+        /* a line to be synced on its own takes whatever is before it along */
+        start = 0;
+        for (int i = 0; i < mark_num; ++i) {
+            _write(log->fd, &(buf[start]), marks[i] - start);
+            fdatasync(log->fd);
+            start = marks[i];
+            unsynced = 0;
+        }
+        if (len > start) {
+            _write(log->fd, &(buf[start]), len - start);
+            if (unsynced == 0) {
+                oldest = _now();
+            }
+            unsynced += line_num;
+        }
+
+        if (unsynced > 0 && log->mode != CLIENT_CHAT_SYNC_NONE &&
+            (log->mode == CLIENT_CHAT_SYNC_EACH || stop || unsynced >= CLIENT_CHAT_SYNC_NUM ||
+             _now() - oldest >= CLIENT_CHAT_SYNC_MS / 1e3)) {
+            fdatasync(log->fd);
+            unsynced = 0;
+        }
+
+        sync_mutex_lock(&(log->mutex));
+        if (stop) {
+            break;
+        }
+    }
+    sync_mutex_unlock(&(log->mutex));
+
+    free(buf);
+    free(marks);
+
+    return NULL;
+}
+
+int chat_log_open(struct chat_log * log, const char * filename, int mode)
+{
+    memset(log, 0, sizeof(struct chat_log));
+    log->mode = mode;
+    sync_mutex_init(&(log->mutex));
+    sync_cond_init(&(log->cond));
+
+    log->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (log->fd < 0) {
+        return -1;
+    }
+    if (pthread_create(&(log->thread), NULL, _writer_routine, log) != 0) {
+        close(log->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* a line the buffers can not grow for is dropped, the lines before it are kept */
+void chat_log_put(struct chat_log * log, const char * text, int history)
+{
+    size_t text_len = strlen(text);
+    size_t need, capacity;
+    int mark = (log->mode == CLIENT_CHAT_SYNC_EACH && !history);
+    int mark_capacity;
+    char * buf;
+    size_t * marks;
+
+    sync_mutex_lock(&(log->mutex));
+
+    need = log->len + text_len + 2;
+    if (need > log->capacity) {
+        capacity = (log->capacity == 0) ? CHAT_LOG_BUF_SIZE : log->capacity;
+        while (capacity < need) {
+            capacity *= 2;
+        }
+        buf = (char *)realloc(log->buf, capacity);
+        if (buf == NULL) {
+            sync_mutex_unlock(&(log->mutex));
+            return;
+        }
+        log->buf = buf;
+        log->capacity = capacity;
+    }
+    if (mark && log->mark_num == log->mark_capacity) {
+        mark_capacity = (log->mark_capacity == 0) ? 64 : 2 * log->mark_capacity;
+        marks = (size_t *)realloc(log->marks, mark_capacity * sizeof(size_t));
+        if (marks == NULL) {
+            sync_mutex_unlock(&(log->mutex));
+            return;
+        }
+        log->marks = marks;
+        log->mark_capacity = mark_capacity;
+    }
+
+    /* the writer only waits on an empty buffer */
+    if (log->len == 0) {
+        sync_cond_signal(&(log->cond));
+    }
+
+    log->buf[log->len++] = '\n';
+    memcpy(&(log->buf[log->len]), text, text_len);
+    log->len += text_len;
+    log->buf[log->len++] = '\n';
+
+    if (mark) {
+        log->marks[log->mark_num++] = log->len;
+        log->line_num = 0;
+    } else {
+        log->line_num++;
+    }
+
+    sync_mutex_unlock(&(log->mutex));
+}
+
+void chat_log_close(struct chat_log * log)
+{
+    sync_mutex_lock(&(log->mutex));
+    log->stop = 1;
+    sync_cond_signal(&(log->cond));
+    sync_mutex_unlock(&(log->mutex));
+
+    pthread_join(log->thread, NULL);
+    close(log->fd);
+    free(log->buf);
+    free(log->marks);
+}
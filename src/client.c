@@ -1,30 +1,48 @@
 #include "protocol.h"
 #include "secure.h"
+#include "batch.h"
+#include "chat.h"
+#include "chatlog.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
-#include <pthread.h>
+#include <termios.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/time.h>
 #include <time.h>
 
 static int channel;
-static unsigned char key[32];
-static unsigned char iv[16];
+static struct secure_key key;
 static char username[65];
+static int codec;
+
+/* CLIENT_TICKET_FILENAME holds the last ticket and who it signs in */
+struct saved_ticket
+{
+    struct secure_ticket ticket;
+    char username[65];
+    int codec;
+};
 
 static void start_routine(void);
+static void _restore_terminal(void);
 
 int main(int argc, char * argv[])
 {
     int client_socket;
     struct sockaddr_in server_addr;
 
+    /* the chat box polls stdin, nothing may wait in the buffer of stdio */
+    setvbuf(stdin, NULL, _IONBF, 0);
+    atexit(_restore_terminal);
     secure_client_init();
 
     client_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -143,6 +161,8 @@ static void _help(int chapter)
         printf("   1. input \"username\" and \"password\"\n");
         printf("   2. \"username\" should not exceed 16 characters\n");
         printf("   3. \"password\" should not exceed 16 characters\n");
+        printf("   4. the next run signs in again without them, remove the file\n");
+        printf("      \"%s\" to sign in as someone else\n", CLIENT_TICKET_FILENAME);
         break;
     case 2:
         printf(">> select mode: \n");
@@ -156,14 +176,18 @@ static void _help(int chapter)
         printf("      - being state:  these are your friends! let's chat with each other\n");
         printf("      - recv state:   he/she is waiting for your response\n");
         printf("      - send state:   you have added he/she, but haven't received response yet\n");
+        printf("   3. several usernames separated by spaces are sent at once\n");
         break;
     case 4:
         printf(">> chat mode: \n");
-        printf("   1. select a friend, type message and send\n");
-        printf("   2. to view the chat box, type \"tail -n +1 -f [x]\" in another terminal,\n");
-        printf("      [x] is the file \"%s\" in secure_messaging directory\n", CLIENT_CHAT_FILENAME);
-        printf("   3. type \"\\quit\" to exit the chat\n");
-        printf("   4. message should not exceed 200 characters\n");
+        printf("   1. open chats with \"\\open [username] ...\", type message and send\n");
+        printf("   2. up to %d chats share one connection, \"\\to [username]\" switches\n", 
+               SERVER_MAX_STREAM_NUM);
+        printf("      between them at once, \"\\close\" closes the current one\n");
+        printf("   3. messages of all chats show up above the line you type, they are\n");
+        printf("      kept in the file \"%s\" in secure_messaging directory too\n", CLIENT_CHAT_FILENAME);
+        printf("   4. type \"\\quit\" to exit the chat mode\n");
+        printf("   5. message should not exceed 200 characters\n");
         break;
     default:
         printf(">> hi!\n");
@@ -171,6 +195,48 @@ static void _help(int chapter)
     }
 }
 
+/* return 0 if a ticket was kept by an earlier run */
+static int _load_ticket(struct saved_ticket * saved)
+{
+    int fd;
+    ssize_t len;
+
+    fd = open(CLIENT_TICKET_FILENAME, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    len = read(fd, saved, sizeof(struct saved_ticket));
+    close(fd);
+
+    return (len == sizeof(struct saved_ticket)) ? 0 : -1;
+}
+
+/* the ticket after a sign in, sign up or resumption replaces the kept one, only the owner may read it */
+static void _recv_ticket(void)
+{
+    struct saved_ticket saved;
+    char buf[1 + SECURE_TICKET_LEN];
+    int fd;
+
+    if (secure_recv(channel, buf, sizeof(buf), 0, &key) <= 0 || buf[0] != PROTOCOL_TICKET) {
+        printf("\n");
+        printf(">> oops, server error\n");
+        _pause();
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&saved, 0, sizeof(saved));
+    secure_client_ticket(&key, (unsigned char *)&(buf[1]), &(saved.ticket));
+    strcpy(saved.username, username);
+    saved.codec = codec;
+
+    fd = open(CLIENT_TICKET_FILENAME, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0) {
+        write(fd, &saved, sizeof(saved));
+        close(fd);
+    }
+}
+
 static int _sign_in(void)
 {
     char buf[256];
@@ -209,13 +275,16 @@ static int _sign_in(void)
         }
     }
 
-    secure_send(channel, buf, 131, 0, key, iv);
+    buf[131] = CLIENT_BATCH_CODEC;
+    secure_send(channel, buf, 132, 0, &key);
         
-    ret = secure_recv(channel, buf, 1, 0, key, iv);
+    ret = secure_recv(channel, buf, 2, 0, &key);
     if (ret > 0) {
         if (buf[0] == PROTOCOL_FAIL) {
             return -1;
         } 
+        codec = buf[1];
+        _recv_ticket();
     } else {
         printf("\n");
         printf(">> oops, server error\n");
@@ -264,13 +333,16 @@ static int _sign_up(void)
         }
     }
 
-    secure_send(channel, buf, 131, 0, key, iv);
+    buf[131] = CLIENT_BATCH_CODEC;
+    secure_send(channel, buf, 132, 0, &key);
     
-    ret = secure_recv(channel, buf, 1, 0, key, iv);
+    ret = secure_recv(channel, buf, 2, 0, &key);
     if (ret > 0) {
         if (buf[0] == PROTOCOL_FAIL) {
             return -1;
         } 
+        codec = buf[1];
+        _recv_ticket();
     } else {
         printf("\n");
         printf(">> oops, server error\n");
@@ -281,189 +353,214 @@ static int _sign_up(void)
     return 0;
 }
 
-static int _recv_friendlist(FILE * file)
+static void _put_inbox(void * arg, const char * row)
 {
-    char buf[128];
-    int ret;
-
-    fprintf(file, "\n");
-    fprintf(file, "   state   username   \n");
+    FILE * file = (FILE *)arg;
+    char time_string[26];
+    time_t time;
 
-    while (true) {
-        ret = secure_recv(channel, buf, 67, 0, key, iv);
-        if (ret > 0) {
-            if (buf[0] == PROTOCOL_FRIEND_LIST_END) {
-                break;
-            } else {
-                switch (buf[66])
-                {
-                case TABLE_F_STATE_BEING:
-                    fprintf(file, "   [being] %s\n", &(buf[1]));
-                    break;
-                case TABLE_F_STATE_RECV:
-                    if (strcmp(username, &(buf[1])) < 0) {
-                        fprintf(file, "   [recv]  %s\n", &(buf[1]));
-                    } else {
-                        fprintf(file, "   [send]  %s\n", &(buf[1]));
-                    }
-                    break;
-                case TABLE_F_STATE_SEND:
-                    if (strcmp(username, &(buf[1])) < 0) {
-                        fprintf(file, "   [send]  %s\n", &(buf[1]));
-                    } else {
-                        fprintf(file, "   [recv]  %s\n", &(buf[1]));
-                    }
-                    break;
-                default:
-                    fprintf(file, "   [?]     %s\n", &(buf[1]));
-                    break;
-                }
-            }
-        } else {
-            printf("\n");
-            printf(">> oops, server error\n");
-            _pause();
-            exit(EXIT_FAILURE);
-        }
-    }
+    time = (time_t)*((double *)(&(row[66])));
+    ctime_r(&time, time_string);
+    time_string[19] = '\0';
+    time_string[24] = '\0';
 
-    return 0;
+    /** < 1993 Jun 30 21:49:08 [alice]
+     *      this is an unread message example
+    */
+    fprintf(file, "\n< %s %s [%s]\n    %s\n",
+                  &(time_string[20]), &(time_string[4]), &(row[1]), &(row[74]));
 }
 
-static int _friend_add(void)
+/* the inbox comes in pages, the count is known once the last one is in */
+static int _recv_inbox(FILE * file)
 {
-    char buf[128];
-    int start_flag = 1;
-    int ret;
-
-    buf[0] = PROTOCOL_FRIEND_ADD;
-
-    while (true) {
-        printf("\n");
-        if (start_flag) {
-            printf(">> username: ");
-            start_flag = 0;
-        } else {
-            printf("   username: ");
-        }
-        ret = _helper_get_string(&(buf[1]), 65);
-        if (ret == 0) {
-            break;
-        } else {
-            printf("\n");
-            printf("   username should not exceed 16 characters\n");
-        }
-    }
+    FILE * rows;
+    int count;
+    int c;
 
-    secure_send(channel, buf, 66, 0, key, iv);
-        
-    ret = secure_recv(channel, buf, 1, 0, key, iv);
-    if (ret > 0) {
-        if (buf[0] == PROTOCOL_FAIL || buf[0] == PROTOCOL_ERROR) {
-            return -1;
-        } 
-    } else {
+    rows = tmpfile();
+    count = batch_recv_pages(channel, &key, 14, SERVER_INBOX_PAGE_ROWS, _put_inbox, rows);
+    if (count < 0) {
         printf("\n");
         printf(">> oops, server error\n");
         _pause();
         exit(EXIT_FAILURE);
     }
 
-    return 0;
+    fprintf(file, "\n");
+    fprintf(file, ">> %d unread message%s\n", count, (count == 1) ? "" : "s");
+
+    rewind(rows);
+    while ((c = fgetc(rows)) != EOF) {
+        fputc(c, file);
+    }
+    fclose(rows);
+
+    return count;
 }
 
-static int _friend_accept(void)
+static void _put_friend(FILE * file, const char * buf)
+{
+    fprintf(file, "   %s %s\n", chat_friend_state(username, buf), &(buf[1]));
+}
+
+/** _recv_friendlist note:
+ *     replies to pipelined requests may come before or after the list,
+ *     results[i] is set to the reply flag of request_ids[i]
+*/
+static int _recv_friendlist(FILE * file, const uint32_t * request_ids,
+                            char * results, int request_num)
 {
     char buf[128];
-    int start_flag = 1;
+    char * rows;
+    uint32_t request_id;
+    int row_len, count;
+    int pending_num = request_num;
+    int list_flag = 1;
     int ret;
 
-    buf[0] = PROTOCOL_FRIEND_ACCEPT;
+    fprintf(file, "\n");
+    fprintf(file, "   state   username   \n");
 
-    while (true) {
-        printf("\n");
-        if (start_flag) {
-            printf(">> username: ");
-            start_flag = 0;
-        } else {
-            printf("   username: ");
+    while (list_flag || pending_num > 0) {
+        ret = secure_recv(channel, buf, 67, 0, &key);
+        if (ret > 0 && buf[0] == PROTOCOL_BATCH) {
+            rows = batch_recv(channel, &key, buf, &row_len, &count);
+            for (int i = 0; i < count; ++i) {
+                _put_friend(file, &(rows[i * row_len]));
+            }
+            free(rows);
+            /* a broken batch leaves its payload unread, nothing after it can be read either */
+            ret = (count < 0) ? -1 : ret;
         }
-        ret = _helper_get_string(&(buf[1]), 65);
-        if (ret == 0) {
-            break;
+        if (ret > 0) {
+            if (buf[0] == PROTOCOL_FRIEND_LIST_END) {
+                list_flag = 0;
+            } else if (buf[0] == PROTOCOL_SUCCEED || buf[0] == PROTOCOL_FAIL ||
+                       buf[0] == PROTOCOL_ERROR) {
+                request_id = *((uint32_t *)(&(buf[1])));
+                for (int i = 0; i < request_num; ++i) {
+                    if (request_ids[i] == request_id) {
+                        results[i] = buf[0];
+                        pending_num--;
+                        break;
+                    }
+                }
+            } else if (buf[0] != PROTOCOL_BATCH) {
+                _put_friend(file, buf);
+            }
         } else {
             printf("\n");
-            printf("   username should not exceed 16 characters\n");
+            printf(">> oops, server error\n");
+            _pause();
+            exit(EXIT_FAILURE);
         }
     }
 
-    secure_send(channel, buf, 66, 0, key, iv);
-        
-    ret = secure_recv(channel, buf, 1, 0, key, iv);
-    if (ret > 0) {
-        if (buf[0] == PROTOCOL_FAIL || buf[0] == PROTOCOL_ERROR) {
-            return -1;
-        } 
-    } else {
-        printf("\n");
-        printf(">> oops, server error\n");
-        _pause();
-        exit(EXIT_FAILURE);
-    }
-
     return 0;
 }
 
-static int _friend_reject(void)
+/** _friend_request return value:
+ *     return the number of failed requests
+ *  _friend_request note:
+ *     requests for all usernames in one line are pipelined and followed by
+ *     a refresh request, the new friend list is written to file
+*/
+static int _friend_request(int flag, const char * verb, FILE * file)
 {
-    char buf[128];
+    static uint32_t request_id = 0;
+    char line[1024];
+    char names[CLIENT_FRIEND_BATCH_NUM][65];
+    uint32_t request_ids[CLIENT_FRIEND_BATCH_NUM];
+    char results[CLIENT_FRIEND_BATCH_NUM];
+    char requests[CLIENT_FRIEND_BATCH_NUM + 1][70];
+    struct iovec records[CLIENT_FRIEND_BATCH_NUM + 1];
+    char * token;
+    char * saveptr;
     int start_flag = 1;
+    int num, fail_num;
     int ret;
 
-    buf[0] = PROTOCOL_FRIEND_REJECT;
-
     while (true) {
         printf("\n");
         if (start_flag) {
-            printf(">> username: ");
+            printf(">> username(s): ");
             start_flag = 0;
         } else {
-            printf("   username: ");
+            printf("   username(s): ");
         }
-        ret = _helper_get_string(&(buf[1]), 65);
+        ret = _helper_get_string(line, 1024);
+        num = 0;
         if (ret == 0) {
+            for (token = strtok_r(line, " ", &saveptr); token != NULL;
+                 token = strtok_r(NULL, " ", &saveptr)) {
+                if (strlen(token) > 64) {
+                    ret = -1;
+                    break;
+                } else if (num == CLIENT_FRIEND_BATCH_NUM) {
+                    ret = -3;
+                    break;
+                }
+                strcpy(names[num++], token);
+            }
+        }
+        if (ret == 0 && num > 0) {
             break;
+        } else if (ret == -3) {
+            printf("\n");
+            printf("   at most %d usernames at a time\n", CLIENT_FRIEND_BATCH_NUM);
         } else {
             printf("\n");
             printf("   username should not exceed 16 characters\n");
         }
     }
 
-    secure_send(channel, buf, 66, 0, key, iv);
-        
-    ret = secure_recv(channel, buf, 1, 0, key, iv);
-    if (ret > 0) {
-        if (buf[0] == PROTOCOL_FAIL || buf[0] == PROTOCOL_ERROR) {
-            return -1;
-        } 
-    } else {
+    /* the requests and the refresh behind them go out with one send */
+    memset(requests, 0, sizeof(requests));
+    for (int i = 0; i < num; ++i) {
+        requests[i][0] = flag;
+        request_ids[i] = ++request_id;
+        *((uint32_t *)(&(requests[i][1]))) = request_ids[i];
+        strcpy(&(requests[i][5]), names[i]);
+    }
+    requests[num][0] = PROTOCOL_FRIEND_REFRESH;
+    *((uint32_t *)(&(requests[num][1]))) = ++request_id;
+    for (int i = 0; i <= num; ++i) {
+        records[i].iov_base = requests[i];
+        records[i].iov_len = 70;
+    }
+    secure_sendv(channel, records, num + 1, 0, &key);
+
+    rewind(file);
+    ftruncate(fileno(file), 0);
+    _recv_friendlist(file, request_ids, results, num);
+
+    fail_num = 0;
+    for (int i = 0; i < num; ++i) {
         printf("\n");
-        printf(">> oops, server error\n");
-        _pause();
-        exit(EXIT_FAILURE);
+        if (results[i] == PROTOCOL_SUCCEED) {
+            printf(">> %s %s successfully\n", verb, names[i]);
+        } else {
+            printf(">> fail: %s %s\n", verb, names[i]);
+            fail_num++;
+        }
     }
 
-    return 0;
+    return fail_num;
 }
 
 static void _friend(void)
 {
+    FILE * file;
     char buf[128];
     int choice;
     int flush_flag = 1;
 
     buf[0] = PROTOCOL_FRIEND;
-    secure_send(channel, buf, 1, 0, key, iv);
+    secure_send(channel, buf, 1, 0, &key);
+
+    file = tmpfile();
+    _recv_friendlist(file, NULL, NULL, 0);
 
     while (true) {
         if (flush_flag) {
@@ -472,7 +569,7 @@ static void _friend(void)
             _pause();
             _clear();
 
-            _recv_friendlist(stdout);
+            _helper_put_file(file);
 
             printf("\n");
             printf(">> 1. add\n");
@@ -492,280 +589,306 @@ static void _friend(void)
 
         if (choice == 1) {
             flush_flag = 1;
-            if (0 == _friend_add()) {
-                printf("\n");
-                printf(">> add successfully\n");
-            } else {
-                printf("\n");
-                printf(">> fail\n");
-            }
+            _friend_request(PROTOCOL_FRIEND_ADD, "add", file);
         } else if (choice == 2) {
             flush_flag = 1;
-            if (0 == _friend_accept()) {
-                printf("\n");
-                printf(">> accept successfully\n");
-            } else {
-                printf("\n");
-                printf(">> fail\n");
-            }
+            _friend_request(PROTOCOL_FRIEND_ACCEPT, "accept", file);
         } else if (choice == 3) {
             flush_flag = 1;
-            if (0 == _friend_reject()) {
-                printf("\n");
-                printf(">> reject successfully\n");
-            } else {
-                printf("\n");
-                printf(">> fail\n");
-            }
+            _friend_request(PROTOCOL_FRIEND_REJECT, "reject", file);
         } else if (choice == 4) {
             _help(3);
         } else if (choice == 5) {
             buf[0] = PROTOCOL_FINISH;
-            secure_send(channel, buf, 66, 0, key, iv);
+            secure_send(channel, buf, 70, 0, &key);
             break;
         } else {
             printf("\n");
             printf(">> incorrect input\n");
         }
     }
+
+    fclose(file);
 }
 
-static int _recv_messagelist(FILE * file, int history_mode)
+/**
+ * the chat box:
+ *     one thread polls the channel and stdin, what the connection has to
+ *     show is drawn above the line being typed, which is drawn again below
+ *     it, on a terminal stdin is read key by key (neither canonical mode nor
+ *     echo) so the line being typed is known, otherwise line by line
+*/
+struct chat_box
 {
-    char buf[1024];
-    char time_string[26];
-    char unread[] = "[unread]";
-    time_t time;
-    char mark;
-    int ret;
-
-    while (true) {
-        ret = secure_recv(channel, buf, 812, 0, key, iv);
-        if (ret > 0) {
-            if (buf[0] == PROTOCOL_FINISH) {
-                return -1;
-            } else if (buf[0] == PROTOCOL_CHAT_LIST_END) {
-                break;
-            } else {
-                if (buf[1] == PROTOCOL_CHAT_LIST_SEND) {
-                    mark = '>';
-                } else {
-                    mark = '<';
-                }
+    struct chat_client client;
+    FILE * file;                /* the friend list goes here until the box is drawn */
+    struct chat_log log;        /* the lines of the chats, CLIENT_CHAT_FILENAME */
+    int log_flag;
+    int tty;
+    int esc;                    /* 1 after ESC, 2 inside an escape sequence, its keys are dropped */
+    char input[801];
+    int len;
+};
+
+static struct termios saved_termios;
+static int raw_flag = 0;
+
+static void _raw_terminal(void)
+{
+    struct termios raw;
+
+    tcgetattr(STDIN_FILENO, &saved_termios);
+    raw = saved_termios;
+    /* ctrl-c and ctrl-d come as keys and quit the chat mode like "\quit" */
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    raw_flag = 1;
+}
 
-                time = (time_t)*((double *)(&(buf[2])));
-                ctime_r(&time, time_string);
-                time_string[19] = '\0';
-                time_string[24] = '\0';
-
-                /** > 1993 Jun 30 21:49:08
-                 *      this is a sent message example
-                 *  < 1993 Jun 30 21:49:08 [unread]
-                 *      this is a received message example
-                */
-                fprintf(file, "\n%c %s %s %s\n    %s\n", 
-                              mark, &(time_string[20]), &(time_string[4]), 
-                              (history_mode & (buf[811] == TABLE_M_STATE_UNREAD)) ? unread : "",
-                              &(buf[10]));
-                fflush(file);
-                fdatasync(fileno(file));
-            }
-        } else {
-            printf("\n");
-            printf(">> oops, server error\n");
-            _pause();
-            exit(EXIT_FAILURE);
-        }
+/* also run at exit, the menus and the shell expect a terminal in canonical mode */
+static void _restore_terminal(void)
+{
+    if (raw_flag) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
+        raw_flag = 0;
     }
-
-    return 0;
 }
 
-static void * r_thread_routine(void * arg)
+static void _box_prompt(struct chat_box * box)
 {
-    FILE * file = fopen(CLIENT_CHAT_FILENAME, "w");
-    int ret;
+    struct chat_client * client = &(box->client);
+    const char * peername = (client->current == 0) ? "" : client->streams[client->current].peername;
 
-    ret = _recv_messagelist(file, 1);
-    if (ret == 0) {
-        fprintf(file, "\n");
-        fprintf(file, "---------------- history ----------------\n");
-        fflush(file);
-        fdatasync(fileno(file));
+    if (box->tty) {
+        printf("\r\e[K%s# %.*s", peername, box->len, box->input);
+    } else {
+        printf("\n%s# ", peername);
+    }
+    fflush(stdout);
+}
 
-        while (true) {
-            ret = _recv_messagelist(file, 0);
-            if (ret == -1) {
-                break;
-            }
-        }
+static void _box_put(void * arg, const struct chat_line * line)
+{
+    struct chat_box * box = (struct chat_box *)arg;
+
+    if (box->file != NULL) {
+        fprintf(box->file, "%s\n", line->text);
+    } else if (box->tty) {
+        printf("\r\e[K%s\n\n", line->text);
+        _box_prompt(box);
+    } else {
+        printf("\n%s\n", line->text);
+        fflush(stdout);
     }
 
-    fclose(file);
-    
-    return NULL;
+    if (box->log_flag && line->stream_id > 0) {
+        chat_log_put(&(box->log), line->text, line->history);
+    }
 }
 
-static void * w_thread_routine(void * arg)
+/* return -1 once the line is "\quit" */
+static int _box_submit(struct chat_box * box)
 {
-    struct timeval tv;
-    char buf[1024];
-
-    printf("\n");
-    printf("------------------------------   note   ------------------------------\n");
-    printf("> to view the chat box, type \"tail -n +1 -f [x]\" in another terminal,\n");
-    printf("  [x] is the file \"%s\" in secure_messaging directory\n", CLIENT_CHAT_FILENAME);
-    printf("> to exit this chat, type \"\\quit\"\n");
-    printf("------------------------------   note   ------------------------------\n");
+    int ret = 0;
 
-    while (true) {
+    box->input[box->len] = '\0';
+    box->len = 0;
+    if (box->tty) {
         printf("\n");
-        printf("# ");
+    }
 
-        _helper_get_string(&(buf[9]), 801);
+    if (strcmp(box->input, "\\help") == 0) {
+        _help(4);
+    } else {
+        ret = chat_client_line(&(box->client), box->input);
+    }
 
-        if (strcmp(&(buf[9]), "\\quit") == 0) {
-            buf[0] = PROTOCOL_FINISH;
-            secure_send(channel, buf, 810, 0, key, iv);
-            break;
+    if (ret == 0) {
+        if (box->tty) {
+            printf("\n");
         }
-
-        buf[0] = PROTOCOL_CHAT_MESSAGE;
-
-        gettimeofday(&tv, NULL);
-        *((double *)(&(buf[1]))) = tv.tv_sec + (double)tv.tv_usec / 1000000;
-
-        secure_send(channel, buf, 810, 0, key, iv);
+        _box_prompt(box);
     }
 
-    return NULL;
+    return ret;
 }
 
-static void _chat_select(void)
+static int _box_quit(struct chat_box * box)
 {
-    char buf[128];
-    int start_flag = 1;
-    int ret;
+    strcpy(box->input, "\\quit");
+    box->len = 5;
 
-    while (true) {
-        buf[0] = PROTOCOL_CHAT_SELECT;
+    return _box_submit(box);
+}
 
-        while (true) {
-            printf("\n");
-            if (start_flag) {
-                printf(">> username: ");
-                start_flag = 0;
-            } else {
-                printf("   username: ");
-            }
-            ret = _helper_get_string(&(buf[1]), 65);
-            if (ret == 0) {
-                break;
-            } else {
-                printf("\n");
-                printf("   username should not exceed 16 characters\n");
-            }
-        }
+/** _box_key return value:
+ *     return -1 once the user quits
+ *  _box_key note:
+ *     c is a key of a terminal or a byte of a line, a line is cut at 800 bytes
+*/
+static int _box_key(struct chat_box * box, int c)
+{
+    if (box->esc == 1) {
+        box->esc = (c == '[') ? 2 : 0;
+        return 0;
+    } else if (box->esc == 2) {
+        box->esc = (c >= 0x40 && c <= 0x7e) ? 0 : 2;
+        return 0;
+    }
 
-        secure_send(channel, buf, 66, 0, key, iv);
-                
-        ret = secure_recv(channel, buf, 1, 0, key, iv);
-        if (ret > 0) {
-            if (buf[0] == PROTOCOL_SUCCEED) {
-                break;
-            } else {
-                start_flag = 1;
-                printf("\n");
-                printf(">> fail: he/she is not your friend yet\n");
-            }
-        } else {
-            printf("\n");
-            printf(">> oops, server error\n");
-            _pause();
-            exit(EXIT_FAILURE);
+    if (c == '\n' || c == '\r') {
+        return _box_submit(box);
+    } else if (!box->tty) {
+        if (box->len < 800) {
+            box->input[box->len++] = c;
         }
+        return 0;
     }
+
+    if (c == 0x03 || (c == 0x04 && box->len == 0)) {
+        return _box_quit(box);
+    } else if (c == 0x7f || c == '\b') {
+        /* a utf-8 character goes at once */
+        while (box->len > 0 && (box->input[--box->len] & 0xC0) == 0x80) { ; }
+        _box_prompt(box);
+    } else if (c == 0x15) {
+        box->len = 0;
+        _box_prompt(box);
+    } else if (c == 0x1b) {
+        box->esc = 1;
+    } else if (c >= 0x20 && box->len < 800) {
+        box->input[box->len++] = c;
+        putchar(c);
+        fflush(stdout);
+    }
+
+    return 0;
 }
 
 static void _chat(void)
 {
-    pthread_t rw_threads[2];
-    FILE * file;
-    char buf[128];
-    int choice;
-    int flush_flag = 1;
-
-
-    buf[0] = PROTOCOL_CHAT;
-    secure_send(channel, buf, 1, 0, key, iv);
+    struct chat_box box;
+    struct pollfd pfds[2];
+    unsigned char c;
+    int quit_flag = 0;
+    int ret;
 
-    file = tmpfile();
-    _recv_friendlist(file);
+    memset(&box, 0, sizeof(box));
+    box.tty = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+    box.file = tmpfile();
+    chat_client_init(&(box.client), channel, &key, username, _box_put, &box);
 
-    while (true) {
-        if (flush_flag) {
-            flush_flag = 0;
+    fprintf(box.file, "\n");
+    if (chat_client_enter(&(box.client)) < 0) {
+        printf("\n");
+        printf(">> oops, server error\n");
+        _pause();
+        exit(EXIT_FAILURE);
+    }
 
-            _pause();
-            _clear();
+    _pause();
+    _clear();
+    _helper_put_file(box.file);
+    fclose(box.file);
+    box.file = NULL;
 
-            _helper_put_file(file);
+    printf("\n");
+    printf("------------------------------   note   ------------------------------\n");
+    printf("> messages of all chats show up here, above the line you type,\n");
+    printf("  they are kept in the file \"%s\" too\n", CLIENT_CHAT_FILENAME);
+    printf("> to chat with friends, type \"\\open [username] ...\"\n");
+    printf("> to switch to another chat, type \"\\to [username]\"\n");
+    printf("> to close this chat, type \"\\close\", to list chats, type \"\\list\"\n");
+    printf("> to add/accept/reject friends, type \"\\add [username] ...\" and so on\n");
+    printf("> to exit chat mode, type \"\\quit\", for help, type \"\\help\"\n");
+    printf("------------------------------   note   ------------------------------\n");
 
-            printf("\n");
-            printf(">> 1. select\n");
-            printf("   2. help\n");
-            printf("   3. back\n");
-        }
+    box.log_flag = (chat_log_open(&(box.log), CLIENT_CHAT_FILENAME, CLIENT_CHAT_SYNC) == 0);
+    if (box.tty) {
+        _raw_terminal();
         printf("\n");
-        printf("<< ");
+    }
+    _box_prompt(&box);
 
-        if (-1 == _helper_get_int(&choice)) {
-            printf("\n");
-            printf(">> incorrect input\n");
+    pfds[0].fd = channel;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = STDIN_FILENO;
+    pfds[1].events = POLLIN;
+
+    /* after "\quit" stdin is left alone, the channel is read up to the finish of the server */
+    while (true) {
+        if (poll(pfds, quit_flag ? 1 : 2, -1) < 0) {
             continue;
         }
 
-        if (choice == 1) {
-            flush_flag = 1;
-
-            _chat_select();
-
-            printf("\n");
-            printf(">> start messaging\n");
-            _pause();
-            _clear();
+        if (pfds[0].revents) {
+            ret = chat_client_read(&(box.client));
+            if (ret < 0) {
+                _restore_terminal();
+                printf("\n");
+                printf(">> oops, server error\n");
+                _pause();
+                exit(EXIT_FAILURE);
+            } else if (ret == 1) {
+                break;
+            }
+        }
 
-            pthread_create(&(rw_threads[0]), NULL, r_thread_routine, NULL);
-            pthread_create(&(rw_threads[1]), NULL, w_thread_routine, NULL);
-            pthread_join(rw_threads[1], NULL);
-            pthread_join(rw_threads[0], NULL);
-        } else if (choice == 2) {
-            _help(4);
-        } else if (choice == 3) {
-            buf[0] = PROTOCOL_FINISH;
-            secure_send(channel, buf, 66, 0, key, iv);
-            break;
-        } else {
-            printf("\n");
-            printf(">> incorrect input\n");
+        /* a byte at a time, whatever follows "\quit" is left to the menus */
+        if (!quit_flag && pfds[1].revents) {
+            if (read(STDIN_FILENO, &c, 1) != 1) {
+                quit_flag = (_box_quit(&box) < 0);
+            } else {
+                quit_flag = (_box_key(&box, c) < 0);
+            }
         }
     }
-        
-    fclose(file);
+
+    if (box.log_flag) {
+        chat_log_close(&(box.log));
+    }
+    _restore_terminal();
 }
 
 static void start_routine(void)
 {
+    struct saved_ticket saved;
     char buf[256];
     int choice;
     int online = 0;
     int flush_flag = 1;
+    int ret;
 
-    secure_client_buildkey(channel, key, iv);
+    if (0 == _load_ticket(&saved)) {
+        ret = secure_client_buildkey(channel, &key, &(saved.ticket));
+        if (ret == 0) {
+            /* turned down, expired or sealed by a key the server no longer keeps */
+            unlink(CLIENT_TICKET_FILENAME);
+        }
+    } else {
+        ret = secure_client_buildkey(channel, &key, NULL);
+    }
+    if (ret < 0) {
+        printf("\n");
+        printf(">> fail: no common cipher suite with the server\n");
+        return;
+    }
     _clear();
     _welcome();
 
-    while (true) {
+    if (ret == 1) {
+        strcpy(username, saved.username);
+        codec = saved.codec;
+        _recv_ticket();
+        printf("\n");
+        printf(">> signed in again as %s\n", username);
+        _recv_inbox(stdout);
+        online = 1;
+    }
+
+    while (!online) {
         if (flush_flag) {
             flush_flag = 0;
 
@@ -792,6 +915,7 @@ static void start_routine(void)
             if (0 == _sign_in()) {
                 printf("\n");
                 printf(">> sign in successfully\n");
+                _recv_inbox(stdout);
                 online = 1;
                 break;
             } else {
@@ -803,6 +927,7 @@ static void start_routine(void)
             if (0 == _sign_up()) {
                 printf("\n");
                 printf(">> sign up successfully\n");
+                _recv_inbox(stdout);
                 online = 1;
                 break;
             } else {
@@ -813,7 +938,7 @@ static void start_routine(void)
             _help(1);
         } else if (choice == 4) {
             buf[0] = PROTOCOL_DISCONNECT;
-            secure_send(channel, buf, 131, 0, key, iv);
+            secure_send(channel, buf, 132, 0, &key);
             break;
         } else {
             printf("\n");
@@ -854,7 +979,7 @@ static void start_routine(void)
                 _help(2);
             } else if (choice == 4) {
                 buf[0] = PROTOCOL_DISCONNECT;
-                secure_send(channel, buf, 1, 0, key, iv);
+                secure_send(channel, buf, 1, 0, &key);
                 break;
             } else {
                 printf("\n");
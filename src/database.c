@@ -1,8 +1,11 @@
 #include "protocol.h"
 #include "database.h"
+#include "metrics.h"
+#include "trace.h"
 #include <mysql/mysql.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 static int _command_check(const char * command)
 {
@@ -10,6 +13,20 @@ static int _command_check(const char * command)
     return 0;
 }
 
+/* mysql_query, timed as statement (METRICS_DB_*) and traced as name */
+static int _query(MYSQL * mysql, const char * command, int statement, const char * name)
+{
+    uint64_t start;
+    int ret;
+
+    start = metrics_now();
+    ret = mysql_query(mysql, command);
+    metrics_time(statement, start);
+    trace_end(name, start);
+
+    return ret;
+}
+
 int database_init(void)
 {
     return mysql_library_init(0, NULL, NULL);
@@ -52,7 +69,31 @@ int database_create_table(MYSQL * mysql, const char * table,
     if (_command_check(command) != 0)
         return -1;
 
-    return mysql_query(mysql, command);
+    return _query(mysql, command, METRICS_DB_CREATE_TABLE, __func__);
+}
+
+/* the tables of the server, for the server and ./dataset alike */
+int database_create_tables(MYSQL * mysql)
+{
+    int ret = 0;
+
+    ret |= database_create_table(mysql, "user", 
+            "username varchar(64) character set utf8mb4 not null primary key, \
+             password varchar(64) character set utf8mb4 not null");
+    ret |= database_create_table(mysql, "friend", 
+            "username1 varchar(64) character set utf8mb4 not null, \
+             username2 varchar(64) character set utf8mb4 not null, \
+             state tinyint not null, \
+             primary key (username1, username2)");
+    ret |= database_create_table(mysql, "message", 
+            "id bigint not null auto_increment primary key, \
+             username1 varchar(64) character set utf8mb4 not null, \
+             username2 varchar(64) character set utf8mb4 not null, \
+             time double not null, \
+             content varchar(800) character set utf8mb4, \
+             state tinyint not null");
+
+    return ret;
 }
 
 int database_insert(MYSQL * mysql, const char * table,
@@ -67,7 +108,39 @@ int database_insert(MYSQL * mysql, const char * table,
     if (_command_check(command) != 0)
         return -1;
 
-    return mysql_query(mysql, command);
+    return _query(mysql, command, METRICS_DB_INSERT, __func__);
+}
+
+/** database_insert_rows return value:
+ *     return  0 if the rows are in
+ *     return -2 if the command can not be allocated
+ *     return the error of mysql otherwise
+ *  database_insert_rows note:
+ *     one statement for many rows is what makes a bulk load fast, a row that
+ *     is already there (by its key) is skipped rather than failing the rest
+*/
+int database_insert_rows(MYSQL * mysql, const char * table,
+                                        const char * column,
+                                        const char * values)
+{
+    char * command;
+    size_t size;
+    int ret;
+
+    size = strlen(table) + strlen(column) + strlen(values) + 32;
+    command = (char *)malloc(size);
+    if (command == NULL)
+        return -2;
+    snprintf(command, size, "insert ignore into %s (%s) values %s", table, column, values);
+    if (_command_check(command) != 0) {
+        free(command);
+        return -1;
+    }
+
+    ret = _query(mysql, command, METRICS_DB_INSERT, __func__);
+    free(command);
+
+    return ret;
 }
 
 int database_update(MYSQL * mysql, const char * table,
@@ -82,7 +155,7 @@ int database_update(MYSQL * mysql, const char * table,
     if (_command_check(command) != 0)
         return -1;
 
-    return mysql_query(mysql, command);
+    return _query(mysql, command, METRICS_DB_UPDATE, __func__);
 }
 
 int database_select(MYSQL * mysql, const char * table,
@@ -97,16 +170,20 @@ int database_select(MYSQL * mysql, const char * table,
     if (_command_check(command) != 0)
         return -1;
 
-    return mysql_query(mysql, command);
+    return _query(mysql, command, METRICS_DB_SELECT, __func__);
 }
 
 result_t * database_get_result(MYSQL * mysql)
 {
     result_t * res;
+    uint64_t start;
 
     res = (result_t *)malloc(sizeof(result_t));
 
+    start = metrics_now();
     res->_res = mysql_store_result(mysql);
+    metrics_time(METRICS_DB_STORE_RESULT, start);
+    trace_end(__func__, start);
     res->c = mysql_field_count(mysql);
     if (res->_res == NULL) {
         res->r = 0;
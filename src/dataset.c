@@ -0,0 +1,468 @@
+#include "protocol.h"
+#include "database.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+/**
+ * usage: dataset [-u users] [-f friendships] [-m messages] [-a exponent]
+ *                [-l length] [-r unread] [-p password] [-s seed]
+ *                [-j threads] [-b bytes] [-o directory]
+ *     fills the tables of the server (database_create_tables) with a
+ *     synthetic dataset, so that friend lists and message histories are
+ *     as large as those of production:
+ *         -u  users user0 ~ user<n - 1> (10000), all with password -p (dataset)
+ *         -f  friendships (10 per user), both ends picked by a power law of
+ *             exponent -a (1.0) over the users, user0 has the most friends,
+ *             nine in ten are accepted (TABLE_F_STATE_BEING), the rest pending
+ *         -m  messages (100 per user), between accepted friends, conversations
+ *             picked by the same power law, over the past year in id order,
+ *             a fraction -r (0.01) of them unread
+ *         -l  mean length of a message (60), log-normal, 1 ~ 800 bytes
+ *         -s  seed (1), the same seed and -j give the same dataset
+ *         -j  threads (8), each with its own connection and range of rows
+ *         -b  bytes of rows per insert statement (1 MB), under max_allowed_packet
+ *         -o  writes <table>.<thread>.tsv to directory instead, and prints the
+ *             LOAD DATA statements that load them, the fastest way into mysql
+ *             and a plain format for any other storage
+ *  the tables are expected to be empty, friendships and users that are
+ *  already there are skipped (insert ignore)
+*/
+
+#define DATASET_USERS           10000
+#define DATASET_FRIENDS         10      /* per user */
+#define DATASET_MESSAGES        100     /* per user */
+#define DATASET_EXPONENT        1.0
+#define DATASET_LENGTH          60
+#define DATASET_LENGTH_SIGMA    1.0
+#define DATASET_UNREAD          0.01
+#define DATASET_PASSWORD        "dataset"
+#define DATASET_THREADS         8
+#define DATASET_STATEMENT_BYTES (1 << 20)
+#define DATASET_ACCEPTED        0.9
+#define DATASET_SPAN            (365 * 86400.0)
+
+#define ROW_MAX                 1024    /* a message row, 800 bytes of text and the rest */
+
+struct edge
+{
+    uint32_t user1;
+    uint32_t user2;
+};
+
+struct table
+{
+    const char * name;
+    const char * column;
+    uint64_t num;
+    /* writes row i into row, tsv or sql values, returns its length */
+    int (* row)(uint64_t i, uint64_t * rng, char * row, int tsv);
+};
+
+struct worker
+{
+    pthread_t thread;
+    int id;
+    const struct table * table;
+    uint64_t first;
+    uint64_t last;
+    uint64_t rows;
+    int fails;
+};
+
+static uint64_t user_num = DATASET_USERS;
+static uint64_t friend_num;
+static uint64_t message_num;
+static double exponent = DATASET_EXPONENT;
+static double length = DATASET_LENGTH;
+static double unread = DATASET_UNREAD;
+static const char * password = DATASET_PASSWORD;
+static uint64_t seed = 1;
+static int thread_num = DATASET_THREADS;
+static size_t statement_bytes = DATASET_STATEMENT_BYTES;
+static const char * directory;
+
+static struct edge * edges;             /* friendships, sorted */
+static uint8_t * states;
+static uint32_t * accepted;             /* indices into edges */
+static uint64_t accepted_num;
+static double time_start;
+
+static const char * words[] = {
+    "the", "a", "to", "and", "you", "i", "it", "is", "that", "of", "in", "we",
+    "for", "on", "are", "me", "ok", "see", "what", "just", "lol", "now",
+    "tomorrow", "meeting", "dinner", "sounds", "good", "thanks", "call",
+    "later", "maybe", "sure"
+};
+
+/* splitmix64, a state per thread */
+static uint64_t _random(uint64_t * rng)
+{
+    uint64_t z = (*rng += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* uniform in [0, 1) */
+static double _uniform(uint64_t * rng)
+{
+    return (_random(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* rank 0 ~ n - 1, rank k about (k + 1) ^ -exponent as likely as rank 0 */
+static uint64_t _power_law(uint64_t * rng, uint64_t n)
+{
+    double u = _uniform(rng);
+    double x;
+    uint64_t rank;
+
+    if (fabs(exponent - 1.0) < 1e-9) {
+        x = exp(u * log((double)n + 1));
+    } else {
+        x = pow(1 + u * (pow((double)n + 1, 1 - exponent) - 1), 1 / (1 - exponent));
+    }
+    rank = (uint64_t)x - 1;
+
+    return (rank < n) ? rank : n - 1;
+}
+
+/* log-normal with mean length, 1 ~ 800 */
+static int _length(uint64_t * rng)
+{
+    double z, mu;
+    int len;
+
+    z = sqrt(-2 * log(1 - _uniform(rng))) * cos(2 * M_PI * _uniform(rng));
+    mu = log(length) - DATASET_LENGTH_SIGMA * DATASET_LENGTH_SIGMA / 2;
+    len = (int)exp(mu + DATASET_LENGTH_SIGMA * z);
+
+    return (len < 1) ? 1 : ((len > 800) ? 800 : len);
+}
+
+static int _user_row(uint64_t i, uint64_t * rng, char * row, int tsv)
+{
+    if (tsv) {
+        return sprintf(row, "user%lu\t%s\n", i, password);
+    }
+    return sprintf(row, "('user%lu','%s'),", i, password);
+}
+
+static int _friend_row(uint64_t i, uint64_t * rng, char * row, int tsv)
+{
+    if (tsv) {
+        return sprintf(row, "user%u\tuser%u\t%d\n", edges[i].user1, edges[i].user2, states[i]);
+    }
+    return sprintf(row, "('user%u','user%u',%d),", edges[i].user1, edges[i].user2, states[i]);
+}
+
+static int _message_row(uint64_t i, uint64_t * rng, char * row, int tsv)
+{
+    const struct edge * edge;
+    char content[801];
+    const char * word;
+    uint32_t from, to;
+    double time;
+    int len, n = 0;
+    int state;
+
+    edge = &(edges[accepted[_power_law(rng, accepted_num)]]);
+    if (_random(rng) & 1) {
+        from = edge->user1;
+        to = edge->user2;
+    } else {
+        from = edge->user2;
+        to = edge->user1;
+    }
+    time = time_start + DATASET_SPAN * i / message_num;
+    state = (_uniform(rng) < unread) ? TABLE_M_STATE_UNREAD : TABLE_M_STATE_READ;
+
+    /* words only, nothing to escape in either format */
+    len = _length(rng);
+    while (n < len) {
+        word = words[_random(rng) % (sizeof(words) / sizeof(words[0]))];
+        while (*word != '\0' && n < len) {
+            content[n++] = *(word++);
+        }
+        if (n < len) {
+            content[n++] = ' ';
+        }
+    }
+    content[n] = '\0';
+
+    if (tsv) {
+        return sprintf(row, "user%u\tuser%u\t%.6f\t%s\t%d\n", from, to, time, content, state);
+    }
+    return sprintf(row, "('user%u','user%u',%.6f,'%s',%d),", from, to, time, content, state);
+}
+
+static const struct table tables[] = {
+    {"user", "username, password", 0, _user_row},
+    {"friend", "username1, username2, state", 0, _friend_row},
+    {"message", "username1, username2, time, content, state", 0, _message_row},
+};
+
+static int _edge_compare(const void * a, const void * b)
+{
+    const struct edge * x = a;
+    const struct edge * y = b;
+
+    if (x->user1 != y->user1) {
+        return (x->user1 > y->user1) - (x->user1 < y->user1);
+    }
+    return (x->user2 > y->user2) - (x->user2 < y->user2);
+}
+
+/* "user<a>" sorts before "user<b>" by strcmp, the order the server keeps a friend row in */
+static int _username_less(uint32_t a, uint32_t b)
+{
+    char x[11], y[11];
+
+    snprintf(x, sizeof(x), "%u", a);
+    snprintf(y, sizeof(y), "%u", b);
+
+    return strcmp(x, y) < 0;
+}
+
+/* friend_num pairs, username1 before username2 by strcmp, no pair twice, friend_num is what is left */
+static int _edges_init(void)
+{
+    uint64_t rng = seed;
+    uint64_t n = 0, missing;
+    uint32_t a, b;
+
+    edges = (struct edge *)malloc((friend_num + 1) * sizeof(struct edge));
+    states = (uint8_t *)malloc(friend_num + 1);
+    accepted = (uint32_t *)malloc((friend_num + 1) * sizeof(uint32_t));
+    if (edges == NULL || states == NULL || accepted == NULL) {
+        return -1;
+    }
+
+    /* the popular pairs come up again and again, the missing are drawn anew */
+    for (int round = 0; round < 8 && n < friend_num; ++round) {
+        missing = friend_num - n;
+        for (uint64_t i = 0; i < missing; ++i) {
+            a = (uint32_t)_power_law(&rng, user_num);
+            b = (uint32_t)_power_law(&rng, user_num);
+            if (a != b) {
+                edges[n].user1 = _username_less(a, b) ? a : b;
+                edges[n].user2 = _username_less(a, b) ? b : a;
+                n++;
+            }
+        }
+        qsort(edges, n, sizeof(struct edge), _edge_compare);
+        missing = n;
+        n = 0;
+        for (uint64_t i = 0; i < missing; ++i) {
+            if (n == 0 || _edge_compare(&(edges[n - 1]), &(edges[i])) != 0) {
+                edges[n++] = edges[i];
+            }
+        }
+    }
+    friend_num = n;
+
+    for (uint64_t i = 0; i < friend_num; ++i) {
+        if (_uniform(&rng) < DATASET_ACCEPTED) {
+            states[i] = TABLE_F_STATE_BEING;
+            accepted[accepted_num++] = (uint32_t)i;
+        } else {
+            /* user1 asked, user2 has not answered */
+            states[i] = TABLE_F_STATE_SEND;
+        }
+    }
+
+    return 0;
+}
+
+/* one connection (or file), rows first ~ last - 1 */
+static void * worker_routine(void * arg)
+{
+    struct worker * worker = arg;
+    const struct table * table = worker->table;
+    MYSQL * mysql = NULL;
+    FILE * file = NULL;
+    char path[4096];
+    char * values;
+    size_t len = 0;
+    uint64_t rng;
+
+    /* the rows of a thread depend on the seed, the table and the thread only */
+    rng = seed ^ ((uint64_t)(table - tables + 1) << 56) ^ ((uint64_t)(worker->id + 1) << 40);
+
+    values = (char *)malloc(statement_bytes + ROW_MAX);
+    if (directory != NULL) {
+        snprintf(path, sizeof(path), "%s/%s.%d.tsv", directory, table->name, worker->id);
+        file = fopen(path, "w");
+        if (file != NULL) {
+            setvbuf(file, NULL, _IOFBF, 1 << 20);
+        }
+    } else {
+        database_thread_init();
+        mysql = database_connect();
+    }
+    if (values == NULL || (file == NULL && mysql == NULL)) {
+        worker->fails++;
+        goto finish;
+    }
+
+    for (uint64_t i = worker->first; i < worker->last; ++i) {
+        len += table->row(i, &rng, &(values[len]), file != NULL);
+        worker->rows++;
+        if (len >= statement_bytes || i + 1 == worker->last) {
+            if (file != NULL) {
+                if (fwrite(values, 1, len, file) != len) {
+                    worker->fails++;
+                }
+            } else {
+                /* the trailing comma */
+                values[len - 1] = '\0';
+                if (database_insert_rows(mysql, table->name, table->column, values) != 0) {
+                    worker->fails++;
+                }
+            }
+            len = 0;
+        }
+    }
+
+finish:
+    if (file != NULL && fclose(file) != 0) {
+        worker->fails++;
+    }
+    if (mysql != NULL) {
+        database_disconnect(mysql);
+    }
+    if (directory == NULL) {
+        database_thread_finish();
+    }
+    free(values);
+
+    return NULL;
+}
+
+/** load return value:
+ *     return the statements (or files) that failed
+*/
+static int load(const struct table * table)
+{
+    struct worker * workers;
+    struct timespec start, end;
+    uint64_t rows = 0;
+    double seconds;
+    int fails = 0;
+
+    workers = (struct worker *)calloc(thread_num, sizeof(struct worker));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < thread_num; ++i) {
+        workers[i].id = i;
+        workers[i].table = table;
+        workers[i].first = table->num * i / thread_num;
+        workers[i].last = table->num * (i + 1) / thread_num;
+        pthread_create(&(workers[i].thread), NULL, worker_routine, &(workers[i]));
+    }
+    for (int i = 0; i < thread_num; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        rows += workers[i].rows;
+        fails += workers[i].fails;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%-8s %12lu rows %8.1f s %12.0f rows/s %6d fails\n",
+           table->name, rows, seconds, rows / ((seconds > 0) ? seconds : 1), fails);
+    free(workers);
+
+    return fails;
+}
+
+static void usage(const char * name)
+{
+    fprintf(stderr, "usage: %s [-u users] [-f friendships] [-m messages] [-a exponent] "
+                    "[-l length] [-r unread] [-p password] [-s seed] [-j threads] "
+                    "[-b bytes] [-o directory]\n", name);
+}
+
+int main(int argc, char ** argv)
+{
+    struct table loads[3];
+    MYSQL * mysql;
+    int64_t friends = -1, messages = -1;
+    int fails = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:f:m:a:l:r:p:s:j:b:o:")) != -1) {
+        switch (opt) {
+        case 'u': user_num = strtoull(optarg, NULL, 10); break;
+        case 'f': friends = strtoll(optarg, NULL, 10); break;
+        case 'm': messages = strtoll(optarg, NULL, 10); break;
+        case 'a': exponent = atof(optarg); break;
+        case 'l': length = atof(optarg); break;
+        case 'r': unread = atof(optarg); break;
+        case 'p': password = optarg; break;
+        case 's': seed = strtoull(optarg, NULL, 10); break;
+        case 'j': thread_num = atoi(optarg); break;
+        case 'b': statement_bytes = strtoull(optarg, NULL, 10); break;
+        case 'o': directory = optarg; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    friend_num = (friends >= 0) ? (uint64_t)friends : user_num * DATASET_FRIENDS;
+    message_num = (messages >= 0) ? (uint64_t)messages : user_num * DATASET_MESSAGES;
+    if (optind != argc || user_num < 2 || user_num > UINT32_MAX || friend_num > UINT32_MAX ||
+        exponent <= 0 || length < 1 || thread_num < 1 || statement_bytes < ROW_MAX ||
+        strlen(password) > 64) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (_edges_init() != 0) {
+        fprintf(stderr, "dataset: no memory for %lu friendships\n", friend_num);
+        return 1;
+    }
+    if (accepted_num == 0) {
+        message_num = 0;
+    }
+    time_start = (double)time(NULL) - DATASET_SPAN;
+
+    if (directory != NULL) {
+        mkdir(directory, 0755);
+    } else {
+        database_init();
+        mysql = database_connect();
+        if (mysql == NULL) {
+            fprintf(stderr, "dataset: can not connect to %s\n", DATABASE_DBNAME);
+            return 1;
+        }
+        database_create_tables(mysql);
+        database_disconnect(mysql);
+    }
+
+    memcpy(loads, tables, sizeof(loads));
+    loads[0].num = user_num;
+    loads[1].num = friend_num;
+    loads[2].num = message_num;
+    for (int i = 0; i < 3; ++i) {
+        fails += load(&(loads[i]));
+    }
+
+    if (directory != NULL) {
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < thread_num; ++j) {
+                printf("load data local infile '%s/%s.%d.tsv' ignore into table %s (%s);\n",
+                       directory, loads[i].name, j, loads[i].name, loads[i].column);
+            }
+        }
+    } else {
+        database_finish();
+    }
+    free(edges);
+    free(states);
+    free(accepted);
+
+    return (fails == 0) ? 0 : 1;
+}
@@ -0,0 +1,962 @@
+#include "protocol.h"
+#include "secure.h"
+#include "batch.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * usage: loadgen [scenario] [server ip] [server port]
+ *     runs the users of a scenario file against the server, headless,
+ *     a few worker threads drive them all, each worker parks its users
+ *     between steps and polls their channels, so idle sessions and chat
+ *     rows pushed by the server cost no thread, a step itself waits for
+ *     its round trips on the channel of its user,
+ *     the server needs SERVER_MAX_CLIENT_NUM above the users connected at once
+ *
+ *  scenario file, one directive per line, '#' starts a comment:
+ *     users    <n>         simulated users <prefix>0 ~ <prefix><n - 1>, password pw
+ *     prefix   <name>      (lg)
+ *     workers  <n>         worker threads (8)
+ *     codec    <codec>     null, store or zlib, asked for at sign in (zlib)
+ *     friends  <n>         setup: user i adds i + 1 ~ i + n, who accept (0)
+ *     seconds  <n>         how long the run lasts (10)
+ *     ramp     <n>         users start spread over the first n seconds (0)
+ *     step     <step>      every user runs the steps from the top, again
+ *                          and again until the run ends:
+ *         connect              handshake, resumed if the user holds a ticket,
+ *                              signs in (or up) otherwise, reads the inbox
+ *         chat <n>             chat mode, opens streams with n of its friends
+ *         burst <n> <ms>       n messages to every open stream, ms apart
+ *         idle <ms>            stays as it is for ms
+ *         leave                closes the streams, back from chat mode
+ *         friend               friend mode, reads the list, back
+ *         disconnect           says bye and closes the channel
+ *         drop                 closes the channel without a word
+ *  a user whose step fails is dropped and starts over a second later
+ *
+ *  report, setup and run apart, per operation:
+ *     samples, failures, per second, latency percentiles in ms,
+ *     message is the delivery of a chat message, from the burst of the
+ *     sender until the receiver reads it, counted when the receiver has
+ *     the stream open and its history caught up
+*/
+
+#define OP_HANDSHAKE_FULL       0       /* connect() until the keys are built */
+#define OP_HANDSHAKE_RESUMED    1
+#define OP_SIGN_IN              2
+#define OP_SIGN_UP              3
+#define OP_INBOX                4       /* ticket and inbox after sign in */
+#define OP_FRIEND_ADD           5
+#define OP_FRIEND_ACCEPT        6
+#define OP_FRIEND_LIST          7
+#define OP_CHAT_ENTER           8       /* chat mode until the friend list */
+#define OP_CHAT_SELECT          9
+#define OP_MESSAGE              10
+#define OP_CHAT_CLOSE           11
+#define OP_NUM                  12
+
+static const char * op_names[OP_NUM] = {
+    "handshake_full", "handshake_resumed", "sign_in", "sign_up", "inbox",
+    "friend_add", "friend_accept", "friend_list",
+    "chat_enter", "chat_select", "message", "chat_close"
+};
+
+#define STEP_CONNECT            0
+#define STEP_CHAT               1
+#define STEP_BURST              2
+#define STEP_IDLE               3
+#define STEP_LEAVE              4
+#define STEP_FRIEND             5
+#define STEP_DISCONNECT         6
+#define STEP_DROP               7
+
+#define STREAM_CLOSED           0
+#define STREAM_SELECTING        1
+#define STREAM_OPEN             2
+#define STREAM_CLOSING          3
+
+#define MAX_STEP_NUM            64
+#define PHASE_SETUP             0
+#define PHASE_RUN               1
+
+struct step
+{
+    int type;
+    int arg[2];
+};
+
+struct samples
+{
+    double * ms;
+    int num;
+    int capacity;
+};
+
+struct stats
+{
+    struct samples samples[OP_NUM];
+    long fail[OP_NUM];
+    long sent;                  /* chat messages */
+};
+
+struct user_stream
+{
+    int state;
+    int caught_up;
+    double start;
+};
+
+struct user
+{
+    int id;
+    char name[65];
+    int channel;                /* -1 while disconnected */
+    int chatting;
+    int codec;
+    struct secure_key key;
+    struct secure_ticket ticket;
+    int has_ticket;
+    int step;
+    int burst_left;
+    double due;
+    int pending;                /* chat mode replies still awaited */
+    struct user_stream streams[SERVER_MAX_STREAM_NUM + 1];
+};
+
+struct worker
+{
+    pthread_t thread;
+    struct user * users;
+    int num;
+    unsigned int seed;
+    struct stats stats[2];
+    int phase;
+};
+
+/* the scenario */
+static int user_num = 0;
+static char prefix[32] = "lg";
+static int worker_num = 8;
+static int codec = BATCH_CODEC_ZLIB;
+static int friend_num = 0;
+static double seconds = 10;
+static double ramp = 0;
+static struct step steps[MAX_STEP_NUM];
+static int step_num = 0;
+
+static struct sockaddr_in addr;
+static pthread_barrier_t barrier;
+static double run_start;
+static double deadline;
+static unsigned int run_tag;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void _sample(struct worker * worker, int op, double start)
+{
+    struct samples * samples = &(worker->stats[worker->phase].samples[op]);
+    double * ms;
+
+    if (samples->num == samples->capacity) {
+        samples->capacity = (samples->capacity == 0) ? 1024 : samples->capacity * 2;
+        ms = (double *)realloc(samples->ms, samples->capacity * sizeof(double));
+        if (ms == NULL) {
+            samples->capacity = samples->num;
+            return;
+        }
+        samples->ms = ms;
+    }
+    samples->ms[samples->num++] = (now() - start) * 1e3;
+}
+
+static void _fail(struct worker * worker, int op)
+{
+    worker->stats[worker->phase].fail[op]++;
+}
+
+static void _drop(struct user * user)
+{
+    if (user->channel >= 0) {
+        secure_flush();
+        close(user->channel);
+    }
+    user->channel = -1;
+    user->chatting = 0;
+    user->pending = 0;
+    memset(user->streams, 0, sizeof(user->streams));
+}
+
+static void _disconnect(struct user * user)
+{
+    char buf[811];
+
+    if (user->channel < 0) {
+        return;
+    }
+    /* the reply to the finish is never read, the server goes on to the disconnect */
+    if (user->chatting) {
+        memset(buf, 0, sizeof(buf));
+        buf[0] = PROTOCOL_FINISH;
+        secure_send(user->channel, buf, 811, 0, &(user->key));
+    }
+    buf[0] = PROTOCOL_DISCONNECT;
+    secure_send(user->channel, buf, 1, 0, &(user->key));
+    _drop(user);
+}
+
+/** _connect return value:
+ *     return  0 if the user is signed in and has read its inbox
+ *     return -1 otherwise, the user is dropped
+*/
+static int _connect(struct worker * worker, struct user * user)
+{
+    char buf[1 + SECURE_TICKET_LEN];
+    double start;
+    int on = 1;
+    int op;
+    int ret;
+
+    start = now();
+    user->channel = socket(AF_INET, SOCK_STREAM, 0);
+    if (user->channel < 0) {
+        _fail(worker, OP_HANDSHAKE_FULL);
+        return -1;
+    }
+    /* the public key and the sign in go out back to back, nagle would hold the second */
+    setsockopt(user->channel, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(user->channel, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        _fail(worker, user->has_ticket ? OP_HANDSHAKE_RESUMED : OP_HANDSHAKE_FULL);
+        _drop(user);
+        return -1;
+    }
+    fcntl(user->channel, F_SETFL, fcntl(user->channel, F_GETFL) | O_NONBLOCK);
+
+    ret = secure_client_buildkey(user->channel, &(user->key),
+                                 user->has_ticket ? &(user->ticket) : NULL);
+    if (ret < 0) {
+        _fail(worker, user->has_ticket ? OP_HANDSHAKE_RESUMED : OP_HANDSHAKE_FULL);
+        _drop(user);
+        return -1;
+    }
+    _sample(worker, (ret == 1) ? OP_HANDSHAKE_RESUMED : OP_HANDSHAKE_FULL, start);
+
+    /* a ticket the server turned down is gone, the user signs in */
+    if (ret == 0) {
+        user->has_ticket = 0;
+        ret = -1;
+        for (op = OP_SIGN_IN; op <= OP_SIGN_UP && ret != 0; ++op) {
+            start = now();
+            memset(buf, 0, 132);
+            buf[0] = (op == OP_SIGN_IN) ? PROTOCOL_SIGN_IN : PROTOCOL_SIGN_UP;
+            strcpy(&(buf[1]), user->name);
+            strcpy(&(buf[66]), "pw");
+            buf[131] = (char)codec;
+            if (secure_send(user->channel, buf, 132, 0, &(user->key)) <= 0 ||
+                secure_recv(user->channel, buf, 2, 0, &(user->key)) <= 0) {
+                _fail(worker, op);
+                _drop(user);
+                return -1;
+            }
+            ret = (buf[0] == PROTOCOL_SUCCEED) ? 0 : -1;
+            if (ret == 0) {
+                user->codec = (unsigned char)buf[1];
+                _sample(worker, op, start);
+            }
+        }
+        /* the password is pw, a user that can neither sign in nor up is somebody else */
+        if (ret != 0) {
+            _fail(worker, OP_SIGN_UP);
+            _drop(user);
+            return -1;
+        }
+    }
+
+    start = now();
+    if (secure_recv(user->channel, buf, sizeof(buf), 0, &(user->key)) <= 0 ||
+        buf[0] != PROTOCOL_TICKET) {
+        _fail(worker, OP_INBOX);
+        _drop(user);
+        return -1;
+    }
+    secure_client_ticket(&(user->key), (unsigned char *)&(buf[1]), &(user->ticket));
+    user->has_ticket = 1;
+    if (batch_recv_pages(user->channel, &(user->key), 14, SERVER_INBOX_PAGE_ROWS, NULL, NULL) < 0) {
+        _fail(worker, OP_INBOX);
+        _drop(user);
+        return -1;
+    }
+    _sample(worker, OP_INBOX, start);
+
+    return 0;
+}
+
+/* reads 67-byte rows up to PROTOCOL_FRIEND_LIST_END, friend rows may come batched */
+static int _recv_friendlist(struct user * user)
+{
+    char buf[128];
+    int row_len, count;
+
+    while (1) {
+        if (secure_recv(user->channel, buf, 67, 0, &(user->key)) <= 0) {
+            return -1;
+        }
+        if (buf[0] == PROTOCOL_FRIEND_LIST_END) {
+            return 0;
+        } else if (buf[0] == PROTOCOL_BATCH) {
+            free(batch_recv(user->channel, &(user->key), buf, &row_len, &count));
+            if (count < 0) {
+                return -1;
+            }
+        }
+    }
+}
+
+/* the i-th friend of user in the ring, i + 1 ahead for even i, i / 2 + 1 behind for odd i */
+static int _friend_of(const struct user * user, int i)
+{
+    int distance = i / 2 + 1;
+
+    return (i % 2 == 0) ? (user->id + distance) % user_num
+                        : (user->id - distance % user_num + user_num) % user_num;
+}
+
+/** _friend return value:
+ *     return  0 if the list is read and every request answered
+ *     return -1 if the connection is broken
+ *  _friend note:
+ *     friend mode, flag (PROTOCOL_FRIEND_ADD or PROTOCOL_FRIEND_ACCEPT) goes to
+ *     the friend_num users ahead of user (or behind it), pipelined,
+ *     0 only reads the list
+*/
+static int _friend(struct worker * worker, struct user * user, int flag)
+{
+    char buf[128];
+    char results[64];
+    double start;
+    uint32_t request_id;
+    int request_num = 0;
+    int op;
+
+    start = now();
+    buf[0] = PROTOCOL_FRIEND;
+    if (secure_send(user->channel, buf, 1, 0, &(user->key)) <= 0 ||
+        _recv_friendlist(user) != 0) {
+        _fail(worker, OP_FRIEND_LIST);
+        return -1;
+    }
+    _sample(worker, OP_FRIEND_LIST, start);
+
+    if (flag != 0) {
+        op = (flag == PROTOCOL_FRIEND_ADD) ? OP_FRIEND_ADD : OP_FRIEND_ACCEPT;
+        request_num = (friend_num < user_num - 1) ? friend_num : user_num - 1;
+        if (request_num > (int)sizeof(results)) {
+            request_num = sizeof(results);
+        }
+        start = now();
+        for (int i = 0; i < request_num; ++i) {
+            memset(buf, 0, 70);
+            buf[0] = (char)flag;
+            *((uint32_t *)(&(buf[1]))) = i;
+            snprintf(&(buf[5]), 65, "%s%d", prefix,
+                     (user->id + ((flag == PROTOCOL_FRIEND_ADD) ? i + 1 : user_num - i - 1)) % user_num);
+            if (secure_send(user->channel, buf, 70, 0, &(user->key)) <= 0) {
+                _fail(worker, op);
+                return -1;
+            }
+            results[i] = 0;
+        }
+        for (int pending = request_num; pending > 0; --pending) {
+            if (secure_recv(user->channel, buf, 67, 0, &(user->key)) <= 0) {
+                _fail(worker, op);
+                return -1;
+            }
+            request_id = *((uint32_t *)(&(buf[1])));
+            if (request_id < (uint32_t)request_num) {
+                results[request_id] = buf[0];
+            }
+        }
+        /* a refusal (already friends from an earlier run) is an answer as well */
+        for (int i = 0; i < request_num; ++i) {
+            if (results[i] == PROTOCOL_SUCCEED || results[i] == PROTOCOL_FAIL) {
+                _sample(worker, op, start);
+            } else {
+                _fail(worker, op);
+            }
+        }
+    }
+
+    memset(buf, 0, 70);
+    buf[0] = PROTOCOL_FINISH;
+    return (secure_send(user->channel, buf, 70, 0, &(user->key)) > 0) ? 0 : -1;
+}
+
+/* one 813-byte record of chat mode or a row of a batch of them */
+static void _chat_record(struct worker * worker, struct user * user, char * buf)
+{
+    struct user_stream * stream = NULL;
+    unsigned int tag;
+    double stamp;
+    int stream_id;
+
+    stream_id = (unsigned char)buf[1];
+    if (stream_id >= 1 && stream_id <= SERVER_MAX_STREAM_NUM) {
+        stream = &(user->streams[stream_id]);
+    }
+
+    if (buf[0] == PROTOCOL_CHAT_LIST) {
+        /* history rows are no delivery, nor are messages of an earlier run */
+        buf[811] = '\0';
+        if (stream != NULL && stream->caught_up && buf[2] == PROTOCOL_CHAT_LIST_RECV &&
+            sscanf(&(buf[11]), "loadgen %x %lf", &tag, &stamp) == 2 && tag == run_tag) {
+            _sample(worker, OP_MESSAGE, stamp);
+        }
+    } else if (buf[0] == PROTOCOL_CHAT_LIST_END) {
+        if (stream != NULL) {
+            stream->caught_up = 1;
+        }
+    } else if (buf[0] == PROTOCOL_FINISH && stream_id == 0) {
+        user->chatting = 0;
+        user->pending--;
+    } else if (stream == NULL) {
+        return;
+    } else if (stream->state == STREAM_SELECTING) {
+        if (buf[0] == PROTOCOL_SUCCEED) {
+            stream->state = STREAM_OPEN;
+            _sample(worker, OP_CHAT_SELECT, stream->start);
+        } else {
+            stream->state = STREAM_CLOSED;
+            _fail(worker, OP_CHAT_SELECT);
+        }
+        user->pending--;
+    } else if (stream->state == STREAM_CLOSING) {
+        if (buf[0] == PROTOCOL_FINISH) {
+            _sample(worker, OP_CHAT_CLOSE, stream->start);
+        } else {
+            _fail(worker, OP_CHAT_CLOSE);
+        }
+        stream->state = STREAM_CLOSED;
+        user->pending--;
+    }
+}
+
+static int _chat_read(struct worker * worker, struct user * user)
+{
+    char buf[1024];
+    char * rows;
+    int row_len, count;
+
+    if (secure_recv(user->channel, buf, 813, 0, &(user->key)) <= 0) {
+        return -1;
+    }
+    if (buf[0] == PROTOCOL_BATCH) {
+        rows = batch_recv(user->channel, &(user->key), buf, &row_len, &count);
+        if (count < 0) {
+            return -1;
+        }
+        for (int i = 0; i < count; ++i) {
+            _chat_record(worker, user, &(rows[i * row_len]));
+        }
+        free(rows);
+    } else {
+        _chat_record(worker, user, buf);
+    }
+
+    return 0;
+}
+
+/* reads chat records until every reply awaited has come */
+static int _chat_wait(struct worker * worker, struct user * user)
+{
+    while (user->pending > 0) {
+        if (_chat_read(worker, user) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/** _chat_enter return value:
+ *     return  0 if in chat mode, with the streams the server accepted open
+ *     return -1 if the connection is broken
+*/
+static int _chat_enter(struct worker * worker, struct user * user, int n)
+{
+    char buf[811];
+    int candidates[2 * 64];
+    int candidate_num, peer;
+    double start;
+
+    start = now();
+    buf[0] = PROTOCOL_CHAT;
+    if (secure_send(user->channel, buf, 1, 0, &(user->key)) <= 0 ||
+        _recv_friendlist(user) != 0) {
+        _fail(worker, OP_CHAT_ENTER);
+        return -1;
+    }
+    user->chatting = 1;
+    _sample(worker, OP_CHAT_ENTER, start);
+
+    /* n of its friends, at random, each once */
+    candidate_num = 0;
+    for (int i = 0; i < 2 * friend_num && candidate_num < 2 * 64; ++i) {
+        peer = _friend_of(user, i);
+        for (int j = 0; j < candidate_num && peer != user->id; ++j) {
+            if (candidates[j] == peer) {
+                peer = user->id;
+            }
+        }
+        if (peer != user->id) {
+            candidates[candidate_num++] = peer;
+        }
+    }
+    if (n > SERVER_MAX_STREAM_NUM) {
+        n = SERVER_MAX_STREAM_NUM;
+    }
+    for (int stream_id = 1; stream_id <= n && candidate_num > 0; ++stream_id) {
+        peer = rand_r(&(worker->seed)) % candidate_num;
+        memset(buf, 0, sizeof(buf));
+        buf[0] = PROTOCOL_CHAT_SELECT;
+        buf[1] = (char)stream_id;
+        snprintf(&(buf[2]), 65, "%s%d", prefix, candidates[peer]);
+        candidates[peer] = candidates[--candidate_num];
+
+        user->streams[stream_id].state = STREAM_SELECTING;
+        user->streams[stream_id].caught_up = 0;
+        user->streams[stream_id].start = now();
+        user->pending++;
+        if (secure_send(user->channel, buf, 811, 0, &(user->key)) <= 0) {
+            _fail(worker, OP_CHAT_SELECT);
+            return -1;
+        }
+    }
+
+    return _chat_wait(worker, user);
+}
+
+/* one message to every open stream, the delivery is timed by the receiver */
+static int _burst(struct worker * worker, struct user * user)
+{
+    struct timespec ts;
+    char buf[811];
+
+    for (int stream_id = 1; stream_id <= SERVER_MAX_STREAM_NUM; ++stream_id) {
+        if (user->streams[stream_id].state != STREAM_OPEN) {
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        memset(buf, 0, sizeof(buf));
+        buf[0] = PROTOCOL_CHAT_MESSAGE;
+        buf[1] = (char)stream_id;
+        *((double *)(&(buf[2]))) = ts.tv_sec + ts.tv_nsec / 1e9;
+        snprintf(&(buf[10]), 801, "loadgen %08x %.6f from %s", run_tag, now(), user->name);
+        if (secure_send(user->channel, buf, 811, 0, &(user->key)) <= 0) {
+            return -1;
+        }
+        worker->stats[worker->phase].sent++;
+    }
+
+    return 0;
+}
+
+static int _chat_leave(struct worker * worker, struct user * user)
+{
+    char buf[811];
+
+    memset(buf, 0, sizeof(buf));
+    for (int stream_id = 1; stream_id <= SERVER_MAX_STREAM_NUM; ++stream_id) {
+        if (user->streams[stream_id].state != STREAM_OPEN) {
+            continue;
+        }
+        buf[0] = PROTOCOL_CHAT_CLOSE;
+        buf[1] = (char)stream_id;
+        user->streams[stream_id].state = STREAM_CLOSING;
+        user->streams[stream_id].start = now();
+        user->pending++;
+        if (secure_send(user->channel, buf, 811, 0, &(user->key)) <= 0) {
+            _fail(worker, OP_CHAT_CLOSE);
+            return -1;
+        }
+    }
+    buf[0] = PROTOCOL_FINISH;
+    buf[1] = 0;
+    user->pending++;
+    if (secure_send(user->channel, buf, 811, 0, &(user->key)) <= 0) {
+        return -1;
+    }
+
+    return _chat_wait(worker, user);
+}
+
+/* runs the step the user is at and moves it on, a user that fails starts over */
+static void _step(struct worker * worker, struct user * user)
+{
+    struct step * step = &(steps[user->step]);
+    int connected = (user->channel >= 0);
+    int ret = 0;
+
+    user->due = now();
+    if (step->type == STEP_CONNECT) {
+        ret = connected ? 0 : _connect(worker, user);
+    } else if (step->type == STEP_CHAT) {
+        ret = (connected && !user->chatting) ? _chat_enter(worker, user, step->arg[0]) : 0;
+    } else if (step->type == STEP_BURST) {
+        if (user->chatting) {
+            ret = _burst(worker, user);
+            if (user->burst_left == 0) {
+                user->burst_left = step->arg[0];
+            }
+            /* stays on the step until the last message of the burst */
+            if (--user->burst_left > 0) {
+                user->due += step->arg[1] / 1e3;
+                return;
+            }
+        }
+    } else if (step->type == STEP_IDLE) {
+        user->due += step->arg[0] / 1e3;
+    } else if (step->type == STEP_LEAVE) {
+        ret = user->chatting ? _chat_leave(worker, user) : 0;
+    } else if (step->type == STEP_FRIEND) {
+        ret = (connected && !user->chatting) ? _friend(worker, user, 0) : 0;
+    } else if (step->type == STEP_DISCONNECT) {
+        _disconnect(user);
+    } else {
+        _drop(user);
+    }
+
+    if (ret != 0) {
+        _drop(user);
+        user->burst_left = 0;
+        user->step = 0;
+        user->due = now() + 1;
+    } else {
+        user->step = (user->step + 1) % step_num;
+    }
+}
+
+/* connects every user of worker once, with flag to friend mode if not 0 */
+static void _setup(struct worker * worker, int flag)
+{
+    struct user * user;
+
+    for (int i = 0; i < worker->num; ++i) {
+        user = &(worker->users[i]);
+        if (_connect(worker, user) == 0) {
+            if (flag != 0 && _friend(worker, user, flag) != 0) {
+                _drop(user);
+            } else {
+                _disconnect(user);
+            }
+        }
+    }
+}
+
+static void * worker_routine(void * arg)
+{
+    struct worker * worker = arg;
+    struct pollfd * pfds;
+    struct user ** polled;
+    struct user * user;
+    double next, current;
+    int pfd_num;
+    int ret;
+
+    pfds = (struct pollfd *)malloc(worker->num * sizeof(struct pollfd));
+    polled = (struct user **)malloc(worker->num * sizeof(struct user *));
+
+    /* every user signs up, then the friend graph is added, then accepted */
+    worker->phase = PHASE_SETUP;
+    _setup(worker, 0);
+    pthread_barrier_wait(&barrier);
+    if (friend_num > 0) {
+        _setup(worker, PROTOCOL_FRIEND_ADD);
+    }
+    pthread_barrier_wait(&barrier);
+    if (friend_num > 0) {
+        _setup(worker, PROTOCOL_FRIEND_ACCEPT);
+    }
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+
+    worker->phase = PHASE_RUN;
+    /* what the steps of one round send goes out in one submission, before the poll */
+    secure_cork();
+    for (int i = 0; i < worker->num; ++i) {
+        worker->users[i].due = run_start + ramp * rand_r(&(worker->seed)) / RAND_MAX;
+    }
+    while ((current = now()) < deadline) {
+        next = deadline;
+        pfd_num = 0;
+        for (int i = 0; i < worker->num; ++i) {
+            user = &(worker->users[i]);
+            if (user->due <= current) {
+                _step(worker, user);
+            }
+            if (user->due < next) {
+                next = user->due;
+            }
+            /* parked users in chat mode get rows pushed, the others only a close */
+            if (user->channel >= 0) {
+                pfds[pfd_num].fd = user->channel;
+                pfds[pfd_num].events = POLLIN;
+                polled[pfd_num++] = user;
+            }
+        }
+
+        secure_flush();
+        current = now();
+        ret = poll(pfds, pfd_num, (next > current) ? (int)((next - current) * 1e3) + 1 : 0);
+        for (int i = 0; ret > 0 && i < pfd_num; ++i) {
+            if (pfds[i].revents == 0) {
+                continue;
+            }
+            user = polled[i];
+            if (!user->chatting || _chat_read(worker, user) != 0) {
+                _drop(user);
+                user->burst_left = 0;
+                user->step = 0;
+                user->due = now() + 1;
+            }
+        }
+    }
+
+    for (int i = 0; i < worker->num; ++i) {
+        _disconnect(&(worker->users[i]));
+    }
+    free(pfds);
+    free(polled);
+
+    return NULL;
+}
+
+static int compare(const void * a, const void * b)
+{
+    double x = *((const double *)a);
+    double y = *((const double *)b);
+
+    return (x > y) - (x < y);
+}
+
+/* every worker's samples of op merged into the first worker's, sorted */
+static void report(struct worker * workers, int phase, double elapsed)
+{
+    struct samples * all;
+    struct samples * samples;
+    long fail;
+    int n;
+
+    printf("%-18s %9s %7s %9s %9s %9s %9s %9s\n",
+           "", "samples", "fail", "per_s", "p50_ms", "p90_ms", "p99_ms", "max_ms");
+    for (int op = 0; op < OP_NUM; ++op) {
+        all = &(workers[0].stats[phase].samples[op]);
+        fail = workers[0].stats[phase].fail[op];
+        for (int i = 1; i < worker_num; ++i) {
+            samples = &(workers[i].stats[phase].samples[op]);
+            fail += workers[i].stats[phase].fail[op];
+            if (samples->num > 0) {
+                all->ms = (double *)realloc(all->ms, (all->num + samples->num) * sizeof(double));
+                memcpy(&(all->ms[all->num]), samples->ms, samples->num * sizeof(double));
+                all->num += samples->num;
+            }
+        }
+        n = all->num;
+        if (n == 0 && fail == 0) {
+            continue;
+        }
+        printf("%-18s %9d %7ld %9.1f", op_names[op], n, fail, n / elapsed);
+        if (n > 0) {
+            qsort(all->ms, n, sizeof(double), compare);
+            printf(" %9.3f %9.3f %9.3f %9.3f", all->ms[n / 2], all->ms[(int)(n * 0.9)],
+                   all->ms[(int)(n * 0.99)], all->ms[n - 1]);
+        }
+        printf("\n");
+    }
+}
+
+static int load_scenario(const char * filename)
+{
+    char line[256];
+    char word[32], value[32];
+    struct step * step;
+    FILE * file;
+    int line_num = 0;
+    int ret = 0;
+    int n;
+
+    file = fopen(filename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "scenario: can not open %s\n", filename);
+        return -1;
+    }
+
+    while (ret == 0 && fgets(line, sizeof(line), file) != NULL) {
+        line_num++;
+        line[strcspn(line, "#\n")] = '\0';
+        if (sscanf(line, "%31s", word) != 1) {
+            continue;
+        }
+
+        n = sscanf(line, "%*s %31s", value);
+        if (strcmp(word, "users") == 0 && n == 1) {
+            user_num = atoi(value);
+        } else if (strcmp(word, "prefix") == 0 && n == 1 && strlen(value) <= 8) {
+            strcpy(prefix, value);
+        } else if (strcmp(word, "workers") == 0 && n == 1) {
+            worker_num = atoi(value);
+        } else if (strcmp(word, "friends") == 0 && n == 1) {
+            friend_num = atoi(value);
+        } else if (strcmp(word, "seconds") == 0 && n == 1) {
+            seconds = atof(value);
+        } else if (strcmp(word, "ramp") == 0 && n == 1) {
+            ramp = atof(value);
+        } else if (strcmp(word, "codec") == 0 && n == 1 && strcmp(value, "null") == 0) {
+            codec = BATCH_CODEC_NULL;
+        } else if (strcmp(word, "codec") == 0 && n == 1 && strcmp(value, "store") == 0) {
+            codec = BATCH_CODEC_STORE;
+        } else if (strcmp(word, "codec") == 0 && n == 1 && strcmp(value, "zlib") == 0) {
+            codec = BATCH_CODEC_ZLIB;
+        } else if (strcmp(word, "step") == 0 && n == 1 && step_num < MAX_STEP_NUM) {
+            step = &(steps[step_num++]);
+            n = sscanf(line, "%*s %*s %d %d", &(step->arg[0]), &(step->arg[1]));
+            if (strcmp(value, "connect") == 0 && n <= 0) {
+                step->type = STEP_CONNECT;
+            } else if (strcmp(value, "chat") == 0 && n == 1) {
+                step->type = STEP_CHAT;
+            } else if (strcmp(value, "burst") == 0 && n == 2 && step->arg[0] > 0) {
+                step->type = STEP_BURST;
+            } else if (strcmp(value, "idle") == 0 && n == 1) {
+                step->type = STEP_IDLE;
+            } else if (strcmp(value, "leave") == 0 && n <= 0) {
+                step->type = STEP_LEAVE;
+            } else if (strcmp(value, "friend") == 0 && n <= 0) {
+                step->type = STEP_FRIEND;
+            } else if (strcmp(value, "disconnect") == 0 && n <= 0) {
+                step->type = STEP_DISCONNECT;
+            } else if (strcmp(value, "drop") == 0 && n <= 0) {
+                step->type = STEP_DROP;
+            } else {
+                ret = -1;
+            }
+        } else {
+            ret = -1;
+        }
+    }
+    fclose(file);
+
+    if (ret != 0) {
+        fprintf(stderr, "scenario: %s: line %d is not understood\n", filename, line_num);
+    } else if (user_num < 1 || worker_num < 1 || step_num == 0 || seconds <= 0) {
+        fprintf(stderr, "scenario: %s: needs users, workers, seconds and a step\n", filename);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int main(int argc, char ** argv)
+{
+    struct worker * workers;
+    struct user * users;
+    struct rlimit limit;
+    double setup_start, setup_seconds;
+    long sent = 0;
+    int per_worker;
+
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: %s [scenario] [server ip] [server port]\n", argv[0]);
+        return 1;
+    }
+    if (load_scenario(argv[1]) != 0) {
+        return 1;
+    }
+    if (worker_num > user_num) {
+        worker_num = user_num;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((argc > 3) ? (unsigned short)atoi(argv[3]) : SERVER_PORT);
+    if (inet_aton((argc > 2) ? argv[2] : SERVER_IP, &(addr.sin_addr)) == 0) {
+        fprintf(stderr, "usage: %s [scenario] [server ip] [server port]\n", argv[0]);
+        return 1;
+    }
+
+    /* one channel per user at most */
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    secure_client_init();
+    srand(time(NULL) ^ getpid());
+    run_tag = (unsigned int)rand();
+
+    users = (struct user *)calloc(user_num, sizeof(struct user));
+    workers = (struct worker *)calloc(worker_num, sizeof(struct worker));
+    for (int i = 0; i < user_num; ++i) {
+        users[i].id = i;
+        users[i].channel = -1;
+        snprintf(users[i].name, sizeof(users[i].name), "%s%d", prefix, i);
+    }
+    per_worker = user_num / worker_num;
+    for (int i = 0; i < worker_num; ++i) {
+        workers[i].users = &(users[i * per_worker]);
+        workers[i].num = (i == worker_num - 1) ? user_num - i * per_worker : per_worker;
+        workers[i].seed = (unsigned int)rand();
+    }
+
+    pthread_barrier_init(&barrier, NULL, worker_num + 1);
+    setup_start = now();
+    for (int i = 0; i < worker_num; ++i) {
+        pthread_create(&(workers[i].thread), NULL, worker_routine, &(workers[i]));
+    }
+    for (int i = 0; i < 3; ++i) {
+        pthread_barrier_wait(&barrier);
+    }
+    run_start = now();
+    deadline = run_start + seconds;
+    setup_seconds = run_start - setup_start;
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < worker_num; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        sent += workers[i].stats[PHASE_RUN].sent;
+    }
+
+    printf("setup: %d users, %d friends each, %.1f s\n", user_num, friend_num, setup_seconds);
+    report(workers, PHASE_SETUP, setup_seconds);
+    printf("\nrun: %d workers, %d steps, %.0f s, %ld messages sent (%.1f per s)\n",
+           worker_num, step_num, seconds, sent, sent / seconds);
+    report(workers, PHASE_RUN, seconds);
+
+    pthread_barrier_destroy(&barrier);
+    for (int i = 0; i < worker_num; ++i) {
+        for (int phase = PHASE_SETUP; phase <= PHASE_RUN; ++phase) {
+            for (int op = 0; op < OP_NUM; ++op) {
+                free(workers[i].stats[phase].samples[op].ms);
+            }
+        }
+    }
+    free(workers);
+    free(users);
+    secure_client_finish();
+
+    return 0;
+}
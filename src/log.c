@@ -1,12 +1,11 @@
 #include "protocol.h"
 #include "log.h"
+#include "lock.h"
 #include <stdio.h>
-#include <pthread.h>
 #include <sys/time.h>
 #include <stdarg.h>
-#include <errno.h>
 
-static pthread_mutex_t log_mutex;
+static lock_t log_mutex;
 static FILE * log_file;
 
 int log_init(void)
@@ -18,7 +17,7 @@ int log_init(void)
     if (log_file == NULL)
         return -1;
 #endif /* LOG_USE_STDOUT */
-    pthread_mutex_init(&log_mutex, NULL);
+    lock_init(&log_mutex, METRICS_LOCK_LOG);
 
     return 0;
 }
@@ -28,13 +27,7 @@ int log_print(int type, const char msg[], ...)
     struct timeval tv;
     va_list args;
 
-#ifdef MULTICORE
-    while (pthread_mutex_trylock(&log_mutex)) {
-        if (errno != EBUSY) { return -1; }
-    }
-#else
-    pthread_mutex_lock(&log_mutex);
-#endif /* MULTICORE */
+    lock_acquire(&log_mutex);
 
     gettimeofday(&tv, NULL);
 
@@ -63,7 +56,7 @@ int log_print(int type, const char msg[], ...)
     va_end(args);
     fprintf(log_file, "\n");
 
-    pthread_mutex_unlock(&log_mutex);
+    lock_release(&log_mutex);
 
     fflush(log_file);
 
@@ -72,7 +65,7 @@ int log_print(int type, const char msg[], ...)
 
 void log_finish(void)
 {
-    pthread_mutex_destroy(&log_mutex);
+    lock_destroy(&log_mutex);
 #ifdef LOG_USE_STDOUT
     /* do nothing */
 #else
@@ -0,0 +1,411 @@
+#define _GNU_SOURCE
+#include "protocol.h"
+#include "metrics.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * histogram buckets, log-linear in nanoseconds like an hdr histogram:
+ *     bucket 0 holds everything under 2^10 ns, then every power of two up
+ *     to 2^MAX_EXP (17 s) is split into 4 buckets (at most 25% wide),
+ *     the last bucket holds the rest
+*/
+#define MIN_EXP         10
+#define MAX_EXP         34
+#define SUB_BITS        2
+#define BUCKET_NUM      (2 + (MAX_EXP - MIN_EXP) * (1 << SUB_BITS))
+
+struct metrics_block
+{
+    uint64_t counters[METRICS_COUNTER_NUM];
+    uint64_t buckets[METRICS_HISTOGRAM_NUM][BUCKET_NUM];
+    uint64_t sums[METRICS_HISTOGRAM_NUM];       /* nanoseconds */
+    int in_use;
+    struct metrics_block * next;
+};
+
+struct metric_name
+{
+    const char * family;
+    const char * help;
+    const char * label;
+};
+
+/* metrics of one family are next to each other, the first has the help */
+static const struct metric_name counter_names[METRICS_COUNTER_NUM] = {
+    {"server_connections_total", "Connections accepted.", NULL},
+    {"secure_sealed_bytes_total", "Plaintext bytes sealed into records in user space.", NULL},
+    {"secure_opened_bytes_total", "Plaintext bytes opened from records in user space.", NULL},
+    {"lock_contended_total", "Acquisitions that found the lock held.", "lock=\"queue\""},
+    {"lock_contended_total", NULL, "lock=\"log\""},
+    {"lock_contended_total", NULL, "lock=\"pool_deque\""},
+    {"lock_contended_total", NULL, "lock=\"pool_idle\""},
+    {"lock_contended_total", NULL, "lock=\"ticket\""},
+    {"lock_contended_total", NULL, "lock=\"keypair\""},
+    {"lock_contended_total", NULL, "lock=\"trace\""},
+    {"lock_contended_total", NULL, "lock=\"capture\""},
+};
+
+static const struct metric_name histogram_names[METRICS_HISTOGRAM_NUM] = {
+    {"secure_handshake_seconds", "Key agreement, from the first record to the keys.",
+     "kind=\"full\""},
+    {"secure_handshake_seconds", NULL, "kind=\"resumed\""},
+    {"server_request_seconds", "Protocol operations, from the request to the reply.",
+     "op=\"sign_in\""},
+    {"server_request_seconds", NULL, "op=\"sign_up\""},
+    {"server_request_seconds", NULL, "op=\"friend_add\""},
+    {"server_request_seconds", NULL, "op=\"friend_accept\""},
+    {"server_request_seconds", NULL, "op=\"friend_reject\""},
+    {"server_request_seconds", NULL, "op=\"friend_list\""},
+    {"server_request_seconds", NULL, "op=\"chat_select\""},
+    {"server_request_seconds", NULL, "op=\"message_insert\""},
+    {"server_request_seconds", NULL, "op=\"history_sync\""},
+    {"server_request_seconds", NULL, "op=\"inbox_sync\""},
+    {"database_query_seconds", "Database round trips by statement.",
+     "statement=\"create_table\""},
+    {"database_query_seconds", NULL, "statement=\"insert\""},
+    {"database_query_seconds", NULL, "statement=\"update\""},
+    {"database_query_seconds", NULL, "statement=\"select\""},
+    {"database_query_seconds", NULL, "statement=\"store_result\""},
+    {"lock_wait_seconds", "Lock acquisitions, from asking for the lock to taking it.",
+     "lock=\"queue\""},
+    {"lock_wait_seconds", NULL, "lock=\"log\""},
+    {"lock_wait_seconds", NULL, "lock=\"pool_deque\""},
+    {"lock_wait_seconds", NULL, "lock=\"pool_idle\""},
+    {"lock_wait_seconds", NULL, "lock=\"ticket\""},
+    {"lock_wait_seconds", NULL, "lock=\"keypair\""},
+    {"lock_wait_seconds", NULL, "lock=\"trace\""},
+    {"lock_wait_seconds", NULL, "lock=\"capture\""},
+    {"lock_hold_seconds", "Lock holds, from taking the lock to releasing it.",
+     "lock=\"queue\""},
+    {"lock_hold_seconds", NULL, "lock=\"log\""},
+    {"lock_hold_seconds", NULL, "lock=\"pool_deque\""},
+    {"lock_hold_seconds", NULL, "lock=\"pool_idle\""},
+    {"lock_hold_seconds", NULL, "lock=\"ticket\""},
+    {"lock_hold_seconds", NULL, "lock=\"keypair\""},
+    {"lock_hold_seconds", NULL, "lock=\"trace\""},
+    {"lock_hold_seconds", NULL, "lock=\"capture\""},
+};
+
+/* the lock metrics are left out unless lock_t counts into them */
+#ifdef LOCK_PROFILE
+#define RENDER_COUNTER_NUM      METRICS_COUNTER_NUM
+#define RENDER_HISTOGRAM_NUM    METRICS_HISTOGRAM_NUM
+#else
+#define RENDER_COUNTER_NUM      METRICS_LOCK_CONTENDED
+#define RENDER_HISTOGRAM_NUM    METRICS_LOCK_WAIT
+#endif /* LOCK_PROFILE */
+
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_block * blocks;
+static int metrics_socket = -1;
+static pthread_t metrics_thread;
+
+/* the block is left in the list for the next thread, its counts stay in the sums */
+static void _block_release(void * arg)
+{
+    struct metrics_block * block = arg;
+
+    pthread_mutex_lock(&metrics_lock);
+    block->in_use = 0;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+static void _metrics_key_init(void)
+{
+    pthread_key_create(&metrics_key, _block_release);
+}
+
+/** _block_get return value:
+ *     return the block of the calling thread, taken over or allocated on first use
+ *     return NULL if it can not be allocated
+*/
+static struct metrics_block * _block_get(void)
+{
+    struct metrics_block * block;
+
+    pthread_once(&metrics_once, _metrics_key_init);
+    block = pthread_getspecific(metrics_key);
+    if (block != NULL) {
+        return block;
+    }
+
+    pthread_mutex_lock(&metrics_lock);
+    for (block = blocks; block != NULL && block->in_use; block = block->next);
+    if (block == NULL) {
+        block = (struct metrics_block *)calloc(1, sizeof(struct metrics_block));
+        if (block != NULL) {
+            block->next = blocks;
+            blocks = block;
+        }
+    }
+    if (block != NULL) {
+        block->in_use = 1;
+    }
+    pthread_mutex_unlock(&metrics_lock);
+    pthread_setspecific(metrics_key, block);
+
+    return block;
+}
+
+/* only the owner thread writes a block, the exporter may read it at any time */
+static inline void _bump(uint64_t * value, uint64_t n)
+{
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static int _bucket(uint64_t ns)
+{
+    int exp;
+
+    if (ns < (1ULL << MIN_EXP)) {
+        return 0;
+    }
+    exp = 63 - __builtin_clzll(ns);
+    if (exp >= MAX_EXP) {
+        return BUCKET_NUM - 1;
+    }
+
+    return 1 + ((exp - MIN_EXP) << SUB_BITS) +
+           (int)((ns >> (exp - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+}
+
+/* the values of bucket i are below its bound, the last bucket has none */
+static uint64_t _bucket_bound(int i)
+{
+    int exp, sub;
+
+    if (i == 0) {
+        return 1ULL << MIN_EXP;
+    }
+    exp = MIN_EXP + ((i - 1) >> SUB_BITS);
+    sub = (i - 1) & ((1 << SUB_BITS) - 1);
+
+    return (uint64_t)((1 << SUB_BITS) + sub + 1) << (exp - SUB_BITS);
+}
+
+uint64_t metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_add(int counter, uint64_t value)
+{
+    struct metrics_block * block = _block_get();
+
+    if (block != NULL) {
+        _bump(&(block->counters[counter]), value);
+    }
+}
+
+void metrics_time(int histogram, uint64_t start)
+{
+    metrics_observe(histogram, metrics_now() - start);
+}
+
+void metrics_observe(int histogram, uint64_t ns)
+{
+    struct metrics_block * block = _block_get();
+
+    if (block != NULL) {
+        _bump(&(block->buckets[histogram][_bucket(ns)]), 1);
+        _bump(&(block->sums[histogram]), ns);
+    }
+}
+
+char * metrics_render(size_t * len)
+{
+    struct metrics_block * total;
+    struct metrics_block * block;
+    const struct metric_name * name;
+    char * buf = NULL;
+    FILE * out;
+    uint64_t count;
+
+    total = (struct metrics_block *)calloc(1, sizeof(struct metrics_block));
+    if (total == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&metrics_lock);
+    for (block = blocks; block != NULL; block = block->next) {
+        for (int c = 0; c < METRICS_COUNTER_NUM; ++c) {
+            total->counters[c] += __atomic_load_n(&(block->counters[c]), __ATOMIC_RELAXED);
+        }
+        for (int h = 0; h < METRICS_HISTOGRAM_NUM; ++h) {
+            for (int i = 0; i < BUCKET_NUM; ++i) {
+                total->buckets[h][i] += __atomic_load_n(&(block->buckets[h][i]),
+                                                        __ATOMIC_RELAXED);
+            }
+            total->sums[h] += __atomic_load_n(&(block->sums[h]), __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+
+    out = open_memstream(&buf, len);
+    if (out == NULL) {
+        free(total);
+        return NULL;
+    }
+    for (int c = 0; c < RENDER_COUNTER_NUM; ++c) {
+        name = &(counter_names[c]);
+        if (name->help != NULL) {
+            fprintf(out, "# HELP %s %s\n# TYPE %s counter\n",
+                         name->family, name->help, name->family);
+        }
+        if (name->label != NULL) {
+            fprintf(out, "%s{%s} %lu\n", name->family, name->label, total->counters[c]);
+        } else {
+            fprintf(out, "%s %lu\n", name->family, total->counters[c]);
+        }
+    }
+    for (int h = 0; h < RENDER_HISTOGRAM_NUM; ++h) {
+        name = &(histogram_names[h]);
+        if (name->help != NULL) {
+            fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n",
+                         name->family, name->help, name->family);
+        }
+        /* an observation sits in one bucket, prometheus buckets count everything up to le */
+        count = 0;
+        for (int i = 0; i < BUCKET_NUM - 1; ++i) {
+            count += total->buckets[h][i];
+            fprintf(out, "%s_bucket{%s,le=\"%.9g\"} %lu\n",
+                         name->family, name->label, _bucket_bound(i) / 1e9, count);
+        }
+        count += total->buckets[h][BUCKET_NUM - 1];
+        fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name->family, name->label, count);
+        fprintf(out, "%s_sum{%s} %.9f\n", name->family, name->label, total->sums[h] / 1e9);
+        fprintf(out, "%s_count{%s} %lu\n", name->family, name->label, count);
+    }
+    fclose(out);
+    free(total);
+
+    return buf;
+}
+
+static int _sendall(int channel, const char * buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = send(channel, buf, len, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+/** _export_routine note:
+ *     answers every connection with one HTTP/1.0 response, whatever it asks
+ *     for, the request is read to its end first, so that closing the
+ *     connection does not reset it under the response
+*/
+static void * _export_routine(void * arg)
+{
+    struct timeval tv = {1, 0};
+    char request[2048];
+    char header[256];
+    char * body;
+    size_t request_len, body_len;
+    ssize_t ret;
+    int channel;
+
+    while (1) {
+        channel = accept4(metrics_socket, NULL, NULL, SOCK_CLOEXEC);
+        if (channel == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        setsockopt(channel, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        request_len = 0;
+        do {
+            ret = recv(channel, request + request_len, sizeof(request) - 1 - request_len, 0);
+            if (ret > 0) {
+                request_len += ret;
+                request[request_len] = '\0';
+            }
+        } while (ret > 0 && request_len < sizeof(request) - 1 &&
+                 strstr(request, "\r\n\r\n") == NULL);
+
+        body = metrics_render(&body_len);
+        if (body != NULL) {
+            snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                                             "Content-Type: text/plain; version=0.0.4\r\n"
+                                             "Content-Length: %zu\r\n\r\n", body_len);
+            if (_sendall(channel, header, strlen(header)) == 0) {
+                _sendall(channel, body, body_len);
+            }
+            free(body);
+        }
+        shutdown(channel, SHUT_WR);
+        close(channel);
+    }
+
+    return NULL;
+}
+
+/** metrics_init return value:
+ *     return  0 if the exporter listens on METRICS_IP:METRICS_PORT
+ *     return -1 otherwise, the metrics are still counted
+*/
+int metrics_init(void)
+{
+    struct sockaddr_in addr;
+    int on = 1;
+
+    metrics_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (metrics_socket == -1) {
+        return -1;
+    }
+    setsockopt(metrics_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(METRICS_PORT);
+    inet_aton(METRICS_IP, &(addr.sin_addr));
+
+    if (0 != bind(metrics_socket, (struct sockaddr *)&addr, sizeof(addr)) ||
+        0 != listen(metrics_socket, 16) ||
+        0 != pthread_create(&metrics_thread, NULL, _export_routine, NULL)) {
+        close(metrics_socket);
+        metrics_socket = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the blocks stay, threads that are still running may count into them */
+void metrics_finish(void)
+{
+    if (metrics_socket != -1) {
+        /* wakes accept4 up with EINVAL */
+        shutdown(metrics_socket, SHUT_RDWR);
+        pthread_join(metrics_thread, NULL);
+        close(metrics_socket);
+        metrics_socket = -1;
+    }
+}
@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+#include "protocol.h"
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define POOL_DEQUE_INIT_SIZE        64
+
+/** _deque_push return value:
+ *     return  0 if succeed
+ *     return -1 if out of memory
+*/
+static int _deque_push(struct pool_deque * d, struct pool_task * task)
+{
+    struct pool_task ** tasks;
+    int ret = 0;
+
+    lock_acquire(&(d->lock));
+
+    if (d->size == d->capacity) {
+        tasks = (struct pool_task **)malloc(2 * d->capacity * sizeof(struct pool_task *));
+        if (tasks == NULL) {
+            ret = -1;
+        } else {
+            for (int i = 0; i < d->size; ++i) {
+                tasks[i] = d->tasks[(d->head + i) % d->capacity];
+            }
+            free(d->tasks);
+            d->tasks = tasks;
+            d->capacity *= 2;
+            d->head = 0;
+        }
+    }
+
+    if (ret == 0) {
+        d->tasks[(d->head + d->size) % d->capacity] = task;
+        (d->size)++;
+    }
+
+    lock_release(&(d->lock));
+
+    return ret;
+}
+
+/** _deque_pop note:
+ *     the owner takes the oldest task too, tasks come from sessions and not
+ *     from other tasks, so taking the newest one only starves older requests
+*/
+static struct pool_task * _deque_pop(struct pool_deque * d)
+{
+    struct pool_task * task = NULL;
+
+    lock_acquire(&(d->lock));
+
+    if (d->size > 0) {
+        task = d->tasks[d->head];
+        d->head = (d->head + 1) % d->capacity;
+        (d->size)--;
+    }
+
+    lock_release(&(d->lock));
+
+    return task;
+}
+
+static struct pool_task * _deque_steal(struct pool_deque * d)
+{
+    struct pool_task * task = NULL;
+
+    /* do not wait for a busy victim, another one may be free */
+    if (lock_try(&(d->lock))) {
+        return NULL;
+    }
+
+    if (d->size > 0) {
+        task = d->tasks[d->head];
+        d->head = (d->head + 1) % d->capacity;
+        (d->size)--;
+    }
+
+    lock_release(&(d->lock));
+
+    return task;
+}
+
+static struct pool_task * _pool_take(struct pool_worker * worker)
+{
+    struct pool * pool = worker->pool;
+    struct pool_task * task;
+    int start;
+
+    task = _deque_pop(&(worker->deque));
+
+    if (task == NULL && pool->worker_num > 1) {
+        start = rand_r(&(worker->seed)) % pool->worker_num;
+        for (int i = 0; i < pool->worker_num && task == NULL; ++i) {
+            if (&(pool->workers[(start + i) % pool->worker_num]) != worker) {
+                task = _deque_steal(&(pool->workers[(start + i) % pool->worker_num].deque));
+            }
+        }
+    }
+
+    if (task != NULL) {
+        __atomic_sub_fetch(&(pool->pending), 1, __ATOMIC_SEQ_CST);
+    }
+
+    return task;
+}
+
+static void * _pool_routine(void * arg)
+{
+    struct pool_worker * worker = arg;
+    struct pool * pool = worker->pool;
+    struct pool_task * task;
+    int exit_flag;
+
+    if (pool->worker_init != NULL) {
+        worker->data = pool->worker_init();
+    }
+
+    while (true) {
+        task = _pool_take(worker);
+        if (task != NULL) {
+            task->func(worker->data, task->arg);
+            if (task->owner == NULL) {
+                sync_event_set(&(task->done));
+            } else {
+                /* a pointer is less than PIPE_BUF, the write is atomic */
+                while (write(task->owner->fd[1], &task, sizeof(task)) == -1 && errno == EINTR) {
+                }
+            }
+            continue;
+        }
+
+        lock_acquire(&(pool->idle_lock));
+        /* pending may be negative for a moment, while a task is taken before it is counted */
+        while (__atomic_load_n(&(pool->pending), __ATOMIC_SEQ_CST) <= 0 && !pool->exit_flag) {
+            lock_wait(&(pool->idle_cond), &(pool->idle_lock));
+        }
+        exit_flag = pool->exit_flag && __atomic_load_n(&(pool->pending), __ATOMIC_SEQ_CST) <= 0;
+        lock_release(&(pool->idle_lock));
+
+        if (exit_flag) {
+            break;
+        }
+    }
+
+    if (pool->worker_finish != NULL) {
+        pool->worker_finish(worker->data);
+    }
+
+    return NULL;
+}
+
+struct pool * pool_init(int worker_num,
+                        void * (* worker_init)(void),
+                        void (* worker_finish)(void * worker_data))
+{
+    struct pool * pool;
+    struct pool_worker * worker;
+
+    pool = (struct pool *)malloc(sizeof(struct pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->workers = (struct pool_worker *)calloc(worker_num, sizeof(struct pool_worker));
+    if (pool->workers == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->worker_num = worker_num;
+    pool->worker_init = worker_init;
+    pool->worker_finish = worker_finish;
+    lock_init(&(pool->idle_lock), METRICS_LOCK_POOL_IDLE);
+    sync_cond_init(&(pool->idle_cond));
+    pool->pending = 0;
+    pool->exit_flag = 0;
+
+    for (int i = 0; i < worker_num; ++i) {
+        worker = &(pool->workers[i]);
+        worker->pool = pool;
+        worker->seed = (unsigned int)time(NULL) ^ (unsigned int)i;
+        lock_init(&(worker->deque.lock), METRICS_LOCK_POOL_DEQUE);
+        worker->deque.capacity = POOL_DEQUE_INIT_SIZE;
+        worker->deque.tasks = (struct pool_task **)malloc(POOL_DEQUE_INIT_SIZE * 
+                                                         sizeof(struct pool_task *));
+        worker->deque.head = 0;
+        worker->deque.size = 0;
+    }
+
+    for (int i = 0; i < worker_num; ++i) {
+        pthread_create(&(pool->workers[i].thread), NULL, _pool_routine, &(pool->workers[i]));
+    }
+
+    return pool;
+}
+
+void pool_task_init(struct pool_task * task,
+                    void (* func)(void * worker_data, void * arg),
+                    void * arg)
+{
+    task->func = func;
+    task->arg = arg;
+    sync_event_init(&(task->done));
+    task->then = NULL;
+    task->owner = NULL;
+}
+
+/** pool_submit return value:
+ *     return  0 if succeed
+ *     return -1 if out of memory
+*/
+int pool_submit(struct pool * pool, struct pool_task * task, unsigned int hint)
+{
+    if (0 != _deque_push(&(pool->workers[hint % pool->worker_num].deque), task)) {
+        return -1;
+    }
+
+    lock_acquire(&(pool->idle_lock));
+    __atomic_add_fetch(&(pool->pending), 1, __ATOMIC_SEQ_CST);
+    sync_cond_signal(&(pool->idle_cond));
+    lock_release(&(pool->idle_lock));
+
+    return 0;
+}
+
+void pool_wait(struct pool_task * task)
+{
+    sync_event_wait(&(task->done));
+}
+
+/** pool_owner_init return value:
+ *     return  0 if succeed
+ *     return -1 if the pipe can not be created
+*/
+int pool_owner_init(struct pool_owner * owner)
+{
+    owner->inflight = 0;
+
+    return pipe2(owner->fd, O_CLOEXEC);
+}
+
+/** pool_owner_finish note:
+ *     the owner must have no task in flight
+*/
+void pool_owner_finish(struct pool_owner * owner)
+{
+    close(owner->fd[0]);
+    close(owner->fd[1]);
+}
+
+/** pool_submit_then return value:
+ *     return  0 if succeed, then(task->arg) runs in pool_complete of owner
+ *     return -1 if out of memory
+*/
+int pool_submit_then(struct pool * pool, struct pool_task * task, unsigned int hint,
+                     struct pool_owner * owner, void (* then)(void * arg))
+{
+    task->then = then;
+    task->owner = owner;
+    if (0 != pool_submit(pool, task, hint)) {
+        task->owner = NULL;
+        return -1;
+    }
+    owner->inflight++;
+
+    return 0;
+}
+
+/** pool_complete return value:
+ *     return  0 if the continuation of a task of owner has run, it waits
+ *               for one to complete if none has (fd[0] is not readable)
+ *     return -1 if the pipe fails
+*/
+int pool_complete(struct pool_owner * owner)
+{
+    struct pool_task * task;
+    ssize_t ret;
+
+    do {
+        ret = read(owner->fd[0], &task, sizeof(task));
+    } while (ret == -1 && errno == EINTR);
+    if (ret != sizeof(task)) {
+        return -1;
+    }
+    owner->inflight--;
+    task->then(task->arg);
+
+    return 0;
+}
+
+/** pool_finish note:
+ *     tasks already submitted are run before the workers exit
+*/
+void pool_finish(struct pool * pool)
+{
+    lock_acquire(&(pool->idle_lock));
+    pool->exit_flag = 1;
+    sync_cond_broadcast(&(pool->idle_cond));
+    lock_release(&(pool->idle_lock));
+
+    for (int i = 0; i < pool->worker_num; ++i) {
+        pthread_join(pool->workers[i].thread, NULL);
+        free(pool->workers[i].deque.tasks);
+        lock_destroy(&(pool->workers[i].deque.lock));
+    }
+
+    lock_destroy(&(pool->idle_lock));
+    free(pool->workers);
+    free(pool);
+}
@@ -1,8 +1,6 @@
 #include "protocol.h"
 #include "queue.h"
 #include <stdlib.h>
-#include <pthread.h>
-#include <errno.h>
 
 struct queue * queue_init(int size)
 {
@@ -10,14 +8,14 @@ struct queue * queue_init(int size)
 
     q = (struct queue *)malloc(sizeof(struct queue));
     if (q != NULL) {
-        pthread_mutex_init(&(q->lock), NULL);
+        lock_init(&(q->lock), METRICS_LOCK_QUEUE);
         q->front = 0;
         q->rear = -1;
         q->cur_size = 0;
         q->max_size = size;
         q->data = (void **)malloc(size * sizeof(void *));
         if (q->data == NULL) {
-            pthread_mutex_destroy(&(q->lock));
+            lock_destroy(&(q->lock));
             free(q);
             q = NULL;
         }
@@ -30,13 +28,7 @@ int enqueue(struct queue * q, void * data)
 {
     int ret;
 
-#ifdef MULTICORE
-    while (pthread_mutex_trylock(&(q->lock))) {
-        if (errno != EBUSY) { return -2; }
-    }
-#else
-    pthread_mutex_lock(&(q->lock));
-#endif /* MULTICORE */
+    lock_acquire(&(q->lock));
 
     if (q->cur_size == q->max_size)
         ret = -1;
@@ -48,7 +40,7 @@ int enqueue(struct queue * q, void * data)
         ret = 0;
     }
 
-    pthread_mutex_unlock(&(q->lock));
+    lock_release(&(q->lock));
 
     return ret;
 }
@@ -57,13 +49,7 @@ void * dequeue(struct queue * q)
 {
     void * ret;
 
-#ifdef MULTICORE
-    while (pthread_mutex_trylock(&(q->lock))) {
-        if (errno != EBUSY) { return NULL; }
-    }
-#else
-    pthread_mutex_lock(&(q->lock));
-#endif /* MULTICORE */
+    lock_acquire(&(q->lock));
 
     if (q->cur_size == 0)
         ret = NULL;
@@ -74,7 +60,7 @@ void * dequeue(struct queue * q)
         (q->cur_size)--;
     }
 
-    pthread_mutex_unlock(&(q->lock));
+    lock_release(&(q->lock));
 
     return ret;
 }
@@ -82,6 +68,6 @@ void * dequeue(struct queue * q)
 void queue_finish(struct queue * q)
 {
     free(q->data);
-    pthread_mutex_destroy(&(q->lock));
+    lock_destroy(&(q->lock));
     free(q);
 }
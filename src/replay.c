@@ -0,0 +1,806 @@
+#include "protocol.h"
+#include "secure.h"
+#include "batch.h"
+#include "capture.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * usage: replay [capture] [speed] [server ip] [server port]
+ *     re-drives the sessions of a capture (SERVER_CAPTURE) against a test
+ *     server, [speed] times as fast as they were recorded (1 by default,
+ *     0 as fast as the order allows), every frame goes out in the order of
+ *     the capture, across sessions as well, one thread per session,
+ *     a thread waits for its turn and time while it reads the replies,
+ *     so latencies are those of the records the capture holds:
+ *     passwords were blanked, every user signs in (or up) with
+ *     REPLAY_PASSWORD, of the sign ins of a session only the last is sent
+ *     (the earlier ones failed), a resumed session resumes with the
+ *     ticket the user got last in the replay, or signs in if it has none,
+ *     lag is how late the frames go out, a high lag means the replay does
+ *     not keep up with [speed]
+*/
+
+#define REPLAY_PASSWORD         "replay"
+#define REPLAY_PENDING_NUM      64
+#define REPLAY_TICKET_BUCKETS   4096
+
+#define OP_HANDSHAKE_FULL       0
+#define OP_HANDSHAKE_RESUMED    1
+#define OP_SIGN_IN              2       /* until the inbox is in */
+#define OP_SIGN_UP              3
+#define OP_FRIEND_ENTER         4       /* friend mode until the friend list */
+#define OP_FRIEND_ADD           5
+#define OP_FRIEND_ACCEPT        6
+#define OP_FRIEND_REJECT        7
+#define OP_FRIEND_REFRESH       8
+#define OP_CHAT_ENTER           9
+#define OP_CHAT_SELECT          10
+#define OP_CHAT_CLOSE           11
+#define OP_CHAT_LEAVE           12
+#define OP_LAG                  13
+#define OP_NUM                  14
+
+static const char * op_names[OP_NUM] = {
+    "handshake_full", "handshake_resumed", "sign_in", "sign_up",
+    "friend_enter", "friend_add", "friend_accept", "friend_reject", "friend_refresh",
+    "chat_enter", "chat_select", "chat_close", "chat_leave", "lag"
+};
+
+#define MODE_AUTH               0
+#define MODE_MENU               1
+#define MODE_FRIEND             2
+#define MODE_CHAT               3
+
+struct frame
+{
+    struct capture_frame header;
+    unsigned char * data;       /* header.len bytes */
+    int skip;                   /* a sign in that failed */
+};
+
+struct pending
+{
+    uint32_t request_id;
+    int op;
+    double start;
+};
+
+struct session
+{
+    uint32_t id;
+    int * frames;               /* indices into frames, in order */
+    int frame_num;
+    int frame_capacity;
+
+    pthread_mutex_t lock;
+    int event;                  /* eventfd, written when the turn comes to this session */
+
+    char username[65];
+    int channel;
+    int mode;
+    struct secure_key key;
+    struct pending pendings[REPLAY_PENDING_NUM];    /* requests ids, streams in chat mode */
+    int pending_num;
+};
+
+struct ticket_entry
+{
+    char username[65];
+    struct secure_ticket ticket;
+    struct ticket_entry * next;
+};
+
+static struct frame * frames;
+static int frame_num;
+static struct session ** sessions;     /* by capture session id */
+static uint32_t session_num;
+
+static struct sockaddr_in addr;
+static double speed = 1;
+static double replay_start;
+static uint32_t turn;                   /* the frame that goes out next */
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static double * samples[OP_NUM];
+static int sample_nums[OP_NUM];
+static int sample_capacities[OP_NUM];
+static long fails[OP_NUM];
+static long messages;
+
+static pthread_mutex_t ticket_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ticket_entry * tickets[REPLAY_TICKET_BUCKETS];
+
+static pthread_mutex_t running_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t running_cond = PTHREAD_COND_INITIALIZER;
+static int running;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* when a frame taken at time (ns into the capture) goes out */
+static double due(uint64_t time)
+{
+    return (speed > 0) ? replay_start + time / 1e9 / speed : replay_start;
+}
+
+static void _sample(int op, double start)
+{
+    double * ms;
+
+    pthread_mutex_lock(&stats_lock);
+    if (sample_nums[op] == sample_capacities[op]) {
+        sample_capacities[op] = (sample_capacities[op] == 0) ? 1024 : sample_capacities[op] * 2;
+        ms = (double *)realloc(samples[op], sample_capacities[op] * sizeof(double));
+        if (ms == NULL) {
+            sample_capacities[op] = sample_nums[op];
+            pthread_mutex_unlock(&stats_lock);
+            return;
+        }
+        samples[op] = ms;
+    }
+    samples[op][sample_nums[op]++] = (now() - start) * 1e3;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void _fail(int op)
+{
+    pthread_mutex_lock(&stats_lock);
+    fails[op]++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static unsigned int _ticket_hash(const char * username)
+{
+    unsigned int hash = 5381;
+
+    while (*username != '\0') {
+        hash = hash * 33 + (unsigned char)*(username++);
+    }
+
+    return hash % REPLAY_TICKET_BUCKETS;
+}
+
+/* returns 0 and copies the last ticket of username into ticket if there is one */
+static int _ticket_get(const char * username, struct secure_ticket * ticket)
+{
+    struct ticket_entry * entry;
+    int ret = -1;
+
+    pthread_mutex_lock(&ticket_lock);
+    for (entry = tickets[_ticket_hash(username)]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->username, username) == 0) {
+            memcpy(ticket, &(entry->ticket), sizeof(*ticket));
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ticket_lock);
+
+    return ret;
+}
+
+static void _ticket_put(const char * username, const struct secure_ticket * ticket)
+{
+    struct ticket_entry * entry;
+    unsigned int hash = _ticket_hash(username);
+
+    pthread_mutex_lock(&ticket_lock);
+    for (entry = tickets[hash]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->username, username) == 0) {
+            break;
+        }
+    }
+    if (entry == NULL && (entry = (struct ticket_entry *)calloc(1, sizeof(*entry))) != NULL) {
+        strcpy(entry->username, username);
+        entry->next = tickets[hash];
+        tickets[hash] = entry;
+    }
+    if (entry != NULL) {
+        memcpy(&(entry->ticket), ticket, sizeof(*ticket));
+    }
+    pthread_mutex_unlock(&ticket_lock);
+}
+
+static void _close(struct session * s)
+{
+    if (s->channel >= 0) {
+        close(s->channel);
+    }
+    s->channel = -1;
+    s->pending_num = 0;
+}
+
+/* the frame after k may go out, its session is told */
+static void _advance(uint32_t k)
+{
+    struct session * s;
+    uint64_t one = 1;
+
+    __atomic_store_n(&turn, k + 1, __ATOMIC_RELEASE);
+    if (k + 1 < frame_num) {
+        s = sessions[frames[k + 1].header.session];
+        pthread_mutex_lock(&(s->lock));
+        if (s->event >= 0) {
+            write(s->event, &one, sizeof(one));
+        }
+        pthread_mutex_unlock(&(s->lock));
+    }
+}
+
+static void _pending_add(struct session * s, uint32_t request_id, int op)
+{
+    if (s->pending_num < REPLAY_PENDING_NUM) {
+        s->pendings[s->pending_num].request_id = request_id;
+        s->pendings[s->pending_num].op = op;
+        s->pendings[s->pending_num].start = now();
+        s->pending_num++;
+    }
+}
+
+/* the reply to request_id (a stream id in chat mode, or'ed with 0x100 for friend requests) */
+static void _pending_done(struct session * s, uint32_t request_id, int ok)
+{
+    for (int i = 0; i < s->pending_num; ++i) {
+        if (s->pendings[i].request_id == request_id) {
+            if (ok) {
+                _sample(s->pendings[i].op, s->pendings[i].start);
+            } else {
+                _fail(s->pendings[i].op);
+            }
+            s->pendings[i] = s->pendings[--s->pending_num];
+            break;
+        }
+    }
+}
+
+/* reads the ticket and the inbox that follow a sign in or a resumption */
+static int _recv_welcome(struct session * s)
+{
+    char buf[1 + SECURE_TICKET_LEN];
+    struct secure_ticket ticket;
+
+    if (secure_recv(s->channel, buf, sizeof(buf), 0, &(s->key)) <= 0 ||
+        buf[0] != PROTOCOL_TICKET) {
+        return -1;
+    }
+    secure_client_ticket(&(s->key), (unsigned char *)&(buf[1]), &ticket);
+    _ticket_put(s->username, &ticket);
+    if (batch_recv_pages(s->channel, &(s->key), 14, SERVER_INBOX_PAGE_ROWS, NULL, NULL) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/** _sign_in return value:
+ *     return  0 if signed in, in menu mode
+ *     return -1 otherwise
+ *  _sign_in note:
+ *     record is the sign in (or up) of the capture, the other one is tried
+ *     if the server turns it down, as the test server knows other users
+*/
+static int _sign_in(struct session * s, unsigned char * record)
+{
+    char buf[132];
+    double start;
+    int flag = record[0];
+    int op;
+
+    memcpy(buf, record, 132);
+    memset(&(buf[66]), 0, 65);
+    strcpy(&(buf[66]), REPLAY_PASSWORD);
+    strncpy(s->username, &(buf[1]), 64);
+
+    for (int i = 0; i < 2; ++i) {
+        op = (flag == PROTOCOL_SIGN_IN) ? OP_SIGN_IN : OP_SIGN_UP;
+        buf[0] = (char)flag;
+        start = now();
+        if (secure_send(s->channel, buf, 132, 0, &(s->key)) <= 0 ||
+            secure_recv(s->channel, buf, 2, 0, &(s->key)) <= 0) {
+            _fail(op);
+            return -1;
+        }
+        if (buf[0] == PROTOCOL_SUCCEED) {
+            if (_recv_welcome(s) != 0) {
+                _fail(op);
+                return -1;
+            }
+            _sample(op, start);
+            s->mode = MODE_MENU;
+            return 0;
+        }
+        flag = (flag == PROTOCOL_SIGN_IN) ? PROTOCOL_SIGN_UP : PROTOCOL_SIGN_IN;
+    }
+    _fail(op);
+
+    return -1;
+}
+
+/** _open return value:
+ *     return  0 if the keys are built, in menu mode if the capture resumed
+ *     return -1 otherwise
+*/
+static int _open(struct session * s, const struct frame * f, double start)
+{
+    struct secure_ticket ticket;
+    unsigned char record[132];
+    int has_ticket = 0;
+    int ret;
+
+    /* a resumed session of the capture carries the ticket state, username + codec */
+    if (f->header.len == SECURE_TICKET_STATE_LEN) {
+        memcpy(s->username, f->data, 64);
+        s->username[64] = '\0';
+        has_ticket = (_ticket_get(s->username, &ticket) == 0);
+    }
+
+    ret = secure_client_buildkey(s->channel, &(s->key), has_ticket ? &ticket : NULL);
+    if (ret < 0) {
+        _fail(has_ticket ? OP_HANDSHAKE_RESUMED : OP_HANDSHAKE_FULL);
+        return -1;
+    }
+    _sample((ret == 1) ? OP_HANDSHAKE_RESUMED : OP_HANDSHAKE_FULL, start);
+
+    s->mode = MODE_AUTH;
+    if (ret == 1) {
+        if (_recv_welcome(s) != 0) {
+            return -1;
+        }
+        s->mode = MODE_MENU;
+    } else if (f->header.len == SECURE_TICKET_STATE_LEN) {
+        /* no ticket in the replay (yet), the user signs in instead */
+        memset(record, 0, sizeof(record));
+        record[0] = PROTOCOL_SIGN_IN;
+        strcpy((char *)&(record[1]), s->username);
+        record[131] = f->data[65];
+        return _sign_in(s, record);
+    }
+
+    return 0;
+}
+
+/* reads 67-byte rows up to PROTOCOL_FRIEND_LIST_END */
+static int _recv_friendlist(struct session * s)
+{
+    char buf[128];
+    int row_len, count;
+
+    while (1) {
+        if (secure_recv(s->channel, buf, 67, 0, &(s->key)) <= 0) {
+            return -1;
+        }
+        if (buf[0] == PROTOCOL_FRIEND_LIST_END) {
+            return 0;
+        } else if (buf[0] == PROTOCOL_BATCH) {
+            free(batch_recv(s->channel, &(s->key), buf, &row_len, &count));
+            if (count < 0) {
+                return -1;
+            }
+        }
+    }
+}
+
+/** _recv_reply return value:
+ *     return  1 if it is the reply to PROTOCOL_FINISH in chat mode
+ *     return  0 if it is something else
+ *     return -1 if the connection is broken
+ *  _recv_reply note:
+ *     reads one record of friend or chat mode, a reply settles its request
+*/
+static int _recv_reply(struct session * s)
+{
+    char buf[1024];
+    int row_len, count;
+    int flag, stream_id;
+
+    if (s->mode == MODE_FRIEND) {
+        if (secure_recv(s->channel, buf, 67, 0, &(s->key)) <= 0) {
+            return -1;
+        }
+        flag = buf[0];
+        if (flag == PROTOCOL_BATCH) {
+            free(batch_recv(s->channel, &(s->key), buf, &row_len, &count));
+            return (count < 0) ? -1 : 0;
+        } else if (flag == PROTOCOL_SUCCEED || flag == PROTOCOL_FAIL || flag == PROTOCOL_ERROR ||
+                   flag == PROTOCOL_FRIEND_LIST_END) {
+            _pending_done(s, 0x100 | *((uint32_t *)(&(buf[1]))), flag != PROTOCOL_ERROR);
+        }
+        return 0;
+    } else if (s->mode == MODE_CHAT) {
+        if (secure_recv(s->channel, buf, 813, 0, &(s->key)) <= 0) {
+            return -1;
+        }
+        flag = buf[0];
+        stream_id = (unsigned char)buf[1];
+        if (flag == PROTOCOL_BATCH) {
+            free(batch_recv(s->channel, &(s->key), buf, &row_len, &count));
+            return (count < 0) ? -1 : 0;
+        } else if (flag == PROTOCOL_FINISH && stream_id == 0) {
+            return 1;
+        } else if (flag == PROTOCOL_SUCCEED || flag == PROTOCOL_FAIL || flag == PROTOCOL_ERROR ||
+                   flag == PROTOCOL_FINISH) {
+            if (stream_id == 0) {
+                _pending_done(s, 0x100 | *((uint32_t *)(&(buf[2]))), flag != PROTOCOL_ERROR);
+            } else {
+                _pending_done(s, stream_id, flag != PROTOCOL_ERROR);
+            }
+        }
+        return 0;
+    }
+
+    /* nothing comes unasked in the other modes, but the end of the connection */
+    return -1;
+}
+
+/* replays one record of the capture */
+static int _send_record(struct session * s, struct frame * f)
+{
+    unsigned char * record = f->data;
+    double start;
+    int flag = record[0];
+    int ret;
+
+    if (s->mode == MODE_AUTH) {
+        if (flag == PROTOCOL_SIGN_IN || flag == PROTOCOL_SIGN_UP) {
+            return f->skip ? 0 : _sign_in(s, record);
+        }
+        secure_send(s->channel, record, f->header.len, 0, &(s->key));
+        return -1;
+    } else if (s->mode == MODE_MENU) {
+        start = now();
+        if (secure_send(s->channel, record, f->header.len, 0, &(s->key)) <= 0) {
+            return -1;
+        }
+        if (flag == PROTOCOL_FRIEND || flag == PROTOCOL_CHAT) {
+            if (_recv_friendlist(s) != 0) {
+                _fail((flag == PROTOCOL_FRIEND) ? OP_FRIEND_ENTER : OP_CHAT_ENTER);
+                return -1;
+            }
+            _sample((flag == PROTOCOL_FRIEND) ? OP_FRIEND_ENTER : OP_CHAT_ENTER, start);
+            s->mode = (flag == PROTOCOL_FRIEND) ? MODE_FRIEND : MODE_CHAT;
+            return 0;
+        }
+        /* the disconnect */
+        return -1;
+    } else if (s->mode == MODE_FRIEND) {
+        /* the requests in flight are answered before the server leaves friend mode */
+        if (flag == PROTOCOL_FINISH) {
+            while (s->pending_num > 0) {
+                if (_recv_reply(s) < 0) {
+                    return -1;
+                }
+            }
+        } else if (flag == PROTOCOL_FRIEND_ADD || flag == PROTOCOL_FRIEND_ACCEPT ||
+                   flag == PROTOCOL_FRIEND_REJECT || flag == PROTOCOL_FRIEND_REFRESH) {
+            _pending_add(s, 0x100 | *((uint32_t *)(&(record[1]))),
+                         OP_FRIEND_ADD + (flag - PROTOCOL_FRIEND_ADD));
+        }
+        if (secure_send(s->channel, record, f->header.len, 0, &(s->key)) <= 0) {
+            return -1;
+        }
+        if (flag == PROTOCOL_FINISH) {
+            s->mode = MODE_MENU;
+        }
+        return 0;
+    }
+
+    /* chat mode */
+    if (flag == PROTOCOL_CHAT_SELECT || flag == PROTOCOL_CHAT_CLOSE) {
+        _pending_add(s, record[1], (flag == PROTOCOL_CHAT_SELECT) ? OP_CHAT_SELECT : OP_CHAT_CLOSE);
+    } else if (flag == PROTOCOL_FRIEND_ADD || flag == PROTOCOL_FRIEND_ACCEPT ||
+               flag == PROTOCOL_FRIEND_REJECT) {
+        _pending_add(s, 0x100 | *((uint32_t *)(&(record[2]))),
+                     OP_FRIEND_ADD + (flag - PROTOCOL_FRIEND_ADD));
+    } else if (flag == PROTOCOL_CHAT_MESSAGE) {
+        __atomic_add_fetch(&messages, 1, __ATOMIC_RELAXED);
+    }
+    start = now();
+    if (secure_send(s->channel, record, f->header.len, 0, &(s->key)) <= 0) {
+        return -1;
+    }
+    if (flag == PROTOCOL_FINISH) {
+        while ((ret = _recv_reply(s)) == 0);
+        if (ret < 0) {
+            _fail(OP_CHAT_LEAVE);
+            return -1;
+        }
+        _sample(OP_CHAT_LEAVE, start);
+        s->pending_num = 0;
+        s->mode = MODE_MENU;
+    }
+
+    return 0;
+}
+
+/* waits for frame k to be due and its turn, reading replies meanwhile */
+static void _wait_turn(struct session * s, uint32_t k, double when)
+{
+    struct pollfd pfds[2];
+    uint64_t value;
+    double current;
+    int timeout;
+    int ret;
+
+    while (1) {
+        current = now();
+        if (__atomic_load_n(&turn, __ATOMIC_ACQUIRE) == k && current >= when) {
+            return;
+        }
+        /* its turn has come, only the time has not */
+        if (__atomic_load_n(&turn, __ATOMIC_ACQUIRE) == k) {
+            timeout = (int)((when - current) * 1e3) + 1;
+        } else {
+            timeout = -1;
+        }
+
+        pfds[0].fd = s->event;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = s->channel;
+        pfds[1].events = POLLIN;
+        ret = poll(pfds, (s->channel >= 0) ? 2 : 1, timeout);
+        if (ret > 0 && pfds[0].revents != 0) {
+            read(s->event, &value, sizeof(value));
+        }
+        if (ret > 0 && s->channel >= 0 && pfds[1].revents != 0 && _recv_reply(s) < 0) {
+            _close(s);
+        }
+    }
+}
+
+static void * session_routine(void * arg)
+{
+    struct session * s = arg;
+    struct frame * f;
+    double when, start;
+    uint32_t k;
+    int on = 1;
+
+    pthread_mutex_lock(&(s->lock));
+    s->event = eventfd(0, EFD_NONBLOCK);
+    pthread_mutex_unlock(&(s->lock));
+    s->channel = -1;
+
+    for (int i = 0; i < s->frame_num; ++i) {
+        k = s->frames[i];
+        f = &(frames[k]);
+        when = due(f->header.time);
+        _wait_turn(s, k, when);
+        _sample(OP_LAG, when);
+
+        if (f->header.type == CAPTURE_OPEN) {
+            start = now();
+            s->channel = socket(AF_INET, SOCK_STREAM, 0);
+            setsockopt(s->channel, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            if (connect(s->channel, (struct sockaddr *)&(addr), sizeof(addr)) != 0) {
+                _fail(OP_HANDSHAKE_FULL);
+                _close(s);
+            } else {
+                fcntl(s->channel, F_SETFL, fcntl(s->channel, F_GETFL) | O_NONBLOCK);
+            }
+            /* the others go on while the keys are built, the order is that of connect() */
+            _advance(k);
+            if (s->channel >= 0 && _open(s, f, start) != 0) {
+                _close(s);
+            }
+            continue;
+        }
+
+        if (f->header.type == CAPTURE_RECORD && s->channel >= 0) {
+            if (_send_record(s, f) != 0) {
+                _close(s);
+            }
+        } else if (f->header.type == CAPTURE_CLOSE) {
+            _close(s);
+        }
+        _advance(k);
+    }
+    _close(s);
+
+    pthread_mutex_lock(&(s->lock));
+    close(s->event);
+    s->event = -1;
+    pthread_mutex_unlock(&(s->lock));
+
+    pthread_mutex_lock(&running_lock);
+    running--;
+    pthread_cond_signal(&running_cond);
+    pthread_mutex_unlock(&running_lock);
+
+    return NULL;
+}
+
+/** load return value:
+ *     return  0 if every frame of filename is in frames and sessions
+ *     return -1 otherwise
+*/
+static int load(const char * filename)
+{
+    struct capture_frame header;
+    struct session * s;
+    char magic[8];
+    int capacity = 0;
+    int * last_sign_in;
+    FILE * file;
+
+    file = fopen(filename, "r");
+    if (file == NULL || fread(magic, 1, 8, file) != 8 || memcmp(magic, CAPTURE_MAGIC, 8) != 0) {
+        fprintf(stderr, "replay: %s is no capture\n", filename);
+        if (file != NULL) {
+            fclose(file);
+        }
+        return -1;
+    }
+
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        if (frame_num == capacity) {
+            capacity = (capacity == 0) ? 4096 : capacity * 2;
+            frames = (struct frame *)realloc(frames, capacity * sizeof(struct frame));
+        }
+        frames[frame_num].header = header;
+        frames[frame_num].data = (unsigned char *)calloc(1, header.len + 1);
+        frames[frame_num].skip = 0;
+        /* a session cut short by the end of the capture is left out */
+        if (header.stored > header.len ||
+            fread(frames[frame_num].data, 1, header.stored, file) != header.stored) {
+            free(frames[frame_num].data);
+            break;
+        }
+        if (header.session > session_num) {
+            session_num = header.session;
+        }
+        frame_num++;
+    }
+    fclose(file);
+
+    sessions = (struct session **)calloc(session_num + 1, sizeof(struct session *));
+    last_sign_in = (int *)malloc((session_num + 1) * sizeof(int));
+    for (int i = 0; i < frame_num; ++i) {
+        s = sessions[frames[i].header.session];
+        if (s == NULL) {
+            s = (struct session *)calloc(1, sizeof(struct session));
+            s->id = frames[i].header.session;
+            s->event = -1;
+            pthread_mutex_init(&(s->lock), NULL);
+            sessions[s->id] = s;
+            last_sign_in[s->id] = -1;
+        }
+        if (s->frame_num == s->frame_capacity) {
+            s->frame_capacity = (s->frame_capacity == 0) ? 16 : s->frame_capacity * 2;
+            s->frames = (int *)realloc(s->frames, s->frame_capacity * sizeof(int));
+        }
+        s->frames[s->frame_num++] = i;
+
+        /* a sign in followed by another one failed */
+        if (frames[i].header.type == CAPTURE_RECORD && frames[i].header.len == 132 &&
+            (frames[i].data[0] == PROTOCOL_SIGN_IN || frames[i].data[0] == PROTOCOL_SIGN_UP)) {
+            if (last_sign_in[s->id] >= 0) {
+                frames[last_sign_in[s->id]].skip = 1;
+            }
+            last_sign_in[s->id] = i;
+        }
+    }
+    free(last_sign_in);
+
+    return 0;
+}
+
+static int compare(const void * a, const void * b)
+{
+    double x = *((const double *)a);
+    double y = *((const double *)b);
+
+    return (x > y) - (x < y);
+}
+
+static void report(double seconds)
+{
+    int n;
+
+    printf("%-18s %9s %7s %9s %9s %9s %9s %9s\n",
+           "", "samples", "fail", "per_s", "p50_ms", "p90_ms", "p99_ms", "max_ms");
+    for (int op = 0; op < OP_NUM; ++op) {
+        n = sample_nums[op];
+        if (n == 0 && fails[op] == 0) {
+            continue;
+        }
+        printf("%-18s %9d %7ld %9.1f", op_names[op], n, fails[op], n / seconds);
+        if (n > 0) {
+            qsort(samples[op], n, sizeof(double), compare);
+            printf(" %9.3f %9.3f %9.3f %9.3f", samples[op][n / 2], samples[op][(int)(n * 0.9)],
+                   samples[op][(int)(n * 0.99)], samples[op][n - 1]);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    struct rlimit limit;
+    pthread_attr_t attr;
+    pthread_t thread;
+    struct session * s;
+    double seconds;
+    int session_count = 0;
+
+    if (argc < 2 || argc > 5) {
+        fprintf(stderr, "usage: %s [capture] [speed] [server ip] [server port]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2) {
+        speed = atof(argv[2]);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((argc > 4) ? (unsigned short)atoi(argv[4]) : SERVER_PORT);
+    if (inet_aton((argc > 3) ? argv[3] : SERVER_IP, &(addr.sin_addr)) == 0 || speed < 0 ||
+        load(argv[1]) != 0) {
+        fprintf(stderr, "usage: %s [capture] [speed] [server ip] [server port]\n", argv[0]);
+        return 1;
+    }
+
+    /* a channel and an eventfd per session */
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    secure_client_init();
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 256 << 10);
+
+    /* a session starts when its first frame is due, they wait for their turns */
+    replay_start = now();
+    for (int i = 0; i < frame_num; ++i) {
+        s = sessions[frames[i].header.session];
+        if (s->frames[0] != i) {
+            continue;
+        }
+        while (now() < due(frames[i].header.time)) {
+            usleep((useconds_t)((due(frames[i].header.time) - now()) * 1e6) + 1);
+        }
+        pthread_mutex_lock(&running_lock);
+        running++;
+        pthread_mutex_unlock(&running_lock);
+        if (pthread_create(&thread, &attr, session_routine, s) != 0) {
+            fprintf(stderr, "replay: can not start session %u\n", s->id);
+            return 1;
+        }
+        session_count++;
+    }
+    pthread_mutex_lock(&running_lock);
+    while (running > 0) {
+        pthread_cond_wait(&running_cond, &running_lock);
+    }
+    pthread_mutex_unlock(&running_lock);
+    seconds = now() - replay_start;
+
+    printf("%d sessions, %d frames, %ld messages, captured over %.1f s, replayed in %.1f s "
+           "at %gx\n", session_count, frame_num, messages,
+           (frame_num > 0) ? frames[frame_num - 1].header.time / 1e9 : 0.0, seconds, speed);
+    report(seconds);
+
+    pthread_attr_destroy(&attr);
+    secure_client_finish();
+
+    return 0;
+}
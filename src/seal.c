@@ -0,0 +1,313 @@
+#include "seal.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+#define SEAL_TARGET __attribute__((target("aes,pclmul,sse4.1")))
+
+struct lane
+{
+    struct seal_record * record;
+    size_t off;
+    uint32_t counter;       /* of the next block, block 1 is the tag mask E(K, J0) */
+    __m128i nonce;          /* the counter block with the counter left 0 */
+    const __m128i * h;      /* H^1 .. H^SEAL_GHASH_BLOCKS */
+    __m128i y;              /* GHASH so far, byte reversed */
+    __m128i pending[SEAL_GHASH_BLOCKS];     /* ciphertext blocks not in y yet */
+    int pending_num;
+    __m128i mask;
+};
+
+int seal_available(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+}
+
+/* the two halves of an AES-256 key expansion step */
+SEAL_TARGET static inline __m128i _expand_even(__m128i t1, __m128i t2)
+{
+    __m128i t4;
+
+    t2 = _mm_shuffle_epi32(t2, 0xff);
+    t4 = _mm_slli_si128(t1, 4);
+    t1 = _mm_xor_si128(t1, t4);
+    t4 = _mm_slli_si128(t4, 4);
+    t1 = _mm_xor_si128(t1, t4);
+    t4 = _mm_slli_si128(t4, 4);
+    t1 = _mm_xor_si128(t1, t4);
+
+    return _mm_xor_si128(t1, t2);
+}
+
+SEAL_TARGET static inline __m128i _expand_odd(__m128i t1, __m128i t3)
+{
+    __m128i t2, t4;
+
+    t2 = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(t1, 0x00), 0xaa);
+    t4 = _mm_slli_si128(t3, 4);
+    t3 = _mm_xor_si128(t3, t4);
+    t4 = _mm_slli_si128(t4, 4);
+    t3 = _mm_xor_si128(t3, t4);
+    t4 = _mm_slli_si128(t4, 4);
+    t3 = _mm_xor_si128(t3, t4);
+
+    return _mm_xor_si128(t3, t2);
+}
+
+/* carry-less product of two byte reversed blocks, added to the unreduced lo || hi */
+SEAL_TARGET static inline void _clmul(__m128i a, __m128i b, __m128i * lo, __m128i * hi)
+{
+    __m128i mid;
+
+    mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+    *lo = _mm_xor_si128(*lo, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00), 
+                                           _mm_slli_si128(mid, 8)));
+    *hi = _mm_xor_si128(*hi, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11), 
+                                           _mm_srli_si128(mid, 8)));
+}
+
+/* lo || hi modulo x^128 + x^7 + x^2 + x + 1 */
+SEAL_TARGET static inline __m128i _reduce(__m128i lo, __m128i hi)
+{
+    __m128i t7, t8, t9;
+
+    /* the product is bit reflected, shift it left by one */
+    t7 = _mm_srli_epi32(lo, 31);
+    t8 = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4);
+    t7 = _mm_slli_si128(t7, 4);
+    lo = _mm_or_si128(lo, t7);
+    hi = _mm_or_si128(hi, t8);
+    hi = _mm_or_si128(hi, t9);
+
+    t7 = _mm_slli_epi32(lo, 31);
+    t8 = _mm_slli_epi32(lo, 30);
+    t9 = _mm_slli_epi32(lo, 25);
+    t7 = _mm_xor_si128(t7, t8);
+    t7 = _mm_xor_si128(t7, t9);
+    t8 = _mm_srli_si128(t7, 4);
+    t7 = _mm_slli_si128(t7, 12);
+    lo = _mm_xor_si128(lo, t7);
+    t9 = _mm_srli_epi32(lo, 1);
+    t9 = _mm_xor_si128(t9, _mm_srli_epi32(lo, 2));
+    t9 = _mm_xor_si128(t9, _mm_srli_epi32(lo, 7));
+    t9 = _mm_xor_si128(t9, t8);
+    lo = _mm_xor_si128(lo, t9);
+
+    return _mm_xor_si128(hi, lo);
+}
+
+SEAL_TARGET static inline __m128i _gfmul(__m128i a, __m128i b)
+{
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+
+    _clmul(a, b, &lo, &hi);
+
+    return _reduce(lo, hi);
+}
+
+SEAL_TARGET static inline __m128i _reverse(__m128i x)
+{
+    return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+SEAL_TARGET void seal_key_init(struct seal_key * key, const unsigned char * raw)
+{
+    __m128i * rk = (__m128i *)key->round_keys;
+    __m128i * hs = (__m128i *)key->h;
+    __m128i t1, t3, h;
+
+    t1 = _mm_loadu_si128((const __m128i *)raw);
+    t3 = _mm_loadu_si128((const __m128i *)(raw + 16));
+    rk[0] = t1;
+    rk[1] = t3;
+    /* aeskeygenassist takes its round constant as an immediate */
+    t1 = _expand_even(t1, _mm_aeskeygenassist_si128(t3, 0x01));
+    rk[2] = t1;
+    rk[3] = t3 = _expand_odd(t1, t3);
+    t1 = _expand_even(t1, _mm_aeskeygenassist_si128(t3, 0x02));
+    rk[4] = t1;
+    rk[5] = t3 = _expand_odd(t1, t3);
+    t1 = _expand_even(t1, _mm_aeskeygenassist_si128(t3, 0x04));
+    rk[6] = t1;
+    rk[7] = t3 = _expand_odd(t1, t3);
+    t1 = _expand_even(t1, _mm_aeskeygenassist_si128(t3, 0x08));
+    rk[8] = t1;
+    rk[9] = t3 = _expand_odd(t1, t3);
+    t1 = _expand_even(t1, _mm_aeskeygenassist_si128(t3, 0x10));
+    rk[10] = t1;
+    rk[11] = t3 = _expand_odd(t1, t3);
+    t1 = _expand_even(t1, _mm_aeskeygenassist_si128(t3, 0x20));
+    rk[12] = t1;
+    rk[13] = t3 = _expand_odd(t1, t3);
+    t1 = _expand_even(t1, _mm_aeskeygenassist_si128(t3, 0x40));
+    rk[14] = t1;
+
+    h = _mm_xor_si128(_mm_setzero_si128(), rk[0]);
+    for (int r = 1; r < 14; ++r) {
+        h = _mm_aesenc_si128(h, rk[r]);
+    }
+    h = _mm_aesenclast_si128(h, rk[14]);
+    hs[0] = _reverse(h);
+    for (int i = 1; i < SEAL_GHASH_BLOCKS; ++i) {
+        hs[i] = _gfmul(hs[i - 1], hs[0]);
+    }
+}
+
+static void _lane_start(struct lane * lane, struct seal_record * record)
+{
+    unsigned char block[16];
+
+    memcpy(block, record->nonce, 12);
+    memset(block + 12, 0, 4);
+    lane->record = record;
+    lane->off = 0;
+    lane->counter = 1;
+    lane->nonce = _mm_loadu_si128((const __m128i *)block);
+    lane->h = (const __m128i *)record->key->h;
+    lane->y = _mm_setzero_si128();
+    lane->pending_num = 0;
+}
+
+/* folds the pending blocks into y with one reduction: y = (y + P1) H^k + P2 H^(k-1) + .. + Pk H */
+SEAL_TARGET static inline void _lane_ghash(struct lane * lane)
+{
+    __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+    int k = lane->pending_num;
+
+    _clmul(_mm_xor_si128(lane->y, lane->pending[0]), lane->h[k - 1], &lo, &hi);
+    for (int i = 1; i < k; ++i) {
+        _clmul(lane->pending[i], lane->h[k - 1 - i], &lo, &hi);
+    }
+    lane->y = _reduce(lo, hi);
+    lane->pending_num = 0;
+}
+
+/** seal_batch note:
+ *     every round takes one block of each lane, the first block of a
+ *     record is its tag mask, the others its keystream, a lane whose
+ *     record is done takes the next record, idle lanes run on the key of
+ *     the first record and are thrown away
+*/
+SEAL_TARGET void seal_batch(struct seal_record * records, int num)
+{
+    struct lane lanes[SEAL_LANES];
+    const __m128i * rk[SEAL_LANES];
+    __m128i b[SEAL_LANES];
+    unsigned char block[16];
+    struct lane * lane;
+    struct seal_record * record;
+    __m128i c;
+    size_t n;
+    int next = 0, active = 0;
+
+    if (num == 0) {
+        return;
+    }
+    for (int l = 0; l < SEAL_LANES; ++l) {
+        lanes[l].record = NULL;
+        if (next < num) {
+            _lane_start(&(lanes[l]), &(records[next++]));
+            active++;
+        }
+    }
+
+    while (active > 0) {
+        for (int l = 0; l < SEAL_LANES; ++l) {
+            lane = &(lanes[l]);
+            if (lane->record == NULL) {
+                rk[l] = (const __m128i *)records[0].key->round_keys;
+                b[l] = _mm_setzero_si128();
+                continue;
+            }
+            rk[l] = (const __m128i *)lane->record->key->round_keys;
+            b[l] = _mm_insert_epi32(lane->nonce, (int)__builtin_bswap32(lane->counter), 3);
+        }
+
+        /* SEAL_LANES independent blocks through every round */
+        for (int l = 0; l < SEAL_LANES; ++l) {
+            b[l] = _mm_xor_si128(b[l], rk[l][0]);
+        }
+        for (int r = 1; r < 14; ++r) {
+            b[0] = _mm_aesenc_si128(b[0], rk[0][r]);
+            b[1] = _mm_aesenc_si128(b[1], rk[1][r]);
+            b[2] = _mm_aesenc_si128(b[2], rk[2][r]);
+            b[3] = _mm_aesenc_si128(b[3], rk[3][r]);
+            b[4] = _mm_aesenc_si128(b[4], rk[4][r]);
+            b[5] = _mm_aesenc_si128(b[5], rk[5][r]);
+            b[6] = _mm_aesenc_si128(b[6], rk[6][r]);
+            b[7] = _mm_aesenc_si128(b[7], rk[7][r]);
+        }
+        for (int l = 0; l < SEAL_LANES; ++l) {
+            b[l] = _mm_aesenclast_si128(b[l], rk[l][14]);
+        }
+
+        for (int l = 0; l < SEAL_LANES; ++l) {
+            lane = &(lanes[l]);
+            record = lane->record;
+            if (record == NULL) {
+                continue;
+            }
+            if (lane->counter == 1) {
+                lane->mask = b[l];
+            } else {
+                n = record->len - lane->off;
+                if (n >= 16) {
+                    n = 16;
+                    c = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(record->in + lane->off)),
+                                      b[l]);
+                    _mm_storeu_si128((__m128i *)(record->out + lane->off), c);
+                } else {
+                    /* the last block is padded with zeros for GHASH */
+                    memset(block, 0, 16);
+                    memcpy(block, record->in + lane->off, n);
+                    c = _mm_xor_si128(_mm_loadu_si128((const __m128i *)block), b[l]);
+                    _mm_storeu_si128((__m128i *)block, c);
+                    memcpy(record->out + lane->off, block, n);
+                    memset(block + n, 0, 16 - n);
+                    c = _mm_loadu_si128((const __m128i *)block);
+                }
+                lane->pending[lane->pending_num++] = _reverse(c);
+                lane->off += n;
+                if (lane->pending_num == SEAL_GHASH_BLOCKS || lane->off == record->len) {
+                    _lane_ghash(lane);
+                }
+            }
+            lane->counter++;
+
+            if (lane->off == record->len) {
+                /* the length block, no AAD, bit length of the ciphertext */
+                c = _mm_set_epi64x(0, (long long)record->len * 8);
+                lane->y = _gfmul(_mm_xor_si128(lane->y, c), lane->h[0]);
+                _mm_storeu_si128((__m128i *)(record->out + record->len),
+                                 _mm_xor_si128(_reverse(lane->y), lane->mask));
+                if (next < num) {
+                    _lane_start(lane, &(records[next++]));
+                } else {
+                    lane->record = NULL;
+                    active--;
+                }
+            }
+        }
+    }
+}
+#else
+int seal_available(void)
+{
+    return 0;
+}
+
+void seal_key_init(struct seal_key * key, const unsigned char * raw)
+{
+}
+
+void seal_batch(struct seal_record * records, int num)
+{
+}
+#endif
@@ -1,5 +1,12 @@
+#define _GNU_SOURCE
 #include "protocol.h"
 #include "secure.h"
+#include "pool.h"
+#include "metrics.h"
+#include "lock.h"
+#include "sync.h"
+#include "trace.h"
+#include "seal.h"
 #include <openssl/rand.h>
 #include <openssl/dh.h>
 #include <openssl/bn.h>
@@ -8,25 +15,66 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#include <limits.h>
+#include <poll.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#ifdef __aarch64__
+#include <sys/auxv.h>
+#endif
+#ifdef SECURE_IO_URING
+#include <liburing.h>
+#endif
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 static char * dh_parameter_p;
 static int dh_parameter_g = DH_GENERATOR_2;
 
+/* a non-blocking channel waits here until it is ready again */
+static void _wait(int channel, short events)
+{
+    struct pollfd pfd;
+
+    pfd.fd = channel;
+    pfd.events = events;
+    poll(&pfd, 1, -1);
+}
+
+/* a peer that goes away fails the send instead of raising SIGPIPE */
 static ssize_t _sendall(int channel, const void * buf, size_t len, int flags)
 {
     ssize_t total_send_len, ret;
+    uint64_t start;
 
+    start = trace_begin();
     total_send_len = 0;
     while (total_send_len < len)
     {
-        ret = send(channel, buf + total_send_len, len - total_send_len, flags);
+        ret = send(channel, buf + total_send_len, len - total_send_len, flags | MSG_NOSIGNAL);
         if (ret >= 0)
             total_send_len += ret;
-        else if (errno != EINTR)
-            return -1;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            _wait(channel, POLLOUT);
+        else if (errno != EINTR) {
+            total_send_len = -1;
+            break;
+        }
     }
+    trace_end("send", start);
 
     return total_send_len;
 }
@@ -34,67 +82,862 @@ static ssize_t _sendall(int channel, const void * buf, size_t len, int flags)
 static ssize_t _recvall(int channel, void * buf, size_t len, int flags)
 {
     ssize_t total_recv_len, ret;
+    uint64_t start;
 
+    start = trace_begin();
     total_recv_len = 0;
     while (total_recv_len < len)
     {
         ret = recv(channel, buf + total_recv_len, len - total_recv_len, flags);
         if (ret > 0)
             total_recv_len += ret;
-        else if (ret == 0)
+        else if (ret == 0) {
+            total_recv_len = 0;
+            break;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            _wait(channel, POLLIN);
+        else if (errno != EINTR) {
+            total_recv_len = -1;
+            break;
+        }
+    }
+    trace_end("recv", start);
+
+    return total_recv_len;
+}
+
+/* sends every byte of records with sendmsg, advancing records past what went out */
+static ssize_t _sendmsgall(int channel, struct iovec * records, int count, int flags)
+{
+    struct msghdr msg;
+    ssize_t total_send_len, ret;
+    uint64_t start;
+
+    start = trace_begin();
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = records;
+    total_send_len = 0;
+    while (count > 0)
+    {
+        msg.msg_iovlen = (count < IOV_MAX) ? count : IOV_MAX;
+        ret = sendmsg(channel, &msg, flags | MSG_NOSIGNAL);
+        if (ret >= 0) {
+            total_send_len += ret;
+            while (count > 0 && ret >= msg.msg_iov->iov_len) {
+                ret -= msg.msg_iov->iov_len;
+                msg.msg_iov++;
+                count--;
+            }
+            if (count > 0) {
+                msg.msg_iov->iov_base += ret;
+                msg.msg_iov->iov_len -= ret;
+            }
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            _wait(channel, POLLOUT);
+        else if (errno != EINTR) {
+            total_send_len = -1;
+            break;
+        }
+    }
+    trace_end("send", start);
+
+    return total_send_len;
+}
+
+#ifdef SECURE_IO_URING
+/**
+ * io_uring backend:
+ *     every thread owns a ring and one registered buffer, cut into
+ *     SECURE_URING_DEPTH send slots and one receive slot of
+ *     SECURE_URING_SLOT_SIZE bytes, records are encrypted into a send slot,
+ *     the records a thread sends to one channel in a row share the slot,
+ *     a slot turns into one fixed-buffer write queued on the ring, which is
+ *     submitted
+ *         by the next record sent without MSG_MORE, without waiting for it,
+ *         unless the thread is corked (secure_cork),
+ *         by the next receive, in the same io_uring_enter as its read,
+ *         by secure_flush, which waits until it is written,
+ *     so a corked thread that sends to up to SECURE_URING_DEPTH channels and
+ *     then receives enters the kernel once for all of it,
+ *     completions are reaped when a slot is needed or the thread waits
+ *     anyway, a write that comes back short (or with EAGAIN) is finished with
+ *     send right there, which keeps the order because a channel has one slot
+ *     in flight at a time, a write that fails fails the next send or receive
+ *     on its channel,
+ *     a thread whose ring cannot be set up (old kernel, seccomp, memlock
+ *     limit) takes the poll path, and so do records larger than a slot,
+ *     small AES-GCM records are copied into the slot and sealed there in
+ *     one seal_batch call for every slot right before the kernel sees them
+*/
+#define URING_SLOT_FREE         0
+#define URING_SLOT_FILLING      1
+#define URING_SLOT_BUSY         2       /* queued or in flight */
+
+struct uring_slot
+{
+    int state;
+    int channel;
+    size_t len;
+    struct seal_key key;    /* of the records in seals, expanded when the key changes */
+    unsigned char raw_key[32];
+    int key_ready;
+};
+
+struct uring_state
+{
+    struct io_uring ring;
+    unsigned char * buf;
+    struct uring_slot slots[SECURE_URING_DEPTH];
+    int filling;            /* the slot records are appended to, -1 for none */
+    int queued;             /* sqes not submitted yet */
+    int busy;               /* slots queued or in flight */
+    int corked;
+    int read_done;          /* the read in flight has completed with read_res */
+    int read_res;
+    int failed_channel;     /* a write on it has failed with failed_errno, -1 for none */
+    int failed_errno;
+    struct seal_record seals[SECURE_SEAL_BATCH];    /* plaintext in the slots, sealed in place */
+    int seal_num;
+};
+
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t uring_key;
+static char uring_unavailable;
+
+static int _uring_drain(struct uring_state * uring);
+
+static void _uring_free(void * arg)
+{
+    struct uring_state * uring = arg;
+
+    if (uring != (void *)&uring_unavailable) {
+        _uring_drain(uring);
+        io_uring_queue_exit(&(uring->ring));
+        OPENSSL_cleanse(uring->slots, sizeof(uring->slots));
+        free(uring->buf);
+        free(uring);
+    }
+}
+
+static void _uring_key_init(void)
+{
+    pthread_key_create(&uring_key, _uring_free);
+}
+
+/** _uring_get return value:
+ *     return the ring of the calling thread, set up on first use
+ *     return NULL if io_uring is not available to this thread
+*/
+static struct uring_state * _uring_get(void)
+{
+    struct uring_state * uring;
+    struct iovec iov;
+
+    pthread_once(&uring_once, _uring_key_init);
+    uring = pthread_getspecific(uring_key);
+    if (uring == (void *)&uring_unavailable) {
+        return NULL;
+    } else if (uring != NULL) {
+        return uring;
+    }
+
+    iov.iov_len = (SECURE_URING_DEPTH + 1) * SECURE_URING_SLOT_SIZE;
+    uring = (struct uring_state *)calloc(1, sizeof(struct uring_state));
+    if (uring == NULL || 
+        posix_memalign((void **)&(uring->buf), 4096, iov.iov_len) != 0) {
+        free(uring);
+        pthread_setspecific(uring_key, &uring_unavailable);
+        return NULL;
+    }
+    /* every slot and the read may be queued at once */
+    if (io_uring_queue_init(2 * SECURE_URING_DEPTH, &(uring->ring), 0) < 0) {
+        free(uring->buf);
+        free(uring);
+        pthread_setspecific(uring_key, &uring_unavailable);
+        return NULL;
+    }
+    iov.iov_base = uring->buf;
+    if (io_uring_register_buffers(&(uring->ring), &iov, 1) < 0) {
+        io_uring_queue_exit(&(uring->ring));
+        free(uring->buf);
+        free(uring);
+        pthread_setspecific(uring_key, &uring_unavailable);
+        return NULL;
+    }
+    uring->filling = -1;
+    uring->failed_channel = -1;
+    pthread_setspecific(uring_key, uring);
+
+    return uring;
+}
+
+/* slot SECURE_URING_DEPTH is the receive slot */
+static unsigned char * _uring_slot_buf(struct uring_state * uring, int slot)
+{
+    return uring->buf + (size_t)slot * SECURE_URING_SLOT_SIZE;
+}
+
+/* return -1 with the errno of a write that has failed on channel since the last call */
+static int _uring_failed(struct uring_state * uring, int channel)
+{
+    if (uring->failed_channel != channel) {
+        return 0;
+    }
+    uring->failed_channel = -1;
+    errno = uring->failed_errno;
+
+    return -1;
+}
+
+/* seals the records put into the slots since the last submission */
+static void _uring_seal(struct uring_state * uring)
+{
+    uint64_t start;
+
+    if (uring->seal_num == 0) {
+        return;
+    }
+    start = trace_begin();
+    seal_batch(uring->seals, uring->seal_num);
+    trace_end("seal", start);
+    uring->seal_num = 0;
+}
+
+/* one io_uring_enter for whatever is queued, waits for wait_nr completions */
+static int _uring_submit(struct uring_state * uring, unsigned wait_nr)
+{
+    int ret;
+
+    if (uring->queued == 0 && wait_nr == 0) {
+        return 0;
+    }
+    _uring_seal(uring);
+    ret = io_uring_submit_and_wait(&(uring->ring), wait_nr);
+    if (ret < 0 && ret != -EINTR) {
+        errno = -ret;
+        return -1;
+    }
+    uring->queued = 0;
+
+    return 0;
+}
+
+/* a write frees its slot, the read leaves its result in read_res */
+static void _uring_complete(struct uring_state * uring, struct io_uring_cqe * cqe)
+{
+    struct uring_slot * slot = io_uring_cqe_get_data(cqe);
+    int res = cqe->res;
+    int err = 0;
+    size_t done;
+
+    io_uring_cqe_seen(&(uring->ring), cqe);
+    if (slot == NULL) {
+        uring->read_res = res;
+        uring->read_done = 1;
+        return;
+    }
+
+    if (res < 0 && res != -EAGAIN && res != -EINTR) {
+        err = -res;
+    } else {
+        done = (res > 0) ? res : 0;
+        if (done < slot->len && 
+            _sendall(slot->channel, _uring_slot_buf(uring, slot - uring->slots) + done, 
+                     slot->len - done, 0) < 0) {
+            err = errno;
+        }
+    }
+    if (err != 0) {
+        uring->failed_channel = slot->channel;
+        uring->failed_errno = err;
+    }
+    slot->state = URING_SLOT_FREE;
+    slot->len = 0;
+    uring->busy--;
+}
+
+/* reaps the completions there are, enters the kernel for one first if wait is set and there are none */
+static int _uring_reap(struct uring_state * uring, int wait)
+{
+    struct io_uring_cqe * cqe;
+
+    while (1) {
+        if (io_uring_peek_cqe(&(uring->ring), &cqe) == 0) {
+            _uring_complete(uring, cqe);
+            wait = 0;
+        } else if (!wait) {
             return 0;
-        else if (errno != EINTR)
+        } else if (_uring_submit(uring, 1) < 0) {
             return -1;
+        }
+    }
+}
+
+/* submits whatever is queued and waits until every write of the thread has completed */
+static int _uring_wait_all(struct uring_state * uring)
+{
+    uint64_t start;
+    int ret = 0;
+
+    if (uring->busy == 0) {
+        return 0;
+    }
+    start = trace_begin();
+    /* one io_uring_enter for all of them unless a write blocks */
+    ret = _uring_reap(uring, 0);
+    if (ret == 0 && uring->busy > 0) {
+        ret = _uring_submit(uring, uring->busy);
+    }
+    while (ret == 0 && uring->busy > 0) {
+        ret = _uring_reap(uring, 1);
+    }
+    trace_end("send", start);
+
+    return ret;
+}
+
+/* turns the slot being filled into a write queued on the ring */
+static int _uring_queue(struct uring_state * uring)
+{
+    struct uring_slot * slot;
+    struct io_uring_sqe * sqe;
+
+    if (uring->filling < 0) {
+        return 0;
     }
+    slot = &(uring->slots[uring->filling]);
+    uring->filling = -1;
+
+    for (int i = 0; i < SECURE_URING_DEPTH; ++i) {
+        if (uring->slots[i].state == URING_SLOT_BUSY && uring->slots[i].channel == slot->channel) {
+            if (_uring_wait_all(uring) < 0) {
+                slot->state = URING_SLOT_FREE;
+                slot->len = 0;
+                return -1;
+            }
+            break;
+        }
+    }
+
+    sqe = io_uring_get_sqe(&(uring->ring));
+    io_uring_prep_write_fixed(sqe, slot->channel, _uring_slot_buf(uring, slot - uring->slots), 
+                              slot->len, 0, 0);
+    io_uring_sqe_set_data(sqe, slot);
+    slot->state = URING_SLOT_BUSY;
+    uring->queued++;
+    uring->busy++;
+
+    return 0;
+}
+
+/* the poll path must not overtake what the thread has queued */
+static int _uring_drain(struct uring_state * uring)
+{
+    if (_uring_queue(uring) < 0) {
+        return -1;
+    }
+
+    return _uring_wait_all(uring);
+}
+
+/** _uring_take return value:
+ *     return room for len bytes of records to channel in the slot being
+ *            filled, a new slot is taken (waiting for one if none is free)
+ *            when the channel changes or the slot is full
+ *     return NULL if the ring fails
+*/
+static unsigned char * _uring_take(struct uring_state * uring, int channel, size_t len)
+{
+    struct uring_slot * slot;
+
+    if (uring->filling >= 0) {
+        slot = &(uring->slots[uring->filling]);
+        if ((slot->channel != channel || slot->len + len > SECURE_URING_SLOT_SIZE) &&
+            _uring_queue(uring) < 0) {
+            return NULL;
+        }
+    }
+    while (uring->filling < 0) {
+        for (int i = 0; i < SECURE_URING_DEPTH; ++i) {
+            if (uring->slots[i].state == URING_SLOT_FREE) {
+                uring->filling = i;
+                break;
+            }
+        }
+        if (uring->filling < 0 && _uring_reap(uring, 1) < 0) {
+            return NULL;
+        }
+    }
+    slot = &(uring->slots[uring->filling]);
+    if (slot->state == URING_SLOT_FREE) {
+        slot->state = URING_SLOT_FILLING;
+        slot->channel = channel;
+        slot->len = 0;
+    }
+
+    return _uring_slot_buf(uring, uring->filling) + slot->len;
+}
+
+/** _uring_read return value:
+ *     same as recv, the read goes into the kernel with whatever the thread
+ *     has queued, buf is the receive slot if fixed is set
+*/
+static ssize_t _uring_read(struct uring_state * uring, int channel, unsigned char * buf, 
+                           size_t len, int fixed)
+{
+    struct io_uring_sqe * sqe;
+    int ret;
+
+    if (_uring_queue(uring) < 0) {
+        return -1;
+    }
+    sqe = io_uring_get_sqe(&(uring->ring));
+    if (fixed) {
+        io_uring_prep_read_fixed(sqe, channel, buf, len, 0, 0);
+    } else {
+        io_uring_prep_recv(sqe, channel, buf, len, 0);
+    }
+    io_uring_sqe_set_data(sqe, NULL);
+    uring->queued++;
+    uring->read_done = 0;
+
+    /* the writes in flight complete first, waiting for one would return before the read */
+    ret = _uring_reap(uring, 0);
+    if (ret == 0) {
+        ret = _uring_submit(uring, uring->busy + 1);
+    }
+    while (ret == 0 && !uring->read_done) {
+        ret = _uring_reap(uring, 1);
+    }
+    if (ret < 0 || _uring_failed(uring, channel) < 0) {
+        return -1;
+    }
+    if (uring->read_res < 0) {
+        errno = -(uring->read_res);
+        return -1;
+    }
+
+    return uring->read_res;
+}
+
+static ssize_t _uring_recvall(struct uring_state * uring, int channel, size_t len)
+{
+    unsigned char * buf = _uring_slot_buf(uring, SECURE_URING_DEPTH);
+    ssize_t total_recv_len, ret;
+    uint64_t start;
+
+    start = trace_begin();
+    total_recv_len = 0;
+    while (total_recv_len < len)
+    {
+        ret = _uring_read(uring, channel, buf + total_recv_len, len - total_recv_len, 1);
+        if (ret > 0)
+            total_recv_len += ret;
+        else if (ret == 0) {
+            total_recv_len = 0;
+            break;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            _wait(channel, POLLIN);
+        else if (errno != EINTR) {
+            total_recv_len = -1;
+            break;
+        }
+    }
+    trace_end("recv", start);
 
     return total_recv_len;
 }
+#endif
 
-ssize_t secure_send(int channel, const void * buf, size_t len, int flags,
-                    const unsigned char * key, const unsigned char * iv)
+/* bytes of a len-byte record on the channel, the kernel keeps the tag to itself with ktls */
+static size_t _record_len(const struct secure_key * key, size_t len)
+{
+    return key->ktls ? len : len + SECURE_TAG_LEN;
+}
+
+static const EVP_CIPHER * _suite_cipher(int suite)
+{
+    return (suite == SECURE_SUITE_CHACHA20_POLY1305) ? EVP_chacha20_poly1305() 
+                                                     : EVP_aes_256_gcm();
+}
+
+/* the nonce of record seq is the 12-byte salt xor seq (big endian, right aligned) */
+static void _nonce(const unsigned char * salt, uint64_t seq, unsigned char * nonce)
+{
+    memcpy(nonce, salt, 12);
+    for (int i = 11; i >= 4; --i) {
+        nonce[i] ^= (unsigned char)seq;
+        seq >>= 8;
+    }
+}
+
+/**
+ * cipher contexts:
+ *     every thread keeps one context to seal and one to open, with the key
+ *     schedule of the last key it used, a record then only sets its nonce,
+ *     a thread serves one connection at a time, so the schedule is expanded
+ *     once per connection instead of once per record, the same goes for the
+ *     seal_key secure_sendv batches with
+*/
+struct cipher_cache
+{
+    EVP_CIPHER_CTX * ctx[2];
+    int suite[2];
+    unsigned char key[2][32];
+    struct seal_key seal;
+    unsigned char seal_raw[32];
+    int seal_ready;
+};
+
+static pthread_once_t cipher_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cipher_key;
+
+static void _cipher_free(void * arg)
+{
+    struct cipher_cache * cache = arg;
+
+    EVP_CIPHER_CTX_free(cache->ctx[0]);
+    EVP_CIPHER_CTX_free(cache->ctx[1]);
+    OPENSSL_clear_free(cache, sizeof(struct cipher_cache));
+}
+
+static void _cipher_key_init(void)
+{
+    pthread_key_create(&cipher_key, _cipher_free);
+}
+
+/* the cache of the calling thread, NULL if it can not be allocated */
+static struct cipher_cache * _cipher_cache(void)
+{
+    struct cipher_cache * cache;
+
+    pthread_once(&cipher_once, _cipher_key_init);
+    cache = pthread_getspecific(cipher_key);
+    if (cache == NULL) {
+        cache = (struct cipher_cache *)OPENSSL_zalloc(sizeof(struct cipher_cache));
+        if (cache == NULL) {
+            return NULL;
+        }
+        cache->ctx[0] = EVP_CIPHER_CTX_new();
+        cache->ctx[1] = EVP_CIPHER_CTX_new();
+        if (cache->ctx[0] == NULL || cache->ctx[1] == NULL) {
+            _cipher_free(cache);
+            return NULL;
+        }
+        cache->suite[0] = cache->suite[1] = -1;
+        pthread_setspecific(cipher_key, cache);
+    }
+
+    return cache;
+}
+
+/** _cipher_get return value:
+ *     return the context of the calling thread to seal (enc 1) or open (enc 0)
+ *     records with suite and key, ready for the nonce of the next record
+ *     return NULL if it can not be allocated
+*/
+static EVP_CIPHER_CTX * _cipher_get(int enc, int suite, const unsigned char * key)
+{
+    struct cipher_cache * cache = _cipher_cache();
+
+    if (cache == NULL) {
+        return NULL;
+    }
+    if (cache->suite[enc] != suite || memcmp(cache->key[enc], key, 32) != 0) {
+        if (1 != EVP_CipherInit_ex(cache->ctx[enc], _suite_cipher(suite), NULL, key, NULL, enc)) {
+            cache->suite[enc] = -1;
+            return NULL;
+        }
+        cache->suite[enc] = suite;
+        memcpy(cache->key[enc], key, 32);
+    }
+
+    return cache->ctx[enc];
+}
+
+/* seals buf into enc_buf as ciphertext + tag with ctx (_cipher_get), returns len + SECURE_TAG_LEN */
+static int _encrypt(EVP_CIPHER_CTX * ctx, const void * buf, size_t len, unsigned char * enc_buf,
+                    struct secure_key * key)
+{
+    unsigned char nonce[12];
+    int enc_len;
+
+    _nonce(key->send_iv, key->send_seq++, nonce);
+    EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, nonce);
+    EVP_EncryptUpdate(ctx, enc_buf, &enc_len, buf, len);
+    EVP_EncryptFinal_ex(ctx, enc_buf + enc_len, &enc_len);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, SECURE_TAG_LEN, enc_buf + len);
+    metrics_add(METRICS_SEALED_BYTES, len);
+
+    return len + SECURE_TAG_LEN;
+}
+
+/**
+ * multi-buffer sealing (./src/seal.c):
+ *     AES-256-GCM records of up to SECURE_SEAL_MAX_LEN bytes are not sealed
+ *     through EVP one by one but handed to seal_batch, which runs SEAL_LANES
+ *     of them side by side so their AES rounds overlap, secure_sendv
+ *     batches the records of one call, the io_uring backend every record a
+ *     thread puts into its slots before it enters the kernel, whatever the
+ *     channel, larger records (where one EVP call already keeps the AES unit
+ *     busy) and ChaCha20-Poly1305 stay on EVP, the records come out the same
+*/
+static pthread_once_t seal_once = PTHREAD_ONCE_INIT;
+static int seal_cpu;
+
+static void _seal_cpu_init(void)
+{
+    seal_cpu = seal_available();
+}
+
+static int _seal_fits(const struct secure_key * key, size_t len)
+{
+    pthread_once(&seal_once, _seal_cpu_init);
+
+    return seal_cpu && !key->ktls && key->suite == SECURE_SUITE_AES_256_GCM && 
+           len <= SECURE_SEAL_MAX_LEN;
+}
+
+/* the seal_key of the calling thread for key, NULL if it can not be allocated */
+static const struct seal_key * _seal_key_get(const unsigned char * key)
+{
+    struct cipher_cache * cache = _cipher_cache();
+
+    if (cache == NULL) {
+        return NULL;
+    }
+    if (!cache->seal_ready || memcmp(cache->seal_raw, key, 32) != 0) {
+        seal_key_init(&(cache->seal), key);
+        memcpy(cache->seal_raw, key, 32);
+        cache->seal_ready = 1;
+    }
+
+    return &(cache->seal);
+}
+
+/* puts buf into seals[*num] with the nonce of the next record of key, returns len + SECURE_TAG_LEN */
+static int _seal_put(struct seal_record * seals, int * num, const struct seal_key * seal_key,
+                     const void * buf, size_t len, unsigned char * enc_buf, struct secure_key * key)
+{
+    struct seal_record * seal = &(seals[(*num)++]);
+
+    seal->key = seal_key;
+    _nonce(key->send_iv, key->send_seq++, seal->nonce);
+    seal->in = buf;
+    seal->len = len;
+    seal->out = enc_buf;
+    metrics_add(METRICS_SEALED_BYTES, len);
+
+    return len + SECURE_TAG_LEN;
+}
+
+/** _decrypt return value:
+ *     return  0 if the record is authentic, buf holds its recv_len - SECURE_TAG_LEN bytes
+ *     return -1 otherwise
+ *  note: buf may be recv_buf itself
+*/
+static int _decrypt(const unsigned char * recv_buf, int recv_len, void * buf,
+                    struct secure_key * key)
 {
     EVP_CIPHER_CTX * ctx;
+    unsigned char nonce[12];
+    int len, dec_len, ret;
+    uint64_t start;
+
+    start = trace_begin();
+    ctx = _cipher_get(0, key->suite, key->recv_key);
+    if (ctx == NULL) {
+        return -1;
+    }
+    len = recv_len - SECURE_TAG_LEN;
+    _nonce(key->recv_iv, key->recv_seq++, nonce);
+    EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce);
+    EVP_DecryptUpdate(ctx, buf, &dec_len, recv_buf, len);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, SECURE_TAG_LEN, (void *)(recv_buf + len));
+    ret = EVP_DecryptFinal_ex(ctx, buf + dec_len, &dec_len);
+    trace_end("open", start);
+
+    if (ret <= 0) {
+        errno = EBADMSG;
+        return -1;
+    }
+    metrics_add(METRICS_OPENED_BYTES, len);
+
+    return 0;
+}
+
+ssize_t secure_sendv(int channel, const struct iovec * records, int count, int flags,
+                     struct secure_key * key)
+{
+    EVP_CIPHER_CTX * ctx = NULL;
     unsigned char * enc_buf;
-    int total_enc_len, enc_len;
+    struct iovec * plain;
+    size_t total_len, enc_len;
     ssize_t send_len;
+    uint64_t start;
+    struct seal_record seals[SECURE_SEAL_BATCH];
+    const struct seal_key * seal_key = NULL;
+    int seal_num = 0;
+#ifdef SECURE_IO_URING
+    struct uring_state * uring;
+    struct uring_slot * slot;
+    unsigned char * out;
+#endif
 
-    enc_buf = (unsigned char *)malloc(len - len % 16 + 16);
+    total_len = 0;
+    for (int i = 0; i < count; ++i) {
+        total_len += _record_len(key, records[i].iov_len);
+    }
+    if (!key->ktls && (ctx = _cipher_get(1, key->suite, key->send_key)) == NULL) {
+        return -1;
+    }
 
-    ctx = EVP_CIPHER_CTX_new();
-    EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv);
-    EVP_EncryptUpdate(ctx, enc_buf, &enc_len, buf, len);
-    total_enc_len = enc_len;
-    EVP_EncryptFinal_ex(ctx, enc_buf + total_enc_len, &enc_len);
-    total_enc_len += enc_len;
-    EVP_CIPHER_CTX_free(ctx);
+#ifdef SECURE_IO_URING
+    uring = _uring_get();
+    if (uring != NULL && (key->ktls || total_len > SECURE_URING_SLOT_SIZE)) {
+        if (_uring_drain(uring) < 0 || _uring_failed(uring, channel) < 0) {
+            return -1;
+        }
+    } else if (uring != NULL) {
+        if (_uring_failed(uring, channel) < 0 || 
+            (out = _uring_take(uring, channel, total_len)) == NULL) {
+            return -1;
+        }
+        slot = &(uring->slots[uring->filling]);
+        start = trace_begin();
+        enc_len = 0;
+        for (int i = 0; i < count; ++i) {
+            if (!_seal_fits(key, records[i].iov_len)) {
+                enc_len += _encrypt(ctx, records[i].iov_base, records[i].iov_len, out + enc_len, 
+                                    key);
+                continue;
+            }
+            if (!slot->key_ready || memcmp(slot->raw_key, key->send_key, 32) != 0) {
+                /* what is still waiting may be under the old key */
+                _uring_seal(uring);
+                seal_key_init(&(slot->key), key->send_key);
+                memcpy(slot->raw_key, key->send_key, 32);
+                slot->key_ready = 1;
+            } else if (uring->seal_num == SECURE_SEAL_BATCH) {
+                _uring_seal(uring);
+            }
+            memcpy(out + enc_len, records[i].iov_base, records[i].iov_len);
+            enc_len += _seal_put(uring->seals, &(uring->seal_num), &(slot->key), out + enc_len,
+                                 records[i].iov_len, out + enc_len, key);
+        }
+        trace_end("seal", start);
+        slot->len += enc_len;
+        if (!(flags & MSG_MORE) && !uring->corked &&
+            (_uring_queue(uring) < 0 || _uring_submit(uring, 0) < 0)) {
+            return -1;
+        }
+        return total_len;
+    }
+#endif
 
-    send_len = _sendall(channel, enc_buf, total_enc_len, flags);
+    if (key->ktls) {
+        /* the kernel seals straight from the rows, records only needs a copy to advance */
+        plain = (struct iovec *)malloc(count * sizeof(struct iovec));
+        if (plain == NULL) {
+            return -1;
+        }
+        memcpy(plain, records, count * sizeof(struct iovec));
+        send_len = _sendmsgall(channel, plain, count, flags);
+        free(plain);
+        return send_len;
+    }
 
+    /* a single record has nothing to run beside it */
+    if (count > 1 && _seal_fits(key, 0) && (seal_key = _seal_key_get(key->send_key)) == NULL) {
+        return -1;
+    }
+    enc_buf = (unsigned char *)malloc(total_len);
+    if (enc_buf == NULL) {
+        return -1;
+    }
+    start = trace_begin();
+    enc_len = 0;
+    for (int i = 0; i < count; ++i) {
+        if (seal_key == NULL || !_seal_fits(key, records[i].iov_len)) {
+            enc_len += _encrypt(ctx, records[i].iov_base, records[i].iov_len, enc_buf + enc_len, 
+                                key);
+            continue;
+        }
+        enc_len += _seal_put(seals, &seal_num, seal_key, records[i].iov_base, records[i].iov_len,
+                             enc_buf + enc_len, key);
+        if (seal_num == SECURE_SEAL_BATCH) {
+            seal_batch(seals, seal_num);
+            seal_num = 0;
+        }
+    }
+    if (seal_num > 0) {
+        seal_batch(seals, seal_num);
+    }
+    trace_end("seal", start);
+    send_len = _sendall(channel, enc_buf, enc_len, flags);
     free(enc_buf);
 
     return send_len;
 }
 
+ssize_t secure_send(int channel, const void * buf, size_t len, int flags,
+                    struct secure_key * key)
+{
+    struct iovec record;
+
+    record.iov_base = (void *)buf;
+    record.iov_len = len;
+
+    return secure_sendv(channel, &record, 1, flags, key);
+}
+
 ssize_t secure_recv(int channel, void * buf, size_t len, int flags,
-                    const unsigned char * key, const unsigned char * iv)
+                    struct secure_key * key)
 {
-    EVP_CIPHER_CTX * ctx;
     unsigned char * recv_buf;
-    int align_len, total_dec_len, dec_len;
+    size_t record_len;
     ssize_t recv_len;
+#ifdef SECURE_IO_URING
+    struct uring_state * uring;
+#endif
+
+    record_len = _record_len(key, len);
 
-    align_len = len - len % 16 + 16;
-    recv_buf = (unsigned char *)malloc(align_len);
+#ifdef SECURE_IO_URING
+    uring = _uring_get();
+    if (uring != NULL && (key->ktls || record_len > SECURE_URING_SLOT_SIZE || flags != 0) &&
+        (_uring_drain(uring) < 0 || _uring_failed(uring, channel) < 0)) {
+        return -1;
+    }
+#endif
+
+    if (key->ktls) {
+        /* the kernel has opened the record already, a forged one fails recv with EBADMSG */
+        return _recvall(channel, buf, len, flags);
+    }
+
+#ifdef SECURE_IO_URING
+    if (uring != NULL && record_len <= SECURE_URING_SLOT_SIZE && flags == 0) {
+        recv_len = _uring_recvall(uring, channel, record_len);
+        if (recv_len > 0 && 
+            _decrypt(_uring_slot_buf(uring, SECURE_URING_DEPTH), recv_len, buf, key) < 0) {
+            recv_len = -1;
+        }
+        return recv_len;
+    }
+#endif
+
+    recv_buf = (unsigned char *)malloc(record_len);
+    if (recv_buf == NULL) {
+        return -1;
+    }
 
-    recv_len = _recvall(channel, recv_buf, align_len, flags);
-    if (recv_len > 0) {
-        ctx = EVP_CIPHER_CTX_new();
-        EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv);
-        EVP_DecryptUpdate(ctx, buf, &dec_len, recv_buf, recv_len);
-        total_dec_len = dec_len;
-        EVP_DecryptFinal_ex(ctx, buf + total_dec_len, &dec_len);
-        total_dec_len += dec_len;
-        EVP_CIPHER_CTX_free(ctx);
+    recv_len = _recvall(channel, recv_buf, record_len, flags);
+    if (recv_len > 0 && _decrypt(recv_buf, recv_len, buf, key) < 0) {
+        recv_len = -1;
     }
 
     free(recv_buf);
@@ -102,9 +945,542 @@ ssize_t secure_recv(int channel, void * buf, size_t len, int flags,
     return recv_len;
 }
 
+void secure_cork(void)
+{
+#ifdef SECURE_IO_URING
+    struct uring_state * uring = _uring_get();
+
+    if (uring != NULL) {
+        uring->corked = 1;
+    }
+#endif
+}
+
+void secure_flush(void)
+{
+#ifdef SECURE_IO_URING
+    struct uring_state * uring;
+
+    pthread_once(&uring_once, _uring_key_init);
+    uring = pthread_getspecific(uring_key);
+    if (uring != NULL && uring != (void *)&uring_unavailable) {
+        _uring_drain(uring);
+    }
+#endif
+}
+
+int secure_session_init(struct secure_session * session, int channel,
+                        struct secure_key * key)
+{
+    session->channel = channel;
+    session->key = key;
+    session->capacity = SECURE_SESSION_BUF_SIZE;
+    session->head = 0;
+    session->tail = 0;
+    session->buf = (unsigned char *)malloc(session->capacity);
+
+    return (session->buf == NULL) ? -1 : 0;
+}
+
+/* reads as much as fits after the tail, same return value as recv */
+static ssize_t _session_read(struct secure_session * session)
+{
+#ifdef SECURE_IO_URING
+    struct uring_state * uring = _uring_get();
+
+    /* what the thread has queued goes into the kernel with the read */
+    if (uring != NULL) {
+        return _uring_read(uring, session->channel, session->buf + session->tail, 
+                           session->capacity - session->tail, 0);
+    }
+#endif
+
+    return recv(session->channel, session->buf + session->tail, 
+                session->capacity - session->tail, 0);
+}
+
+/** secure_recv_view return value:
+ *     same as secure_recv, *view points at the plaintext inside the session
+ *     buffer, it stays valid and writable until the next secure_recv_view or
+ *     secure_session_finish on this session
+*/
+ssize_t secure_recv_view(struct secure_session * session, size_t len, void ** view)
+{
+    unsigned char * record;
+    unsigned char * buf;
+    size_t record_len;
+    ssize_t ret;
+    uint64_t start;
+#ifdef SECURE_IO_URING
+    struct uring_state * uring;
+
+    uring = _uring_get();
+    if (uring != NULL && _uring_failed(uring, session->channel) < 0) {
+        return -1;
+    }
+#endif
+
+    record_len = _record_len(session->key, len);
+
+    if (session->capacity - session->head < record_len) {
+        /* only the tail of a record read ahead moves, the rest is in place */
+        memmove(session->buf, session->buf + session->head, session->tail - session->head);
+        session->tail -= session->head;
+        session->head = 0;
+    }
+    if (session->capacity < record_len) {
+        buf = (unsigned char *)realloc(session->buf, record_len);
+        if (buf == NULL) {
+            return -1;
+        }
+        session->buf = buf;
+        session->capacity = record_len;
+    }
+
+    /* a record read ahead with an earlier one is no recv */
+    start = (session->tail - session->head < record_len) ? trace_begin() : 0;
+    while (session->tail - session->head < record_len)
+    {
+        ret = _session_read(session);
+        if (ret > 0)
+            session->tail += ret;
+        else if (ret == 0) {
+            trace_end("recv", start);
+            return 0;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            _wait(session->channel, POLLIN);
+        else if (errno != EINTR) {
+            trace_end("recv", start);
+            return -1;
+        }
+    }
+    trace_end("recv", start);
+
+    record = session->buf + session->head;
+    session->head += record_len;
+    if (session->head == session->tail) {
+        session->head = 0;
+        session->tail = 0;
+    }
+    if (!session->key->ktls && _decrypt(record, record_len, record, session->key) < 0) {
+        return -1;
+    }
+    *view = record;
+
+    return record_len;
+}
+
+size_t secure_session_buffered(const struct secure_session * session)
+{
+    return session->tail - session->head;
+}
+
+void secure_session_finish(struct secure_session * session)
+{
+    free(session->buf);
+    session->buf = NULL;
+}
+
+union ktls_info
+{
+    struct tls12_crypto_info_aes_gcm_256 gcm;
+    struct tls12_crypto_info_chacha20_poly1305 chacha;
+};
+
+/**
+ * one direction in the TLS 1.3 form the kernel takes, its nonce is salt || iv
+ * xor the record sequence number just as _nonce does, so gcm splits our
+ * 12-byte salt into a 4-byte salt and an 8-byte iv
+*/
+static socklen_t _ktls_info(union ktls_info * info, int suite, const unsigned char * key,
+                            const unsigned char * salt, uint64_t seq)
+{
+    unsigned char rec_seq[8];
+
+    for (int i = 7; i >= 0; --i) {
+        rec_seq[i] = (unsigned char)seq;
+        seq >>= 8;
+    }
+    memset(info, 0, sizeof(union ktls_info));
+
+    if (suite == SECURE_SUITE_CHACHA20_POLY1305) {
+        info->chacha.info.version = TLS_1_3_VERSION;
+        info->chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        memcpy(info->chacha.iv, salt, 12);
+        memcpy(info->chacha.key, key, 32);
+        memcpy(info->chacha.rec_seq, rec_seq, 8);
+        return sizeof(info->chacha);
+    }
+
+    info->gcm.info.version = TLS_1_3_VERSION;
+    info->gcm.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+    memcpy(info->gcm.salt, salt, 4);
+    memcpy(info->gcm.iv, salt + 4, 8);
+    memcpy(info->gcm.key, key, 32);
+    memcpy(info->gcm.rec_seq, rec_seq, 8);
+    return sizeof(info->gcm);
+}
+
+/* attaching the tls ulp changes nothing on the channel until keys go in */
+static int _ktls_attach(int channel)
+{
+    if (setsockopt(channel, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0 || errno == EEXIST) {
+        return 0;
+    }
+
+    return -1;
+}
+
+/** secure_ktls_enable return value:
+ *     return  0 if the kernel seals and opens the records of channel from now on
+ *     return -1 otherwise, key is left as it was, but if sending was handed
+ *               over and receiving was not the channel is of no further use
+*/
+int secure_ktls_enable(int channel, struct secure_key * key)
+{
+    union ktls_info info;
+    socklen_t info_len;
+    int ret;
+
+    if (_ktls_attach(channel) < 0) {
+        return -1;
+    }
+
+    info_len = _ktls_info(&info, key->suite, key->send_key, key->send_iv, key->send_seq);
+    ret = setsockopt(channel, SOL_TLS, TLS_TX, &info, info_len);
+    if (ret == 0) {
+        info_len = _ktls_info(&info, key->suite, key->recv_key, key->recv_iv, key->recv_seq);
+        ret = setsockopt(channel, SOL_TLS, TLS_RX, &info, info_len);
+    }
+    OPENSSL_cleanse(&info, sizeof(info));
+    if (ret != 0) {
+        return -1;
+    }
+    key->ktls = 1;
+
+    return 0;
+}
+
+/* AES-GCM only beats ChaCha20-Poly1305 with AES and carry-less multiply in hardware */
+static int _aes_in_hardware(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__)
+    return (getauxval(AT_HWCAP) & HWCAP_AES) && (getauxval(AT_HWCAP) & HWCAP_PMULL);
+#else
+    return 0;
+#endif
+}
+
+/* one 32-byte secret per label: SHA-256(label || dh shared secret) */
+static void _derive(const unsigned char * shared_key, int shared_len, const char * label,
+                    unsigned char * out, size_t out_len)
+{
+    EVP_MD_CTX * ctx;
+    unsigned char digest[32];
+
+    ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    EVP_DigestUpdate(ctx, label, strlen(label));
+    EVP_DigestUpdate(ctx, shared_key, shared_len);
+    EVP_DigestFinal_ex(ctx, digest, NULL);
+    EVP_MD_CTX_free(ctx);
+
+    memcpy(out, digest, out_len);
+}
+
+static void _derive_key(struct secure_key * key, int suite, int is_server,
+                        const unsigned char * shared_key, int shared_len)
+{
+    key->suite = suite;
+    key->ktls = 0;
+    _derive(shared_key, shared_len, is_server ? "s2c key" : "c2s key", key->send_key, 32);
+    _derive(shared_key, shared_len, is_server ? "s2c iv" : "c2s iv", key->send_iv, 12);
+    _derive(shared_key, shared_len, is_server ? "c2s key" : "s2c key", key->recv_key, 32);
+    _derive(shared_key, shared_len, is_server ? "c2s iv" : "s2c iv", key->recv_iv, 12);
+    _derive(shared_key, shared_len, "resume", key->resume_secret, 32);
+    key->send_seq = 0;
+    key->recv_seq = 0;
+}
+
+/* a resumed connection stands secret || client random || server random in for the dh shared secret */
+static void _derive_resumed_key(struct secure_key * key, int suite, int is_server,
+                                const unsigned char * secret,
+                                const unsigned char * client_random,
+                                const unsigned char * server_random)
+{
+    unsigned char shared_key[96];
+
+    memcpy(shared_key, secret, 32);
+    memcpy(&(shared_key[32]), client_random, 32);
+    memcpy(&(shared_key[64]), server_random, 32);
+    _derive_key(key, suite, is_server, shared_key, 96);
+    OPENSSL_cleanse(shared_key, 96);
+}
+
+static int _suite_known(int suite)
+{
+    return (suite == SECURE_SUITE_AES_256_GCM || suite == SECURE_SUITE_CHACHA20_POLY1305) &&
+           (suite & SECURE_SERVER_SUITES);
+}
+
+struct ticket_key
+{
+    uint32_t id;
+    time_t created;
+    unsigned char key[32];
+};
+
+/* a ticket key seals for SECURE_TICKET_ROTATE seconds, then is kept until its tickets expire */
+#define TICKET_KEY_NUM      (SECURE_TICKET_LIFETIME / SECURE_TICKET_ROTATE + 1)
+#define TICKET_PLAIN_LEN    (8 + 32 + SECURE_TICKET_STATE_LEN)
+
+static struct ticket_key ticket_keys[TICKET_KEY_NUM];
+static uint32_t ticket_key_id;
+static lock_t ticket_lock = LOCK_INITIALIZER(METRICS_LOCK_TICKET);
+
+/* the key new tickets are sealed with, a fresh one takes the slot of the oldest when it is due */
+static void _ticket_key_current(time_t now, struct ticket_key * out)
+{
+    struct ticket_key * current;
+
+    lock_acquire(&ticket_lock);
+    current = &(ticket_keys[ticket_key_id % TICKET_KEY_NUM]);
+    if (current->created == 0 || now - current->created >= SECURE_TICKET_ROTATE) {
+        ticket_key_id++;
+        current = &(ticket_keys[ticket_key_id % TICKET_KEY_NUM]);
+        current->id = ticket_key_id;
+        current->created = now;
+        RAND_bytes(current->key, 32);
+    }
+    *out = *current;
+    lock_release(&ticket_lock);
+}
+
+static int _ticket_key_find(uint32_t id, struct ticket_key * out)
+{
+    struct ticket_key * slot;
+    int ret = -1;
+
+    lock_acquire(&ticket_lock);
+    slot = &(ticket_keys[id % TICKET_KEY_NUM]);
+    if (slot->created != 0 && slot->id == id) {
+        *out = *slot;
+        ret = 0;
+    }
+    lock_release(&ticket_lock);
+
+    return ret;
+}
+
+/**
+ * ticket: 4B key id + 12B nonce + sealed (8B issue time + 32B secret + state) + 16B tag,
+ * the key id is authenticated along with the rest
+*/
+void secure_server_ticket(const struct secure_key * key, const void * state,
+                          unsigned char * ticket)
+{
+    struct ticket_key ticket_key;
+    EVP_CIPHER_CTX * ctx;
+    unsigned char plain[TICKET_PLAIN_LEN];
+    uint64_t issued;
+    int len;
+
+    issued = (uint64_t)time(NULL);
+    _ticket_key_current((time_t)issued, &ticket_key);
+    memcpy(plain, &issued, 8);
+    memcpy(&(plain[8]), key->resume_secret, 32);
+    memcpy(&(plain[40]), state, SECURE_TICKET_STATE_LEN);
+
+    memcpy(ticket, &(ticket_key.id), 4);
+    RAND_bytes(&(ticket[4]), 12);
+    ctx = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, ticket_key.key, &(ticket[4]));
+    EVP_EncryptUpdate(ctx, NULL, &len, ticket, 4);
+    EVP_EncryptUpdate(ctx, &(ticket[16]), &len, plain, TICKET_PLAIN_LEN);
+    EVP_EncryptFinal_ex(ctx, &(ticket[16 + len]), &len);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, SECURE_TAG_LEN, 
+                        &(ticket[16 + TICKET_PLAIN_LEN]));
+    EVP_CIPHER_CTX_free(ctx);
+
+    OPENSSL_cleanse(plain, TICKET_PLAIN_LEN);
+    OPENSSL_cleanse(&ticket_key, sizeof(ticket_key));
+}
+
+/** _ticket_open return value:
+ *     return  0 if a kept ticket key sealed ticket and it has not expired,
+ *               secret and state are restored from it
+ *     return -1 otherwise
+*/
+static int _ticket_open(const unsigned char * ticket, unsigned char * secret, void * state)
+{
+    struct ticket_key ticket_key;
+    EVP_CIPHER_CTX * ctx;
+    unsigned char plain[TICKET_PLAIN_LEN];
+    uint64_t issued;
+    uint32_t id;
+    int len, ret;
+
+    memcpy(&id, ticket, 4);
+    if (_ticket_key_find(id, &ticket_key) < 0) {
+        return -1;
+    }
+
+    ctx = EVP_CIPHER_CTX_new();
+    EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, ticket_key.key, &(ticket[4]));
+    EVP_DecryptUpdate(ctx, NULL, &len, ticket, 4);
+    EVP_DecryptUpdate(ctx, plain, &len, &(ticket[16]), TICKET_PLAIN_LEN);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, SECURE_TAG_LEN, 
+                        (void *)&(ticket[16 + TICKET_PLAIN_LEN]));
+    ret = EVP_DecryptFinal_ex(ctx, &(plain[len]), &len);
+    EVP_CIPHER_CTX_free(ctx);
+    OPENSSL_cleanse(&ticket_key, sizeof(ticket_key));
+
+    /* an issue time ahead of the clock wraps around and expires too */
+    memcpy(&issued, plain, 8);
+    if (ret <= 0 || (uint64_t)time(NULL) - issued > SECURE_TICKET_LIFETIME) {
+        OPENSSL_cleanse(plain, TICKET_PLAIN_LEN);
+        return -1;
+    }
+    memcpy(secret, &(plain[8]), 32);
+    memcpy(state, &(plain[40]), SECURE_TICKET_STATE_LEN);
+    OPENSSL_cleanse(plain, TICKET_PLAIN_LEN);
+
+    return 0;
+}
+
+/**
+ * server handshake math:
+ *     key generation and the shared secret run on crypto_pool, which has one
+ *     worker per core, so handshakes never take more cpu than that from chats,
+ *     keypairs are generated ahead into a cache by a SCHED_IDLE thread, i.e.
+ *     only with cpu nobody else wants, a handshake takes one (each is used
+ *     once) or has one made on the pool if the cache is empty or busy
+*/
+struct keypair
+{
+    DH * dh;
+    char * pub_key;
+};
+
+struct compute_task
+{
+    struct keypair * keypair;
+    BIGNUM * peer_pub_key;
+    unsigned char * shared_key;
+    int shared_len;
+};
+
+static struct pool * crypto_pool;
+static unsigned int crypto_hint;
+static struct keypair keypairs[SECURE_KEYPAIR_CACHE_NUM];
+static int keypair_num;
+static lock_t keypair_lock = LOCK_INITIALIZER(METRICS_LOCK_KEYPAIR);
+static struct sync_cond keypair_cond = SYNC_COND_INITIALIZER;
+static pthread_t refill_thread;
+static int refill_exit;
+
+static void _keypair_generate(struct keypair * keypair)
+{
+    BIGNUM * p = NULL;
+    BIGNUM * g = NULL;
+
+    keypair->dh = DH_new();
+    BN_hex2bn(&p, dh_parameter_p);
+    g = BN_new();
+    BN_set_word(g, dh_parameter_g);
+    DH_set0_pqg(keypair->dh, p, NULL, g);
+    DH_generate_key(keypair->dh);
+    keypair->pub_key = BN_bn2hex(DH_get0_pub_key(keypair->dh));
+}
+
+static void _keypair_free(struct keypair * keypair)
+{
+    OPENSSL_free(keypair->pub_key);
+    DH_free(keypair->dh);
+}
+
+static void _keypair_routine(void * worker_data, void * arg)
+{
+    _keypair_generate((struct keypair *)arg);
+}
+
+static void _compute_routine(void * worker_data, void * arg)
+{
+    struct compute_task * task = arg;
+
+    if (task->shared_key == NULL || task->peer_pub_key == NULL) {
+        task->shared_len = -1;
+        return;
+    }
+    task->shared_len = DH_compute_key(task->shared_key, task->peer_pub_key, task->keypair->dh);
+}
+
+/* the only producer of the cache, it holds keypair_lock just long enough to push */
+static void * _refill_routine(void * arg)
+{
+    struct sched_param param;
+    struct keypair keypair;
+
+    memset(&param, 0, sizeof(param));
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    lock_acquire(&keypair_lock);
+    while (!refill_exit) {
+        if (keypair_num == SECURE_KEYPAIR_CACHE_NUM) {
+            lock_wait(&keypair_cond, &keypair_lock);
+            continue;
+        }
+        lock_release(&keypair_lock);
+        _keypair_generate(&keypair);
+        lock_acquire(&keypair_lock);
+        keypairs[keypair_num++] = keypair;
+    }
+    lock_release(&keypair_lock);
+
+    return NULL;
+}
+
+/* runs func on the crypto pool and waits, or in place if the pool can not take it */
+static void _crypto_run(void (* func)(void * worker_data, void * arg), void * arg)
+{
+    struct pool_task task;
+
+    pool_task_init(&task, func, arg);
+    if (0 != pool_submit(crypto_pool, &task, 
+                         __atomic_fetch_add(&crypto_hint, 1, __ATOMIC_RELAXED))) {
+        func(NULL, arg);
+        return;
+    }
+    pool_wait(&task);
+}
+
+/* the refill thread may be preempted holding the lock at SCHED_IDLE, so it is never waited for */
+static void _keypair_take(struct keypair * keypair)
+{
+    int taken = 0;
+
+    if (0 == lock_try(&keypair_lock)) {
+        if (keypair_num > 0) {
+            *keypair = keypairs[--keypair_num];
+            taken = 1;
+            sync_cond_signal(&keypair_cond);
+        }
+        lock_release(&keypair_lock);
+    }
+
+    if (!taken) {
+        _crypto_run(_keypair_routine, keypair);
+    }
+}
+
 int secure_server_init(void)
 {
     DH * dh;
+    int worker_num;
 
     RAND_poll();
     dh = DH_new();
@@ -112,57 +1488,139 @@ int secure_server_init(void)
     dh_parameter_p = BN_bn2hex(DH_get0_p(dh));
     DH_free(dh);
 
+    worker_num = SECURE_CRYPTO_WORKER_NUM;
+    if (worker_num <= 0) {
+        worker_num = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        worker_num = (worker_num > 0) ? worker_num : 1;
+    }
+    crypto_pool = pool_init(worker_num, NULL, NULL);
+    if (crypto_pool == NULL) {
+        return -1;
+    }
+    pthread_create(&refill_thread, NULL, _refill_routine, NULL);
+
     return 0;
 }
 
-int secure_server_buildkey(int channel, unsigned char * key, unsigned char * iv)
+/** secure_server_buildkey return value:
+ *     return  0 if succeed by the dh exchange
+ *     return  1 if succeed by a ticket, state holds the SECURE_TICKET_STATE_LEN
+ *               bytes sealed in it
+ *     return -1 if connection is broken, the client picks no offered suite or
+ *               both ends asked for ktls and the kernel would not take the keys
+ *  secure_server_buildkey note:
+ *     the client speaks first, with a ticket (PROTOCOL_BUILD_RESUME) or without,
+ *     a ticket that can not be opened falls back to the dh exchange
+*/
+int secure_server_buildkey(int channel, struct secure_key * key, void * state)
 {
-    DH * dh;
-    BIGNUM * p = NULL;
-    BIGNUM * g = NULL;
-    char * pub_key;
+    struct keypair keypair;
+    struct compute_task task;
     BIGNUM * peer_pub_key = NULL;
-    unsigned char * shared_key;
+    unsigned char secret[32];
+    unsigned char server_random[32];
     char buf[1024];
+    int suite, ktls_offered;
+
+#ifdef SECURE_KTLS
+    ktls_offered = (_ktls_attach(channel) == 0) ? SECURE_SUITE_KTLS : 0;
+#else
+    ktls_offered = 0;
+#endif
 
     buf[0] = PROTOCOL_BUILD_P;
     memcpy(&(buf[1]), dh_parameter_p, 512);
-    _sendall(channel, buf, 513, 0);
+    buf[513] = (char)(SECURE_SERVER_SUITES | ktls_offered);
+    if (514 != _sendall(channel, buf, 514, 0) || 514 != _recvall(channel, buf, 514, 0)) {
+        return -1;
+    }
 
-    dh = DH_new();
-    BN_hex2bn(&p, dh_parameter_p);
-    g = BN_new();
-    BN_set_word(g, dh_parameter_g);
-    DH_set0_pqg(dh, p, NULL, g);
-    DH_generate_key(dh);
+    if (buf[0] == PROTOCOL_BUILD_RESUME) {
+        suite = (unsigned char)buf[513];
+        if (_suite_known(suite & ~SECURE_SUITE_KTLS) &&
+            0 == _ticket_open((unsigned char *)&(buf[33]), secret, state)) {
+            RAND_bytes(server_random, 32);
+            _derive_resumed_key(key, suite & ~SECURE_SUITE_KTLS, 1, secret,
+                                (unsigned char *)&(buf[1]), server_random);
+            OPENSSL_cleanse(secret, 32);
 
-    pub_key = BN_bn2hex(DH_get0_pub_key(dh));
-    buf[0] = PROTOCOL_BUILD_PUBK;
-    memcpy(&(buf[1]), pub_key, 512);
-    _sendall(channel, buf, 513, 0);
+            memset(buf, 0, 514);
+            buf[0] = PROTOCOL_BUILD_RESUME;
+            memcpy(&(buf[1]), server_random, 32);
+            buf[513] = (char)(suite & ktls_offered);
+            if (514 != _sendall(channel, buf, 514, 0)) {
+                return -1;
+            }
+            if ((suite & ktls_offered) && secure_ktls_enable(channel, key) < 0) {
+                return -1;
+            }
+            return 1;
+        }
+    } else if (buf[0] != PROTOCOL_BUILD_HELLO) {
+        return -1;
+    }
+
+    _keypair_take(&keypair);
 
-    _recvall(channel, buf, 513, 0);
+    buf[0] = PROTOCOL_BUILD_PUBK;
+    memcpy(&(buf[1]), keypair.pub_key, 512);
+    buf[513] = 0;
+    if (514 != _sendall(channel, buf, 514, 0) || 514 != _recvall(channel, buf, 514, 0)) {
+        _keypair_free(&keypair);
+        return -1;
+    }
+    suite = (unsigned char)buf[513];
     buf[513] = '\0';
-    BN_hex2bn(&peer_pub_key, &(buf[1]));
+    /* no pool worker gets a key that is no number, one out of range fails DH_compute_key */
+    if (0 == BN_hex2bn(&peer_pub_key, &(buf[1]))) {
+        _keypair_free(&keypair);
+        return -1;
+    }
 
-    /* shared_key is 256 bytes */
-    shared_key = (unsigned char *)OPENSSL_malloc(DH_size(dh));
-    DH_compute_key(shared_key, peer_pub_key, dh);
+    /* shared_key is 256 bytes at most */
+    task.keypair = &keypair;
+    task.peer_pub_key = peer_pub_key;
+    task.shared_key = (unsigned char *)OPENSSL_malloc(DH_size(keypair.dh));
+    _crypto_run(_compute_routine, &task);
 
-    memcpy(key, shared_key, 32);
-    memcpy(iv, shared_key + 32, 16);
+    /* DH_compute_key returns -1 for a public key out of range, it is no length */
+    if (task.shared_len <= 0) {
+        OPENSSL_clear_free(task.shared_key, DH_size(keypair.dh));
+        BN_free(peer_pub_key);
+        _keypair_free(&keypair);
+        return -1;
+    }
+    _derive_key(key, suite & ~SECURE_SUITE_KTLS, 1, task.shared_key, task.shared_len);
 
-    OPENSSL_free(shared_key);
+    OPENSSL_clear_free(task.shared_key, DH_size(keypair.dh));
     BN_free(peer_pub_key);
-    OPENSSL_free(pub_key);
-    DH_free(dh);
+    _keypair_free(&keypair);
+
+    if (((suite & SECURE_SUITE_KTLS) & ~ktls_offered) || !_suite_known(key->suite)) {
+        return -1;
+    }
+    if (suite & SECURE_SUITE_KTLS) {
+        return secure_ktls_enable(channel, key);
+    }
 
     return 0;
 }
 
 void secure_server_finish(void)
 {
+    lock_acquire(&keypair_lock);
+    refill_exit = 1;
+    sync_cond_signal(&keypair_cond);
+    lock_release(&keypair_lock);
+    pthread_join(refill_thread, NULL);
+    pool_finish(crypto_pool);
+    for (int i = 0; i < keypair_num; ++i) {
+        _keypair_free(&(keypairs[i]));
+    }
+    keypair_num = 0;
+
     OPENSSL_free(dh_parameter_p);
+    OPENSSL_cleanse(ticket_keys, sizeof(ticket_keys));
 }
 
 int secure_client_init(void)
@@ -170,7 +1628,17 @@ int secure_client_init(void)
     return 0;
 }
 
-int secure_client_buildkey(int channel, unsigned char * key, unsigned char * iv)
+/** secure_client_buildkey return value:
+ *     return  0 if succeed by the dh exchange
+ *     return  1 if succeed by ticket
+ *     return -1 if connection is broken, the server offers no known suite or
+ *               both ends asked for ktls and the kernel would not take the keys
+ *  secure_client_buildkey note:
+ *     ticket may be NULL, a ticket the server turns down falls back to the
+ *     dh exchange
+*/
+int secure_client_buildkey(int channel, struct secure_key * key,
+                           const struct secure_ticket * ticket)
 {
     DH * dh;
     BIGNUM * p = NULL;
@@ -178,42 +1646,122 @@ int secure_client_buildkey(int channel, unsigned char * key, unsigned char * iv)
     BIGNUM * peer_pub_key = NULL;
     char * pub_key;
     unsigned char * shared_key;
+    unsigned char client_random[32];
     char buf[1024];
+    char peer[514];
+    int shared_len;
+    int offered, suite, ktls, ktls_able;
 
-    _recvall(channel, buf, 513, 0);
-    buf[513] = '\0';
-    BN_hex2bn(&p, &(buf[1]));
+#ifdef SECURE_KTLS
+    ktls_able = (_ktls_attach(channel) == 0);
+#else
+    ktls_able = 0;
+#endif
+
+    memset(buf, 0, 514);
+    if (ticket != NULL) {
+        RAND_bytes(client_random, 32);
+        buf[0] = PROTOCOL_BUILD_RESUME;
+        memcpy(&(buf[1]), client_random, 32);
+        memcpy(&(buf[33]), ticket->ticket, SECURE_TICKET_LEN);
+        buf[513] = (char)(ticket->suite | (ktls_able ? SECURE_SUITE_KTLS : 0));
+    } else {
+        buf[0] = PROTOCOL_BUILD_HELLO;
+    }
+    if (514 != _sendall(channel, buf, 514, 0) || 514 != _recvall(channel, buf, 514, 0)) {
+        return -1;
+    }
+    offered = (unsigned char)buf[513];
+
+    /* the server answers a ticket with its random, or with its dh_pubk if it turns the ticket down */
+    if (ticket != NULL) {
+        if (514 != _recvall(channel, peer, 514, 0)) {
+            return -1;
+        }
+        if (peer[0] == PROTOCOL_BUILD_RESUME) {
+            _derive_resumed_key(key, ticket->suite, 0, ticket->secret, client_random,
+                                (unsigned char *)&(peer[1]));
+            if ((peer[513] & SECURE_SUITE_KTLS) && secure_ktls_enable(channel, key) < 0) {
+                return -1;
+            }
+            return 1;
+        }
+    }
+
+    if ((offered & SECURE_SUITE_AES_256_GCM) && 
+        (_aes_in_hardware() || !(offered & SECURE_SUITE_CHACHA20_POLY1305))) {
+        suite = SECURE_SUITE_AES_256_GCM;
+    } else if (offered & SECURE_SUITE_CHACHA20_POLY1305) {
+        suite = SECURE_SUITE_CHACHA20_POLY1305;
+    } else {
+        return -1;
+    }
+    ktls = (offered & SECURE_SUITE_KTLS) && ktls_able;
 
+    buf[513] = '\0';
+    if (0 == BN_hex2bn(&p, &(buf[1]))) {
+        return -1;
+    }
     dh = DH_new();
     g = BN_new();
     BN_set_word(g, dh_parameter_g);
     DH_set0_pqg(dh, p, NULL, g);
     DH_generate_key(dh);
 
-    _recvall(channel, buf, 513, 0);
-    buf[513] = '\0';
-    BN_hex2bn(&peer_pub_key, &(buf[1]));
+    if (ticket == NULL && 514 != _recvall(channel, peer, 514, 0)) {
+        DH_free(dh);
+        return -1;
+    }
+    peer[513] = '\0';
+    /* a public key that is no number, or one DH_compute_key turns down, ends the handshake */
+    if (0 == BN_hex2bn(&peer_pub_key, &(peer[1]))) {
+        DH_free(dh);
+        return -1;
+    }
 
     pub_key = BN_bn2hex(DH_get0_pub_key(dh));
     buf[0] = PROTOCOL_BUILD_PUBK;
     memcpy(&(buf[1]), pub_key, 512);
-    _sendall(channel, buf, 513, 0);
+    buf[513] = (char)(suite | (ktls ? SECURE_SUITE_KTLS : 0));
+    if (514 != _sendall(channel, buf, 514, 0)) {
+        OPENSSL_free(pub_key);
+        BN_free(peer_pub_key);
+        DH_free(dh);
+        return -1;
+    }
 
-    /* shared_key is 256 bytes */
+    /* shared_key is 256 bytes at most */
     shared_key = (unsigned char *)OPENSSL_malloc(DH_size(dh));
-    DH_compute_key(shared_key, peer_pub_key, dh);
+    shared_len = DH_compute_key(shared_key, peer_pub_key, dh);
 
-    memcpy(key, shared_key, 32);
-    memcpy(iv, shared_key + 32, 16);
+    if (shared_len > 0) {
+        _derive_key(key, suite, 0, shared_key, shared_len);
+    }
 
-    OPENSSL_free(shared_key);
+    OPENSSL_clear_free(shared_key, DH_size(dh));
     OPENSSL_free(pub_key);
     BN_free(peer_pub_key);
     DH_free(dh);
 
+    if (shared_len <= 0) {
+        return -1;
+    }
+
+    if (ktls) {
+        return secure_ktls_enable(channel, key);
+    }
+
     return 0;
 }
 
+void secure_client_ticket(const struct secure_key * key, const unsigned char * ticket,
+                          struct secure_ticket * out)
+{
+    out->suite = key->suite;
+    memcpy(out->ticket, ticket, SECURE_TICKET_LEN);
+    memcpy(out->secret, key->resume_secret, 32);
+}
+
 void secure_client_finish(void)
 {
     ;
@@ -1,15 +1,24 @@
+#define _GNU_SOURCE
 #include "protocol.h"
 #include "log.h"
 #include "secure.h"
 #include "database.h"
 #include "queue.h"
+#include "batch.h"
+#include "pool.h"
+#include "metrics.h"
+#include "trace.h"
+#include "capture.h"
+#include "sync.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <sched.h>
 #include <mysql/mysql.h>
 #include <string.h>
 #include <errno.h>
@@ -19,94 +28,274 @@
 #include <time.h>
 #include <stdbool.h>
 
+struct shard
+{
+    pthread_t thread;
+    int id;
+    int listen_socket;
+};
+
 struct thread_info
 {
     pthread_t thread;
     int channel;
+    uint32_t trace_id;      /* 0 if the connection is not traced */
+    struct pool_owner owner;    /* pool tasks of the session complete here */
 };
 
-struct chat_rw_thread_info
+struct chat_stream
+{
+    char peername[65];
+    uint64_t message_id;
+    int open;
+    int caught_up;
+};
+
+/* a chat request, handled on the session thread or put on the pool */
+struct chat_job
+{
+    struct pool_task task;
+    struct chat_info * chat;
+    char buf[811];
+    uint64_t start;
+    int ret;
+};
+
+struct chat_info
 {
-    pthread_t thread;
     int channel;
-    const unsigned char * key;
-    const unsigned char * iv;
+    struct secure_key * key;
+    MYSQL * mysql;
     const char * username;
-    const char * peername;
-    pthread_mutex_t * exit_flag_lock;
-    volatile int * exit_flag;
+    int codec;
+    struct thread_info * info;
+    /* stream 0 is the connection itself */
+    struct chat_stream streams[SERVER_MAX_STREAM_NUM + 1];
+    /* first stream of the next sync round */
+    int start;
+    int sync_flag;
+    /* requests in the order they came, jobs[job_head] is being handled */
+    struct chat_job jobs[SERVER_CHAT_JOB_NUM];
+    int job_head;
+    int job_num;
+    int job_busy;           /* jobs[job_head] is on the pool */
+};
+
+/* sign in / sign up on a pool worker */
+struct auth_task
+{
+    struct pool_task task;
+    struct thread_info * info;
+    struct secure_session * session;
+    char * buf;             /* the request, the reply is built over it */
+    char * username;
+    int * codec;
+    uint64_t start;
+    int ret;
+};
+
+/* a friend request of friend mode on a pool worker */
+struct friend_task
+{
+    struct pool_task task;
+    struct thread_info * info;
+    struct secure_session * session;
+    const char * username;
+    char buf[70];
+    uint64_t start;
+    int flag;
+    int busy;               /* on the pool, friend_reply has not run yet */
+};
+
+struct chat_sync_task
+{
+    struct pool_task task;
+    struct chat_info * chat;
+    int stream_id;
+    int pooled;             /* 0 if it has run on the session thread */
+    result_t * result;
 };
 
-static sem_t thread_sem;
+#if SERVER_INBOX_PAGE_ROWS * 875 > BATCH_MAX_SIZE
+#error "an inbox page does not fit in a batch"
+#endif
+
+static struct shard shards[SERVER_ACCEPTOR_NUM];
 static struct thread_info threads[SERVER_MAX_CLIENT_NUM];
+/* free session slots, shared by every shard */
+static struct sync_sem thread_sem;
 static struct queue * q;
+static struct pool * pool;
 
 static void database_warmup(void);
+static void * pool_worker_init(void);
+static void pool_worker_finish(void * worker_data);
+static int _listen(void);
+static void * acceptor_routine(void * arg);
 static void * thread_start_routine(void * arg);
 
 int main(int argc, char ** argv)
 {
-    int server_socket, channel;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addrlen;
-    struct thread_info * info;
-
     log_init();
+    /* before any thread, they all inherit the blocked SIGUSR2 */
+    if (trace_init() != 0) {
+        log_print(LOG_WARNING, "server: spans are not dumped, errno: %d", errno);
+    }
+    if (metrics_init() != 0) {
+        log_print(LOG_WARNING, "server: metrics are not exported, errno: %d", errno);
+    }
+    if (capture_init(SERVER_CAPTURE_FILENAME) != 0) {
+        log_print(LOG_WARNING, "server: records are not captured, errno: %d", errno);
+    }
     secure_server_init();
     database_init();
     database_warmup();
-    sem_init(&thread_sem, 0, SERVER_MAX_CLIENT_NUM);
+    pool = pool_init(SERVER_POOL_WORKER_NUM, pool_worker_init, pool_worker_finish);
+
+    sync_sem_init(&thread_sem, 0);
     q = queue_init(SERVER_MAX_CLIENT_NUM);
     for (int i = 0; i < SERVER_MAX_CLIENT_NUM; ++i) {
+        if (pool_owner_init(&(threads[i].owner)) != 0) {
+            log_print(LOG_ERROR, "server: pipe fails with errno: %d", errno);
+            return 1;
+        }
         enqueue(q, &(threads[i]));
+        sync_sem_post(&thread_sem);
+    }
+
+    for (int i = 0; i < SERVER_ACCEPTOR_NUM; ++i) {
+        shards[i].id = i;
+        shards[i].listen_socket = _listen();
+        if (shards[i].listen_socket == -1) {
+            log_print(LOG_ERROR, "server: listen fails with errno: %d", errno);
+            return 1;
+        }
+    }
+    for (int i = 0; i < SERVER_ACCEPTOR_NUM; ++i) {
+        pthread_create(&(shards[i].thread), NULL, acceptor_routine, &(shards[i]));
     }
 
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    log_print(LOG_INFO, "server: starts");
+
+    for (int i = 0; i < SERVER_ACCEPTOR_NUM; ++i) {
+        pthread_join(shards[i].thread, NULL);
+    }
+
+    for (int i = 0; i < SERVER_ACCEPTOR_NUM; ++i) {
+        close(shards[i].listen_socket);
+    }
+    queue_finish(q);
+    pool_finish(pool);
+    for (int i = 0; i < SERVER_MAX_CLIENT_NUM; ++i) {
+        pool_owner_finish(&(threads[i].owner));
+    }
+    database_finish();
+    secure_server_finish();
+    capture_finish();
+    metrics_finish();
+    trace_finish();
+    log_finish();
+
+    return 0;
+}
+
+/** _listen return value:
+ *     return the listening socket
+ *     return -1 if meet error
+ *  _listen note:
+ *     every acceptor listens on its own socket bound with SO_REUSEPORT,
+ *     the kernel spreads incoming connections among them
+*/
+static int _listen(void)
+{
+    struct sockaddr_in server_addr;
+    int listen_socket;
+    int on = 1;
+
+    listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_socket == -1) {
+        return -1;
+    }
+
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
 
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(SERVER_PORT);
     inet_aton(SERVER_IP, &(server_addr.sin_addr));
-    bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr));
 
-    listen(server_socket, SERVER_MAX_CLIENT_NUM);
+    if (0 != bind(listen_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) ||
+        0 != listen(listen_socket, SERVER_LISTEN_BACKLOG)) {
+        close(listen_socket);
+        return -1;
+    }
+
+    return listen_socket;
+}
 
-    log_print(LOG_INFO, "server: starts");
+/** acceptor_routine note:
+ *     accepts a connection of its shard, then takes a session slot of the
+ *     process, it only waits for one while all of them are taken, so a
+ *     connection never stays in the backlog of one shard while another
+ *     shard has a free slot,
+ *     with SERVER_ACCEPTOR_PIN the acceptor is pinned to one cpu, and the
+ *     session threads it creates inherit the affinity
+*/
+static void * acceptor_routine(void * arg)
+{
+    struct shard * shard;
+    struct thread_info * info;
+    struct sockaddr_in client_addr;
+    socklen_t addrlen;
+    char addr_string[INET_ADDRSTRLEN];
+    int channel;
+    int on = 1;
+#ifdef SERVER_ACCEPTOR_PIN
+    cpu_set_t cpuset;
+#endif /* SERVER_ACCEPTOR_PIN */
+
+    shard = arg;
+
+#ifdef SERVER_ACCEPTOR_PIN
+    CPU_ZERO(&cpuset);
+    CPU_SET(shard->id % sysconf(_SC_NPROCESSORS_ONLN), &cpuset);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+#endif /* SERVER_ACCEPTOR_PIN */
 
     while (true)
     {
-        sem_wait(&thread_sem);
-        info = (struct thread_info *)dequeue(q);
-
         addrlen = sizeof(client_addr);
-        channel = accept(server_socket, (struct sockaddr *)&client_addr, &addrlen);
+        channel = accept4(shard->listen_socket, (struct sockaddr *)&client_addr, &addrlen, 
+                          SOCK_NONBLOCK | SOCK_CLOEXEC);
 
         if (channel == -1)
         {
-            enqueue(q, info);
-            sem_post(&thread_sem);
-            log_print(LOG_ERROR, "server: accept() fails with errno: %d", errno);
+            log_print(LOG_ERROR, "server: acceptor %d: accept4() fails with errno: %d", 
+                                 shard->id, errno);
             continue;
         }
+        sync_sem_wait(&thread_sem);
+        info = (struct thread_info *)dequeue(q);
+        metrics_add(METRICS_CONNECTIONS, 1);
+        info->trace_id = trace_new_id();
 
         log_print(LOG_INFO, "server: thread %d/%d establishes connection with: %s:%hu",
                             (int)(info - threads),
                             SERVER_MAX_CLIENT_NUM - 1,
-                            inet_ntoa(client_addr.sin_addr),
+                            inet_ntop(AF_INET, &(client_addr.sin_addr), 
+                                      addr_string, INET_ADDRSTRLEN),
                             ntohs(client_addr.sin_port));
 
+        /* a reply is often several small records, do not hold them back for acks */
+        setsockopt(channel, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
         info->channel = channel;
         pthread_create(&(info->thread), NULL, thread_start_routine, info);
+        pthread_detach(info->thread);
     }
 
-    close(server_socket);
-    queue_finish(q);
-    sem_destroy(&thread_sem);
-    database_finish();
-    secure_server_finish();
-    log_finish();
-
-    return 0;
+    return NULL;
 }
 
 static void database_warmup(void)
@@ -114,24 +303,52 @@ static void database_warmup(void)
     MYSQL * mysql;
 
     mysql = database_connect();
-    database_create_table(mysql, "user", 
-            "username varchar(64) character set utf8mb4 not null primary key, \
-             password varchar(64) character set utf8mb4 not null");
-    database_create_table(mysql, "friend", 
-            "username1 varchar(64) character set utf8mb4 not null, \
-             username2 varchar(64) character set utf8mb4 not null, \
-             state tinyint not null, \
-             primary key (username1, username2)");
-    database_create_table(mysql, "message", 
-            "id bigint not null auto_increment primary key, \
-             username1 varchar(64) character set utf8mb4 not null, \
-             username2 varchar(64) character set utf8mb4 not null, \
-             time double not null, \
-             content varchar(800) character set utf8mb4, \
-             state tinyint not null");
+    database_create_tables(mysql);
     database_disconnect(mysql);
 }
 
+/* every pool worker owns one database connection */
+static void * pool_worker_init(void)
+{
+    database_thread_init();
+
+    return database_connect();
+}
+
+static void pool_worker_finish(void * worker_data)
+{
+    database_disconnect((MYSQL *)worker_data);
+    database_thread_finish();
+}
+
+/* a pool worker records spans for the session it serves for now, returns the id to restore */
+static uint32_t _trace_adopt(struct thread_info * info)
+{
+    uint32_t trace_id = trace_get_id();
+
+    trace_set_id(info->trace_id);
+
+    return trace_id;
+}
+
+/** _pool_call return value:
+ *     return  0 if task has run on a pool worker and then on this thread
+ *     return -3 if it can not be submitted
+ *  _pool_call note:
+ *     for the handlers that have nothing else to do until the reply is sent
+*/
+static int _pool_call(struct thread_info * info, struct pool_task * task, 
+                      void (* then)(void * arg))
+{
+    /* tasks of one session start on one worker, idle workers steal them */
+    if (0 != pool_submit_then(pool, task, (unsigned int)(info - threads), &(info->owner), then) ||
+        0 != pool_complete(&(info->owner))) {
+        return -3;
+    }
+
+    return 0;
+}
+
 static int _database_row_exist(MYSQL * mysql, 
                                const char * table,
                                const char * row_constraint)
@@ -196,45 +413,126 @@ static int _sign_up(MYSQL * mysql,
     return ret;
 }
 
+/* a ticket lets the client come back as username with neither the dh exchange nor a password */
+static void _seal_ticket(const struct secure_key * key, const char * username, int codec,
+                         char * record)
+{
+    char state[SECURE_TICKET_STATE_LEN] = {0};
+
+    strcpy(state, username);
+    state[65] = (char)codec;
+    record[0] = PROTOCOL_TICKET;
+    secure_server_ticket(key, state, (unsigned char *)&(record[1]));
+}
+
+/* secure_recv_view, the record is captured (SERVER_CAPTURE) before it is dispatched */
+static ssize_t _recv_view(struct secure_session * session, size_t len, char ** view)
+{
+    ssize_t ret;
+
+    ret = secure_recv_view(session, len, (void **)view);
+    if (ret > 0) {
+        capture_record(*view, len);
+    }
+
+    return ret;
+}
+
+/** auth_routine note:
+ *     runs on a pool worker, checks or inserts the user
+*/
+static void auth_routine(void * worker_data, void * arg)
+{
+    struct auth_task * auth = arg;
+    uint32_t trace_id;
+
+    trace_id = _trace_adopt(auth->info);
+    if (auth->buf[0] == PROTOCOL_SIGN_IN) {
+        auth->ret = _sign_in((MYSQL *)worker_data, &(auth->buf[1]), &(auth->buf[66]));
+    } else {
+        auth->ret = _sign_up((MYSQL *)worker_data, &(auth->buf[1]), &(auth->buf[66]));
+    }
+    trace_set_id(trace_id);
+}
+
+/** auth_reply note:
+ *     the continuation of auth_routine on the session thread,
+ *     codec is the lesser of the client's and SERVER_BATCH_CODEC,
+ *     a new ticket follows PROTOCOL_SUCCEED
+*/
+static void auth_reply(void * arg)
+{
+    struct auth_task * auth = arg;
+    struct secure_session * session = auth->session;
+    struct iovec records[2];
+    char ticket[1 + SECURE_TICKET_LEN];
+    char * buf = auth->buf;
+    int op;
+
+    op = (buf[0] == PROTOCOL_SIGN_IN) ? METRICS_SIGN_IN : METRICS_SIGN_UP;
+    if (auth->ret == 0) {
+        strcpy(auth->username, &(buf[1]));
+        *(auth->codec) = ((unsigned char)buf[131] < SERVER_BATCH_CODEC) ? (unsigned char)buf[131]
+                                                                          : SERVER_BATCH_CODEC;
+        buf[0] = PROTOCOL_SUCCEED;
+        buf[1] = (char)*(auth->codec);
+        _seal_ticket(session->key, auth->username, *(auth->codec), ticket);
+        records[0].iov_base = buf;
+        records[0].iov_len = 2;
+        records[1].iov_base = ticket;
+        records[1].iov_len = sizeof(ticket);
+        secure_sendv(session->channel, records, 2, 0, session->key);
+    } else if (auth->ret == -1) {
+        buf[0] = PROTOCOL_FAIL;
+        buf[1] = BATCH_CODEC_NULL;
+        secure_send(session->channel, buf, 2, 0, session->key);
+    } else {
+        return;
+    }
+    metrics_time(op, auth->start);
+    trace_end((op == METRICS_SIGN_IN) ? "sign_in" : "sign_up", auth->start);
+}
+
 /** _authentication return value:
  *     return  0 if succeed
  *     return -1 if receive disconnect flag
  *     return -2 if connection is broken
  *     return -3 if meet error
  *     return -4 if message format is incorrect
+ *  _authentication note:
+ *     the query runs on the pool, the reply in auth_reply
 */
-static int _authentication(int channel, 
-                            const unsigned char * key, 
-                            const unsigned char * iv, 
-                            MYSQL * mysql, 
-                            char * username)
+static int _authentication(struct secure_session * session, 
+                            struct thread_info * info, 
+                            char * username,
+                            int * codec)
 {
-    char buf[256];
+    struct auth_task auth;
+    char * buf;
     int ret;
 
     while (true) {
-        ret = secure_recv(channel, buf, 131, 0, key, iv);
+        ret = _recv_view(session, 132, &buf);
         if (ret > 0) {
             if (buf[0] == PROTOCOL_DISCONNECT) {
                 return -1;
             } else if (buf[0] != PROTOCOL_SIGN_IN && buf[0] != PROTOCOL_SIGN_UP) {
                 return -4;
             } else {
-                if (buf[0] == PROTOCOL_SIGN_IN) {
-                    ret = _sign_in(mysql, &(buf[1]), &(buf[66]));
-                } else {
-                    ret = _sign_up(mysql, &(buf[1]), &(buf[66]));
+                auth.info = info;
+                auth.session = session;
+                auth.buf = buf;
+                auth.username = username;
+                auth.codec = codec;
+                auth.start = metrics_now();
+                pool_task_init(&(auth.task), auth_routine, &auth);
+                if (0 != _pool_call(info, &(auth.task), auth_reply)) {
+                    return -3;
                 }
-                if (ret == 0) {
-                    buf[0] = PROTOCOL_SUCCEED;
-                    secure_send(channel, buf, 1, 0, key, iv);
-                    strcpy(username, &(buf[1]));
+                if (auth.ret == 0) {
                     break;
-                } else if (ret == -1) {
-                    buf[0] = PROTOCOL_FAIL;
-                    secure_send(channel, buf, 1, 0, key, iv);
-                } else {
-                    return ret;
+                } else if (auth.ret != -1) {
+                    return auth.ret;
                 }
             }
         } else if (ret == 0) {
@@ -247,37 +545,188 @@ static int _authentication(int channel,
     return 0;
 }
 
+/** _resumption return value:
+ *     return  0 if succeed
+ *     return -2 if connection is broken
+ *  _resumption note:
+ *     username and codec come from the ticket the key was built with,
+ *     a new ticket replaces it
+*/
+static int _resumption(struct secure_session * session,
+                       const char * state,
+                       char * username,
+                       int * codec)
+{
+    char ticket[1 + SECURE_TICKET_LEN];
+
+    memcpy(username, state, 64);
+    username[64] = '\0';
+    *codec = (unsigned char)state[65];
+    _seal_ticket(session->key, username, *codec, ticket);
+
+    return (secure_send(session->channel, ticket, sizeof(ticket), 0, session->key) > 0) ? 0 : -2;
+}
+
+/** _send_inbox note:
+ *     unread messages to username are sent by id in batches of
+ *     SERVER_INBOX_PAGE_ROWS rows, the last one has fewer (maybe none),
+ *     each page is marked as read with a single watermark update once it
+ *     is sent, a page that is not sent stays unread
+*/
+static int _send_inbox(int channel,
+                       struct secure_key * key,
+                       MYSQL * mysql,
+                       const char * username,
+                       int codec,
+                       struct thread_info * info)
+{
+    result_t * result;
+    struct timespec start, end;
+    uint64_t current_id, message_id = 0, page_id;
+    char buf[256];
+    char assignment[16];
+    char * rows;
+    char * row;
+    ssize_t send_len;
+    long total_len = 0;
+    int total = 0;
+    int more;
+    uint64_t metrics_start;
+
+    metrics_start = metrics_now();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    do {
+        page_id = message_id;
+        snprintf(buf, 256, "where username2 = \'%s\' and state = %d and id > %lu order by id limit %d",
+                            username, TABLE_M_STATE_UNREAD, message_id, SERVER_INBOX_PAGE_ROWS);
+        database_select(mysql, "message", "*", buf);
+        result = database_get_result(mysql);
+
+        rows = (char *)calloc(result->r + 1, 875);
+        for (int i = 0; i < result->r; ++i) {
+            row = &(rows[i * 875]);
+            row[0] = PROTOCOL_INBOX;
+            strcpy(&(row[1]), result->rows[i][1]);
+            *((double *)(&(row[66]))) = strtod(result->rows[i][3], NULL);
+            strcpy(&(row[74]), result->rows[i][4]);
+
+            current_id = strtoull(result->rows[i][0], NULL, 10);
+            if (current_id > message_id) {
+                message_id = current_id;
+            }
+        }
+
+        /* the inbox is always a batch, even if the client asks for no batch */
+        send_len = batch_send(channel, key, 14, rows, 875, (int)result->r,
+                              codec, SERVER_BATCH_LEVEL);
+
+        if (send_len > 0 && result->r > 0) {
+            snprintf(assignment, 16, "state = %d", TABLE_M_STATE_READ);
+            snprintf(buf, 256, "where username2 = \'%s\' and state = %d and id > %lu and id <= %lu",
+                                username, TABLE_M_STATE_UNREAD, page_id, message_id);
+            database_update(mysql, "message", assignment, buf);
+            total += (int)result->r;
+        }
+        if (send_len > 0) {
+            total_len += (long)send_len;
+        }
+        more = (send_len > 0 && result->r == SERVER_INBOX_PAGE_ROWS);
+
+        free(rows);
+        database_free_result(result);
+    } while (more);
+
+    metrics_time(METRICS_INBOX_SYNC, metrics_start);
+    trace_end("inbox_sync", metrics_start);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    log_print(LOG_INFO, "thread %d/%d: %s syncs %d unread messages in %ld bytes (%lf s)",
+                        (int)(info - threads),
+                        SERVER_MAX_CLIENT_NUM - 1,
+                        username, total, total_len,
+                        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    return (send_len > 0) ? 0 : -2;
+}
+
+/* sends count rows of row_len bytes, one record per row, with one send */
+static ssize_t _send_rows(int channel,
+                          struct secure_key * key,
+                          char * rows,
+                          int row_len,
+                          int count)
+{
+    struct iovec * records;
+    ssize_t send_len;
+
+    records = (struct iovec *)malloc(count * sizeof(struct iovec));
+    if (records == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < count; ++i) {
+        records[i].iov_base = &(rows[i * row_len]);
+        records[i].iov_len = row_len;
+    }
+    send_len = secure_sendv(channel, records, count, 0, key);
+    free(records);
+
+    return send_len;
+}
+
 static int _send_friendlist(int channel, 
-                            const unsigned char * key, 
-                            const unsigned char * iv, 
+                            struct secure_key * key, 
                             MYSQL * mysql, 
                             const char * username,
-                            int flag)
+                            int flag,
+                            int codec,
+                            uint32_t request_id)
 {
     result_t * result;
+    uint64_t start;
     char buf[256];
+    char * rows;
+    char * row;
+    int count;
     int state;
 
+    start = metrics_now();
     snprintf(buf, 256, "where username1 = \'%s\' or username2 = \'%s\' order by state", 
                         username, username);
     database_select(mysql, "friend", "*", buf);
     result = database_get_result(mysql);
+    rows = (char *)calloc(result->r + 1, 67);
+    count = 0;
     for (int i = 0; i < result->r; ++i) {
         state = (int)strtol(result->rows[i][2], NULL, 10);
         if (state & flag) {
-            buf[0] = PROTOCOL_FRIEND_LIST;
+            row = &(rows[count * 67]);
+            row[0] = PROTOCOL_FRIEND_LIST;
             if (strcmp(username, result->rows[i][0])) {
-                strcpy(&(buf[1]), result->rows[i][0]);
+                strcpy(&(row[1]), result->rows[i][0]);
             } else {
-                strcpy(&(buf[1]), result->rows[i][1]);
+                strcpy(&(row[1]), result->rows[i][1]);
             }
-            buf[66] = (char)state;
-            secure_send(channel, buf, 67, 0, key, iv);
+            row[66] = (char)state;
+            count++;
         }
     }
     database_free_result(result);
-    buf[0] = PROTOCOL_FRIEND_LIST_END;
-    secure_send(channel, buf, 67, 0, key, iv);
+
+    /* the row after the last friend holds LIST_END */
+    row = &(rows[count * 67]);
+    row[0] = PROTOCOL_FRIEND_LIST_END;
+    *((uint32_t *)(&(row[1]))) = request_id;
+    if (codec == BATCH_CODEC_NULL) {
+        _send_rows(channel, key, rows, 67, count + 1);
+    } else {
+        if (count > 0) {
+            batch_send(channel, key, 67, rows, 67, count, codec, SERVER_BATCH_LEVEL);
+        }
+        secure_send(channel, row, 67, 0, key);
+    }
+    free(rows);
+    metrics_time(METRICS_FRIEND_LIST, start);
+    trace_end("friend_list", start);
 
     return 0;
 }
@@ -470,113 +919,406 @@ static int _friend_reject(MYSQL * mysql,
     return 0;
 }
 
+/** _friend_operate return value:
+ *     return the reply flag to a friend request
+ *  _friend_operate note:
+ *     runs on a pool worker, see friend_routine and chat_friend_routine
+*/
+static int _friend_operate(MYSQL * mysql,
+                           const char * username,
+                           int flag,
+                           const char * peername)
+{
+    int ret;
+
+    if (flag == PROTOCOL_FRIEND_ADD) {
+        ret = _friend_add(mysql, username, peername);
+    } else if (flag == PROTOCOL_FRIEND_ACCEPT) {
+        ret = _friend_accept(mysql, username, peername);
+    } else {
+        ret = _friend_reject(mysql, username, peername);
+    }
+
+    if (ret == 0) {
+        return PROTOCOL_SUCCEED;
+    } else if (ret == -1) {
+        return PROTOCOL_FAIL;
+    } else {
+        return PROTOCOL_ERROR;
+    }
+}
+
+/* the time of a friend request from the time it is read to its reply */
+static void _friend_time(int flag, uint64_t start)
+{
+    if (flag == PROTOCOL_FRIEND_ADD) {
+        metrics_time(METRICS_FRIEND_ADD, start);
+        trace_end("friend_add", start);
+    } else if (flag == PROTOCOL_FRIEND_ACCEPT) {
+        metrics_time(METRICS_FRIEND_ACCEPT, start);
+        trace_end("friend_accept", start);
+    } else {
+        metrics_time(METRICS_FRIEND_REJECT, start);
+        trace_end("friend_reject", start);
+    }
+}
+
+static void friend_routine(void * worker_data, void * arg)
+{
+    struct friend_task * friend = arg;
+    uint32_t trace_id;
+
+    trace_id = _trace_adopt(friend->info);
+    friend->flag = _friend_operate((MYSQL *)worker_data, friend->username, friend->buf[0], 
+                                   &(friend->buf[5]));
+    trace_set_id(trace_id);
+}
+
+/* the continuation of friend_routine on the session thread */
+static void friend_reply(void * arg)
+{
+    struct friend_task * friend = arg;
+    char * buf = friend->buf;
+
+    _friend_time(buf[0], friend->start);
+    buf[0] = (char)friend->flag;
+    /* buf[1] ~ buf[4] still hold the request id */
+    memset(&(buf[5]), 0, 62);
+    secure_send(friend->session->channel, buf, 67, 0, friend->session->key);
+    friend->busy = 0;
+}
+
+/** _friend_wait return value:
+ *     return  0 if a request on the pool has been replied to
+ *     return -3 if meet error
+*/
+static int _friend_wait(struct thread_info * info)
+{
+    /* the replies that are corked go out before this thread waits */
+    secure_flush();
+
+    return (0 == pool_complete(&(info->owner))) ? 0 : -3;
+}
+
+/** _friend_slot return value:
+ *     return the task the request in buf runs in
+ *     return NULL if meet error
+ *  _friend_slot note:
+ *     a request waits for the one on the pool with the same username, and
+ *     for a free task if SERVER_FRIEND_JOB_NUM are on the pool
+*/
+static struct friend_task * _friend_slot(struct friend_task * friends, 
+                                         struct thread_info * info,
+                                         const char * buf)
+{
+    struct friend_task * slot;
+    int same;
+
+    while (true) {
+        slot = NULL;
+        same = 0;
+        for (int i = 0; i < SERVER_FRIEND_JOB_NUM; ++i) {
+            if (!friends[i].busy) {
+                slot = (slot == NULL) ? &(friends[i]) : slot;
+            } else if (strcmp(&(friends[i].buf[5]), &(buf[5])) == 0) {
+                same = 1;
+            }
+        }
+        if (slot != NULL && !same) {
+            return slot;
+        }
+        if (0 != _friend_wait(info)) {
+            return NULL;
+        }
+    }
+}
+
 /** _friend return value:
  *     return  0 if succeed
  *     return -2 if connection is broken
  *     return -3 if meet error
  *     return -4 if message format is incorrect
+ *  _friend note:
+ *     requests run on the pool, up to SERVER_FRIEND_JOB_NUM at once, and
+ *     are replied to as they finish while this thread reads the next ones,
+ *     the friend list runs on the session connection once every request
+ *     before it is replied to
 */
-static int _friend(int channel, 
-                   const unsigned char * key, 
-                   const unsigned char * iv, 
+static int _friend(struct secure_session * session, 
                    MYSQL * mysql, 
-                   const char * username)
+                   const char * username,
+                   int codec,
+                   struct thread_info * info)
 {
-    char buf[128];
+    int channel = session->channel;
+    struct secure_key * key = session->key;
+    struct friend_task friends[SERVER_FRIEND_JOB_NUM];
+    struct friend_task * friend;
+    struct pollfd pfd[2];
+    char * buf;
     int ret;
 
+    _send_friendlist(channel, key, mysql, username, 
+            TABLE_F_STATE_SEND | TABLE_F_STATE_RECV | TABLE_F_STATE_BEING, codec, 0);
+
+    memset(friends, 0, sizeof(friends));
+    pfd[0].fd = channel;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = info->owner.fd[0];
+    pfd[1].events = POLLIN;
+
     while (true) {
-        _send_friendlist(channel, key, iv, mysql, username, 
-                TABLE_F_STATE_SEND | TABLE_F_STATE_RECV | TABLE_F_STATE_BEING);
+        /* with requests on the pool, whichever comes first, a reply or the next request */
+        if (info->owner.inflight > 0 && secure_session_buffered(session) == 0) {
+            secure_flush();
+            ret = poll(pfd, 2, -1);
+            if (ret == -1 && errno == EINTR) {
+                continue;
+            } else if (ret == -1) {
+                ret = -3;
+                break;
+            }
+            if ((pfd[1].revents & POLLIN) && 0 != pool_complete(&(info->owner))) {
+                ret = -3;
+                break;
+            }
+            if (pfd[0].revents == 0) {
+                continue;
+            }
+        }
 
-        ret = secure_recv(channel, buf, 66, 0, key, iv);
-        if (ret > 0) {
-            if (buf[0] == PROTOCOL_FINISH) {
+        ret = _recv_view(session, 70, &buf);
+        if (ret == 0) {
+            ret = -2;
+            break;
+        } else if (ret < 0) {
+            ret = -3;
+            break;
+        }
+
+        buf[69] = '\0';
+        if (buf[0] == PROTOCOL_FINISH || buf[0] == PROTOCOL_FRIEND_REFRESH) {
+            /* the list reflects every request before it */
+            ret = 0;
+            while (ret == 0 && info->owner.inflight > 0) {
+                ret = _friend_wait(info);
+            }
+            if (ret != 0 || buf[0] == PROTOCOL_FINISH) {
                 break;
-            } else if (buf[0] != PROTOCOL_FRIEND_ADD &
-                       buf[0] != PROTOCOL_FRIEND_ACCEPT &
-                       buf[0] != PROTOCOL_FRIEND_REJECT) {
-                return -4;
-            } else {
-                if (buf[0] == PROTOCOL_FRIEND_ADD) {
-                    ret = _friend_add(mysql, username, &(buf[1]));
-                } else if (buf[0] == PROTOCOL_FRIEND_ACCEPT) {
-                    ret = _friend_accept(mysql, username, &(buf[1]));
-                } else {
-                    ret = _friend_reject(mysql, username, &(buf[1]));
-                }
-                if (ret == 0) {
-                    buf[0] = PROTOCOL_SUCCEED;
-                } else if (ret == -1) {
-                    buf[0] = PROTOCOL_FAIL;
-                } else {
-                    buf[0] = PROTOCOL_ERROR;
-                }
-                secure_send(channel, buf, 1, 0, key, iv);
             }
-        } else if (ret == 0) {
-            return -2;
+            _send_friendlist(channel, key, mysql, username, 
+                    TABLE_F_STATE_SEND | TABLE_F_STATE_RECV | TABLE_F_STATE_BEING, codec,
+                    *((uint32_t *)(&(buf[1]))));
+        } else if (buf[0] != PROTOCOL_FRIEND_ADD &&
+                   buf[0] != PROTOCOL_FRIEND_ACCEPT &&
+                   buf[0] != PROTOCOL_FRIEND_REJECT) {
+            ret = -4;
+            break;
         } else {
-            return -3;
+            friend = _friend_slot(friends, info, buf);
+            if (friend == NULL) {
+                ret = -3;
+                break;
+            }
+            friend->info = info;
+            friend->session = session;
+            friend->username = username;
+            memcpy(friend->buf, buf, 70);
+            friend->start = metrics_now();
+            friend->busy = 1;
+            pool_task_init(&(friend->task), friend_routine, friend);
+            /* tasks of one session start on one worker, idle workers steal them */
+            if (0 != pool_submit_then(pool, &(friend->task), (unsigned int)(info - threads), 
+                                      &(info->owner), friend_reply)) {
+                friend->busy = 0;
+                ret = -3;
+                break;
+            }
         }
     }
 
-    return 0;
+    /* the tasks on the pool point into friends */
+    while (info->owner.inflight > 0 && pool_complete(&(info->owner)) == 0) {
+    }
+
+    return ret;
 }
 
-static int _send_messagelist(int channel, 
-                             const unsigned char * key, 
-                             const unsigned char * iv, 
-                             MYSQL * mysql, 
-                             const char * username, 
-                             const char * peername, 
-                             uint64_t * message_id)
+static ssize_t _chat_reply(struct chat_info * chat, 
+                           int flag, 
+                           int stream_id, 
+                           uint32_t request_id)
 {
-    result_t * result;
-    uint64_t current_id;
     char buf[1024];
-    char assignment[16];
-    char constraint[64];
-    int is_receiver;
-    int state;
 
+    memset(buf, 0, 813);
+    buf[0] = (char)flag;
+    buf[1] = (char)stream_id;
+    *((uint32_t *)(&(buf[2]))) = request_id;
+
+    return secure_send(chat->channel, buf, 813, 0, chat->key);
+}
+
+/** chat_sync_routine note:
+ *     runs on a pool worker, selects the next page of one stream
+*/
+static void chat_sync_routine(void * worker_data, void * arg)
+{
+    struct chat_sync_task * sync = arg;
+    struct chat_stream * stream;
+    char buf[1024];
+    uint32_t trace_id;
+    uint64_t start;
+
+    stream = &(sync->chat->streams[sync->stream_id]);
+    trace_id = _trace_adopt(sync->chat->info);
+    start = trace_begin();
+
+    /* paged by id, so that a page boundary never skips a row */
     snprintf(buf, 1024, "where id > %lu and ( \
                             (username1 = \'%s\' and username2 = \'%s\') or \
                             (username1 = \'%s\' and username2 = \'%s\') \
-                        ) order by time", 
-                        *message_id, username, peername, peername, username);
-    database_select(mysql, "message", "*", buf);
-    result = database_get_result(mysql);
+                        ) order by id limit %d", 
+                        stream->message_id, sync->chat->username, stream->peername, 
+                        stream->peername, sync->chat->username, SERVER_STREAM_SYNC_ROWS);
+    database_select((MYSQL *)worker_data, "message", "*", buf);
+    sync->result = database_get_result((MYSQL *)worker_data);
+    trace_end("stream_page", start);
+    trace_set_id(trace_id);
+}
+
+/** _send_messagelist return value:
+ *     return  1 if the stream has more than SERVER_STREAM_SYNC_ROWS new rows
+ *     return  0 otherwise
+ *  _send_messagelist note:
+ *     sends the page selected by chat_sync_routine and frees it,
+ *     PROTOCOL_CHAT_LIST_END is sent once, when the history is caught up
+*/
+static int _send_messagelist(struct chat_info * chat, int stream_id, result_t * result)
+{
+    struct chat_stream * stream;
+    uint64_t current_id, unread_id = 0;
+    char buf[1024];
+    char assignment[16];
+    char * rows;
+    char * row;
+    int is_receiver;
+    int state;
+    int more, end;
+
+    stream = &(chat->streams[stream_id]);
+
+    rows = (char *)calloc(result->r + 1, 813);
     for (int i = 0; i < result->r; ++i) {
-        buf[0] = PROTOCOL_CHAT_LIST;
-        is_receiver = strcmp(username, result->rows[i][1]);
+        row = &(rows[i * 813]);
+        row[0] = PROTOCOL_CHAT_LIST;
+        row[1] = (char)stream_id;
+        is_receiver = strcmp(chat->username, result->rows[i][1]);
         if (is_receiver) {
-            buf[1] = PROTOCOL_CHAT_LIST_RECV;
+            row[2] = PROTOCOL_CHAT_LIST_RECV;
         } else {
-            buf[1] = PROTOCOL_CHAT_LIST_SEND;
+            row[2] = PROTOCOL_CHAT_LIST_SEND;
         }
-        *((double *)(&(buf[2]))) = strtod(result->rows[i][3], NULL);
-        strcpy(&(buf[10]), result->rows[i][4]);
+        *((double *)(&(row[3]))) = strtod(result->rows[i][3], NULL);
+        strcpy(&(row[11]), result->rows[i][4]);
         state = (int)strtol(result->rows[i][5], NULL, 10);
-        buf[811] = (char)state;
-        secure_send(channel, buf, 812, 0, key, iv);
+        row[812] = (char)state;
 
         current_id = strtoull(result->rows[i][0], NULL, 10);
-        if (current_id > *message_id) {
-            *message_id = current_id;
+        if (current_id > stream->message_id) {
+            stream->message_id = current_id;
         }
-
         if (is_receiver && state == TABLE_M_STATE_UNREAD) {
-            snprintf(assignment, 16, "state = %d", TABLE_M_STATE_READ);
-            snprintf(constraint, 64, "where id = %lu", current_id);
-            database_update(mysql, "message", assignment, constraint);
+            unread_id = current_id;
         }
     }
+    more = (result->r == SERVER_STREAM_SYNC_ROWS);
+    end = (!more && !stream->caught_up);
+
+    /* the spare row after the page holds LIST_END, see _chat_reply */
+    if (end) {
+        stream->caught_up = 1;
+        row = &(rows[result->r * 813]);
+        row[0] = PROTOCOL_CHAT_LIST_END;
+        row[1] = (char)stream_id;
+    }
+    if (chat->codec == BATCH_CODEC_NULL) {
+        if (result->r + end > 0) {
+            _send_rows(chat->channel, chat->key, rows, 813, (int)result->r + end);
+        }
+    } else {
+        if (result->r > 0) {
+            batch_send(chat->channel, chat->key, 813, rows, 813, 
+                       (int)result->r, chat->codec, SERVER_BATCH_LEVEL);
+        }
+        if (end) {
+            secure_send(chat->channel, &(rows[result->r * 813]), 813, 0, chat->key);
+        }
+    }
+
+    free(rows);
     database_free_result(result);
-    buf[0] = PROTOCOL_CHAT_LIST_END;
-    secure_send(channel, buf, 812, 0, key, iv);
 
-    return 0;
+    if (unread_id > 0) {
+        snprintf(assignment, 16, "state = %d", TABLE_M_STATE_READ);
+        snprintf(buf, 1024, "where username1 = \'%s\' and username2 = \'%s\' and \
+                                   state = %d and id <= %lu",
+                            stream->peername, chat->username, TABLE_M_STATE_UNREAD, unread_id);
+        database_update(chat->mysql, "message", assignment, buf);
+    }
+
+    return more;
+}
+
+/** _chat_sync return value:
+ *     return  1 if any stream has rows left
+ *     return  0 otherwise
+ *  _chat_sync note:
+ *     the pages of all open streams are selected on the pool at once, then
+ *     sent from this thread, round-robin, at most SERVER_STREAM_SYNC_ROWS
+ *     rows each per round, the first stream of a round rotates, so one long
+ *     history can not hold back the other streams
+*/
+static int _chat_sync(struct chat_info * chat)
+{
+    struct chat_sync_task tasks[SERVER_MAX_STREAM_NUM];
+    uint64_t start;
+    int task_num = 0;
+    int more = 0;
+    int stream_id;
+
+    start = metrics_now();
+    for (int i = 0; i < SERVER_MAX_STREAM_NUM; ++i) {
+        stream_id = 1 + (chat->start + i) % SERVER_MAX_STREAM_NUM;
+        if (chat->streams[stream_id].open) {
+            tasks[task_num].chat = chat;
+            tasks[task_num].stream_id = stream_id;
+            pool_task_init(&(tasks[task_num].task), chat_sync_routine, &(tasks[task_num]));
+            /* tasks of one session start on one worker, idle workers steal them */
+            tasks[task_num].pooled = (0 == pool_submit(pool, &(tasks[task_num].task), 
+                                                       (unsigned int)(chat->info - threads)));
+            /* the page is selected on the connection of the session if the pool refuses it */
+            if (!tasks[task_num].pooled) {
+                chat_sync_routine(chat->mysql, &(tasks[task_num]));
+            }
+            task_num++;
+        }
+    }
+    chat->start = (chat->start + 1) % SERVER_MAX_STREAM_NUM;
+
+    for (int i = 0; i < task_num; ++i) {
+        if (tasks[i].pooled) {
+            pool_wait(&(tasks[i].task));
+        }
+        more |= _send_messagelist(chat, tasks[i].stream_id, tasks[i].result);
+    }
+    /* a round without an open stream is no sync */
+    if (task_num > 0) {
+        metrics_time(METRICS_HISTORY_SYNC, start);
+        trace_end("history_sync", start);
+    }
+
+    return more;
 }
 
 /** _chat_select return value:
@@ -614,105 +1356,209 @@ static int _chat_select(MYSQL * mysql,
     return 0;
 }
 
-/** chat_r_thread_routine return value:
- *     return  0 if succeed
- *     return -2 if connection is broken
- *     return -3 if meet error
- *     return -4 if message format is incorrect
-*/
-static void * chat_r_thread_routine(void * arg)
+static void chat_message_routine(void * worker_data, void * arg)
 {
-    struct chat_rw_thread_info * info;
-    MYSQL * mysql;
-    char buf[1024];
+    struct chat_job * job = arg;
+    struct chat_info * chat = job->chat;
     char value[1024];
-    int ret;
+    uint32_t trace_id;
+
+    trace_id = _trace_adopt(chat->info);
+    snprintf(value, 1024, "\'%s\', \'%s\', %lf, \'%s\', %d", 
+                            chat->username, 
+                            chat->streams[(unsigned char)job->buf[1]].peername, 
+                            *((double *)(&(job->buf[2]))), 
+                            &(job->buf[10]), 
+                            TABLE_M_STATE_UNREAD);
+    database_insert((MYSQL *)worker_data, 
+                    "message", 
+                    "username1, username2, time, content, state", 
+                    value);
+    trace_set_id(trace_id);
+}
 
-    info = arg;
+static void chat_select_routine(void * worker_data, void * arg)
+{
+    struct chat_job * job = arg;
+    uint32_t trace_id;
 
-    database_thread_init();
-    mysql = database_connect();
+    trace_id = _trace_adopt(job->chat->info);
+    job->ret = _chat_select((MYSQL *)worker_data, job->chat->username, &(job->buf[2]));
+    trace_set_id(trace_id);
+}
 
-    while (true) {
-        ret = secure_recv(info->channel, buf, 810, 0, info->key, info->iv);
-        if (ret > 0) {
-            if (buf[0] == PROTOCOL_FINISH) {
-                ret = 0;
-                break;
-            } else if (buf[0] == PROTOCOL_CHAT_MESSAGE) {
-                snprintf(value, 1024, "\'%s\', \'%s\', %lf, \'%s\', %d", 
-                                        info->username, 
-                                        info->peername, 
-                                        *((double *)(&(buf[1]))), 
-                                        &(buf[9]), 
-                                        TABLE_M_STATE_UNREAD);
-                database_insert(mysql, 
-                                "message", 
-                                "username1, username2, time, content, state", 
-                                value);
-            } else {
-                ret = -4;
-                break;
-            }
-        } else if (ret == 0) {
-            ret = -2;
-            break;
+static void chat_friend_routine(void * worker_data, void * arg)
+{
+    struct chat_job * job = arg;
+    uint32_t trace_id;
+
+    trace_id = _trace_adopt(job->chat->info);
+    job->ret = _friend_operate((MYSQL *)worker_data, job->chat->username, job->buf[0], 
+                               &(job->buf[6]));
+    trace_set_id(trace_id);
+}
+
+/** chat_job_done note:
+ *     the continuation of a job on the session thread, it replies and
+ *     leaves the next job to _chat_next
+*/
+static void chat_job_done(void * arg)
+{
+    struct chat_job * job = arg;
+    struct chat_info * chat = job->chat;
+    struct chat_stream * stream;
+    int stream_id = (unsigned char)job->buf[1];
+
+    if (job->buf[0] == PROTOCOL_CHAT_MESSAGE) {
+        metrics_time(METRICS_MESSAGE_INSERT, job->start);
+        trace_end("message_insert", job->start);
+    } else if (job->buf[0] == PROTOCOL_CHAT_SELECT) {
+        stream = &(chat->streams[stream_id]);
+        if (job->ret == 0) {
+            strcpy(stream->peername, &(job->buf[2]));
+            stream->message_id = 0;
+            stream->caught_up = 0;
+            stream->open = 1;
+            /* sent before the first row of the stream */
+            _chat_reply(chat, PROTOCOL_SUCCEED, stream_id, 0);
+            /* the history is sent at once, not on the next round */
+            chat->sync_flag = 1;
+
+            log_print(LOG_INFO, "thread %d/%d: %s chats with %s on stream %d (%lf s)", 
+                                (int)(chat->info - threads), 
+                                SERVER_MAX_CLIENT_NUM - 1, 
+                                chat->username, stream->peername, stream_id,
+                                (metrics_now() - job->start) / 1e9);
         } else {
-            ret = -3;
-            break;
+            _chat_reply(chat, PROTOCOL_ERROR, stream_id, 0);
         }
+        metrics_time(METRICS_CHAT_SELECT, job->start);
+        trace_end("chat_select", job->start);
+    } else {
+        _friend_time(job->buf[0], job->start);
+        _chat_reply(chat, job->ret, 0, *((uint32_t *)(&(job->buf[2]))));
     }
 
-    database_disconnect(mysql);
-    database_thread_finish();
-
-    return (void *)ret;
+    chat->job_head = (chat->job_head + 1) % SERVER_CHAT_JOB_NUM;
+    chat->job_num--;
+    chat->job_busy = 0;
 }
 
-static void * chat_w_thread_routine(void * arg)
+/** _chat_start return value:
+ *     return  1 if the request is PROTOCOL_FINISH
+ *     return  0 if it is handled on this thread
+ *     return  2 if it is on the pool, chat_job_done finishes it
+ *     return -3 if it can not be submitted
+*/
+static int _chat_start(struct chat_info * chat, struct chat_job * job)
 {
-    struct chat_rw_thread_info * info;
-    struct timespec ts;
-    MYSQL * mysql;
-    uint64_t message_id = 0;
-    int exit_flag = 0;
-    char buf[1024];
+    struct chat_stream * stream;
+    void (* routine)(void * worker_data, void * arg);
+    char * buf = job->buf;
+    int stream_id;
+
+    stream_id = (unsigned char)buf[1];
+    if (stream_id >= 1 && stream_id <= SERVER_MAX_STREAM_NUM) {
+        stream = &(chat->streams[stream_id]);
+    } else {
+        stream = NULL;
+    }
 
-    info = arg;
+    job->start = metrics_now();
+    if (buf[0] == PROTOCOL_FINISH) {
+        return 1;
+    } else if (buf[0] == PROTOCOL_CHAT_MESSAGE) {
+        /* messages to a stream that is already closed are dropped */
+        if (stream == NULL || !stream->open) {
+            return 0;
+        }
+        buf[810] = '\0';
+        routine = chat_message_routine;
+    } else if (buf[0] == PROTOCOL_CHAT_SELECT) {
+        if (stream == NULL || stream->open) {
+            _chat_reply(chat, PROTOCOL_ERROR, stream_id, 0);
+            metrics_time(METRICS_CHAT_SELECT, job->start);
+            trace_end("chat_select", job->start);
+            return 0;
+        }
+        buf[66] = '\0';
+        routine = chat_select_routine;
+    } else if (buf[0] == PROTOCOL_CHAT_CLOSE) {
+        if (stream != NULL && stream->open) {
+            stream->open = 0;
+            /* sent after the last row of the stream */
+            _chat_reply(chat, PROTOCOL_FINISH, stream_id, 0);
+        } else {
+            _chat_reply(chat, PROTOCOL_ERROR, stream_id, 0);
+        }
+        return 0;
+    } else {
+        buf[70] = '\0';
+        routine = chat_friend_routine;
+    }
 
-    ts.tv_sec = (time_t)(SERVER_CHAT_SYN_INTERVAL);
-    ts.tv_nsec = (SERVER_CHAT_SYN_INTERVAL - ts.tv_sec) * 1e9;
+    job->chat = chat;
+    pool_task_init(&(job->task), routine, job);
+    if (0 != pool_submit_then(pool, &(job->task), (unsigned int)(chat->info - threads), 
+                              &(chat->info->owner), chat_job_done)) {
+        return -3;
+    }
 
-    database_thread_init();
-    mysql = database_connect();
+    return 2;
+}
 
-    while (true) {
-        _send_messagelist(info->channel, info->key, info->iv, 
-                          mysql, info->username, info->peername, &message_id);
-
-        #ifdef MULTICORE
-            while (pthread_mutex_trylock(info->exit_flag_lock)) { ; }
-        #else
-            pthread_mutex_lock(info->exit_flag_lock);
-        #endif /* MULTICORE */
-        if (*(info->exit_flag)) {
-            exit_flag = 1;
-        }
-        pthread_mutex_unlock(info->exit_flag_lock);
-
-        if (exit_flag) {
-            buf[0] = PROTOCOL_FINISH;
-            secure_send(info->channel, buf, 812, 0, info->key, info->iv);
-            break;
+/** _chat_next return value:
+ *     return  1 if PROTOCOL_FINISH is reached
+ *     return  0 if succeed
+ *     return -3 if meet error
+ *  _chat_next note:
+ *     starts the queued requests in order until one is on the pool, the
+ *     rest wait for its chat_job_done, so the requests of one connection
+ *     never overtake each other (a message after the select of its stream)
+*/
+static int _chat_next(struct chat_info * chat)
+{
+    int ret;
+
+    while (!chat->job_busy && chat->job_num > 0) {
+        ret = _chat_start(chat, &(chat->jobs[chat->job_head]));
+        if (ret == 2) {
+            chat->job_busy = 1;
+        } else if (ret != 0) {
+            return ret;
+        } else {
+            chat->job_head = (chat->job_head + 1) % SERVER_CHAT_JOB_NUM;
+            chat->job_num--;
         }
+    }
+
+    return 0;
+}
 
-        nanosleep(&ts, NULL);
+/** _chat_request return value:
+ *     return  1 if PROTOCOL_FINISH is reached
+ *     return  0 if succeed
+ *     return -3 if meet error
+ *     return -4 if message format is incorrect
+ *  _chat_request note:
+ *     queues the request, _chat reads no more while SERVER_CHAT_JOB_NUM wait
+*/
+static int _chat_request(struct chat_info * chat, const char * buf)
+{
+    if (buf[0] != PROTOCOL_FINISH &&
+        buf[0] != PROTOCOL_CHAT_MESSAGE &&
+        buf[0] != PROTOCOL_CHAT_SELECT &&
+        buf[0] != PROTOCOL_CHAT_CLOSE &&
+        buf[0] != PROTOCOL_FRIEND_ADD &&
+        buf[0] != PROTOCOL_FRIEND_ACCEPT &&
+        buf[0] != PROTOCOL_FRIEND_REJECT) {
+        return -4;
     }
 
-    database_disconnect(mysql);
-    database_thread_finish();
+    memcpy(chat->jobs[(chat->job_head + chat->job_num) % SERVER_CHAT_JOB_NUM].buf, buf, 811);
+    chat->job_num++;
 
-    return NULL;
+    return _chat_next(chat);
 }
 
 /** _chat return value:
@@ -720,123 +1566,166 @@ static void * chat_w_thread_routine(void * arg)
  *     return -2 if connection is broken
  *     return -3 if meet error
  *     return -4 if message format is incorrect
+ *  _chat note:
+ *     one connection carries up to SERVER_MAX_STREAM_NUM chats at once,
+ *     plus friend requests on stream 0,
+ *     requests are read when the channel is readable, their queries run on
+ *     the pool one after another while this thread goes on reading and
+ *     syncing, streams are synced every SERVER_CHAT_SYN_INTERVAL, the
+ *     replies and the pages are sent from this thread
 */
-static int _chat(int channel, 
-                 const unsigned char * key, 
-                 const unsigned char * iv, 
+static int _chat(struct secure_session * session, 
                  MYSQL * mysql, 
                  const char * username, 
+                 int codec,
                  struct thread_info * info)
 {
-    /* 0 for r_thread, 1 for w_thread */
-    struct chat_rw_thread_info rw_threads[2];
-    pthread_mutex_t exit_flag_lock;
-    volatile int exit_flag;
-    char buf[128];
+    int channel = session->channel;
+    struct secure_key * key = session->key;
+    struct chat_info chat;
+    struct pollfd pfd[2];
+    struct timespec ts;
+    double now, next_sync;
+    char * buf;
+    int more = 0;
+    int timeout;
+    int full;
     int ret;
 
-    _send_friendlist(channel, key, iv, mysql, username, TABLE_F_STATE_BEING);
+    _send_friendlist(channel, key, mysql, username, TABLE_F_STATE_BEING, codec, 0);
+
+    memset(&chat, 0, sizeof(chat));
+    chat.channel = channel;
+    chat.key = key;
+    chat.mysql = mysql;
+    chat.username = username;
+    chat.codec = codec;
+    chat.info = info;
+
+    pfd[0].events = POLLIN;
+    pfd[1].fd = info->owner.fd[0];
+    pfd[1].events = POLLIN;
+
+    next_sync = 0;
 
     while (true) {
-        ret = secure_recv(channel, buf, 66, 0, key, iv);
-        if (ret > 0) {
-            if (buf[0] == PROTOCOL_FINISH) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        now = ts.tv_sec + ts.tv_nsec / 1e9;
+        if (more || chat.sync_flag || now >= next_sync) {
+            chat.sync_flag = 0;
+            more = _chat_sync(&chat);
+            next_sync = now + SERVER_CHAT_SYN_INTERVAL;
+        }
+
+        if (more) {
+            timeout = 0;
+        } else {
+            timeout = (int)((next_sync - now) * 1000) + 1;
+        }
+
+        /* requests read ahead with an earlier one are already here, none is read while the queue is full */
+        full = (chat.job_num == SERVER_CHAT_JOB_NUM);
+        if (full || secure_session_buffered(session) == 0) {
+            secure_flush();
+            pfd[0].fd = full ? -1 : channel;
+            pfd[0].revents = 0;
+            ret = poll(pfd, 2, timeout);
+            if (ret == 0 || (ret == -1 && errno == EINTR)) {
+                continue;
+            } else if (ret == -1) {
+                ret = -3;
                 break;
-            } else if (buf[0] == PROTOCOL_CHAT_SELECT) {
-                if (0 == _chat_select(mysql, username, &(buf[1]))) {
-                    buf[0] = PROTOCOL_SUCCEED;
-                    secure_send(channel, buf, 1, 0, key, iv);
-                    database_disconnect(mysql);
-                    /* database_thread_finish(); */
-
-                    log_print(LOG_INFO, "thread %d/%d: %s chats with %s", 
-                                        (int)(info - threads), 
-                                        SERVER_MAX_CLIENT_NUM - 1, 
-                                        username, &(buf[1]));
-
-                    /* spawn read / write threads */
-                    rw_threads[0].channel = rw_threads[1].channel = channel;
-                    rw_threads[0].key = rw_threads[1].key = key;
-                    rw_threads[0].iv = rw_threads[1].iv = iv;
-                    rw_threads[0].username = rw_threads[1].username = username;
-                    rw_threads[0].peername = rw_threads[1].peername = &(buf[1]);
-                    pthread_mutex_init(&exit_flag_lock, NULL);
-                    rw_threads[0].exit_flag_lock = NULL;
-                    rw_threads[1].exit_flag_lock = &exit_flag_lock;
-                    exit_flag = 0;
-                    rw_threads[0].exit_flag = NULL;
-                    rw_threads[1].exit_flag = &exit_flag;
-                    pthread_create(&(rw_threads[0].thread), 
-                                    NULL, 
-                                    chat_r_thread_routine, 
-                                    &(rw_threads[0]));
-                    pthread_create(&(rw_threads[1].thread), 
-                                    NULL, 
-                                    chat_w_thread_routine, 
-                                    &(rw_threads[1]));
-                    pthread_join(rw_threads[0].thread, (void **)&(ret));
-                    #ifdef MULTICORE
-                        while (pthread_mutex_trylock(&exit_flag_lock)) { ; }
-                    #else
-                        pthread_mutex_lock(&exit_flag_lock);
-                    #endif /* MULTICORE */
-                    exit_flag = 1;
-                    pthread_mutex_unlock(&exit_flag_lock);
-                    pthread_join(rw_threads[1].thread, NULL);
-                    pthread_mutex_destroy(&exit_flag_lock);
-
-                    /* database_thread_init(); */
-                    mysql = database_connect();
-                    if (ret != 0) {
-                        return ret;
-                    }
-                } else {
-                    buf[0] = PROTOCOL_ERROR;
-                    secure_send(channel, buf, 1, 0, key, iv);
+            }
+            if (pfd[1].revents & POLLIN) {
+                if (0 != pool_complete(&(info->owner))) {
+                    ret = -3;
+                    break;
                 }
-            } else {
-                return -4;
+                ret = _chat_next(&chat);
+                if (ret != 0) {
+                    break;
+                }
+            }
+            if (pfd[0].revents == 0) {
+                continue;
+            }
+        }
+
+        ret = _recv_view(session, 811, &buf);
+        if (ret > 0) {
+            ret = _chat_request(&chat, buf);
+            if (ret != 0) {
+                break;
             }
         } else if (ret == 0) {
-            return -2;
+            ret = -2;
+            break;
         } else {
-            return -3;
+            ret = -3;
+            break;
         }
     }
 
-    return 0;
+    /* the job on the pool points into chat */
+    while (chat.job_busy && pool_complete(&(info->owner)) == 0) {
+    }
+    if (ret == 1) {
+        _chat_reply(&chat, PROTOCOL_FINISH, 0, 0);
+        ret = 0;
+    }
+
+    return ret;
 }
 
 static void * thread_start_routine(void * arg)
 {
     struct thread_info * info;
-    unsigned char key[32];
-    unsigned char iv[16];
+    struct secure_session session;
+    struct secure_key key;
     MYSQL * mysql;
     char username[65] = {0};
-    char buf[16];
+    char state[SECURE_TICKET_STATE_LEN];
+    char * buf;
+    int codec = BATCH_CODEC_NULL;
+    uint64_t start;
+    int resumed;
+    int ret;
 
     info = arg;
-
-    secure_server_buildkey(info->channel, key, iv);
+    trace_set_id(info->trace_id);
+
+    start = metrics_now();
+    ret = secure_server_buildkey(info->channel, &key, state);
+    resumed = (ret == 1);
+    if (ret >= 0) {
+        metrics_time(resumed ? METRICS_HANDSHAKE_RESUMED : METRICS_HANDSHAKE_FULL, start);
+        trace_end(resumed ? "handshake_resumed" : "handshake_full", start);
+        capture_open(resumed ? state : NULL);
+        ret = secure_session_init(&session, info->channel, &key);
+        /* replies go out with the read of the next request */
+        secure_cork();
+    }
     database_thread_init();
     mysql = database_connect();
 
-    if (0 == _authentication(info->channel, key, iv, mysql, username)) {
+    if (ret == 0 && 0 == (resumed ? _resumption(&session, state, username, &codec)
+                                  : _authentication(&session, info, username, &codec))) {
         log_print(LOG_INFO, "thread %d/%d: %s says \"hello, world!\"", 
                             (int)(info - threads), 
                             SERVER_MAX_CLIENT_NUM - 1, 
                             username);
 
-        while (secure_recv(info->channel, buf, 1, 0, key, iv) > 0) {
+        _send_inbox(info->channel, &key, mysql, username, codec, info);
+
+        while (_recv_view(&session, 1, &buf) > 0) {
             if (buf[0] == PROTOCOL_DISCONNECT) {
                 break;
             } else if (buf[0] == PROTOCOL_FRIEND) {
-                if (0 != _friend(info->channel, key, iv, mysql, username)) {
+                if (0 != _friend(&session, mysql, username, codec, info)) {
                     break;
                 }
             } else if (buf[0] == PROTOCOL_CHAT) {
-                if (0 != _chat(info->channel, key, iv, mysql, username, info)) {
+                if (0 != _chat(&session, mysql, username, codec, info)) {
                     break;
                 }
             } else {
@@ -850,16 +1739,22 @@ static void * thread_start_routine(void * arg)
                             username);
     }
 
+    if (ret == 0) {
+        secure_session_finish(&session);
+    }
+    capture_close();
     database_disconnect(mysql);
     database_thread_finish();
+    secure_flush();
     close(info->channel);
     info->channel = -1;
     enqueue(q, info);
-    sem_post(&thread_sem);
+    sync_sem_post(&thread_sem);
 
     log_print(LOG_INFO, "server: thread %d/%d disconnects",
                         (int)(info - threads),
                         SERVER_MAX_CLIENT_NUM - 1);
+    trace_set_id(0);
 
     return NULL;
 }
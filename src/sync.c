@@ -0,0 +1,220 @@
+#include "protocol.h"
+#include "sync.h"
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+
+static int spin_num = -1;
+
+/* timeout is relative, NULL for none */
+static void _futex_wait(uint32_t * word, uint32_t value, const struct timespec * timeout)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
+
+static void _futex_wake(uint32_t * word, int n)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static inline void _pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* spinning on a single core only keeps the holder off it */
+static int _spin_num(void)
+{
+    int n = __atomic_load_n(&spin_num, __ATOMIC_RELAXED);
+
+    if (n < 0) {
+        n = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SYNC_SPIN_NUM : 0;
+        __atomic_store_n(&spin_num, n, __ATOMIC_RELAXED);
+    }
+
+    return n;
+}
+
+void sync_mutex_init(struct sync_mutex * mutex)
+{
+    mutex->state = 0;
+}
+
+/** sync_mutex_lock note:
+ *     the mutex of "futexes are tricky" (drepper), a parked waiter leaves
+ *     the state at 2, so the unlock that follows wakes the next one
+*/
+void sync_mutex_lock(struct sync_mutex * mutex)
+{
+    uint32_t c;
+    int n = _spin_num();
+
+    for (int i = 0; i <= n; ++i) {
+        c = 0;
+        if (__atomic_compare_exchange_n(&(mutex->state), &c, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        if (c == 2) {
+            break;
+        }
+        _pause();
+    }
+
+    c = __atomic_exchange_n(&(mutex->state), 2, __ATOMIC_ACQUIRE);
+    while (c != 0) {
+        _futex_wait(&(mutex->state), 2, NULL);
+        c = __atomic_exchange_n(&(mutex->state), 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+int sync_mutex_trylock(struct sync_mutex * mutex)
+{
+    uint32_t c = 0;
+
+    return __atomic_compare_exchange_n(&(mutex->state), &c, 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : EBUSY;
+}
+
+void sync_mutex_unlock(struct sync_mutex * mutex)
+{
+    if (__atomic_exchange_n(&(mutex->state), 0, __ATOMIC_RELEASE) == 2) {
+        _futex_wake(&(mutex->state), 1);
+    }
+}
+
+void sync_cond_init(struct sync_cond * cond)
+{
+    cond->seq = 0;
+    cond->waiters = 0;
+}
+
+/* a waiter counts itself before it looks at seq, a signal looks at waiters after seq, as sync_sem */
+void sync_cond_wait(struct sync_cond * cond, struct sync_mutex * mutex)
+{
+    uint32_t seq;
+
+    __atomic_add_fetch(&(cond->waiters), 1, __ATOMIC_SEQ_CST);
+    seq = __atomic_load_n(&(cond->seq), __ATOMIC_SEQ_CST);
+    sync_mutex_unlock(mutex);
+    /* a signal between the unlock and the park moved seq, the park returns at once */
+    _futex_wait(&(cond->seq), seq, NULL);
+    __atomic_sub_fetch(&(cond->waiters), 1, __ATOMIC_SEQ_CST);
+    sync_mutex_lock(mutex);
+}
+
+void sync_cond_timedwait(struct sync_cond * cond, struct sync_mutex * mutex, int ms)
+{
+    struct timespec timeout;
+    uint32_t seq;
+
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_nsec = (ms % 1000) * 1000000L;
+    __atomic_add_fetch(&(cond->waiters), 1, __ATOMIC_SEQ_CST);
+    seq = __atomic_load_n(&(cond->seq), __ATOMIC_SEQ_CST);
+    sync_mutex_unlock(mutex);
+    _futex_wait(&(cond->seq), seq, &timeout);
+    __atomic_sub_fetch(&(cond->waiters), 1, __ATOMIC_SEQ_CST);
+    sync_mutex_lock(mutex);
+}
+
+void sync_cond_signal(struct sync_cond * cond)
+{
+    __atomic_add_fetch(&(cond->seq), 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(cond->waiters), __ATOMIC_SEQ_CST) > 0) {
+        _futex_wake(&(cond->seq), 1);
+    }
+}
+
+void sync_cond_broadcast(struct sync_cond * cond)
+{
+    __atomic_add_fetch(&(cond->seq), 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(cond->waiters), __ATOMIC_SEQ_CST) > 0) {
+        _futex_wake(&(cond->seq), INT_MAX);
+    }
+}
+
+void sync_event_init(struct sync_event * event)
+{
+    event->state = 0;
+}
+
+void sync_event_set(struct sync_event * event)
+{
+    if (__atomic_exchange_n(&(event->state), 1, __ATOMIC_RELEASE) == 2) {
+        _futex_wake(&(event->state), INT_MAX);
+    }
+}
+
+void sync_event_wait(struct sync_event * event)
+{
+    uint32_t c;
+    int n = _spin_num();
+
+    for (int i = 0; i <= n; ++i) {
+        if (__atomic_load_n(&(event->state), __ATOMIC_ACQUIRE) == 1) {
+            return;
+        }
+        _pause();
+    }
+
+    c = 0;
+    __atomic_compare_exchange_n(&(event->state), &c, 2, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&(event->state), __ATOMIC_ACQUIRE) != 1) {
+        _futex_wait(&(event->state), 2, NULL);
+    }
+}
+
+void sync_sem_init(struct sync_sem * sem, uint32_t value)
+{
+    sem->value = value;
+    sem->waiters = 0;
+}
+
+/* a waiter counts itself before it looks at value, a post looks at waiters after value */
+void sync_sem_post(struct sync_sem * sem)
+{
+    __atomic_add_fetch(&(sem->value), 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(sem->waiters), __ATOMIC_SEQ_CST) > 0) {
+        _futex_wake(&(sem->value), 1);
+    }
+}
+
+static int _sem_take(struct sync_sem * sem)
+{
+    uint32_t value = __atomic_load_n(&(sem->value), __ATOMIC_SEQ_CST);
+
+    while (value > 0) {
+        if (__atomic_compare_exchange_n(&(sem->value), &value, value - 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void sync_sem_wait(struct sync_sem * sem)
+{
+    int n = _spin_num();
+
+    for (int i = 0; i <= n; ++i) {
+        if (_sem_take(sem)) {
+            return;
+        }
+        _pause();
+    }
+
+    __atomic_add_fetch(&(sem->waiters), 1, __ATOMIC_SEQ_CST);
+    while (!_sem_take(sem)) {
+        _futex_wait(&(sem->value), 0, NULL);
+    }
+    __atomic_sub_fetch(&(sem->waiters), 1, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,260 @@
+#include "protocol.h"
+#include "trace.h"
+#include "metrics.h"
+#include "lock.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct span
+{
+    const char * name;
+    uint64_t start;
+    uint64_t end;
+    uint32_t id;
+};
+
+/**
+ * one thread writes a ring, the dumper reads it at any time like a seqlock:
+ *     a span is written before head moves past it, a copy is only kept if
+ *     head has not since come round to its slot again
+*/
+struct trace_ring
+{
+    struct span spans[TRACE_THREAD_SPANS];
+    uint64_t head;          /* spans ever recorded, the next one goes to head % TRACE_THREAD_SPANS */
+    uint32_t id;            /* the trace id of the owner thread */
+    int tid;
+    int in_use;
+    struct trace_ring * next;
+};
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static lock_t trace_lock = LOCK_INITIALIZER(METRICS_LOCK_TRACE);
+static struct trace_ring * rings;
+static int ring_num;
+static uint32_t connection_num;
+static pthread_t dump_thread;
+static int dump_started;
+static int dump_exit;
+
+static void _ring_release(void * arg)
+{
+    struct trace_ring * ring = arg;
+
+    lock_acquire(&trace_lock);
+    ring->id = 0;
+    ring->in_use = 0;
+    lock_release(&trace_lock);
+}
+
+static void _trace_key_init(void)
+{
+    pthread_key_create(&trace_key, _ring_release);
+}
+
+/** _ring_get return value:
+ *     return the ring of the calling thread, taken over or allocated if create is set
+ *     return NULL if the thread has none
+*/
+static struct trace_ring * _ring_get(int create)
+{
+    struct trace_ring * ring;
+
+    pthread_once(&trace_once, _trace_key_init);
+    ring = pthread_getspecific(trace_key);
+    if (ring != NULL || !create) {
+        return ring;
+    }
+
+    lock_acquire(&trace_lock);
+    for (ring = rings; ring != NULL && ring->in_use; ring = ring->next);
+    if (ring == NULL) {
+        ring = (struct trace_ring *)calloc(1, sizeof(struct trace_ring));
+        if (ring != NULL) {
+            ring->tid = ++ring_num;
+            ring->next = rings;
+            rings = ring;
+        }
+    }
+    if (ring != NULL) {
+        ring->in_use = 1;
+    }
+    lock_release(&trace_lock);
+    pthread_setspecific(trace_key, ring);
+
+    return ring;
+}
+
+static void * _dump_routine(void * arg)
+{
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    while (1) {
+        if (sigwait(&set, &sig) != 0) {
+            continue;
+        }
+        if (__atomic_load_n(&dump_exit, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        trace_dump(TRACE_FILENAME);
+    }
+
+    return NULL;
+}
+
+int trace_init(void)
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0 ||
+        pthread_create(&dump_thread, NULL, _dump_routine, NULL) != 0) {
+        return -1;
+    }
+    dump_started = 1;
+
+    return 0;
+}
+
+uint32_t trace_new_id(void)
+{
+    uint32_t id = __atomic_add_fetch(&connection_num, 1, __ATOMIC_RELAXED);
+
+    return (id % TRACE_SAMPLE_RATE == 0) ? id : 0;
+}
+
+void trace_set_id(uint32_t id)
+{
+    struct trace_ring * ring = _ring_get(id != 0);
+
+    if (ring != NULL) {
+        ring->id = id;
+    }
+}
+
+uint32_t trace_get_id(void)
+{
+    struct trace_ring * ring = _ring_get(0);
+
+    return (ring == NULL) ? 0 : ring->id;
+}
+
+uint64_t trace_begin(void)
+{
+    struct trace_ring * ring = _ring_get(0);
+
+    return (ring == NULL || ring->id == 0) ? 0 : metrics_now();
+}
+
+void trace_end(const char * name, uint64_t start)
+{
+    struct trace_ring * ring;
+    struct span * span;
+    uint64_t head;
+
+    if (start == 0 || (ring = _ring_get(0)) == NULL || ring->id == 0) {
+        return;
+    }
+
+    head = ring->head;
+    span = &(ring->spans[head % TRACE_THREAD_SPANS]);
+    __atomic_store_n(&(span->name), name, __ATOMIC_RELAXED);
+    __atomic_store_n(&(span->start), start, __ATOMIC_RELAXED);
+    __atomic_store_n(&(span->end), metrics_now(), __ATOMIC_RELAXED);
+    __atomic_store_n(&(span->id), ring->id, __ATOMIC_RELAXED);
+    __atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+}
+
+/* copies the spans of ring still intact into out, returns how many */
+static int _ring_copy(struct trace_ring * ring, struct span * out)
+{
+    uint64_t head, first, last;
+    struct span * span;
+    int n = 0;
+
+    head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+    first = (head > TRACE_THREAD_SPANS) ? head - TRACE_THREAD_SPANS : 0;
+    for (uint64_t i = first; i < head; ++i) {
+        span = &(ring->spans[i % TRACE_THREAD_SPANS]);
+        out[i - first].name = __atomic_load_n(&(span->name), __ATOMIC_RELAXED);
+        out[i - first].start = __atomic_load_n(&(span->start), __ATOMIC_RELAXED);
+        out[i - first].end = __atomic_load_n(&(span->end), __ATOMIC_RELAXED);
+        out[i - first].id = __atomic_load_n(&(span->id), __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    /* a slot the owner has come round to again since may have been copied torn */
+    last = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+    for (uint64_t i = first; i < head; ++i) {
+        if (i + TRACE_THREAD_SPANS > last) {
+            out[n++] = out[i - first];
+        }
+    }
+
+    return n;
+}
+
+/** trace_dump return value:
+ *     return  0 if every ring is written to filename (through filename.tmp)
+ *     return -1 otherwise
+*/
+int trace_dump(const char * filename)
+{
+    struct trace_ring * ring;
+    struct span * spans;
+    char tmp[256];
+    FILE * out;
+    int first = 1;
+    int n;
+
+    spans = (struct span *)malloc(TRACE_THREAD_SPANS * sizeof(struct span));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    out = fopen(tmp, "w");
+    if (spans == NULL || out == NULL) {
+        free(spans);
+        if (out != NULL) {
+            fclose(out);
+        }
+        return -1;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    lock_acquire(&trace_lock);
+    for (ring = rings; ring != NULL; ring = ring->next) {
+        n = _ring_copy(ring, spans);
+        for (int i = 0; i < n; ++i) {
+            fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%d,"
+                         "\"ts\":%.3f,\"dur\":%.3f}",
+                         first ? "" : ",", spans[i].name, spans[i].id, ring->tid,
+                         spans[i].start / 1e3, (spans[i].end - spans[i].start) / 1e3);
+            first = 0;
+        }
+    }
+    lock_release(&trace_lock);
+    fprintf(out, "\n]}\n");
+    free(spans);
+
+    if (fclose(out) != 0 || rename(tmp, filename) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the rings stay, threads that are still running may record into them */
+void trace_finish(void)
+{
+    if (dump_started) {
+        __atomic_store_n(&dump_exit, 1, __ATOMIC_RELEASE);
+        pthread_kill(dump_thread, SIGUSR2);
+        pthread_join(dump_thread, NULL);
+        dump_started = 0;
+    }
+}
@@ -0,0 +1,120 @@
+#include "protocol.h"
+#include "secure.h"
+#include "batch.h"
+#include "bench_keys.h"
+#include <sys/socket.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * ROUND_NUM times ROW_NUM chat list rows (813 bytes) over a socketpair,
+ * one secure_send per row and batch_send with every codec, bytes on the
+ * wire and cpu ms of both ends per round:
+ *
+ *     clang -O2 -I./include -o bench_batch test/bench_batch.c src/batch.c src/secure.c src/seal.c \
+ *           src/pool.c src/metrics.c src/trace.c src/sync.c -lcrypto -lz -pthread
+*/
+
+#define ROW_NUM     1000
+#define ROUND_NUM   20
+
+static struct secure_key keys[2];
+static char rows[ROW_NUM * 813];
+static int channels[2];
+static int codec, level;
+static ssize_t wire_len;
+
+static void * send_routine(void * arg)
+{
+    char buf[1024] = {0};
+
+    wire_len = 0;
+    for (int r = 0; r < ROUND_NUM; ++r) {
+        if (codec == BATCH_CODEC_NULL) {
+            for (int i = 0; i < ROW_NUM; ++i) {
+                wire_len += secure_send(channels[0], &(rows[i * 813]), 813, 0, &(keys[0]));
+            }
+        } else {
+            wire_len += batch_send(channels[0], &(keys[0]), 813, rows, 813, ROW_NUM, codec, level);
+        }
+        buf[0] = PROTOCOL_CHAT_LIST_END;
+        wire_len += secure_send(channels[0], buf, 813, 0, &(keys[0]));
+    }
+
+    return NULL;
+}
+
+static double cpu_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char * name, int bench_codec, int bench_level)
+{
+    pthread_t thread;
+    char buf[1024];
+    char * batch;
+    int row_len, count;
+    double start;
+
+    codec = bench_codec;
+    level = bench_level;
+
+    start = cpu_now();
+    pthread_create(&thread, NULL, send_routine, NULL);
+    for (int r = 0; r < ROUND_NUM; ++r) {
+        while (secure_recv(channels[1], buf, 813, 0, &(keys[1])) > 0) {
+            if (buf[0] == PROTOCOL_CHAT_LIST_END) {
+                break;
+            } else if (buf[0] == PROTOCOL_BATCH) {
+                batch = batch_recv(channels[1], &(keys[1]), buf, &row_len, &count);
+                free(batch);
+            }
+        }
+    }
+    pthread_join(thread, NULL);
+
+    /* per 1,000 rows, sender and receiver together */
+    printf("%-8s %5d %10ld %10.3f\n", name, bench_level,
+           (long)(wire_len / ROUND_NUM), (cpu_now() - start) * 1e3 / ROUND_NUM);
+}
+
+int main(void)
+{
+    const char * words[] = {"hello", "see", "you", "tomorrow", "at", "the",
+                            "usual", "place", "ok", "sure", "what", "time", "?"};
+    char * row;
+    int len;
+
+    srand(1);
+    for (int i = 0; i < ROW_NUM; ++i) {
+        row = &(rows[i * 813]);
+        row[0] = PROTOCOL_CHAT_LIST;
+        row[1] = 1;
+        row[2] = (i % 3) ? PROTOCOL_CHAT_LIST_RECV : PROTOCOL_CHAT_LIST_SEND;
+        *((double *)(&(row[3]))) = 1600000000.0 + i * 7.5;
+        len = 0;
+        for (int n = 1 + rand() % 24; n > 0; --n) {
+            len += sprintf(&(row[11 + len]), "%s ", words[rand() % 13]);
+        }
+        row[812] = TABLE_M_STATE_READ;
+    }
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, channels);
+    bench_key_pair(keys);
+
+    printf("%-8s %5s %10s %10s\n", "codec", "level", "bytes", "cpu_ms");
+    bench("null", BATCH_CODEC_NULL, 0);
+    bench("store", BATCH_CODEC_STORE, 0);
+    for (int l = 1; l <= 9; l += 2) {
+        bench("zlib", BATCH_CODEC_ZLIB, l);
+    }
+
+    return 0;
+}
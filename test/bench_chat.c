@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+#include "protocol.h"
+#include "secure.h"
+#include "batch.h"
+#include "chat.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * usage: bench_chat [server ip] [threads|poll] [pairs] [messages/s] [seconds]
+ *     [pairs] pairs of users bc<i> (password pw, signed up and made friends
+ *     if need be) open a chat with each other, one of each pair sends
+ *     [messages/s] messages for [seconds], the other one shows them the way
+ *     the client does:
+ *     threads: the client before ./src/chat.c, a reader thread per connection
+ *              writes every record to a chat file (bc<i>.chat) and syncs it
+ *              for a tail -f in another terminal, the writer thread sleeps in
+ *              a read of stdin and is left out
+ *     poll:    one thread polls every connection and draws the lines the way
+ *              the chat box of ./src/client.c does, to /dev/null here, so the
+ *              cost of the terminal itself is not counted
+ *     cpu:     of the threads that show messages, per message shown
+ *     latency: from the send to the message shown (synced to the file for
+ *              threads), the rounds of the server are in it for both
+ *
+ *     clang -O2 -I./include -o bench_chat test/bench_chat.c src/chat.c src/secure.c src/seal.c \
+ *           src/batch.c src/pool.c src/metrics.c src/trace.c src/sync.c -lcrypto -lz -pthread
+*/
+
+#define MAX_SAMPLES     (1 << 20)
+
+struct session
+{
+    struct chat_client client;
+    struct secure_key key;
+    char name[17];
+    FILE * file;
+    double shown[64];           /* messages of the record being read, shown once it is synced */
+    int shown_num;
+    int done;
+};
+
+static struct sockaddr_in addr;
+static int threads_mode;
+static volatile int measure_flag = 0;
+static double run_start;
+static double deadline;
+
+static pthread_mutex_t sample_lock = PTHREAD_MUTEX_INITIALIZER;
+static double samples[MAX_SAMPLES];
+static int sample_num = 0;
+static double cpu_seconds = 0;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double thread_cpu(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void _sample(double sent)
+{
+    double ms = (now() - sent) * 1e3;
+
+    pthread_mutex_lock(&sample_lock);
+    if (sample_num < MAX_SAMPLES) {
+        samples[sample_num++] = ms;
+    }
+    pthread_mutex_unlock(&sample_lock);
+}
+
+/* the senders and the setup show nothing */
+static void _put_none(void * arg, const struct chat_line * line)
+{
+}
+
+static void _put_file(void * arg, const struct chat_line * line)
+{
+    struct session * session = (struct session *)arg;
+
+    fprintf(session->file, "\n%s\n", line->text);
+    if (measure_flag && line->text[0] == '<' && line->time >= run_start && session->shown_num < 64) {
+        session->shown[session->shown_num++] = line->time;
+    }
+}
+
+/* the same output as _box_put of ./src/client.c on a terminal */
+static void _put_box(void * arg, const struct chat_line * line)
+{
+    struct session * session = (struct session *)arg;
+    struct chat_client * client = &(session->client);
+
+    fprintf(session->file, "\r\e[K%s\n\n\r\e[K%s# ", line->text,
+            (client->current == 0) ? "" : client->streams[client->current].peername);
+    fflush(session->file);
+    if (measure_flag && line->text[0] == '<' && line->time >= run_start) {
+        _sample(line->time);
+    }
+}
+
+/* return 0 if the user is signed in, in chat mode, with the put of threads or poll */
+static int _connect(struct session * session)
+{
+    char buf[1 + SECURE_TICKET_LEN];
+    int channel;
+    int on = 1;
+    int ret = -1;
+
+    channel = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(channel, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(channel, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        secure_client_buildkey(channel, &(session->key), NULL) < 0) {
+        close(channel);
+        return -1;
+    }
+
+    for (int flag = PROTOCOL_SIGN_IN; flag <= PROTOCOL_SIGN_UP && ret != 0; ++flag) {
+        memset(buf, 0, 132);
+        buf[0] = (char)flag;
+        strcpy(&(buf[1]), session->name);
+        strcpy(&(buf[66]), "pw");
+        buf[131] = CLIENT_BATCH_CODEC;
+        if (secure_send(channel, buf, 132, 0, &(session->key)) <= 0 ||
+            secure_recv(channel, buf, 2, 0, &(session->key)) <= 0) {
+            close(channel);
+            return -1;
+        }
+        ret = (buf[0] == PROTOCOL_SUCCEED) ? 0 : -1;
+    }
+    if (ret != 0 ||
+        secure_recv(channel, buf, sizeof(buf), 0, &(session->key)) <= 0 ||
+        batch_recv_pages(channel, &(session->key), 14, SERVER_INBOX_PAGE_ROWS, NULL, NULL) < 0) {
+        close(channel);
+        return -1;
+    }
+
+    chat_client_init(&(session->client), channel, &(session->key), session->name,
+                     _put_none, session);
+
+    return chat_client_enter(&(session->client));
+}
+
+/** _pump return value:
+ *     return  0 once every session is done (after chat_client_quit) or seconds are over
+ *     return -1 if a connection is broken
+*/
+static int _pump(struct session ** sessions, int num, double seconds)
+{
+    struct pollfd pfds[2 * 64];
+    double end = now() + seconds;
+    int left = 0;
+    int ret;
+
+    for (int i = 0; i < num; ++i) {
+        pfds[i].fd = sessions[i]->done ? -1 : sessions[i]->client.channel;
+        pfds[i].events = POLLIN;
+        left += !sessions[i]->done;
+    }
+
+    while (left > 0 && (seconds < 0 || now() < end)) {
+        if (poll(pfds, num, (seconds < 0) ? 100 : 10) <= 0) {
+            continue;
+        }
+        for (int i = 0; i < num; ++i) {
+            if (pfds[i].revents == 0 || sessions[i]->done) {
+                continue;
+            }
+            ret = chat_client_read(&(sessions[i]->client));
+            if (ret < 0) {
+                return -1;
+            } else if (ret == 1) {
+                sessions[i]->done = 1;
+                pfds[i].fd = -1;
+                left--;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static struct session ** senders;
+static struct session ** receivers;
+static int pair_num;
+static double rate;
+
+static void * send_routine(void * arg)
+{
+    char message[64];
+    double next = now();
+    int n = 0;
+
+    while (now() < deadline) {
+        for (int i = 0; i < pair_num; ++i) {
+            snprintf(message, sizeof(message), "bench_chat %d", n);
+            chat_client_send(&(senders[i]->client), senders[i]->client.current, message);
+        }
+        n++;
+        next += 1 / rate;
+        /* the senders get their own messages back, they are read in the meantime */
+        _pump(senders, pair_num, (next > now()) ? next - now() : 0);
+    }
+
+    for (int i = 0; i < pair_num; ++i) {
+        chat_client_quit(&(senders[i]->client));
+    }
+    _pump(senders, pair_num, -1);
+
+    return NULL;
+}
+
+static void * read_routine(void * arg)
+{
+    struct session * session = (struct session *)arg;
+    double cpu;
+    int ret;
+
+    cpu = thread_cpu();
+    while (true) {
+        ret = chat_client_read(&(session->client));
+        if (ret != 0) {
+            break;
+        }
+        fflush(session->file);
+        fdatasync(fileno(session->file));
+        for (int i = 0; i < session->shown_num; ++i) {
+            _sample(session->shown[i]);
+        }
+        session->shown_num = 0;
+    }
+    cpu = thread_cpu() - cpu;
+
+    pthread_mutex_lock(&sample_lock);
+    cpu_seconds += cpu;
+    pthread_mutex_unlock(&sample_lock);
+    session->done = 1;
+
+    return NULL;
+}
+
+static void * poll_routine(void * arg)
+{
+    double cpu;
+
+    cpu = thread_cpu();
+    _pump(receivers, pair_num, -1);
+    cpu_seconds = thread_cpu() - cpu;
+
+    return NULL;
+}
+
+static int compare(const void * a, const void * b)
+{
+    double x = *((const double *)a);
+    double y = *((const double *)b);
+
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char ** argv)
+{
+    struct session * sessions;
+    struct session * all[2 * 64];
+    pthread_t sender;
+    pthread_t * readers;
+    char filename[32];
+    double seconds;
+
+    if (argc != 6 || (strcmp(argv[2], "threads") != 0 && strcmp(argv[2], "poll") != 0)) {
+        printf("usage: %s [server ip] [threads|poll] [pairs] [messages/s] [seconds]\n", argv[0]);
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVER_PORT);
+    inet_aton(argv[1], &(addr.sin_addr));
+    threads_mode = (strcmp(argv[2], "threads") == 0);
+    pair_num = atoi(argv[3]);
+    rate = atof(argv[4]);
+    seconds = atof(argv[5]);
+    if (pair_num < 1 || pair_num > 64 || rate <= 0) {
+        printf("1 to 64 pairs, a rate above 0\n");
+        return 1;
+    }
+
+    secure_client_init();
+    sessions = (struct session *)calloc(2 * pair_num, sizeof(struct session));
+    senders = (struct session **)malloc(pair_num * sizeof(struct session *));
+    receivers = (struct session **)malloc(pair_num * sizeof(struct session *));
+    readers = (pthread_t *)malloc(pair_num * sizeof(pthread_t));
+
+    for (int i = 0; i < 2 * pair_num; ++i) {
+        snprintf(sessions[i].name, sizeof(sessions[i].name), "bc%d", i);
+        if (_connect(&(sessions[i])) != 0) {
+            printf("%s can not sign in\n", sessions[i].name);
+            return 1;
+        }
+        all[i] = &(sessions[i]);
+    }
+    for (int i = 0; i < pair_num; ++i) {
+        senders[i] = &(sessions[2 * i]);
+        receivers[i] = &(sessions[2 * i + 1]);
+    }
+
+    /* friends already from an earlier run fail the add, the accept does no harm */
+    for (int i = 0; i < pair_num; ++i) {
+        chat_client_friend(&(senders[i]->client), PROTOCOL_FRIEND_ADD, receivers[i]->name);
+    }
+    _pump(all, 2 * pair_num, 1);
+    for (int i = 0; i < pair_num; ++i) {
+        chat_client_friend(&(receivers[i]->client), PROTOCOL_FRIEND_ACCEPT, senders[i]->name);
+    }
+    _pump(all, 2 * pair_num, 1);
+    for (int i = 0; i < pair_num; ++i) {
+        senders[i]->client.current = chat_client_open(&(senders[i]->client), receivers[i]->name);
+        receivers[i]->client.current = chat_client_open(&(receivers[i]->client), senders[i]->name);
+    }
+    /* the histories of earlier runs come in here */
+    if (_pump(all, 2 * pair_num, 3) != 0) {
+        printf("a connection is broken\n");
+        return 1;
+    }
+
+    for (int i = 0; i < pair_num; ++i) {
+        if (threads_mode) {
+            snprintf(filename, sizeof(filename), "%s.chat", receivers[i]->name);
+            receivers[i]->file = fopen(filename, "w");
+            receivers[i]->client.put = _put_file;
+        } else {
+            receivers[i]->file = fopen("/dev/null", "w");
+            receivers[i]->client.put = _put_box;
+        }
+    }
+
+    run_start = now();
+    deadline = run_start + seconds;
+    measure_flag = 1;
+    pthread_create(&sender, NULL, send_routine, NULL);
+    if (threads_mode) {
+        for (int i = 0; i < pair_num; ++i) {
+            pthread_create(&(readers[i]), NULL, read_routine, receivers[i]);
+        }
+    } else {
+        pthread_create(&(readers[0]), NULL, poll_routine, NULL);
+    }
+
+    pthread_join(sender, NULL);
+    /* the messages still on their way get a second */
+    sleep(1);
+    for (int i = 0; i < pair_num; ++i) {
+        chat_client_quit(&(receivers[i]->client));
+    }
+    for (int i = 0; i < (threads_mode ? pair_num : 1); ++i) {
+        pthread_join(readers[i], NULL);
+    }
+
+    qsort(samples, sample_num, sizeof(double), compare);
+    printf("%-8s %6s %10s %8s %12s %10s %10s %10s\n",
+           "mode", "pairs", "shown", "cpu_s", "cpu_us/msg", "p50_ms", "p99_ms", "max_ms");
+    printf("%-8s %6d %10d %8.3f %12.1f %10.2f %10.2f %10.2f\n",
+           argv[2], pair_num, sample_num, cpu_seconds,
+           sample_num ? cpu_seconds / sample_num * 1e6 : 0,
+           sample_num ? samples[sample_num / 2] : 0,
+           sample_num ? samples[(int)(sample_num * 0.99)] : 0,
+           sample_num ? samples[sample_num - 1] : 0);
+
+    for (int i = 0; i < 2 * pair_num; ++i) {
+        if (sessions[i].file != NULL) {
+            fclose(sessions[i].file);
+        }
+        close(sessions[i].client.channel);
+    }
+    free(sessions);
+    free(senders);
+    free(receivers);
+    free(readers);
+    secure_client_finish();
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include "protocol.h"
+#include "chatlog.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * usage: bench_chatlog [lines] [directory]
+ *     a history of [lines] messages is put into a chat transcript in
+ *     [directory] (on the disk to measure, not a tmpfs) the way the chat
+ *     box puts the history sent when a chat is opened, in every mode:
+ *     inline:    what the client did before ./src/chatlog.c, fflush and
+ *                fdatasync after every record in the thread that shows them
+ *     each:      CLIENT_CHAT_SYNC_EACH, the history synced once per write
+ *     each-live: CLIENT_CHAT_SYNC_EACH with every line put as a live message,
+ *                one sync per line, on the writer thread
+ *     group:     CLIENT_CHAT_SYNC_GROUP
+ *     none:      CLIENT_CHAT_SYNC_NONE
+ *     put:  the time the showing thread spends on the lines
+ *     wall: from the first line until chat_log_close returns, every line
+ *           written (and synced but for none)
+ *
+ *     clang -O2 -I./include -o bench_chatlog test/bench_chatlog.c src/chatlog.c src/sync.c -pthread
+*/
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void _line(char * text, int i)
+{
+    /* about the size of a line of _put_message */
+    snprintf(text, 256, "< 2024 Jun 30 21:49:08 [alice] \n    history message %d, "
+                        "long enough to look like one people type", i);
+}
+
+static void bench_inline(const char * filename, int line_num)
+{
+    char text[256];
+    double start, put;
+    FILE * file;
+
+    file = fopen(filename, "w");
+    start = now();
+    for (int i = 0; i < line_num; ++i) {
+        _line(text, i);
+        fprintf(file, "\n%s\n", text);
+        fflush(file);
+        fdatasync(fileno(file));
+    }
+    put = now() - start;
+    fclose(file);
+
+    printf("%-10s %8d %10.2f %10.2f\n", "inline", line_num, put * 1e3, (now() - start) * 1e3);
+}
+
+static void bench_log(const char * name, const char * filename, int line_num, int mode, int history)
+{
+    struct chat_log log;
+    char text[256];
+    double start, put;
+
+    if (chat_log_open(&log, filename, mode) != 0) {
+        printf("%s can not be opened\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    start = now();
+    for (int i = 0; i < line_num; ++i) {
+        _line(text, i);
+        chat_log_put(&log, text, history);
+    }
+    put = now() - start;
+    chat_log_close(&log);
+
+    printf("%-10s %8d %10.2f %10.2f\n", name, line_num, put * 1e3, (now() - start) * 1e3);
+}
+
+int main(int argc, char ** argv)
+{
+    char filename[256];
+    int line_num = (argc > 1) ? atoi(argv[1]) : 2000;
+
+    snprintf(filename, sizeof(filename), "%s/bench_chatlog.chat", (argc > 2) ? argv[2] : ".");
+
+    printf("%-10s %8s %10s %10s\n", "mode", "lines", "put_ms", "wall_ms");
+    bench_inline(filename, line_num);
+    bench_log("each", filename, line_num, CLIENT_CHAT_SYNC_EACH, 1);
+    bench_log("each-live", filename, line_num, CLIENT_CHAT_SYNC_EACH, 0);
+    bench_log("group", filename, line_num, CLIENT_CHAT_SYNC_GROUP, 1);
+    bench_log("none", filename, line_num, CLIENT_CHAT_SYNC_NONE, 1);
+
+    unlink(filename);
+
+    return 0;
+}
@@ -0,0 +1,27 @@
+#!/bin/sh
+# usage: bench_compare.sh [old.jsonl] [new.jsonl]
+#     puts two outputs of bench_micro side by side, worst change first,
+#     *_per_s are better higher, the rest (ms) better lower, a change is
+#     the percentage new is better (+) or worse (-) than old
+
+if [ $# -ne 2 ]; then
+    echo "usage: $0 [old.jsonl] [new.jsonl]" >&2
+    exit 1
+fi
+
+awk -F'"' '
+    /^\{/ {
+        key = $8 "/" $12 "/" $16
+        value = $19
+        gsub(/[:}]/, "", value)
+        if (FILENAME == ARGV[1]) {
+            old[key] = value
+        } else if (key in old) {
+            change = (old[key] == 0) ? 0 : (value - old[key]) * 100 / old[key]
+            if ($16 !~ /_per_s$/) {
+                change = -change
+            }
+            printf "%-50s %14.3f %14.3f %8.1f%%\n", key, old[key], value, change
+        }
+    }
+' "$1" "$2" | sort -k4 -n
@@ -0,0 +1,267 @@
+#include "protocol.h"
+#include "secure.h"
+#include "batch.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * usage: bench_handshake [server port] [chats] [chat ms] [handshakers] [handshake ms] [seconds]
+ *     [chats] connections sit in chat mode and send a request every [chat ms],
+ *     each answered right away (a close of a stream that is not open),
+ *     while [handshakers] threads connect with a full handshake, sign in,
+ *     disconnect and wait [handshake ms] again and again, for [seconds],
+ *     handshake: from connect() until the sign in reply, which takes both
+ *                the key generation and the shared secret of the server
+ *     chat:      the round trip of one request
+ *     the users chat<i> / hs<i> (password pw) are signed up if need be:
+ *
+ *     clang -O2 -I./include -o bench_handshake test/bench_handshake.c src/secure.c src/seal.c \
+ *           src/batch.c src/pool.c src/metrics.c src/trace.c src/sync.c -lcrypto -lz -pthread
+*/
+
+#define MAX_SAMPLES     (1 << 20)
+
+struct samples
+{
+    double * ms;
+    int num;
+};
+
+static struct sockaddr_in addr;
+static double deadline;
+static int chat_interval_ms;
+static int handshake_interval_ms;
+static struct samples handshake_samples;
+static struct samples chat_samples;
+static int fail_num;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_sample(struct samples * samples, double ms)
+{
+    pthread_mutex_lock(&lock);
+    if (samples->num < MAX_SAMPLES) {
+        samples->ms[samples->num++] = ms;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void add_fail(void)
+{
+    pthread_mutex_lock(&lock);
+    fail_num++;
+    pthread_mutex_unlock(&lock);
+}
+
+/** connect_user return value:
+ *     the channel, signed in (or up) as username with the ticket and inbox read,
+ *     -1 if anything fails, *handshake_ms is the time until the sign in reply
+*/
+static int connect_user(const char * username, struct secure_key * key, double * handshake_ms)
+{
+    char buf[1 + SECURE_TICKET_LEN];
+    double start;
+    int channel;
+    int on = 1;
+    int ret = -1;
+
+    start = now();
+    channel = socket(AF_INET, SOCK_STREAM, 0);
+    /* the public key and the sign in go out back to back, nagle would hold the second */
+    setsockopt(channel, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(channel, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        secure_client_buildkey(channel, key, NULL) != 0) {
+        close(channel);
+        return -1;
+    }
+
+    for (int flag = PROTOCOL_SIGN_IN; flag <= PROTOCOL_SIGN_UP && ret != 0; ++flag) {
+        memset(buf, 0, 132);
+        buf[0] = (char)flag;
+        strcpy(&(buf[1]), username);
+        strcpy(&(buf[66]), "pw");
+        buf[131] = BATCH_CODEC_NULL;
+        if (secure_send(channel, buf, 132, 0, key) <= 0 ||
+            secure_recv(channel, buf, 2, 0, key) <= 0) {
+            break;
+        }
+        ret = (buf[0] == PROTOCOL_SUCCEED) ? 0 : -1;
+    }
+    *handshake_ms = (now() - start) * 1e3;
+
+    if (ret != 0 ||
+        secure_recv(channel, buf, sizeof(buf), 0, key) <= 0 || buf[0] != PROTOCOL_TICKET ||
+        batch_recv_pages(channel, key, 14, SERVER_INBOX_PAGE_ROWS, NULL, NULL) < 0) {
+        close(channel);
+        return -1;
+    }
+
+    return channel;
+}
+
+static void * handshake_routine(void * arg)
+{
+    struct secure_key key;
+    char username[65];
+    char buf[1];
+    double ms;
+    int channel;
+
+    snprintf(username, sizeof(username), "hs%d", (int)(long)arg);
+    while (now() < deadline) {
+        channel = connect_user(username, &key, &ms);
+        if (channel < 0) {
+            add_fail();
+        } else {
+            add_sample(&handshake_samples, ms);
+            buf[0] = PROTOCOL_DISCONNECT;
+            secure_send(channel, buf, 1, 0, &key);
+            close(channel);
+        }
+        usleep(handshake_interval_ms * 1000);
+    }
+
+    return NULL;
+}
+
+static void * chat_routine(void * arg)
+{
+    struct secure_key key;
+    char username[65];
+    char request[811];
+    char reply[813];
+    double start, ms;
+    int channel;
+
+    snprintf(username, sizeof(username), "chat%d", (int)(long)arg);
+    channel = connect_user(username, &key, &ms);
+    if (channel < 0) {
+        add_fail();
+        return NULL;
+    }
+
+    /* chat mode starts with the friend list, one 67-byte record per friend */
+    request[0] = PROTOCOL_CHAT;
+    secure_send(channel, request, 1, 0, &key);
+    do {
+        if (secure_recv(channel, reply, 67, 0, &key) <= 0) {
+            add_fail();
+            close(channel);
+            return NULL;
+        }
+    } while (reply[0] != PROTOCOL_FRIEND_LIST_END);
+
+    memset(request, 0, sizeof(request));
+    while (now() < deadline) {
+        request[0] = PROTOCOL_CHAT_CLOSE;
+        request[1] = 1;
+        start = now();
+        secure_send(channel, request, 811, 0, &key);
+        do {
+            if (secure_recv(channel, reply, 813, 0, &key) <= 0) {
+                add_fail();
+                close(channel);
+                return NULL;
+            }
+        } while (reply[0] != PROTOCOL_ERROR);
+        add_sample(&chat_samples, (now() - start) * 1e3);
+        usleep(chat_interval_ms * 1000);
+    }
+
+    request[0] = PROTOCOL_FINISH;
+    secure_send(channel, request, 811, 0, &key);
+    request[0] = PROTOCOL_DISCONNECT;
+    secure_send(channel, request, 1, 0, &key);
+    close(channel);
+
+    return NULL;
+}
+
+static int compare(const void * a, const void * b)
+{
+    double x = *((const double *)a);
+    double y = *((const double *)b);
+
+    return (x > y) - (x < y);
+}
+
+static void report(const char * name, struct samples * samples, double seconds)
+{
+    int n = samples->num;
+
+    printf("%-10s %10d %10.1f", name, n, n / seconds);
+    if (n > 0) {
+        qsort(samples->ms, n, sizeof(double), compare);
+        printf(" %10.3f %10.3f %10.3f", samples->ms[n / 2], samples->ms[(int)(n * 0.99)],
+               samples->ms[n - 1]);
+    }
+    printf("\n");
+}
+
+int main(int argc, char ** argv)
+{
+    pthread_t * threads;
+    int chat_num, handshake_num;
+    double seconds;
+
+    if (argc != 7) {
+        fprintf(stderr, "usage: %s [server port] [chats] [chat ms] [handshakers] [handshake ms] "
+                        "[seconds]\n", argv[0]);
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)atoi(argv[1]));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    chat_num = atoi(argv[2]);
+    chat_interval_ms = atoi(argv[3]);
+    handshake_num = atoi(argv[4]);
+    handshake_interval_ms = atoi(argv[5]);
+    seconds = atof(argv[6]);
+
+    secure_client_init();
+    handshake_samples.ms = (double *)malloc(MAX_SAMPLES * sizeof(double));
+    chat_samples.ms = (double *)malloc(MAX_SAMPLES * sizeof(double));
+    threads = (pthread_t *)malloc((chat_num + handshake_num) * sizeof(pthread_t));
+
+    deadline = now() + seconds;
+    for (int i = 0; i < chat_num; ++i) {
+        pthread_create(&(threads[i]), NULL, chat_routine, (void *)(long)i);
+    }
+    for (int i = 0; i < handshake_num; ++i) {
+        pthread_create(&(threads[chat_num + i]), NULL, handshake_routine, (void *)(long)i);
+    }
+    for (int i = 0; i < chat_num + handshake_num; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("%d chats every %d ms, %d handshakers every %d ms, %.0f s, %d failed\n",
+           chat_num, chat_interval_ms, handshake_num, handshake_interval_ms, seconds, fail_num);
+    printf("%-10s %10s %10s %10s %10s %10s\n", "", "samples", "per_s", "p50_ms", "p99_ms", "max_ms");
+    report("handshake", &handshake_samples, seconds);
+    report("chat", &chat_samples, seconds);
+
+    secure_client_finish();
+    free(threads);
+    free(handshake_samples.ms);
+    free(chat_samples.ms);
+
+    return 0;
+}
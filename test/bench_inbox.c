@@ -0,0 +1,292 @@
+#include "protocol.h"
+#include "secure.h"
+#include "batch.h"
+#include "chat.h"
+#include "database.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * usage: bench_inbox [server ip] [peers] [messages]
+ *     a user ib<tag> has [peers] friends ib<tag>_<i>, each of them has sent
+ *     it [messages] messages while it was away, put straight into the
+ *     database of the server, then all of them are fetched in both ways,
+ *     from the sign in request until the last message is in:
+ *     inbox: sign in with the messages unread, they come in the inbox
+ *     open:  sign in with the messages read (the inbox is empty), enter chat
+ *            mode and open every chat until its history is in,
+ *            SERVER_MAX_STREAM_NUM chats at a time, the way the client had
+ *            to before the inbox
+ *     bytes: received on the socket in that time, tcp_info
+ *
+ *     clang -O2 -I./include -o bench_inbox test/bench_inbox.c src/chat.c src/secure.c src/seal.c \
+ *           src/batch.c src/pool.c src/metrics.c src/trace.c src/sync.c src/database.c \
+ *           -lmysqlclient -lcrypto -lz -pthread
+*/
+
+#define INSERT_ROWS     1000
+
+struct bench
+{
+    int rows;               /* messages shown */
+    int histories;          /* chats whose history is in */
+    int closed;
+};
+
+static struct sockaddr_in addr;
+static char username[17];
+static int peer_num;
+static int message_num;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t bytes_received(int channel)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    memset(&info, 0, sizeof(info));
+    getsockopt(channel, IPPROTO_TCP, TCP_INFO, &info, &len);
+
+    return info.tcpi_bytes_received;
+}
+
+/* the users, the friendships and peers * messages unread messages, in statements of INSERT_ROWS rows */
+static int _fill(void)
+{
+    MYSQL * mysql;
+    char * values;
+    char peername[65];
+    int len = 0, n = 0;
+
+    database_init();
+    database_thread_init();
+    mysql = database_connect();
+    if (mysql == NULL) {
+        return -1;
+    }
+    values = (char *)malloc(INSERT_ROWS * 256);
+
+    len = sprintf(values, "('%s','pw'),", username);
+    for (int i = 0; i < peer_num; ++i) {
+        len += sprintf(&(values[len]), "('%s_%d','pw'),", username, i);
+    }
+    values[len - 1] = '\0';
+    database_insert_rows(mysql, "user", "username, password", values);
+
+    /* username sorts before every username_<i>, the order the server keeps a friend row in */
+    len = 0;
+    for (int i = 0; i < peer_num; ++i) {
+        len += sprintf(&(values[len]), "('%s','%s_%d',%d),", username, username, i, TABLE_F_STATE_BEING);
+    }
+    values[len - 1] = '\0';
+    database_insert_rows(mysql, "friend", "username1, username2, state", values);
+
+    len = 0;
+    for (int j = 0; j < message_num; ++j) {
+        for (int i = 0; i < peer_num; ++i) {
+            snprintf(peername, sizeof(peername), "%s_%d", username, i);
+            len += sprintf(&(values[len]), "('%s','%s',%.6f,'bench_inbox message %d of %s, "
+                                           "long enough to look like one people type',%d),",
+                           peername, username, 1e9 + j, j, peername, TABLE_M_STATE_UNREAD);
+            if (++n == INSERT_ROWS || (j == message_num - 1 && i == peer_num - 1)) {
+                values[len - 1] = '\0';
+                database_insert_rows(mysql, "message", "username1, username2, time, content, state",
+                                     values);
+                len = 0;
+                n = 0;
+            }
+        }
+    }
+
+    free(values);
+    database_disconnect(mysql);
+    database_thread_finish();
+    database_finish();
+
+    return 0;
+}
+
+/* return the channel signed in as username with the ticket read, -1 on failure */
+static int _sign_in(struct secure_key * key, double * start, uint64_t * bytes)
+{
+    char buf[1 + SECURE_TICKET_LEN];
+    int channel;
+
+    channel = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(channel, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        secure_client_buildkey(channel, key, NULL) < 0) {
+        close(channel);
+        return -1;
+    }
+
+    memset(buf, 0, 132);
+    buf[0] = PROTOCOL_SIGN_IN;
+    strcpy(&(buf[1]), username);
+    strcpy(&(buf[66]), "pw");
+    buf[131] = CLIENT_BATCH_CODEC;
+    /* the inbox follows the reply and the ticket at once */
+    *start = now();
+    *bytes = bytes_received(channel);
+    if (secure_send(channel, buf, 132, 0, key) <= 0 ||
+        secure_recv(channel, buf, 2, 0, key) <= 0 || buf[0] != PROTOCOL_SUCCEED) {
+        close(channel);
+        return -1;
+    }
+    if (secure_recv(channel, buf, sizeof(buf), 0, key) <= 0 || buf[0] != PROTOCOL_TICKET) {
+        close(channel);
+        return -1;
+    }
+
+    return channel;
+}
+
+static void _disconnect(int channel, struct secure_key * key)
+{
+    char buf[1] = {PROTOCOL_DISCONNECT};
+
+    secure_send(channel, buf, 1, 0, key);
+    close(channel);
+}
+
+static int bench_inbox(void)
+{
+    struct secure_key key;
+    uint64_t bytes;
+    double start, ms;
+    int channel;
+    int count;
+
+    channel = _sign_in(&key, &start, &bytes);
+    if (channel < 0) {
+        return -1;
+    }
+    count = batch_recv_pages(channel, &key, 14, SERVER_INBOX_PAGE_ROWS, NULL, NULL);
+    ms = (now() - start) * 1e3;
+    bytes = bytes_received(channel) - bytes;
+    _disconnect(channel, &key);
+
+    printf("%-6s %10d %10.2f %12lu\n", "inbox", count, ms, (unsigned long)bytes);
+
+    return (count == peer_num * message_num) ? 0 : -1;
+}
+
+static void _put(void * arg, const struct chat_line * line)
+{
+    struct bench * bench = (struct bench *)arg;
+
+    if (line->stream_id == 0) {
+        return;
+    } else if (line->time > 0) {
+        bench->rows++;
+    } else if (strstr(line->text, "history with") != NULL) {
+        bench->histories++;
+    } else if (strstr(line->text, "end of chat") != NULL) {
+        bench->closed++;
+    }
+}
+
+static int bench_open(void)
+{
+    struct chat_client client;
+    struct secure_key key;
+    struct bench bench;
+    char peername[65];
+    int streams[SERVER_MAX_STREAM_NUM];
+    uint64_t bytes;
+    double start, ms;
+    int channel;
+    int num;
+
+    channel = _sign_in(&key, &start, &bytes);
+    if (channel < 0 || batch_recv_pages(channel, &key, 14, SERVER_INBOX_PAGE_ROWS, NULL, NULL) != 0) {
+        return -1;
+    }
+
+    memset(&bench, 0, sizeof(bench));
+    chat_client_init(&client, channel, &key, username, _put, &bench);
+    if (chat_client_enter(&client) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < peer_num; i += SERVER_MAX_STREAM_NUM) {
+        num = (peer_num - i < SERVER_MAX_STREAM_NUM) ? peer_num - i : SERVER_MAX_STREAM_NUM;
+        for (int j = 0; j < num; ++j) {
+            snprintf(peername, sizeof(peername), "%s_%d", username, i + j);
+            streams[j] = chat_client_open(&client, peername);
+        }
+        while (bench.histories < i + num) {
+            if (chat_client_read(&client) != 0) {
+                return -1;
+            }
+        }
+        for (int j = 0; j < num; ++j) {
+            chat_client_close(&client, streams[j]);
+        }
+        while (bench.closed < i + num) {
+            if (chat_client_read(&client) != 0) {
+                return -1;
+            }
+        }
+    }
+    ms = (now() - start) * 1e3;
+    bytes = bytes_received(channel) - bytes;
+
+    chat_client_quit(&client);
+    while (chat_client_read(&client) == 0) {
+    }
+    _disconnect(channel, &key);
+
+    printf("%-6s %10d %10.2f %12lu\n", "open", bench.rows, ms, (unsigned long)bytes);
+
+    return (bench.rows == peer_num * message_num) ? 0 : -1;
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc != 4) {
+        printf("usage: %s [server ip] [peers] [messages]\n", argv[0]);
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVER_PORT);
+    inet_aton(argv[1], &(addr.sin_addr));
+    peer_num = atoi(argv[2]);
+    message_num = atoi(argv[3]);
+    if (peer_num < 1 || message_num < 1) {
+        printf("at least 1 peer and 1 message\n");
+        return 1;
+    }
+    /* a new user every run, the messages of an earlier one are not in the way */
+    snprintf(username, sizeof(username), "ib%x", (unsigned int)time(NULL) & 0xffffff);
+
+    if (_fill() != 0) {
+        printf("the database can not be reached\n");
+        return 1;
+    }
+
+    secure_client_init();
+    printf("%-6s %10s %10s %12s\n", "mode", "messages", "ms", "bytes");
+    /* the inbox marks every message as read, so open finds an empty inbox */
+    if (bench_inbox() != 0 || bench_open() != 0) {
+        printf("a connection is broken or messages are missing\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,457 @@
+#include "protocol.h"
+#include "secure.h"
+#include "bench_keys.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#ifdef SECURE_IO_URING
+#include <liburing.h>
+#endif
+
+/**
+ * secure_send / secure_recv over loopback tcp:
+ *     the sender sends bursts of BURST 813-byte records (a chat list page),
+ *     all but the last with MSG_MORE, the receiver answers every burst with
+ *     one 811-byte record (the next request),
+ *     then a dump of DUMP_ROWS rows, a history page (813 bytes) or a friend
+ *     list (67 bytes), is sent with one secure_send per row and with one
+ *     secure_sendv, the receiver asks for the next dump after each one,
+ *     last INBOUND_NUM 811-byte requests are streamed in runs of
+ *     INBOUND_BURST and read with secure_recv and with secure_recv_view,
+ *     then one thread sends an 811-byte request down each of FANOUT
+ *     connections and reads the 813-byte replies, which one thread on the
+ *     other ends sends once it has every request of the round, both ends
+ *     once as they are and once corked (secure_cork, io_uring only),
+ *     then BULK_BYTES go one way in BULK_RECORD-byte records, sealed in user
+ *     space and, if the kernel takes the keys (secure_ktls_enable), by ktls,
+ *     cpu time of both ends is reported per GB,
+ *     syscalls, allocations and moved bytes are counted by wrapping the
+ *     calls secure.c makes:
+ *
+ *     clang -O2 -I./include -o bench_io test/bench_io.c src/secure.c src/seal.c src/pool.c src/metrics.c \
+ *           src/trace.c src/sync.c -lcrypto -pthread \
+ *           -Wl,--wrap=send,--wrap=recv,--wrap=poll,--wrap=malloc,--wrap=memmove
+ *     clang -O2 -I./include -DSECURE_IO_URING -o bench_io_uring test/bench_io.c src/secure.c src/seal.c \
+ *           src/pool.c src/metrics.c src/trace.c src/sync.c -lcrypto -luring -pthread -Wl,--wrap=send,--wrap=recv \
+ *           -Wl,--wrap=poll,--wrap=malloc,--wrap=memmove,--wrap=io_uring_submit_and_wait
+*/
+
+#define MESSAGE_NUM     200000
+#define DUMP_ROWS       500
+#define DUMP_NUM        400
+#define INBOUND_NUM     200000
+#define INBOUND_BURST   16
+#define FANOUT          SECURE_URING_DEPTH
+#define FANOUT_ROUNDS   20000
+#define BULK_BYTES      (1L << 30)
+#define BULK_RECORD     16384
+
+static struct secure_key keys[2];
+static int channels[2];
+static int burst;
+static int row_len, row_num, round_num;
+static __thread long syscall_num;
+static long peer_syscall_num;
+static __thread long malloc_num, malloc_bytes, move_bytes;
+static struct secure_key fanout_keys[2][FANOUT];
+static int fanout_channels[2][FANOUT];
+static long fanout_syscall_num[2];
+static int fanout_cork;
+
+ssize_t __real_send(int fd, const void * buf, size_t len, int flags);
+ssize_t __real_recv(int fd, void * buf, size_t len, int flags);
+int __real_poll(struct pollfd * fds, nfds_t nfds, int timeout);
+void * __real_malloc(size_t size);
+void * __real_memmove(void * dest, const void * src, size_t n);
+
+ssize_t __wrap_send(int fd, const void * buf, size_t len, int flags)
+{
+    syscall_num++;
+    return __real_send(fd, buf, len, flags);
+}
+
+ssize_t __wrap_recv(int fd, void * buf, size_t len, int flags)
+{
+    syscall_num++;
+    return __real_recv(fd, buf, len, flags);
+}
+
+int __wrap_poll(struct pollfd * fds, nfds_t nfds, int timeout)
+{
+    syscall_num++;
+    return __real_poll(fds, nfds, timeout);
+}
+
+void * __wrap_malloc(size_t size)
+{
+    malloc_num++;
+    malloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void * __wrap_memmove(void * dest, const void * src, size_t n)
+{
+    move_bytes += n;
+    return __real_memmove(dest, src, n);
+}
+
+#ifdef SECURE_IO_URING
+int __real_io_uring_submit_and_wait(struct io_uring * ring, unsigned wait_nr);
+
+int __wrap_io_uring_submit_and_wait(struct io_uring * ring, unsigned wait_nr)
+{
+    syscall_num++;
+    return __real_io_uring_submit_and_wait(ring, wait_nr);
+}
+#endif
+
+/* reads round_num runs of row_num records of row_len bytes, asks for the next run after each */
+static void * recv_routine(void * arg)
+{
+    char buf[813];
+
+    for (int n = 0; n < round_num; ++n) {
+        for (int i = 0; i < row_num; ++i) {
+            if (secure_recv(channels[1], buf, row_len, 0, &(keys[1])) <= 0) {
+                return NULL;
+            }
+        }
+        memset(buf, 0, 811);
+        buf[0] = PROTOCOL_CHAT_SELECT;
+        secure_send(channels[1], buf, 811, 0, &(keys[1]));
+    }
+    peer_syscall_num = syscall_num;
+
+    return NULL;
+}
+
+static void tcp_pair(void)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int listen_socket, opt = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    bind(listen_socket, (struct sockaddr *)&addr, sizeof(addr));
+    listen(listen_socket, 1);
+    getsockname(listen_socket, (struct sockaddr *)&addr, &addr_len);
+
+    channels[0] = socket(AF_INET, SOCK_STREAM, 0);
+    connect(channels[0], (struct sockaddr *)&addr, sizeof(addr));
+    channels[1] = accept(listen_socket, NULL, NULL);
+    close(listen_socket);
+    setsockopt(channels[0], IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    setsockopt(channels[1], IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    bench_key_pair(keys);
+}
+
+static double seconds_since(clockid_t clock, const struct timespec * start)
+{
+    struct timespec end;
+
+    clock_gettime(clock, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void bench_burst(void)
+{
+    pthread_t thread;
+    struct timespec start;
+    char row[813];
+    char buf[811];
+    double seconds;
+
+    memset(row, 'x', 813);
+    row[0] = PROTOCOL_CHAT_LIST;
+    printf("%-8s %14s %14s\n", "burst", "messages/s", "syscalls/msg");
+    for (burst = 1; burst <= 64; burst *= 4) {
+        row_len = 813;
+        row_num = burst;
+        round_num = MESSAGE_NUM / burst;
+        tcp_pair();
+        pthread_create(&thread, NULL, recv_routine, NULL);
+        syscall_num = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int n = 0; n < round_num; ++n) {
+            for (int i = 0; i < burst; ++i) {
+                secure_send(channels[0], row, 813, (i + 1 < burst) ? MSG_MORE : 0, &(keys[0]));
+            }
+            secure_recv(channels[0], buf, 811, 0, &(keys[0]));
+        }
+        seconds = seconds_since(CLOCK_MONOTONIC, &start);
+        pthread_join(thread, NULL);
+        close(channels[0]);
+        close(channels[1]);
+
+        printf("%-8d %14.0f %14.3f\n", burst, MESSAGE_NUM / seconds,
+               (double)(syscall_num + peer_syscall_num) / MESSAGE_NUM);
+    }
+}
+
+static void bench_dump(const char * name, int len, int vectored)
+{
+    pthread_t thread;
+    struct timespec start;
+    struct iovec records[DUMP_ROWS];
+    char * rows;
+    char buf[811];
+    double seconds;
+
+    rows = (char *)malloc(DUMP_ROWS * len);
+    memset(rows, 'x', DUMP_ROWS * len);
+    for (int i = 0; i < DUMP_ROWS; ++i) {
+        records[i].iov_base = &(rows[i * len]);
+        records[i].iov_len = len;
+    }
+    row_len = len;
+    row_num = DUMP_ROWS;
+    round_num = DUMP_NUM;
+    tcp_pair();
+    pthread_create(&thread, NULL, recv_routine, NULL);
+    syscall_num = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int n = 0; n < DUMP_NUM; ++n) {
+        if (vectored) {
+            secure_sendv(channels[0], records, DUMP_ROWS, 0, &(keys[0]));
+        } else {
+            for (int i = 0; i < DUMP_ROWS; ++i) {
+                secure_send(channels[0], &(rows[i * len]), len, 0, &(keys[0]));
+            }
+        }
+        secure_recv(channels[0], buf, 811, 0, &(keys[0]));
+    }
+    seconds = seconds_since(CLOCK_MONOTONIC, &start);
+    pthread_join(thread, NULL);
+    close(channels[0]);
+    close(channels[1]);
+    free(rows);
+
+    printf("%-10s %-8s %12.3f %18.1f\n", name, vectored ? "sendv" : "per-row",
+           seconds / DUMP_NUM * 1e3, (double)syscall_num / DUMP_NUM);
+}
+
+static void * inbound_routine(void * arg)
+{
+    struct iovec records[INBOUND_BURST];
+    char requests[INBOUND_BURST][811];
+
+    memset(requests, 0, sizeof(requests));
+    for (int i = 0; i < INBOUND_BURST; ++i) {
+        requests[i][0] = PROTOCOL_CHAT_MESSAGE;
+        records[i].iov_base = requests[i];
+        records[i].iov_len = 811;
+    }
+    for (int n = 0; n < INBOUND_NUM; n += INBOUND_BURST) {
+        secure_sendv(channels[1], records, INBOUND_BURST, 0, &(keys[1]));
+    }
+
+    return NULL;
+}
+
+static void bench_inbound(int view)
+{
+    pthread_t thread;
+    struct secure_session session;
+    struct timespec start;
+    char buf[811];
+    void * record;
+    double seconds;
+
+    tcp_pair();
+    secure_session_init(&session, channels[0], &(keys[0]));
+    pthread_create(&thread, NULL, inbound_routine, NULL);
+    syscall_num = malloc_num = malloc_bytes = move_bytes = 0;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    for (int n = 0; n < INBOUND_NUM; ++n) {
+        if (view) {
+            secure_recv_view(&session, 811, &record);
+        } else {
+            secure_recv(channels[0], buf, 811, 0, &(keys[0]));
+        }
+    }
+    seconds = seconds_since(CLOCK_THREAD_CPUTIME_ID, &start);
+    pthread_join(thread, NULL);
+    secure_session_finish(&session);
+    close(channels[0]);
+    close(channels[1]);
+
+    printf("%-10s %12.3f %12.3f %12.3f %14.1f %12.1f\n", view ? "view" : "copy",
+           seconds / INBOUND_NUM * 1e6, (double)syscall_num / INBOUND_NUM,
+           (double)malloc_num / INBOUND_NUM, (double)malloc_bytes / INBOUND_NUM,
+           (double)move_bytes / INBOUND_NUM);
+}
+
+/* side 0 sends the requests and reads the replies, side 1 the other way round */
+static void * fanout_routine(void * arg)
+{
+    int side = (int)(long)arg;
+    char buf[813];
+
+    if (fanout_cork) {
+        secure_cork();
+    }
+    memset(buf, 0, sizeof(buf));
+    syscall_num = 0;
+    for (int n = 0; n < FANOUT_ROUNDS; ++n) {
+        for (int i = 0; i < FANOUT; ++i) {
+            if (side == 0) {
+                buf[0] = PROTOCOL_CHAT_MESSAGE;
+                secure_send(fanout_channels[0][i], buf, 811, 0, &(fanout_keys[0][i]));
+            } else {
+                secure_recv(fanout_channels[1][i], buf, 811, 0, &(fanout_keys[1][i]));
+            }
+        }
+        for (int i = 0; i < FANOUT; ++i) {
+            if (side == 0) {
+                secure_recv(fanout_channels[0][i], buf, 813, 0, &(fanout_keys[0][i]));
+            } else {
+                buf[0] = PROTOCOL_CHAT_LIST;
+                secure_send(fanout_channels[1][i], buf, 813, 0, &(fanout_keys[1][i]));
+            }
+        }
+    }
+    secure_flush();
+    fanout_syscall_num[side] = syscall_num;
+
+    return NULL;
+}
+
+static void bench_fanout(int cork)
+{
+    pthread_t threads[2];
+    struct timespec start;
+    double seconds;
+
+    for (int i = 0; i < FANOUT; ++i) {
+        tcp_pair();
+        for (int side = 0; side < 2; ++side) {
+            fanout_channels[side][i] = channels[side];
+            fanout_keys[side][i] = keys[side];
+        }
+    }
+    fanout_cork = cork;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int side = 0; side < 2; ++side) {
+        pthread_create(&(threads[side]), NULL, fanout_routine, (void *)(long)side);
+    }
+    for (int side = 0; side < 2; ++side) {
+        pthread_join(threads[side], NULL);
+    }
+    seconds = seconds_since(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < FANOUT; ++i) {
+        close(fanout_channels[0][i]);
+        close(fanout_channels[1][i]);
+    }
+
+    printf("%-10s %14.0f %14.3f\n", cork ? "corked" : "each", 
+           (double)FANOUT * FANOUT_ROUNDS / seconds,
+           (double)(fanout_syscall_num[0] + fanout_syscall_num[1]) / (FANOUT * FANOUT_ROUNDS));
+}
+
+static void * bulk_routine(void * arg)
+{
+    struct secure_session session;
+    void * record;
+
+    secure_session_init(&session, channels[1], &(keys[1]));
+    for (long n = 0; n < BULK_BYTES / BULK_RECORD; ++n) {
+        if (secure_recv_view(&session, BULK_RECORD, &record) <= 0) {
+            break;
+        }
+    }
+    secure_session_finish(&session);
+
+    return NULL;
+}
+
+static void bench_bulk(int suite, int ktls)
+{
+    pthread_t thread;
+    struct timespec start, wall;
+    char * record;
+    double seconds, wall_seconds;
+
+    tcp_pair();
+    keys[0].suite = keys[1].suite = suite;
+    if (ktls && (secure_ktls_enable(channels[0], &(keys[0])) < 0 ||
+                 secure_ktls_enable(channels[1], &(keys[1])) < 0)) {
+        printf("%-18s %-6s unavailable: %s\n", (suite == SECURE_SUITE_AES_256_GCM) ?
+               "aes-256-gcm" : "chacha20-poly1305", "ktls", strerror(errno));
+        close(channels[0]);
+        close(channels[1]);
+        return;
+    }
+    record = (char *)malloc(BULK_RECORD);
+    memset(record, 'x', BULK_RECORD);
+    pthread_create(&thread, NULL, bulk_routine, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+    for (long n = 0; n < BULK_BYTES / BULK_RECORD; ++n) {
+        secure_send(channels[0], record, BULK_RECORD, 0, &(keys[0]));
+    }
+    pthread_join(thread, NULL);
+    seconds = seconds_since(CLOCK_PROCESS_CPUTIME_ID, &start);
+    wall_seconds = seconds_since(CLOCK_MONOTONIC, &wall);
+    close(channels[0]);
+    close(channels[1]);
+    free(record);
+
+    printf("%-18s %-6s %12.3f %12.1f\n", (suite == SECURE_SUITE_AES_256_GCM) ?
+           "aes-256-gcm" : "chacha20-poly1305", ktls ? "ktls" : "user",
+           seconds / (BULK_BYTES / 1e9), BULK_BYTES / wall_seconds / 1e6);
+}
+
+int main(void)
+{
+#ifdef SECURE_IO_URING
+    printf("backend: io_uring\n");
+#else
+    printf("backend: send / recv\n");
+#endif
+    bench_burst();
+
+    printf("\n%d-row dumps, sender side\n", DUMP_ROWS);
+    printf("%-10s %-8s %12s %18s\n", "dump", "api", "ms/dump", "syscalls/dump");
+    for (int vectored = 0; vectored <= 1; ++vectored) {
+        bench_dump("history", 813, vectored);
+        bench_dump("friends", 67, vectored);
+    }
+
+    printf("\n811-byte requests in runs of %d, receiver side\n", INBOUND_BURST);
+    printf("%-10s %12s %12s %12s %14s %12s\n", "recv", "cpu_us/msg", "syscalls/msg",
+           "mallocs/msg", "malloc_B/msg", "moved_B/msg");
+    bench_inbound(0);
+    bench_inbound(1);
+
+    printf("\n%d connections, a request down each and the replies, both ends\n", FANOUT);
+    printf("%-10s %14s %14s\n", "sends", "requests/s", "syscalls/req");
+    bench_fanout(0);
+    bench_fanout(1);
+
+    printf("\n%ld MB in %d-byte records, both ends\n", BULK_BYTES >> 20, BULK_RECORD);
+    printf("%-18s %-6s %12s %12s\n", "suite", "mode", "cpu_s/GB", "MB/s");
+    for (int ktls = 0; ktls <= 1; ++ktls) {
+        bench_bulk(SECURE_SUITE_AES_256_GCM, ktls);
+        bench_bulk(SECURE_SUITE_CHACHA20_POLY1305, ktls);
+    }
+
+    return 0;
+}
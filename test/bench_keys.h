@@ -0,0 +1,27 @@
+#ifndef _BENCH_KEYS_H_
+#define _BENCH_KEYS_H_
+
+#include "secure.h"
+#include <string.h>
+
+/**
+ * fixed keys for the benches that drive secure_send / secure_recv over a
+ * pair of channels of their own, with no handshake in between
+*/
+
+/* the two ends of a channel pair, keys[1] receives what keys[0] sends and back */
+static inline void bench_key_pair(struct secure_key * keys)
+{
+    memset(keys, 0, 2 * sizeof(struct secure_key));
+    keys[0].suite = keys[1].suite = SECURE_SUITE_AES_256_GCM;
+    memcpy(keys[0].send_key, "qwertyuiopasdfghqwertyuiopasdfgh", 32);
+    memcpy(keys[0].send_iv, "qwertyuiopas", 12);
+    memcpy(keys[0].recv_key, "asdfghqwertyuiopasdfghqwertyuiop", 32);
+    memcpy(keys[0].recv_iv, "asdfghqwerty", 12);
+    memcpy(keys[1].send_key, keys[0].recv_key, 32);
+    memcpy(keys[1].send_iv, keys[0].recv_iv, 12);
+    memcpy(keys[1].recv_key, keys[0].send_key, 32);
+    memcpy(keys[1].recv_iv, keys[0].send_iv, 12);
+}
+
+#endif
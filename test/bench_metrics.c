@@ -0,0 +1,125 @@
+#include "metrics.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * usage: bench_metrics [threads]
+ *     what the metrics cost the code they measure, per call, with [threads]
+ *     threads counting at once (each into its own block):
+ *     add:   metrics_add, a counter
+ *     time:  metrics_now + metrics_time, one latency observation,
+ *            i.e. two clock reads and a bucket
+ *     clock: two bare clock_gettime, the floor of a time
+ *     render: one scrape of everything, for the exporter side,
+ *            which must hold every count of every thread
+ *
+ *     clang -O2 -I./include -o bench_metrics test/bench_metrics.c src/metrics.c -pthread
+*/
+
+#define CALLS_PER_THREAD    (10 * 1000 * 1000)
+
+static int thread_num;
+static pthread_barrier_t barrier;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void * add_routine(void * arg)
+{
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < CALLS_PER_THREAD; ++i) {
+        metrics_add(METRICS_SEALED_BYTES, 813);
+    }
+
+    return NULL;
+}
+
+static void * time_routine(void * arg)
+{
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < CALLS_PER_THREAD; ++i) {
+        metrics_time(METRICS_DB_SELECT, metrics_now());
+    }
+
+    return NULL;
+}
+
+static void * clock_routine(void * arg)
+{
+    struct timespec ts;
+    volatile long sink = 0;
+
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < CALLS_PER_THREAD; ++i) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        sink += ts.tv_nsec;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        sink += ts.tv_nsec;
+    }
+
+    return NULL;
+}
+
+/* ns per call of each thread, the threads run at once */
+static double run(void * (* routine)(void *))
+{
+    pthread_t * threads;
+    double start;
+
+    threads = (pthread_t *)malloc(thread_num * sizeof(pthread_t));
+    pthread_barrier_init(&barrier, NULL, thread_num + 1);
+    for (int i = 0; i < thread_num; ++i) {
+        pthread_create(&(threads[i]), NULL, routine, NULL);
+    }
+    pthread_barrier_wait(&barrier);
+    start = now();
+    for (int i = 0; i < thread_num; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    start = now() - start;
+    pthread_barrier_destroy(&barrier);
+    free(threads);
+
+    return start * 1e9 / CALLS_PER_THREAD;
+}
+
+int main(int argc, char ** argv)
+{
+    char expected[64];
+    size_t len;
+    double start;
+    char * text;
+
+    thread_num = (argc > 1) ? atoi(argv[1]) : 1;
+    if (thread_num < 1) {
+        fprintf(stderr, "usage: %s [threads]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%d thread(s), ns per call\n", thread_num);
+    printf("add    %8.1f\n", run(add_routine));
+    printf("time   %8.1f\n", run(time_routine));
+    printf("clock  %8.1f\n", run(clock_routine));
+
+    start = now();
+    text = metrics_render(&len);
+    printf("render %8.1f us, %zu bytes\n", (now() - start) * 1e6, len);
+    /* every add of every thread must be in the sum */
+    snprintf(expected, sizeof(expected), "secure_sealed_bytes_total %lu\n",
+             (unsigned long)thread_num * CALLS_PER_THREAD * 813);
+    if (strstr(text, expected) == NULL) {
+        printf("counts are lost\n");
+        return 1;
+    }
+    free(text);
+
+    return 0;
+}
@@ -0,0 +1,438 @@
+#include "protocol.h"
+#include "queue.h"
+#include "log.h"
+#include "secure.h"
+#include "database.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * usage: bench_micro [label]
+ *     microbenchmarks of the layers under the server, each case is run
+ *     REPEAT_NUM times and its median printed as one json object per line:
+ *         {"commit":"[label]","bench":"queue","case":"threads=4","metric":"ops_per_s","value":1.0}
+ *     so the output of two commits can be put side by side with
+ *     test/bench_compare.sh:
+ *     queue:     enqueue + dequeue from every thread on one queue, ops are calls
+ *     log:       log_print of a connection line from every thread, to /dev/null
+ *     secure:    secure_send / secure_recv (and secure_recv_view) of one size
+ *                over a socketpair, a thread at each end
+ *     handshake: a full (dh) and a resumed handshake over a socketpair, until
+ *                the client holds the next ticket, the server side is the real one
+ *     database:  the database_* wrappers against DATABASE_DBNAME (a table named
+ *                bench_micro) or the in-memory stand-in of test/mysql_stub.c,
+ *                skipped if there is no connection
+ *
+ *     make bench, or make bench MYSQL_STUB=1
+*/
+
+#define REPEAT_NUM          5
+#define QUEUE_OPS           (1 << 20)
+#define LOG_LINES           (1 << 16)
+#define SECURE_BYTES        (16 << 20)
+#define HANDSHAKE_FULL_NUM  20
+#define HANDSHAKE_RESUMED_NUM 200
+#define DATABASE_OPS        2000
+
+static const char * label = "";
+static pthread_barrier_t barrier;
+static int thread_num;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void emit(const char * bench, const char * name, const char * metric, double value)
+{
+    printf("{\"commit\":\"%s\",\"bench\":\"%s\",\"case\":\"%s\",\"metric\":\"%s\",\"value\":%.3f}\n",
+           label, bench, name, metric, value);
+    fflush(stdout);
+}
+
+static int compare(const void * a, const void * b)
+{
+    double x = *((const double *)a);
+    double y = *((const double *)b);
+
+    return (x > y) - (x < y);
+}
+
+/* the median of REPEAT_NUM runs of routine */
+static double median(double (* routine)(void *), void * arg)
+{
+    double values[REPEAT_NUM];
+
+    for (int i = 0; i < REPEAT_NUM; ++i) {
+        values[i] = routine(arg);
+    }
+    qsort(values, REPEAT_NUM, sizeof(double), compare);
+
+    return values[REPEAT_NUM / 2];
+}
+
+/* runs routine on thread_num threads at once, returns the seconds they take together */
+static double run_threads(void * (* routine)(void *), void * arg)
+{
+    pthread_t threads[64];
+    double start;
+
+    pthread_barrier_init(&barrier, NULL, thread_num + 1);
+    for (int i = 0; i < thread_num; ++i) {
+        pthread_create(&(threads[i]), NULL, routine, arg);
+    }
+    pthread_barrier_wait(&barrier);
+    start = now();
+    for (int i = 0; i < thread_num; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    start = now() - start;
+    pthread_barrier_destroy(&barrier);
+
+    return start;
+}
+
+static void * queue_routine(void * arg)
+{
+    struct queue * q = arg;
+    int item;
+
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < QUEUE_OPS / thread_num / 2; ++i) {
+        enqueue(q, &item);
+        dequeue(q);
+    }
+
+    return NULL;
+}
+
+static double queue_run(void * arg)
+{
+    struct queue * q;
+    double seconds;
+
+    q = queue_init(SERVER_MAX_CLIENT_NUM + 64);
+    seconds = run_threads(queue_routine, q);
+    queue_finish(q);
+
+    return QUEUE_OPS / seconds;
+}
+
+static void * log_routine(void * arg)
+{
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < LOG_LINES / thread_num; ++i) {
+        log_print(LOG_INFO, "thread %d/%d: %s says \"hello, world!\"",
+                  i % SERVER_MAX_CLIENT_NUM, SERVER_MAX_CLIENT_NUM - 1, "alice");
+    }
+
+    return NULL;
+}
+
+static double log_run(void * arg)
+{
+    return LOG_LINES / run_threads(log_routine, NULL);
+}
+
+/* the two ends of a socketpair, keys[1] receives what keys[0] sends */
+struct secure_case
+{
+    int channels[2];
+    struct secure_key keys[2];
+    int suite;
+    size_t len;
+    int count;
+    int view;
+};
+
+static void * secure_recv_routine(void * arg)
+{
+    struct secure_case * c = arg;
+    struct secure_session session;
+    char * buf;
+    void * view;
+
+    buf = (char *)malloc(c->len + SECURE_TAG_LEN);
+    if (c->view) {
+        secure_session_init(&session, c->channels[1], &(c->keys[1]));
+        for (int i = 0; i < c->count; ++i) {
+            secure_recv_view(&session, c->len, &view);
+        }
+        secure_session_finish(&session);
+    } else {
+        for (int i = 0; i < c->count; ++i) {
+            secure_recv(c->channels[1], buf, c->len, 0, &(c->keys[1]));
+        }
+    }
+    free(buf);
+
+    return NULL;
+}
+
+static double secure_run(void * arg)
+{
+    struct secure_case * c = arg;
+    pthread_t thread;
+    double start;
+    char * buf;
+
+    memset(c->keys, 0, sizeof(c->keys));
+    c->keys[0].suite = c->keys[1].suite = c->suite;
+    memcpy(c->keys[0].send_key, "qwertyuiopasdfghqwertyuiopasdfgh", 32);
+    memcpy(c->keys[0].send_iv, "qwertyuiopas", 12);
+    memcpy(c->keys[1].recv_key, c->keys[0].send_key, 32);
+    memcpy(c->keys[1].recv_iv, c->keys[0].send_iv, 12);
+    socketpair(AF_UNIX, SOCK_STREAM, 0, c->channels);
+    buf = (char *)calloc(1, c->len);
+
+    start = now();
+    pthread_create(&thread, NULL, secure_recv_routine, c);
+    for (int i = 0; i < c->count; ++i) {
+        secure_send(c->channels[0], buf, c->len, 0, &(c->keys[0]));
+    }
+    pthread_join(thread, NULL);
+    start = now() - start;
+
+    free(buf);
+    close(c->channels[0]);
+    close(c->channels[1]);
+
+    return c->count / start;
+}
+
+struct handshake_case
+{
+    int channels[2];
+    int resume;
+    int count;
+};
+
+/* the server end, a ticket follows every handshake as it does after a sign in */
+static void * handshake_server_routine(void * arg)
+{
+    struct handshake_case * c = arg;
+    struct secure_key key;
+    char state[SECURE_TICKET_STATE_LEN] = "bench";
+    unsigned char ticket[1 + SECURE_TICKET_LEN];
+
+    for (int i = 0; i < c->count; ++i) {
+        if (secure_server_buildkey(c->channels[1], &key, state) < 0) {
+            break;
+        }
+        ticket[0] = PROTOCOL_TICKET;
+        secure_server_ticket(&key, state, &(ticket[1]));
+        secure_send(c->channels[1], ticket, sizeof(ticket), 0, &key);
+    }
+
+    return NULL;
+}
+
+static double handshake_run(void * arg)
+{
+    struct handshake_case * c = arg;
+    struct secure_ticket saved;
+    struct secure_key key;
+    unsigned char ticket[1 + SECURE_TICKET_LEN];
+    pthread_t thread;
+    double start;
+    int done = 0;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, c->channels);
+    pthread_create(&thread, NULL, handshake_server_routine, c);
+    start = now();
+    for (int i = 0; i < c->count; ++i) {
+        /* a resumed run starts with the ticket of a full handshake, which is not timed */
+        if (secure_client_buildkey(c->channels[0], &key,
+                                   (c->resume && i > 0) ? &saved : NULL) < 0 ||
+            secure_recv(c->channels[0], ticket, sizeof(ticket), 0, &key) <= 0) {
+            break;
+        }
+        secure_client_ticket(&key, &(ticket[1]), &saved);
+        if (i == 0 && c->resume) {
+            start = now();
+        }
+        done++;
+    }
+    start = now() - start;
+    close(c->channels[0]);
+    pthread_join(thread, NULL);
+    close(c->channels[1]);
+
+    return start * 1e3 / (c->resume ? done - 1 : done);
+}
+
+struct database_case
+{
+    MYSQL * mysql;
+    int statement;
+};
+
+#define DATABASE_INSERT     0
+#define DATABASE_SELECT     1
+#define DATABASE_UPDATE     2
+
+static double database_run(void * arg)
+{
+    struct database_case * c = arg;
+    result_t * result;
+    char buf[256];
+    double start;
+
+    start = now();
+    for (int i = 0; i < DATABASE_OPS; ++i) {
+        if (c->statement == DATABASE_INSERT) {
+            snprintf(buf, 256, "\'bench%d\', %lf, \'%s\', %d", i % 64, now(),
+                     "one row of the size of a short chat message", TABLE_M_STATE_UNREAD);
+            database_insert(c->mysql, "bench_micro", "username, time, content, state", buf);
+        } else if (c->statement == DATABASE_SELECT) {
+            /* a page of a stream, as chat_sync_routine selects it */
+            snprintf(buf, 256, "where id > %d and username = \'bench%d\' order by id limit %d",
+                     i % 64, i % 64, SERVER_STREAM_SYNC_ROWS);
+            database_select(c->mysql, "bench_micro", "*", buf);
+            result = database_get_result(c->mysql);
+            database_free_result(result);
+        } else {
+            snprintf(buf, 256, "where username = \'bench%d\' and state = %d",
+                     i % 64, TABLE_M_STATE_UNREAD);
+            database_update(c->mysql, "bench_micro", "state = state", buf);
+        }
+    }
+
+    return DATABASE_OPS / (now() - start);
+}
+
+static void bench_queue(void)
+{
+    char name[32];
+
+    for (thread_num = 1; thread_num <= 8; thread_num *= 2) {
+        snprintf(name, sizeof(name), "threads=%d", thread_num);
+        emit("queue", name, "ops_per_s", median(queue_run, NULL));
+    }
+}
+
+static void bench_log(void)
+{
+    char name[32];
+    double values[2];
+    int saved, null_fd;
+
+    /* log lines go to stdout, so stdout goes to /dev/null while they are printed */
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    null_fd = open("/dev/null", O_WRONLY);
+    for (int i = 0; i < 2; ++i) {
+        thread_num = (i == 0) ? 1 : 4;
+        dup2(null_fd, STDOUT_FILENO);
+        values[i] = median(log_run, NULL);
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+    }
+    close(null_fd);
+    close(saved);
+
+    for (int i = 0; i < 2; ++i) {
+        snprintf(name, sizeof(name), "threads=%d", (i == 0) ? 1 : 4);
+        emit("log", name, "lines_per_s", values[i]);
+    }
+}
+
+static void bench_secure(void)
+{
+    static const size_t lens[] = {64, 813, 4096, 16384};
+    struct secure_case c;
+    char name[64];
+    double records;
+
+    for (int suite = SECURE_SUITE_AES_256_GCM; suite <= SECURE_SUITE_CHACHA20_POLY1305; suite <<= 1) {
+        for (int i = 0; i < sizeof(lens) / sizeof(lens[0]); ++i) {
+            memset(&c, 0, sizeof(c));
+            c.suite = suite;
+            c.len = lens[i];
+            c.count = SECURE_BYTES / lens[i];
+            snprintf(name, sizeof(name), "%s/%zu",
+                     (suite == SECURE_SUITE_AES_256_GCM) ? "aes_256_gcm" : "chacha20_poly1305",
+                     lens[i]);
+            records = median(secure_run, &c);
+            emit("secure", name, "records_per_s", records);
+            emit("secure", name, "mb_per_s", records * lens[i] / (1 << 20));
+        }
+    }
+
+    /* the server reads through a session */
+    memset(&c, 0, sizeof(c));
+    c.suite = SECURE_SUITE_AES_256_GCM;
+    c.len = 811;
+    c.count = SECURE_BYTES / c.len;
+    c.view = 1;
+    emit("secure", "aes_256_gcm/811/recv_view", "records_per_s", median(secure_run, &c));
+}
+
+static void bench_handshake(void)
+{
+    struct handshake_case c;
+
+    memset(&c, 0, sizeof(c));
+    c.count = HANDSHAKE_FULL_NUM;
+    emit("handshake", "full", "ms", median(handshake_run, &c));
+    c.resume = 1;
+    c.count = HANDSHAKE_RESUMED_NUM;
+    emit("handshake", "resumed", "ms", median(handshake_run, &c));
+}
+
+static void bench_database(void)
+{
+    static const char * names[] = {"insert", "select", "update"};
+    struct database_case c;
+
+    database_init();
+    database_thread_init();
+    c.mysql = database_connect();
+    if (c.mysql == NULL) {
+        fprintf(stderr, "bench_micro: no database connection, database skipped\n");
+    } else {
+        database_create_table(c.mysql, "bench_micro",
+                              "id bigint not null auto_increment primary key, "
+                              "username varchar(64) not null, time double not null, "
+                              "content varchar(800), state tinyint not null");
+        for (c.statement = DATABASE_INSERT; c.statement <= DATABASE_UPDATE; ++c.statement) {
+            emit("database", names[c.statement], "ops_per_s", median(database_run, &c));
+        }
+        database_disconnect(c.mysql);
+    }
+    database_thread_finish();
+    database_finish();
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc > 1) {
+        label = argv[1];
+    }
+
+    log_init();
+    secure_server_init();
+    secure_client_init();
+
+    bench_queue();
+    bench_log();
+    bench_secure();
+    bench_handshake();
+    bench_database();
+
+    secure_client_finish();
+    secure_server_finish();
+    log_finish();
+
+    return 0;
+}
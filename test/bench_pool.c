@@ -0,0 +1,137 @@
+#include "protocol.h"
+#include "pool.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * skewed workload:
+ *     PRODUCER_NUM sessions submit bursts of tasks and wait for each burst,
+ *     like _chat_sync does, session 0 is hot and submits HOT_BURST tasks per
+ *     burst, the others submit COLD_BURST,
+ *     a task is a short cpu part plus a wait that stands for a database
+ *     round trip: 90% 0.1 ms, 9% 1 ms, 1% 10 ms
+ *
+ *     clang -O2 -I./include -o bench_pool test/bench_pool.c src/pool.c src/metrics.c src/trace.c \
+ *           src/sync.c -pthread
+*/
+#define PRODUCER_NUM        16
+#define HOT_BURST           32
+#define COLD_BURST          2
+#define RUN_SECONDS         2
+#define MAX_SAMPLES         (1 << 20)
+
+struct bench_task
+{
+    struct pool_task task;
+    struct timespec submit;
+    long wait_ns;
+};
+
+static struct pool * pool;
+static volatile int stop_flag;
+static pthread_mutex_t sample_lock = PTHREAD_MUTEX_INITIALIZER;
+static double samples[MAX_SAMPLES];
+static int sample_num;
+
+static double elapsed(const struct timespec * start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void task_routine(void * worker_data, void * arg)
+{
+    struct bench_task * t = arg;
+    struct timespec start, ts;
+    double latency;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (elapsed(&start) < 20e-6) { ; }
+
+    ts.tv_sec = t->wait_ns / 1000000000;
+    ts.tv_nsec = t->wait_ns % 1000000000;
+    nanosleep(&ts, NULL);
+
+    latency = elapsed(&(t->submit));
+    pthread_mutex_lock(&sample_lock);
+    if (sample_num < MAX_SAMPLES) {
+        samples[sample_num++] = latency;
+    }
+    pthread_mutex_unlock(&sample_lock);
+}
+
+static void * producer_routine(void * arg)
+{
+    struct bench_task tasks[HOT_BURST];
+    unsigned int id = (unsigned int)(long)arg;
+    unsigned int seed = id + 1;
+    int burst = (id == 0) ? HOT_BURST : COLD_BURST;
+    int r;
+
+    while (!stop_flag) {
+        for (int i = 0; i < burst; ++i) {
+            r = rand_r(&seed) % 100;
+            tasks[i].wait_ns = (r < 90) ? 100000 : (r < 99) ? 1000000 : 10000000;
+            clock_gettime(CLOCK_MONOTONIC, &(tasks[i].submit));
+            pool_task_init(&(tasks[i].task), task_routine, &(tasks[i]));
+            pool_submit(pool, &(tasks[i].task), id);
+        }
+        for (int i = 0; i < burst; ++i) {
+            pool_wait(&(tasks[i].task));
+        }
+    }
+
+    return NULL;
+}
+
+static int compare(const void * a, const void * b)
+{
+    double x = *((const double *)a);
+    double y = *((const double *)b);
+
+    return (x > y) - (x < y);
+}
+
+int main(void)
+{
+    pthread_t producers[PRODUCER_NUM];
+    struct timespec start;
+    double seconds;
+
+    printf("%-8s %12s %10s %10s %10s\n", "workers", "tasks/s", "p50_ms", "p99_ms", "p999_ms");
+
+    for (int worker_num = 1; worker_num <= 32; worker_num *= 2) {
+        pool = pool_init(worker_num, NULL, NULL);
+        sample_num = 0;
+        stop_flag = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long i = 0; i < PRODUCER_NUM; ++i) {
+            pthread_create(&(producers[i]), NULL, producer_routine, (void *)i);
+        }
+        while (elapsed(&start) < RUN_SECONDS) {
+            usleep(10000);
+        }
+        stop_flag = 1;
+        for (int i = 0; i < PRODUCER_NUM; ++i) {
+            pthread_join(producers[i], NULL);
+        }
+        seconds = elapsed(&start);
+        pool_finish(pool);
+
+        qsort(samples, sample_num, sizeof(double), compare);
+        printf("%-8d %12.0f %10.3f %10.3f %10.3f\n", worker_num, sample_num / seconds,
+               samples[sample_num / 2] * 1e3,
+               samples[(int)(sample_num * 0.99)] * 1e3,
+               samples[(int)(sample_num * 0.999)] * 1e3);
+    }
+
+    return 0;
+}
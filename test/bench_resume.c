@@ -0,0 +1,206 @@
+#include "protocol.h"
+#include "secure.h"
+#include "batch.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * usage: bench_resume [server port] [username] [password] [reconnects] [concurrency]
+ *     [concurrency] threads sign in (or up) as [username] once to get a ticket,
+ *     then reconnect to 127.0.0.1:[server port] [reconnects] times in all,
+ *     first with the dh exchange and a password, then with the ticket of the
+ *     last connection, a reconnect lasts from connect() until the inbox is in:
+ *
+ *     clang -O2 -I./include -o bench_resume test/bench_resume.c src/secure.c src/seal.c src/batch.c \
+ *           src/pool.c src/metrics.c src/trace.c src/sync.c -lcrypto -lz -pthread
+*/
+
+static struct sockaddr_in addr;
+static char username[65];
+static char password[65];
+static int reconnect_num;
+static int next_reconnect;
+static int use_ticket;
+static int fail_num;
+static double * latency;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* signs in, or up if there is no such user, the ticket follows PROTOCOL_SUCCEED */
+static int sign_in(int channel, struct secure_key * key)
+{
+    char buf[132];
+
+    for (int flag = PROTOCOL_SIGN_IN; flag <= PROTOCOL_SIGN_UP; ++flag) {
+        memset(buf, 0, sizeof(buf));
+        buf[0] = (char)flag;
+        strcpy(&(buf[1]), username);
+        strcpy(&(buf[66]), password);
+        buf[131] = CLIENT_BATCH_CODEC;
+        if (secure_send(channel, buf, 132, 0, key) <= 0 ||
+            secure_recv(channel, buf, 2, 0, key) <= 0) {
+            return -1;
+        }
+        if (buf[0] == PROTOCOL_SUCCEED) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/** reconnect return value:
+ *     return  0 if the connection got as far as the inbox, ticket is replaced
+ *     return -1 otherwise
+*/
+static int reconnect(struct secure_ticket * ticket, int resume)
+{
+    struct secure_key key;
+    char buf[1 + SECURE_TICKET_LEN];
+    int channel, ret;
+
+    channel = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(channel, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(channel);
+        return -1;
+    }
+
+    ret = secure_client_buildkey(channel, &key, resume ? ticket : NULL);
+    if (ret < 0 || (resume && ret != 1) || (ret == 0 && sign_in(channel, &key) < 0) ||
+        secure_recv(channel, buf, sizeof(buf), 0, &key) <= 0 || buf[0] != PROTOCOL_TICKET) {
+        close(channel);
+        return -1;
+    }
+    secure_client_ticket(&key, (unsigned char *)&(buf[1]), ticket);
+
+    if (batch_recv_pages(channel, &key, 14, SERVER_INBOX_PAGE_ROWS, NULL, NULL) < 0) {
+        close(channel);
+        return -1;
+    }
+
+    buf[0] = PROTOCOL_DISCONNECT;
+    secure_send(channel, buf, 1, 0, &key);
+    close(channel);
+
+    return 0;
+}
+
+static void * reconnect_routine(void * arg)
+{
+    struct secure_ticket ticket;
+    double start;
+    int i;
+
+    if (reconnect(&ticket, 0) < 0) {
+        fprintf(stderr, "can not sign in as %s\n", username);
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        pthread_mutex_lock(&lock);
+        i = next_reconnect++;
+        pthread_mutex_unlock(&lock);
+        if (i >= reconnect_num) {
+            break;
+        }
+
+        start = now();
+        if (reconnect(&ticket, use_ticket) == 0) {
+            latency[i] = (now() - start) * 1e3;
+        } else {
+            latency[i] = -1;
+            pthread_mutex_lock(&lock);
+            fail_num++;
+            pthread_mutex_unlock(&lock);
+        }
+    }
+
+    return NULL;
+}
+
+static int compare(const void * a, const void * b)
+{
+    double x = *((const double *)a);
+    double y = *((const double *)b);
+
+    return (x > y) - (x < y);
+}
+
+static void report(const char * name, double seconds)
+{
+    int n = 0;
+
+    for (int i = 0; i < reconnect_num; ++i) {
+        if (latency[i] >= 0) {
+            latency[n++] = latency[i];
+        }
+    }
+    printf("%-8s %12.0f %10d", name, n / seconds, fail_num);
+    if (n > 0) {
+        qsort(latency, n, sizeof(double), compare);
+        printf(" %11.3f %11.3f %11.3f", latency[n / 2], latency[(int)(n * 0.99)], latency[n - 1]);
+    }
+    printf("\n");
+}
+
+int main(int argc, char ** argv)
+{
+    pthread_t * threads;
+    int concurrency;
+    double start;
+
+    if (argc != 6) {
+        fprintf(stderr, "usage: %s [server port] [username] [password] [reconnects] [concurrency]\n",
+                argv[0]);
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)atoi(argv[1]));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    snprintf(username, sizeof(username), "%s", argv[2]);
+    snprintf(password, sizeof(password), "%s", argv[3]);
+    reconnect_num = atoi(argv[4]);
+    concurrency = atoi(argv[5]);
+
+    secure_client_init();
+    latency = (double *)malloc(reconnect_num * sizeof(double));
+    threads = (pthread_t *)malloc(concurrency * sizeof(pthread_t));
+
+    printf("%-8s %12s %10s %11s %11s %11s\n", "mode", "reconnect/s", "failed",
+           "p50_ms", "p99_ms", "max_ms");
+    for (use_ticket = 0; use_ticket <= 1; ++use_ticket) {
+        next_reconnect = 0;
+        fail_num = 0;
+        start = now();
+        for (int i = 0; i < concurrency; ++i) {
+            pthread_create(&(threads[i]), NULL, reconnect_routine, NULL);
+        }
+        for (int i = 0; i < concurrency; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        report(use_ticket ? "ticket" : "dh+pass", now() - start);
+    }
+
+    secure_client_finish();
+    free(threads);
+    free(latency);
+
+    return 0;
+}
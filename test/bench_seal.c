@@ -0,0 +1,235 @@
+#include "seal.h"
+#include <openssl/evp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * records per second sealed at chat-sized records, three ways:
+ *     per-call:    a fresh context and key schedule per record, as secure.c
+ *                  sealed before the thread cipher contexts
+ *     cached:      one context keeps the key schedule, a record only sets
+ *                  its nonce, as secure.c seals a lone record or one above
+ *                  SECURE_SEAL_MAX_LEN
+ *     interleaved: STREAM_NUM cached contexts, one per connection, sealed
+ *                  round robin the way a stage batching the records of many
+ *                  connections would feed them to EVP
+ *     batch:       the records of STREAM_NUM connections, each with its own
+ *                  key, gathered BATCH_NUM at a time and sealed by
+ *                  seal_batch (./src/seal.c) in place, aes-256-gcm only
+ *     every cached record and every record of the last batch is opened
+ *     again with EVP and compared with the original
+ *
+ *     clang -O2 -I./include -o bench_seal test/bench_seal.c src/seal.c -lcrypto
+*/
+
+#define RECORDS_PER_RUN     1000000
+#define STREAM_NUM          8
+#define BATCH_NUM           64
+#define TAG_LEN             16
+
+struct suite
+{
+    const char * name;
+    const EVP_CIPHER * (* cipher)(void);
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void nonce_of(uint64_t seq, unsigned char * nonce)
+{
+    memset(nonce, 0x5a, 12);
+    for (int i = 11; i >= 4; --i) {
+        nonce[i] ^= (unsigned char)seq;
+        seq >>= 8;
+    }
+}
+
+static void seal_with(EVP_CIPHER_CTX * ctx, const unsigned char * nonce,
+                      const unsigned char * msg, int len, unsigned char * enc_buf)
+{
+    int enc_len;
+
+    EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, nonce);
+    EVP_EncryptUpdate(ctx, enc_buf, &enc_len, msg, len);
+    EVP_EncryptFinal_ex(ctx, enc_buf + enc_len, &enc_len);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, enc_buf + len);
+}
+
+static int open_with(EVP_CIPHER_CTX * ctx, const unsigned char * nonce,
+                     unsigned char * enc_buf, int len, unsigned char * dec_buf)
+{
+    int dec_len;
+
+    EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce);
+    EVP_DecryptUpdate(ctx, dec_buf, &dec_len, enc_buf, len);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, TAG_LEN, enc_buf + len);
+
+    return EVP_DecryptFinal_ex(ctx, dec_buf + dec_len, &dec_len);
+}
+
+static double per_call(const struct suite * suite, const unsigned char * key,
+                       const unsigned char * msg, int len, unsigned char * enc_buf)
+{
+    EVP_CIPHER_CTX * ctx;
+    unsigned char nonce[12];
+    double start;
+
+    start = now();
+    for (int i = 0; i < RECORDS_PER_RUN; ++i) {
+        nonce_of(i, nonce);
+        ctx = EVP_CIPHER_CTX_new();
+        EVP_EncryptInit_ex(ctx, suite->cipher(), NULL, key, NULL);
+        seal_with(ctx, nonce, msg, len, enc_buf);
+        EVP_CIPHER_CTX_free(ctx);
+    }
+
+    return RECORDS_PER_RUN / (now() - start);
+}
+
+/** cached return value:
+ *     return records per second sealed over stream_num contexts, round robin
+ *     return -1 if a record does not round trip
+*/
+static double cached(const struct suite * suite, const unsigned char * key, int stream_num,
+                     const unsigned char * msg, int len, unsigned char * enc_buf,
+                     unsigned char * dec_buf)
+{
+    EVP_CIPHER_CTX * ctx[STREAM_NUM];
+    unsigned char nonce[12];
+    double start, records_per_s;
+    int ok = 1;
+
+    for (int s = 0; s < stream_num; ++s) {
+        ctx[s] = EVP_CIPHER_CTX_new();
+        EVP_EncryptInit_ex(ctx[s], suite->cipher(), NULL, key, NULL);
+    }
+
+    start = now();
+    for (int i = 0; i < RECORDS_PER_RUN; ++i) {
+        nonce_of(i, nonce);
+        seal_with(ctx[i % stream_num], nonce, msg, len, enc_buf + (i % stream_num) * 2048);
+    }
+    records_per_s = RECORDS_PER_RUN / (now() - start);
+
+    /* the last record of every stream */
+    for (int s = 0; s < stream_num; ++s) {
+        int i = RECORDS_PER_RUN - stream_num + s;
+
+        nonce_of(i, nonce);
+        EVP_DecryptInit_ex(ctx[s], suite->cipher(), NULL, key, NULL);
+        ok &= (open_with(ctx[s], nonce, enc_buf + (i % stream_num) * 2048, len, dec_buf) > 0 &&
+               memcmp(msg, dec_buf, len) == 0);
+        EVP_CIPHER_CTX_free(ctx[s]);
+    }
+
+    return ok ? records_per_s : -1;
+}
+
+/** batched return value:
+ *     return records per second sealed by seal_batch, BATCH_NUM per call
+ *     return -1 if a record does not round trip
+*/
+static double batched(const unsigned char * key, const unsigned char * msg, int len,
+                      unsigned char * enc_buf, unsigned char * dec_buf)
+{
+    struct seal_key keys[STREAM_NUM];
+    unsigned char raw[STREAM_NUM][32];
+    struct seal_record records[BATCH_NUM];
+    EVP_CIPHER_CTX * ctx;
+    double start, records_per_s;
+    int ok = 1;
+
+    /* every connection has a key of its own */
+    for (int s = 0; s < STREAM_NUM; ++s) {
+        memcpy(raw[s], key, 32);
+        raw[s][0] ^= (unsigned char)s;
+        seal_key_init(&(keys[s]), raw[s]);
+    }
+
+    start = now();
+    for (int i = 0; i < RECORDS_PER_RUN; i += BATCH_NUM) {
+        /* gather: copied into the send buffers, sealed there */
+        for (int j = 0; j < BATCH_NUM; ++j) {
+            records[j].key = &(keys[j % STREAM_NUM]);
+            nonce_of(i + j, records[j].nonce);
+            records[j].in = records[j].out = enc_buf + j * 2048;
+            records[j].len = len;
+            memcpy(records[j].out, msg, len);
+        }
+        seal_batch(records, BATCH_NUM);
+    }
+    records_per_s = RECORDS_PER_RUN / (now() - start);
+
+    ctx = EVP_CIPHER_CTX_new();
+    for (int j = 0; j < BATCH_NUM; ++j) {
+        EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, raw[j % STREAM_NUM], NULL);
+        ok &= (open_with(ctx, records[j].nonce, records[j].out, len, dec_buf) > 0 &&
+               memcmp(msg, dec_buf, len) == 0);
+    }
+    EVP_CIPHER_CTX_free(ctx);
+
+    return ok ? records_per_s : -1;
+}
+
+int main(void)
+{
+    unsigned char key[32] = "qwertyuiopasdfghqwertyuiopasdfgh";
+    struct suite suites[] = {
+        {"aes-256-gcm", EVP_aes_256_gcm},
+        {"chacha20-poly1305", EVP_chacha20_poly1305},
+    };
+    int sizes[] = {64, 128, 256, 512, 813, 1024};
+    unsigned char * msg;
+    unsigned char * enc_buf;
+    unsigned char * dec_buf;
+    double base, one, many, batch;
+
+    msg = (unsigned char *)malloc(1024);
+    enc_buf = (unsigned char *)malloc(BATCH_NUM * 2048);
+    dec_buf = (unsigned char *)malloc(2048);
+    for (int i = 0; i < 1024; ++i) {
+        msg[i] = (unsigned char)(i * 31);
+    }
+
+    printf("%-18s %7s %12s %12s %12s %12s %8s %8s\n", "suite", "record", "per-call/s", 
+           "cached/s", "interleaved", "batch/s", "cached", "batch");
+    for (int s = 0; s < sizeof(suites) / sizeof(struct suite); ++s) {
+        for (int z = 0; z < sizeof(sizes) / sizeof(int); ++z) {
+            base = per_call(&(suites[s]), key, msg, sizes[z], enc_buf);
+            one = cached(&(suites[s]), key, 1, msg, sizes[z], enc_buf, dec_buf);
+            many = cached(&(suites[s]), key, STREAM_NUM, msg, sizes[z], enc_buf, dec_buf);
+            batch = 0;
+            if (suites[s].cipher == EVP_aes_256_gcm && seal_available()) {
+                batch = batched(key, msg, sizes[z], enc_buf, dec_buf);
+            }
+            if (one < 0 || many < 0 || batch < 0) {
+                printf("%s: %d-byte record does not round trip\n", suites[s].name, sizes[z]);
+                return 1;
+            }
+
+            /* speedups over per-call */
+            if (batch > 0) {
+                printf("%-18s %7d %12.0f %12.0f %12.0f %12.0f %7.2fx %7.2fx\n", suites[s].name, 
+                       sizes[z], base, one, many, batch, one / base, batch / base);
+            } else {
+                printf("%-18s %7d %12.0f %12.0f %12.0f %12s %7.2fx %8s\n", suites[s].name, 
+                       sizes[z], base, one, many, "-", one / base, "-");
+            }
+        }
+    }
+
+    free(msg);
+    free(enc_buf);
+    free(dec_buf);
+
+    return 0;
+}
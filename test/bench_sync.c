@@ -0,0 +1,237 @@
+#include "protocol.h"
+#include "sync.h"
+#include <sys/resource.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * mutex under oversubscription:
+ *     threads take one lock in a loop, hold it for a short critical section
+ *     and work outside it for a while, with as many threads as cores and
+ *     with OVERSUBSCRIPTION times as many, in the three ways the server has
+ *     locked: a pthread mutex (the default build), an unbounded trylock
+ *     spin (what MULTICORE did) and the sync_mutex of ./src/sync.c,
+ *     cpu is the cpu time of the process per second of the run, acquire
+ *     the time from asking for the lock to holding it
+ *
+ * semaphore ping-pong:
+ *     two threads hand a token back and forth through two semaphores, like
+ *     an acceptor and a session hand a slot over, sem_t against sync_sem
+ *
+ *     clang -O2 -I./include -o bench_sync test/bench_sync.c src/sync.c -pthread
+*/
+#define RUN_SECONDS         2
+#define OVERSUBSCRIPTION    4
+#define INSIDE_LOOPS        100         /* about 0.1 us held */
+#define OUTSIDE_LOOPS       2000        /* about 2 us between holds */
+#define SAMPLE_EVERY        8
+#define MAX_SAMPLES         (1 << 20)
+#define PING_PONG_ROUNDS    100000
+
+#define MODE_PTHREAD        0
+#define MODE_SPIN           1
+#define MODE_SYNC           2
+
+static const char * mode_names[] = {"pthread", "spin", "sync"};
+
+static int mode;
+static pthread_mutex_t pthread_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sync_mutex sync_lock = SYNC_MUTEX_INITIALIZER;
+static volatile int stop_flag;
+static volatile uint64_t shared[8];
+static uint64_t ops;
+
+static pthread_mutex_t sample_lock = PTHREAD_MUTEX_INITIALIZER;
+static double samples[MAX_SAMPLES];
+static int sample_num;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_seconds(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void _lock(void)
+{
+    if (mode == MODE_PTHREAD) {
+        pthread_mutex_lock(&pthread_lock);
+    } else if (mode == MODE_SPIN) {
+        while (pthread_mutex_trylock(&pthread_lock)) { ; }
+    } else {
+        sync_mutex_lock(&sync_lock);
+    }
+}
+
+static void _unlock(void)
+{
+    if (mode == MODE_SYNC) {
+        sync_mutex_unlock(&sync_lock);
+    } else {
+        pthread_mutex_unlock(&pthread_lock);
+    }
+}
+
+static void * lock_routine(void * arg)
+{
+    double local[256];
+    int local_num = 0;
+    uint64_t n = 0;
+    volatile uint64_t outside = 0;
+    double start = 0;
+
+    while (!stop_flag) {
+        if (n % SAMPLE_EVERY == 0) {
+            start = now();
+        }
+        _lock();
+        if (n % SAMPLE_EVERY == 0) {
+            local[local_num++] = now() - start;
+        }
+        for (int i = 0; i < INSIDE_LOOPS; ++i) {
+            shared[i & 7]++;
+        }
+        _unlock();
+        for (int i = 0; i < OUTSIDE_LOOPS; ++i) {
+            outside++;
+        }
+        n++;
+
+        if (local_num == 256) {
+            pthread_mutex_lock(&sample_lock);
+            for (int i = 0; i < local_num && sample_num < MAX_SAMPLES; ++i) {
+                samples[sample_num++] = local[i];
+            }
+            pthread_mutex_unlock(&sample_lock);
+            local_num = 0;
+        }
+    }
+    __atomic_add_fetch(&ops, n, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+static int compare(const void * a, const void * b)
+{
+    double x = *((const double *)a);
+    double y = *((const double *)b);
+
+    return (x > y) - (x < y);
+}
+
+static void bench_lock(int thread_num)
+{
+    pthread_t * threads;
+    double start, seconds, cpu;
+
+    threads = (pthread_t *)malloc(thread_num * sizeof(pthread_t));
+    stop_flag = 0;
+    ops = 0;
+    sample_num = 0;
+
+    cpu = cpu_seconds();
+    start = now();
+    for (int i = 0; i < thread_num; ++i) {
+        pthread_create(&(threads[i]), NULL, lock_routine, NULL);
+    }
+    sleep(RUN_SECONDS);
+    stop_flag = 1;
+    for (int i = 0; i < thread_num; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    seconds = now() - start;
+    cpu = cpu_seconds() - cpu;
+
+    qsort(samples, sample_num, sizeof(double), compare);
+    printf("%-8s %8d %12.0f %8.2f %10.3f %10.3f %10.3f\n", mode_names[mode], thread_num,
+           ops / seconds, cpu / seconds, samples[sample_num / 2] * 1e6,
+           samples[(int)(sample_num * 0.99)] * 1e6, samples[sample_num - 1] * 1e6);
+    free(threads);
+}
+
+static sem_t posix_sems[2];
+static struct sync_sem sync_sems[2];
+
+static void * pong_routine(void * arg)
+{
+    for (int i = 0; i < PING_PONG_ROUNDS; ++i) {
+        if (mode == MODE_SYNC) {
+            sync_sem_wait(&(sync_sems[0]));
+            sync_sem_post(&(sync_sems[1]));
+        } else {
+            sem_wait(&(posix_sems[0]));
+            sem_post(&(posix_sems[1]));
+        }
+    }
+
+    return NULL;
+}
+
+static void bench_ping_pong(void)
+{
+    pthread_t thread;
+    double start, seconds, cpu;
+
+    sem_init(&(posix_sems[0]), 0, 0);
+    sem_init(&(posix_sems[1]), 0, 0);
+    sync_sem_init(&(sync_sems[0]), 0);
+    sync_sem_init(&(sync_sems[1]), 0);
+
+    cpu = cpu_seconds();
+    start = now();
+    pthread_create(&thread, NULL, pong_routine, NULL);
+    for (int i = 0; i < PING_PONG_ROUNDS; ++i) {
+        if (mode == MODE_SYNC) {
+            sync_sem_post(&(sync_sems[0]));
+            sync_sem_wait(&(sync_sems[1]));
+        } else {
+            sem_post(&(posix_sems[0]));
+            sem_wait(&(posix_sems[1]));
+        }
+    }
+    pthread_join(thread, NULL);
+    seconds = now() - start;
+    cpu = cpu_seconds() - cpu;
+
+    printf("%-8s %12.3f %8.2f\n", (mode == MODE_SYNC) ? "sync_sem" : "sem_t",
+           seconds / PING_PONG_ROUNDS * 1e6, cpu / seconds);
+    sem_destroy(&(posix_sems[0]));
+    sem_destroy(&(posix_sems[1]));
+}
+
+int main(int argc, char ** argv)
+{
+    int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    printf("%d cores, SYNC_SPIN_NUM %d\n\n", cores, SYNC_SPIN_NUM);
+    printf("%-8s %8s %12s %8s %10s %10s %10s\n",
+           "mutex", "threads", "ops/s", "cpu", "p50_us", "p99_us", "max_us");
+    for (int n = cores; n <= cores * OVERSUBSCRIPTION; n *= OVERSUBSCRIPTION) {
+        for (mode = MODE_PTHREAD; mode <= MODE_SYNC; ++mode) {
+            bench_lock(n);
+        }
+    }
+
+    printf("\n%-8s %12s %8s\n", "sem", "round_us", "cpu");
+    mode = MODE_PTHREAD;
+    bench_ping_pong();
+    mode = MODE_SYNC;
+    bench_ping_pong();
+
+    return 0;
+}
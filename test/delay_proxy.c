@@ -0,0 +1,182 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * usage: delay_proxy [listen port] [server port] [one-way delay ms]
+ *     forwards every connection to 127.0.0.1:[server port], holding each
+ *     chunk for [one-way delay ms] in both directions (RTT = 2 * delay)
+ *
+ *     clang -O2 -o delay_proxy test/delay_proxy.c -pthread
+*/
+
+struct chunk
+{
+    struct chunk * next;
+    struct timespec due;
+    ssize_t len;
+    char data[16384];
+};
+
+struct pipe_info
+{
+    int from, to;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct chunk * head;
+    struct chunk * tail;
+    bool closed;
+};
+
+static long delay_ms;
+
+static void * read_routine(void * arg)
+{
+    struct pipe_info * p = arg;
+    struct chunk * c;
+
+    while (true) {
+        c = (struct chunk *)malloc(sizeof(struct chunk));
+        c->next = NULL;
+        c->len = recv(p->from, c->data, sizeof(c->data), 0);
+        clock_gettime(CLOCK_MONOTONIC, &(c->due));
+        c->due.tv_sec += delay_ms / 1000;
+        c->due.tv_nsec += (delay_ms % 1000) * 1000000;
+        if (c->due.tv_nsec >= 1000000000) {
+            c->due.tv_sec++;
+            c->due.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(&(p->lock));
+        if (c->len <= 0) {
+            p->closed = true;
+            free(c);
+        } else if (p->tail == NULL) {
+            p->head = p->tail = c;
+        } else {
+            p->tail->next = c;
+            p->tail = c;
+        }
+        pthread_cond_signal(&(p->cond));
+        pthread_mutex_unlock(&(p->lock));
+
+        if (p->closed) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void * write_routine(void * arg)
+{
+    struct pipe_info * p = arg;
+    struct chunk * c;
+
+    while (true) {
+        pthread_mutex_lock(&(p->lock));
+        while (p->head == NULL && !p->closed) {
+            pthread_cond_wait(&(p->cond), &(p->lock));
+        }
+        c = p->head;
+        if (c != NULL) {
+            p->head = c->next;
+            if (p->head == NULL) {
+                p->tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&(p->lock));
+
+        if (c == NULL) {
+            shutdown(p->to, SHUT_WR);
+            break;
+        }
+
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &(c->due), NULL);
+        send(p->to, c->data, c->len, MSG_NOSIGNAL);
+        free(c);
+    }
+
+    return NULL;
+}
+
+static void * connection_routine(void * arg)
+{
+    struct pipe_info p[2];
+    pthread_t threads[4];
+    int * channels = arg;
+
+    for (int i = 0; i < 2; ++i) {
+        p[i].from = channels[i];
+        p[i].to = channels[1 - i];
+        pthread_mutex_init(&(p[i].lock), NULL);
+        pthread_cond_init(&(p[i].cond), NULL);
+        p[i].head = p[i].tail = NULL;
+        p[i].closed = false;
+        pthread_create(&(threads[2 * i]), NULL, read_routine, &(p[i]));
+        pthread_create(&(threads[2 * i + 1]), NULL, write_routine, &(p[i]));
+    }
+    for (int i = 0; i < 4; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    close(channels[0]);
+    close(channels[1]);
+    free(channels);
+
+    return NULL;
+}
+
+int main(int argc, char ** argv)
+{
+    struct sockaddr_in addr;
+    pthread_t thread;
+    int listen_socket;
+    int * channels;
+    int on = 1;
+
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s [listen port] [server port] [one-way delay ms]\n", argv[0]);
+        return 1;
+    }
+    delay_ms = strtol(argv[3], NULL, 10);
+
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)atoi(argv[1]));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(listen_socket, (struct sockaddr *)&addr, sizeof(addr));
+    listen(listen_socket, 128);
+
+    addr.sin_port = htons((unsigned short)atoi(argv[2]));
+
+    while (true) {
+        channels = (int *)malloc(2 * sizeof(int));
+        channels[0] = accept(listen_socket, NULL, NULL);
+        channels[1] = socket(AF_INET, SOCK_STREAM, 0);
+        if (channels[0] == -1 ||
+            connect(channels[1], (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            close(channels[0]);
+            close(channels[1]);
+            free(channels);
+            continue;
+        }
+        setsockopt(channels[0], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        setsockopt(channels[1], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        pthread_create(&thread, NULL, connection_routine, channels);
+        pthread_detach(thread);
+    }
+
+    return 0;
+}
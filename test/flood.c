@@ -0,0 +1,156 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+/**
+ * usage: flood [server port] [connections] [concurrency]
+ *     opens [connections] connections to 127.0.0.1:[server port] from
+ *     [concurrency] threads at once, each waits for the first handshake
+ *     record of the server and closes,
+ *     connect: until connect() returns, a dropped SYN shows up here
+ *     first:   until the first record arrives, i.e. accepted and served,
+ *              a connection whose last ACK was dropped on a full accept
+ *              queue may never get it, it fails after FIRST_TIMEOUT seconds
+ *
+ *     clang -O2 -o flood test/flood.c -pthread
+*/
+
+#define FIRST_TIMEOUT       10
+
+static struct sockaddr_in addr;
+static int connection_num;
+static int next_connection;
+static int fail_num;
+static double * connect_latency;
+static double * first_latency;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void * flood_routine(void * arg)
+{
+    struct timeval tv = {FIRST_TIMEOUT, 0};
+    char buf[514];
+    double start, connected;
+    ssize_t len, ret;
+    int channel;
+    int i;
+
+    while (1) {
+        pthread_mutex_lock(&lock);
+        i = next_connection++;
+        pthread_mutex_unlock(&lock);
+        if (i >= connection_num) {
+            break;
+        }
+
+        start = now();
+        channel = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(channel, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(channel);
+            pthread_mutex_lock(&lock);
+            fail_num++;
+            pthread_mutex_unlock(&lock);
+            connect_latency[i] = first_latency[i] = -1;
+            continue;
+        }
+        connected = now();
+        setsockopt(channel, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        for (len = 0; len < 514; len += ret) {
+            ret = recv(channel, buf + len, 514 - len, 0);
+            if (ret <= 0) {
+                break;
+            }
+        }
+        close(channel);
+
+        connect_latency[i] = (connected - start) * 1e3;
+        first_latency[i] = (len == 514) ? (now() - start) * 1e3 : -1;
+        if (len != 514) {
+            pthread_mutex_lock(&lock);
+            fail_num++;
+            pthread_mutex_unlock(&lock);
+        }
+    }
+
+    return NULL;
+}
+
+static int compare(const void * a, const void * b)
+{
+    double x = *((const double *)a);
+    double y = *((const double *)b);
+
+    return (x > y) - (x < y);
+}
+
+static void report(const char * name, double * latency)
+{
+    int n = 0;
+
+    for (int i = 0; i < connection_num; ++i) {
+        if (latency[i] >= 0) {
+            latency[n++] = latency[i];
+        }
+    }
+    if (n == 0) {
+        return;
+    }
+    qsort(latency, n, sizeof(double), compare);
+    printf("%-8s p50 %9.3f ms   p99 %9.3f ms   max %9.3f ms\n", name,
+           latency[n / 2], latency[(int)(n * 0.99)], latency[n - 1]);
+}
+
+int main(int argc, char ** argv)
+{
+    pthread_t * threads;
+    int concurrency;
+    double start, seconds;
+
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s [server port] [connections] [concurrency]\n", argv[0]);
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)atoi(argv[1]));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    connection_num = atoi(argv[2]);
+    concurrency = atoi(argv[3]);
+
+    connect_latency = (double *)malloc(connection_num * sizeof(double));
+    first_latency = (double *)malloc(connection_num * sizeof(double));
+    threads = (pthread_t *)malloc(concurrency * sizeof(pthread_t));
+
+    start = now();
+    for (int i = 0; i < concurrency; ++i) {
+        pthread_create(&(threads[i]), NULL, flood_routine, NULL);
+    }
+    for (int i = 0; i < concurrency; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    seconds = now() - start;
+
+    printf("%d connections, %d failed, %.0f accepts/s\n", connection_num, fail_num,
+           (connection_num - fail_num) / seconds);
+    report("connect", connect_latency);
+    report("first", first_latency);
+
+    return 0;
+}
@@ -0,0 +1,52 @@
+#!/bin/sh
+# usage: lock_report.sh [metrics]
+#     one line per lock out of a scrape of a server built with LOCK_PROFILE
+#     (curl -s 127.0.0.1:9464/metrics > metrics), the percentiles are the
+#     upper bounds of their buckets, so at most 25% high, 1.0 is under 1 us
+
+if [ $# -ne 1 ]; then
+    echo "usage: $0 [metrics]" >&2
+    exit 1
+fi
+
+awk '
+    function quantile(kind, lock, q,    i, target) {
+        target = q * count[kind, lock]
+        for (i = 1; i <= bucket_num[kind, lock]; ++i) {
+            if (cumulative[kind, lock, i] >= target) {
+                return bound[kind, lock, i]
+            }
+        }
+        return 0
+    }
+    /^lock_/ {
+        split($1, parts, "\"")
+        lock = parts[2]
+        if (!(lock in seen)) {
+            seen[lock] = 1
+            locks[++lock_num] = lock
+        }
+    }
+    /^lock_contended_total/ { contended[lock] = $2 }
+    /^lock_(wait|hold)_seconds_bucket/ {
+        kind = ($1 ~ /^lock_wait/) ? "wait" : "hold"
+        i = ++bucket_num[kind, lock]
+        cumulative[kind, lock, i] = $2
+        bound[kind, lock, i] = parts[4]
+    }
+    /^lock_(wait|hold)_seconds_sum/ { sum[($1 ~ /^lock_wait/) ? "wait" : "hold", lock] = $2 }
+    /^lock_(wait|hold)_seconds_count/ { count[($1 ~ /^lock_wait/) ? "wait" : "hold", lock] = $2 }
+    END {
+        printf "%-12s %12s %10s %7s %12s %12s %12s %12s\n", "lock", "acquisitions", "contended",
+               "%", "wait_ms", "wait_p99_us", "hold_avg_us", "hold_p99_us"
+        for (l = 1; l <= lock_num; ++l) {
+            lock = locks[l]
+            n = count["wait", lock]
+            printf "%-12s %12d %10d %7.2f %12.3f %12.1f %12.2f %12.1f\n", lock, n, contended[lock],
+                   (n > 0) ? contended[lock] * 100 / n : 0, sum["wait", lock] * 1e3,
+                   quantile("wait", lock, 0.99) * 1e6,
+                   (count["hold", lock] > 0) ? sum["hold", lock] * 1e6 / count["hold", lock] : 0,
+                   quantile("hold", lock, 0.99) * 1e6
+        }
+    }
+' "$1"
@@ -0,0 +1,127 @@
+#include "protocol.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/**
+ * an in-memory stand-in for the part of libmysqlclient that database.c
+ * uses, for test/bench_micro.c (make bench MYSQL_STUB=1):
+ *     every query succeeds at once, a select returns SERVER_STREAM_SYNC_ROWS
+ *     rows shaped like the message table, nothing is stored,
+ *     so what is measured is the wrappers and not a server,
+ *     mysql.h is not included, the handles are opaque to database.c
+*/
+
+#define STUB_COLUMN_NUM     6
+
+struct stub_mysql
+{
+    unsigned int field_count;       /* of the last query */
+};
+
+struct stub_res
+{
+    uint64_t row_num;
+    uint64_t next;
+    char ** rows[SERVER_STREAM_SYNC_ROWS];
+};
+
+static char * stub_row[STUB_COLUMN_NUM] = {
+    "1", "alice", "bob", "1700000000.000000",
+    "one row of the size of a short chat message", "2"
+};
+
+int mysql_server_init(int argc, char ** argv, char ** groups)
+{
+    return 0;
+}
+
+void mysql_server_end(void)
+{
+}
+
+/* mysql.h makes these macros for the two above, other headers do not */
+int mysql_library_init(int argc, char ** argv, char ** groups)
+{
+    return 0;
+}
+
+void mysql_library_end(void)
+{
+}
+
+int mysql_thread_init(void)
+{
+    return 0;
+}
+
+void mysql_thread_end(void)
+{
+}
+
+void * mysql_init(void * mysql)
+{
+    return calloc(1, sizeof(struct stub_mysql));
+}
+
+void * mysql_real_connect(void * mysql, const char * host, const char * user,
+                          const char * password, const char * db, unsigned int port,
+                          const char * unix_socket, unsigned long flags)
+{
+    return mysql;
+}
+
+void mysql_close(void * mysql)
+{
+    free(mysql);
+}
+
+int mysql_query(void * mysql, const char * command)
+{
+    ((struct stub_mysql *)mysql)->field_count =
+        (strncasecmp(command, "select", 6) == 0) ? STUB_COLUMN_NUM : 0;
+
+    return 0;
+}
+
+void * mysql_store_result(void * mysql)
+{
+    struct stub_res * res;
+
+    if (((struct stub_mysql *)mysql)->field_count == 0) {
+        return NULL;
+    }
+    res = (struct stub_res *)malloc(sizeof(struct stub_res));
+    if (res != NULL) {
+        res->row_num = SERVER_STREAM_SYNC_ROWS;
+        res->next = 0;
+        for (int i = 0; i < SERVER_STREAM_SYNC_ROWS; ++i) {
+            res->rows[i] = stub_row;
+        }
+    }
+
+    return res;
+}
+
+unsigned int mysql_field_count(void * mysql)
+{
+    return ((struct stub_mysql *)mysql)->field_count;
+}
+
+uint64_t mysql_num_rows(void * res)
+{
+    return ((struct stub_res *)res)->row_num;
+}
+
+char ** mysql_fetch_row(void * res)
+{
+    struct stub_res * stub = res;
+
+    return (stub->next < stub->row_num) ? stub->rows[stub->next++] : NULL;
+}
+
+void mysql_free_result(void * res)
+{
+    free(res);
+}
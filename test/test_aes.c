@@ -1,58 +1,144 @@
 #include <openssl/evp.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * record throughput of the cipher suites, sealed and opened one record at a
+ * time with a fresh context and nonce per record (bench_seal.c has the
+ * cached contexts of secure.c),
+ * aes-256-cbc is the suite the protocol used before, for comparison,
+ * every record is opened again and compared with the original
+ *
+ *     clang -O2 -o test_aes test/test_aes.c -lcrypto
+*/
+
+#define BYTES_PER_RUN   (64 << 20)
+#define TAG_LEN         16
+
+struct suite
+{
+    const char * name;
+    const EVP_CIPHER * (* cipher)(void);
+    int aead;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int seal(const struct suite * suite, const unsigned char * key, const unsigned char * iv,
+                const unsigned char * msg, int len, unsigned char * enc_buf)
+{
+    EVP_CIPHER_CTX * ctx;
+    int total_enc_len, enc_len;
+
+    ctx = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(ctx, suite->cipher(), NULL, key, iv);
+    EVP_EncryptUpdate(ctx, enc_buf, &enc_len, msg, len);
+    total_enc_len = enc_len;
+    EVP_EncryptFinal_ex(ctx, enc_buf + total_enc_len, &enc_len);
+    total_enc_len += enc_len;
+    if (suite->aead) {
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, enc_buf + total_enc_len);
+        total_enc_len += TAG_LEN;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+
+    return total_enc_len;
+}
+
+static int open_record(const struct suite * suite, const unsigned char * key, const unsigned char * iv,
+                       unsigned char * enc_buf, int enc_len, unsigned char * dec_buf)
+{
+    EVP_CIPHER_CTX * ctx;
+    int total_dec_len, dec_len, ret;
+
+    if (suite->aead) {
+        enc_len -= TAG_LEN;
+    }
+    ctx = EVP_CIPHER_CTX_new();
+    EVP_DecryptInit_ex(ctx, suite->cipher(), NULL, key, iv);
+    EVP_DecryptUpdate(ctx, dec_buf, &dec_len, enc_buf, enc_len);
+    total_dec_len = dec_len;
+    if (suite->aead) {
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, TAG_LEN, enc_buf + enc_len);
+    }
+    ret = EVP_DecryptFinal_ex(ctx, dec_buf + total_dec_len, &dec_len);
+    total_dec_len += dec_len;
+    EVP_CIPHER_CTX_free(ctx);
+
+    return (ret > 0) ? total_dec_len : -1;
+}
 
 int main(void)
 {
     unsigned char key[32] = "qwertyuiopasdfghqwertyuiopasdfgh";
     unsigned char iv[16] = "qwertyuiopasdfgh";
 
-    EVP_CIPHER_CTX * ctx;
-    unsigned char enc_buf[128];
-    unsigned char dec_buf[128];
-    int total_enc_len, enc_len;
-    int total_dec_len, dec_len;
-
-    int msg_len[] = {1, 16, 17, 32, 33};
-    unsigned char * msg[] = {
-        (unsigned char *)"1",
-        (unsigned char *)"1234567890123456",
-        (unsigned char *)"12345678901234567",
-        (unsigned char *)"12345678901234567890123456789012",
-        (unsigned char *)"123456789012345678901234567890123"
+    struct suite suites[] = {
+        {"aes-256-cbc", EVP_aes_256_cbc, 0},
+        {"aes-256-gcm", EVP_aes_256_gcm, 1},
+        {"chacha20-poly1305", EVP_chacha20_poly1305, 1},
     };
+    int sizes[] = {16, 64, 256, 813, 1024, 4096, 16384, 65536};
+    unsigned char * msg;
+    unsigned char * enc_buf;
+    unsigned char * dec_buf;
+    int enc_len, dec_len, count;
+    double start, seal_time, open_time;
 
-    for (int i = 0; i < sizeof(msg_len) / sizeof(int); ++i) {
-        ctx = EVP_CIPHER_CTX_new();
-        EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv);
-        EVP_EncryptUpdate(ctx, enc_buf, &enc_len, msg[i], msg_len[i]);
-        total_enc_len = enc_len;
-        printf("enc upd len: %d\n", enc_len);
-        EVP_EncryptFinal_ex(ctx, enc_buf + total_enc_len, &enc_len);
-        total_enc_len += enc_len;
-        printf("enc fnl len: %d\n", enc_len);
-        EVP_CIPHER_CTX_free(ctx);
-
-        printf("enc msg: 0x");
-        for (int j = 0; j < total_enc_len; ++j)
-            printf("%02x", enc_buf[j]);
-        printf("\n");
-
-        ctx = EVP_CIPHER_CTX_new();
-        EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv);
-        EVP_DecryptUpdate(ctx, dec_buf, &dec_len, enc_buf, total_enc_len);
-        total_dec_len = dec_len;
-        printf("dec upd len: %d\n", dec_len);
-        EVP_DecryptFinal_ex(ctx, dec_buf + total_dec_len, &dec_len);
-        total_dec_len += dec_len;
-        printf("dec fnl len: %d\n", dec_len);
-        EVP_CIPHER_CTX_free(ctx);
-
-        printf("ori msg: %s\n", msg[i]);
-        dec_buf[total_dec_len] = '\0';
-        printf("dec msg: %s\n", dec_buf);
-
-        printf("\n");
+    msg = (unsigned char *)malloc(65536);
+    enc_buf = (unsigned char *)malloc(65536 + 32);
+    dec_buf = (unsigned char *)malloc(65536 + 32);
+    for (int i = 0; i < 65536; ++i) {
+        msg[i] = (unsigned char)(i * 31);
     }
 
+    printf("%-18s %8s %12s %12s %10s\n", "suite", "record", "seal_MB/s", "open_MB/s", "overhead");
+    for (int s = 0; s < sizeof(suites) / sizeof(struct suite); ++s) {
+        for (int z = 0; z < sizeof(sizes) / sizeof(int); ++z) {
+            count = BYTES_PER_RUN / sizes[z];
+            if (count > 500000) {
+                count = 500000;
+            }
+
+            enc_len = 0;
+            start = now();
+            for (int i = 0; i < count; ++i) {
+                /* a new nonce per record, as the record sequence number would give */
+                iv[0] = (unsigned char)i;
+                enc_len = seal(&(suites[s]), key, iv, msg, sizes[z], enc_buf);
+            }
+            seal_time = now() - start;
+
+            dec_len = 0;
+            start = now();
+            for (int i = 0; i < count; ++i) {
+                dec_len = open_record(&(suites[s]), key, iv, enc_buf, enc_len, dec_buf);
+            }
+            open_time = now() - start;
+
+            if (dec_len != sizes[z] || memcmp(msg, dec_buf, sizes[z]) != 0) {
+                printf("%s: %d-byte record does not round trip\n", suites[s].name, sizes[z]);
+                return 1;
+            }
+
+            printf("%-18s %8d %12.1f %12.1f %9dB\n", suites[s].name, sizes[z],
+                   (double)count * sizes[z] / seal_time / 1e6,
+                   (double)count * sizes[z] / open_time / 1e6,
+                   enc_len - sizes[z]);
+        }
+    }
+
+    free(msg);
+    free(enc_buf);
+    free(dec_buf);
+
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,213 @@
+#include "protocol.h"
+#include "seal.h"
+#include <openssl/evp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * seal_batch (./src/seal.c) against EVP_aes_256_gcm, exits 1 on the first
+ * record that differs:
+ *     known answers: the AES-256 test cases 13 ~ 15 of the GCM spec
+ *                    (McGrew and Viega, no AAD, 96-bit IV)
+ *     every length:  0 ~ SECURE_SEAL_MAX_LEN, in batches of sizes that are
+ *                    and are not a multiple of SEAL_LANES, every record with
+ *                    a key picked among KEY_NUM and a nonce of its own, every
+ *                    other record sealed in place
+ *     exits 0 without a test if the cpu has no AES-NI or PCLMULQDQ
+ *
+ *     clang -O2 -I./include -o test_seal test/test_seal.c src/seal.c -lcrypto
+*/
+
+#define KEY_NUM             5
+#define TAG_LEN             16
+#define RECORD_MAX          (SECURE_SEAL_MAX_LEN + TAG_LEN)
+
+struct vector
+{
+    const char * key;
+    const char * nonce;
+    const char * plaintext;
+    const char * ciphertext;
+    const char * tag;
+};
+
+static const struct vector vectors[] = {
+    /* test case 13 */
+    {"0000000000000000000000000000000000000000000000000000000000000000",
+     "000000000000000000000000",
+     "",
+     "",
+     "530f8afbc74536b9a963b4f1c4cb738b"},
+    /* test case 14 */
+    {"0000000000000000000000000000000000000000000000000000000000000000",
+     "000000000000000000000000",
+     "00000000000000000000000000000000",
+     "cea7403d4d606b6e074ec5d3baf39d18",
+     "d0d1c8a799996bf0265b98b5d48ab919"},
+    /* test case 15 */
+    {"feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308",
+     "cafebabefacedbaddecaf888",
+     "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+     "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+     "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+     "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662898015ad",
+     "b094dac5d93471bdec1a502270e3cc6c"},
+};
+
+/* lengths of the batches, SEAL_LANES is 8 */
+static const int batch_sizes[] = {1, 3, 7, 8, 9, 15, 16, 17, 31, SECURE_SEAL_BATCH};
+
+static uint64_t rng = 0x9e3779b97f4a7c15;
+
+static unsigned char _random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+
+    return (unsigned char)(rng >> 32);
+}
+
+static int _hex(const char * hex, unsigned char * out)
+{
+    int len = (int)strlen(hex) / 2;
+
+    for (int i = 0; i < len; ++i) {
+        sscanf(&(hex[2 * i]), "%2hhx", &(out[i]));
+    }
+
+    return len;
+}
+
+static void _evp_seal(const unsigned char * key, const unsigned char * nonce,
+                      const unsigned char * msg, int len, unsigned char * out)
+{
+    EVP_CIPHER_CTX * ctx;
+    int enc_len;
+
+    ctx = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, nonce);
+    EVP_EncryptUpdate(ctx, out, &enc_len, msg, len);
+    EVP_EncryptFinal_ex(ctx, out + enc_len, &enc_len);
+    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, out + len);
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+/* return the number of vectors that do not match */
+static int test_vectors(void)
+{
+    struct seal_key key;
+    struct seal_record record;
+    unsigned char raw[32];
+    unsigned char msg[64], expected[64 + TAG_LEN], out[64 + TAG_LEN], evp[64 + TAG_LEN];
+    int fail_num = 0;
+    int len;
+
+    for (int i = 0; i < (int)(sizeof(vectors) / sizeof(vectors[0])); ++i) {
+        _hex(vectors[i].key, raw);
+        seal_key_init(&key, raw);
+        record.key = &key;
+        _hex(vectors[i].nonce, record.nonce);
+        len = _hex(vectors[i].plaintext, msg);
+        _hex(vectors[i].ciphertext, expected);
+        _hex(vectors[i].tag, &(expected[len]));
+
+        record.in = msg;
+        record.len = len;
+        record.out = out;
+        seal_batch(&record, 1);
+        _evp_seal(raw, record.nonce, msg, len, evp);
+
+        if (memcmp(out, expected, len + TAG_LEN) != 0 || memcmp(evp, expected, len + TAG_LEN) != 0) {
+            printf("known answer %d: seal_batch %s, EVP %s\n", i,
+                   memcmp(out, expected, len + TAG_LEN) ? "differs" : "matches",
+                   memcmp(evp, expected, len + TAG_LEN) ? "differs" : "matches");
+            fail_num++;
+        }
+    }
+
+    return fail_num;
+}
+
+/* return the number of records that do not match */
+static int test_lengths(int batch_size)
+{
+    static unsigned char msgs[SECURE_SEAL_BATCH][RECORD_MAX];
+    static unsigned char bufs[SECURE_SEAL_BATCH][RECORD_MAX];
+    static unsigned char evp[RECORD_MAX];
+    struct seal_key keys[KEY_NUM];
+    struct seal_record records[SECURE_SEAL_BATCH];
+    unsigned char raws[KEY_NUM][32];
+    int key_ids[SECURE_SEAL_BATCH];
+    int fail_num = 0;
+    int len = 0;
+    int num;
+
+    for (int k = 0; k < KEY_NUM; ++k) {
+        for (int i = 0; i < 32; ++i) {
+            raws[k][i] = _random();
+        }
+        seal_key_init(&(keys[k]), raws[k]);
+    }
+
+    while (len <= SECURE_SEAL_MAX_LEN) {
+        for (num = 0; num < batch_size && len <= SECURE_SEAL_MAX_LEN; ++num, ++len) {
+            key_ids[num] = _random() % KEY_NUM;
+            records[num].key = &(keys[key_ids[num]]);
+            for (int i = 0; i < 12; ++i) {
+                records[num].nonce[i] = _random();
+            }
+            for (int i = 0; i < len; ++i) {
+                msgs[num][i] = _random();
+            }
+            records[num].len = len;
+            records[num].out = bufs[num];
+            if (num % 2 == 0) {
+                memcpy(bufs[num], msgs[num], len);
+                records[num].in = bufs[num];
+            } else {
+                records[num].in = msgs[num];
+            }
+        }
+
+        seal_batch(records, num);
+
+        for (int r = 0; r < num; ++r) {
+            _evp_seal(raws[key_ids[r]], records[r].nonce, msgs[r], (int)records[r].len, evp);
+            if (memcmp(bufs[r], evp, records[r].len + TAG_LEN) != 0) {
+                printf("batch of %d: record %d of %zu bytes (%s) differs from EVP\n",
+                       batch_size, r, records[r].len, (r % 2 == 0) ? "in place" : "out of place");
+                fail_num++;
+            }
+        }
+    }
+
+    return fail_num;
+}
+
+int main(void)
+{
+    int fail_num;
+
+    if (!seal_available()) {
+        printf("no AES-NI or PCLMULQDQ, seal_batch is not used on this cpu\n");
+        return 0;
+    }
+
+    fail_num = test_vectors();
+    for (int i = 0; i < (int)(sizeof(batch_sizes) / sizeof(batch_sizes[0])); ++i) {
+        fail_num += test_lengths(batch_sizes[i]);
+    }
+
+    if (fail_num > 0) {
+        printf("%d records differ\n", fail_num);
+        return 1;
+    }
+    printf("%d known answers and every length 0 ~ %d in %d batch sizes match EVP\n",
+           (int)(sizeof(vectors) / sizeof(vectors[0])), SECURE_SEAL_MAX_LEN,
+           (int)(sizeof(batch_sizes) / sizeof(batch_sizes[0])));
+
+    return 0;
+}